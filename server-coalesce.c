@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs/operations.h"
+#include "coalesce.h"
+#include "stats.h"
+
+inflight_lookup_t *lookups[COALESCE_BUCKETS];
+pthread_mutex_t lookupsLock = PTHREAD_MUTEX_INITIALIZER;
+long windowUs = DEFAULT_COALESCE_WINDOW_US;
+
+/*
+ * Bumped before and after every mutation of the filesystem, so it is odd
+ * while one is under way. Mutations are serialized by the server, so a
+ * lookup result is still valid as long as the version hasn't moved since
+ * the lookup started from an even version.
+ */
+unsigned long fsVersion = 0;
+
+
+/*
+ * Sets up an empty table of lookups.
+ * Input:
+ *  - window_us: time in microseconds a resolved lookup may be reused
+ */
+void coalesce_init(long window_us) {
+	windowUs = window_us;
+	for (int i = 0; i < COALESCE_BUCKETS; i++) {
+		lookups[i] = NULL;
+	}
+}
+
+
+/*
+ * Releases every entry left in the table.
+ */
+void coalesce_destroy() {
+	for (int i = 0; i < COALESCE_BUCKETS; i++) {
+		while (lookups[i] != NULL) {
+			inflight_lookup_t *next = lookups[i]->next;
+			pthread_cond_destroy(&lookups[i]->resolved);
+			free(lookups[i]);
+			lookups[i] = next;
+		}
+	}
+}
+
+
+/*
+ * Marks the start of a mutation. Must be called with mutations serialized.
+ */
+void coalesce_mutation_begin() {
+	__atomic_add_fetch(&fsVersion, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Marks the end of a mutation. Must be called with mutations serialized.
+ */
+void coalesce_mutation_end() {
+	__atomic_add_fetch(&fsVersion, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static unsigned long hash_path(char *path) {
+	unsigned long hash = 5381;
+
+	for (char *c = path; *c != '\0'; c++) {
+		hash = hash * 33 + (unsigned char)*c;
+	}
+	return hash % COALESCE_BUCKETS;
+}
+
+static void lock_lookups() {
+	if (pthread_mutex_lock(&lookupsLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_lookups() {
+	if (pthread_mutex_unlock(&lookupsLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Removes an entry from its bucket. Called with the table locked.
+ */
+static void unlink_lookup(inflight_lookup_t *entry) {
+	inflight_lookup_t **link = &lookups[hash_path(entry->path)];
+
+	while (*link != NULL && *link != entry) {
+		link = &(*link)->next;
+	}
+	if (*link == entry) {
+		*link = entry->next;
+	}
+	entry->unlinked = 1;
+}
+
+/*
+ * Drops a reference to an entry, freeing it once it is unlinked and unused.
+ * Called with the table locked.
+ */
+static void release_lookup(inflight_lookup_t *entry) {
+	if (--entry->refs == 0 && entry->unlinked) {
+		pthread_cond_destroy(&entry->resolved);
+		free(entry);
+	}
+}
+
+/*
+ * Checks whether nothing was modified since a lookup started, so its result
+ * describes the filesystem as it is now.
+ */
+static int is_current(inflight_lookup_t *entry) {
+	return entry->version % 2 == 0 && entry->version == __atomic_load_n(&fsVersion, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Checks whether a resolved lookup still describes the filesystem: nothing
+ * may have been modified since it started and it must be inside the window.
+ */
+static int is_reusable(inflight_lookup_t *entry) {
+	struct timespec now;
+	double elapsed_us;
+
+	if (!is_current(entry)) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_us = (now.tv_sec - entry->completed.tv_sec) * 1e6 + (now.tv_nsec - entry->completed.tv_nsec) * 1e-3;
+	return elapsed_us <= windowUs;
+}
+
+
+/*
+ * Drops every resolved entry of a bucket that can no longer be reused.
+ * Called with the table locked.
+ */
+static void prune_bucket(unsigned long bucket) {
+	inflight_lookup_t *entry = lookups[bucket];
+
+	while (entry != NULL) {
+		inflight_lookup_t *next = entry->next;
+
+		if (entry->done && !is_reusable(entry)) {
+			unlink_lookup(entry);
+			entry->refs++;
+			release_lookup(entry);
+		}
+		entry = next;
+	}
+}
+
+
+/*
+ * Lookup for a given path, sharing the work with concurrent lookups of the
+ * same path: if one is already in flight and nothing was modified since it
+ * started the caller waits for its result, and a result obtained in the
+ * last window_us is reused while the filesystem hasn't changed.
+ * Input:
+ *  - parsed: parsed path of node
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int coalesced_lookup(path_t *parsed) {
+	inflight_lookup_t *entry;
+	char *path = parsed->base;
+	int result;
+
+	lock_lookups();
+
+	for (entry = lookups[hash_path(path)]; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->path, path) == 0)
+			break;
+	}
+
+	/* one started before a mutation may miss it, later lookups walk again */
+	if (entry != NULL && !entry->done && !is_current(entry)) {
+		unlink_lookup(entry);
+		entry = NULL;
+	}
+
+	if (entry != NULL && !entry->done) {
+		/* join the lookup in flight */
+		entry->refs++;
+		while (!entry->done) {
+			if (pthread_cond_wait(&entry->resolved, &lookupsLock) != 0) {
+				fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		result = entry->result;
+		release_lookup(entry);
+		unlock_lookups();
+
+		stats_record_lookup(LOOKUP_JOINED);
+		return result;
+	}
+
+	if (entry != NULL && is_reusable(entry)) {
+		result = entry->result;
+		unlock_lookups();
+
+		stats_record_lookup(LOOKUP_REUSED);
+		return result;
+	}
+
+	/* make way for a new entry, dropping stale ones */
+	prune_bucket(hash_path(path));
+
+	entry = malloc(sizeof(inflight_lookup_t));
+	if (entry == NULL) {
+		fprintf(stderr, "Error: coalesced_lookup: Failed to allocate entry.\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(entry->path, path);
+	entry->done = 0;
+	entry->refs = 1;
+	entry->unlinked = 0;
+	entry->version = __atomic_load_n(&fsVersion, __ATOMIC_SEQ_CST);
+	pthread_cond_init(&entry->resolved, NULL);
+	entry->next = lookups[hash_path(path)];
+	lookups[hash_path(path)] = entry;
+
+	unlock_lookups();
+
+	/* resolve it for everyone */
+	result = lookup(parsed);
+
+	lock_lookups();
+	entry->result = result;
+	entry->done = 1;
+	clock_gettime(CLOCK_MONOTONIC, &entry->completed);
+	if (pthread_cond_broadcast(&entry->resolved) != 0) {
+		fprintf(stderr, "Error: pthread_cond_broadcast: Failed to signal change to mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+	/* a result that can't be reused doesn't need to stay around */
+	if (!entry->unlinked && !is_reusable(entry)) {
+		unlink_lookup(entry);
+	}
+	release_lookup(entry);
+	unlock_lookups();
+
+	stats_record_lookup(LOOKUP_RESOLVED);
+	return result;
+}
@@ -0,0 +1,36 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <pthread.h>
+#include <time.h>
+#include "../tecnicofs-api-constants.h"
+#include "fs/path.h"
+
+#define COALESCE_BUCKETS 64
+/* default time a lookup's result may be handed out after it completed */
+#define DEFAULT_COALESCE_WINDOW_US 1000
+
+
+/*
+ * A lookup being resolved, or recently resolved, on behalf of every
+ * request for the same path.
+ */
+typedef struct inflight_lookup {
+	char path[MAX_INPUT_SIZE];
+	int result;
+	int done;
+	int refs;     /* threads still reading this entry */
+	int unlinked; /* no longer reachable from the table */
+	unsigned long version; /* filesystem version when resolution started */
+	struct timespec completed;
+	pthread_cond_t resolved;
+	struct inflight_lookup *next;
+} inflight_lookup_t;
+
+void coalesce_init(long window_us);
+void coalesce_destroy();
+void coalesce_mutation_begin();
+void coalesce_mutation_end();
+int coalesced_lookup(path_t *parsed);
+
+#endif /* COALESCE_H */
@@ -0,0 +1,435 @@
+#define _GNU_SOURCE /* accept4, F_GET_SEALS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "connection.h"
+
+
+/*
+ * Locks a mutex, aborting the server on failure.
+ */
+static void lock_mutex(pthread_mutex_t *mutex) {
+	if (pthread_mutex_lock(mutex) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Unlocks a mutex, aborting the server on failure.
+ */
+static void unlock_mutex(pthread_mutex_t *mutex) {
+	if (pthread_mutex_unlock(mutex) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Changes the events a connection is watched for.
+ */
+static void watch(connection_t *conn, int op, unsigned events) {
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.ptr = conn;
+	if (epoll_ctl(conn->epollfd, op, conn->fd, &event) != 0) {
+		perror("server: epoll_ctl error");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Events a connection should be watched for in its current state.
+ */
+static unsigned watched_events(connection_t *conn) {
+	return (conn->throttled ? 0 : EPOLLIN) | EPOLLRDHUP | (conn->waitingOutput ? EPOLLOUT : 0);
+}
+
+/*
+ * Signals an eventfd. Failures are ignored: they only mean a wakeup the
+ * other side doesn't need.
+ */
+static void signal_eventfd(int fd) {
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		perror("server: eventfd write error");
+	}
+}
+
+/*
+ * Drops a reference to a connection, closing it with the last one.
+ */
+static void connection_release(connection_t *conn) {
+	int refs;
+
+	lock_mutex(&conn->lock);
+	refs = --conn->refs;
+	unlock_mutex(&conn->lock);
+
+	if (refs == 0) {
+		if (conn->ring != NULL) {
+			munmap(conn->ring->region, TFS_SHARED_SIZE);
+			close(conn->ring->serverWake);
+			close(conn->ring->clientWake);
+			free(conn->ring);
+		}
+		close(conn->fd);
+		pthread_mutex_destroy(&conn->lock);
+		free(conn);
+	}
+}
+
+
+/*
+ * Accepts a pending connection and starts watching it for requests.
+ * Input:
+ *  - listenfd: listening socket
+ *  - epollfd: event loop of the receiver that will serve the connection
+ * Returns:
+ *  the new connection, or NULL if none could be accepted
+ */
+connection_t *connection_accept(int listenfd, int epollfd) {
+	connection_t *conn;
+	int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("server: accept error");
+		return NULL;
+	}
+
+	conn = malloc(sizeof(connection_t));
+	if (conn == NULL) {
+		fprintf(stderr, "Error: failed to allocate connection.\n");
+		exit(EXIT_FAILURE);
+	}
+	conn->kind = WATCHED_CONNECTION;
+	conn->fd = fd;
+	conn->ring = NULL;
+	conn->epollfd = epollfd;
+	conn->refs = 1; /* held by the receive stage until the client hangs up */
+	conn->inflight = 0;
+	conn->throttled = 0;
+	conn->closed = 0;
+	conn->waitingOutput = 0;
+	conn->queued = conn->lastQueued = NULL;
+	pthread_mutex_init(&conn->lock, NULL);
+
+	watch(conn, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP);
+	return conn;
+}
+
+
+/*
+ * Accounts for a request received on a connection. A connection with
+ * CONN_MAX_INFLIGHT requests in flight is no longer read from, so a client
+ * that doesn't collect its replies can't fill the server's queues.
+ */
+void connection_request_begin(connection_t *conn) {
+	lock_mutex(&conn->lock);
+	conn->refs++;
+	if (++conn->inflight >= CONN_MAX_INFLIGHT && !conn->throttled) {
+		conn->throttled = 1;
+		watch(conn, EPOLL_CTL_MOD, watched_events(conn));
+	}
+	unlock_mutex(&conn->lock);
+}
+
+
+/*
+ * Attaches the shared-memory rings a client passed over its session and
+ * starts watching the submission ring.
+ * The region must be sealed against shrinking, so the client can't pull it
+ * from under the server.
+ * Input:
+ *  - conn: session of the client
+ *  - fds: memfd of the region, server eventfd and client eventfd; they
+ *    belong to the connection from now on, even if attaching fails
+ * Returns:
+ *  0, or -1 if the descriptors are unusable or rings are already attached
+ */
+int connection_attach(connection_t *conn, int fds[TFS_ATTACH_FDS]) {
+	connection_ring_t *ring;
+	struct epoll_event event;
+	struct stat st;
+	void *region;
+
+	if (conn->ring != NULL || fstat(fds[0], &st) != 0 || st.st_size < (off_t)TFS_SHARED_SIZE ||
+		!(fcntl(fds[0], F_GET_SEALS) & F_SEAL_SHRINK) ||
+		fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0 || fcntl(fds[2], F_SETFL, O_NONBLOCK) != 0 ||
+		(region = mmap(NULL, TFS_SHARED_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+		for (int i = 0; i < TFS_ATTACH_FDS; i++) {
+			close(fds[i]);
+		}
+		return -1;
+	}
+	close(fds[0]);
+
+	ring = malloc(sizeof(connection_ring_t));
+	if (ring == NULL) {
+		fprintf(stderr, "Error: failed to allocate connection ring.\n");
+		exit(EXIT_FAILURE);
+	}
+	ring->kind = WATCHED_RING;
+	ring->conn = conn;
+	ring->region = region;
+	ring->serverWake = fds[1];
+	ring->clientWake = fds[2];
+	tfs_shared_views(region, &ring->submissions, &ring->completions);
+
+	lock_mutex(&conn->lock);
+	conn->ring = ring;
+	event.events = EPOLLIN;
+	event.data.ptr = ring;
+	if (epoll_ctl(conn->epollfd, EPOLL_CTL_ADD, ring->serverWake, &event) != 0) {
+		perror("server: epoll_ctl error");
+		exit(EXIT_FAILURE);
+	}
+	unlock_mutex(&conn->lock);
+
+	return 0;
+}
+
+
+/*
+ * Sends a reply on a connection's socket, without blocking.
+ * Returns: 0 if it was sent, or dropped for the client going away;
+ *  -1 if the socket has no room for it
+ */
+static int send_reply(connection_t *conn, void *message, size_t size, int fd) {
+	ssize_t sent;
+
+	if (fd >= 0) {
+		char control[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { message, size };
+		struct msghdr msg = { 0 };
+		struct cmsghdr *cmsg;
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+		sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+	}
+	else {
+		sent = send(conn->fd, message, size, MSG_NOSIGNAL);
+	}
+
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return -1;
+	}
+	if (sent < 0 && errno != EPIPE && errno != ECONNRESET) {
+		perror("server: send error");
+	}
+	return 0;
+}
+
+/*
+ * Accounts for a request answered, resuming reading from its connection
+ * once enough of them have been, and drops the reference it held.
+ */
+static void reply_done(connection_t *conn) {
+	lock_mutex(&conn->lock);
+	if (--conn->inflight <= CONN_RESUME_INFLIGHT && conn->throttled && !conn->closed) {
+		conn->throttled = 0;
+		watch(conn, EPOLL_CTL_MOD, watched_events(conn));
+		/* the submission ring stopped being drained too */
+		if (conn->ring != NULL) {
+			signal_eventfd(conn->ring->serverWake);
+		}
+	}
+	unlock_mutex(&conn->lock);
+
+	connection_release(conn);
+}
+
+/*
+ * Answers a request received on a connection. A reply that doesn't fit in
+ * the socket, or would overtake one waiting already, is queued until the
+ * receiver reports room (see connection_flush()), so a slow client never
+ * blocks the server nor loses a reply; it stays in flight meanwhile, so
+ * the in-flight limit bounds the queue. The reply is dropped if the client
+ * hung up.
+ * Input:
+ *  - conn: connection the request arrived on
+ *  - message, size: reply to send
+ *  - viaRing: whether the request came through the shared-memory rings
+ *  - fd: descriptor passed along with the reply (only on the socket), or
+ *    -1; it is closed once sent or dropped
+ */
+void connection_reply(connection_t *conn, void *message, size_t size, int viaRing, int fd) {
+	if (viaRing) {
+		int ret = tfs_ring_push(&conn->ring->completions, message, size);
+
+		if (ret < 0) {
+			fprintf(stderr, "Error: completion ring full, reply dropped.\n");
+		}
+		else if (ret == 1) {
+			signal_eventfd(conn->ring->clientWake);
+		}
+	}
+	else {
+		lock_mutex(&conn->lock);
+		if (((conn->queued != NULL && !conn->closed) || send_reply(conn, message, size, fd) < 0) && !conn->closed) {
+			queued_reply_t *reply = malloc(sizeof(queued_reply_t) + size);
+
+			if (reply == NULL) {
+				fprintf(stderr, "Error: failed to allocate reply.\n");
+				exit(EXIT_FAILURE);
+			}
+			reply->next = NULL;
+			reply->fd = fd;
+			reply->size = size;
+			memcpy(reply->message, message, size);
+			if (conn->lastQueued != NULL) {
+				conn->lastQueued->next = reply;
+			}
+			else {
+				conn->queued = reply;
+			}
+			conn->lastQueued = reply;
+
+			if (!conn->waitingOutput) {
+				conn->waitingOutput = 1;
+				watch(conn, EPOLL_CTL_MOD, watched_events(conn));
+			}
+			unlock_mutex(&conn->lock);
+			return;
+		}
+		unlock_mutex(&conn->lock);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	reply_done(conn);
+}
+
+/*
+ * Sends the replies queued on a connection, in order, once the receiver
+ * watching it saw room in its socket. What still doesn't fit waits for
+ * more. The receiver holds a reference to the connection.
+ */
+void connection_flush(connection_t *conn) {
+	queued_reply_t *reply;
+
+	lock_mutex(&conn->lock);
+	while ((reply = conn->queued) != NULL) {
+		if (!conn->closed && send_reply(conn, reply->message, reply->size, reply->fd) < 0) {
+			if (!conn->waitingOutput) {
+				conn->waitingOutput = 1;
+				watch(conn, EPOLL_CTL_MOD, watched_events(conn));
+			}
+			break;
+		}
+		if ((conn->queued = reply->next) == NULL) {
+			conn->lastQueued = NULL;
+		}
+		unlock_mutex(&conn->lock);
+
+		if (reply->fd >= 0) {
+			close(reply->fd);
+		}
+		free(reply);
+		reply_done(conn);
+
+		lock_mutex(&conn->lock);
+	}
+	unlock_mutex(&conn->lock);
+}
+
+
+/*
+ * Takes a reference to a connection, for something other than a request
+ * to keep it open (a lease). Dropped with connection_put().
+ */
+void connection_hold(connection_t *conn) {
+	lock_mutex(&conn->lock);
+	conn->refs++;
+	unlock_mutex(&conn->lock);
+}
+
+void connection_put(connection_t *conn) {
+	connection_release(conn);
+}
+
+
+/*
+ * Sends the client a message it didn't ask for, on the session socket
+ * whatever transport its requests use. It is dropped if the client hung
+ * up or doesn't read its socket.
+ * The caller holds a reference to the connection.
+ */
+void connection_notify(connection_t *conn, void *message, size_t size) {
+	/* racy read, a message to a client going away is harmless */
+	if (__atomic_load_n(&conn->closed, __ATOMIC_RELAXED))
+		return;
+
+	if (send(conn->fd, message, size, MSG_NOSIGNAL) < 0 && errno != EPIPE && errno != ECONNRESET) {
+		perror("server: notification send error");
+	}
+}
+
+
+/*
+ * Asks the receiver watching a connection to report when its socket has
+ * room again, for messages that didn't fit (see watch_flush()).
+ */
+void connection_wait_output(connection_t *conn) {
+	lock_mutex(&conn->lock);
+	if (!conn->closed && !conn->waitingOutput) {
+		conn->waitingOutput = 1;
+		watch(conn, EPOLL_CTL_MOD, watched_events(conn));
+	}
+	unlock_mutex(&conn->lock);
+}
+
+/*
+ * Stops waiting for room on a connection's socket, once the receiver saw
+ * there is some.
+ */
+void connection_output_ready(connection_t *conn) {
+	lock_mutex(&conn->lock);
+	if (!conn->closed && conn->waitingOutput) {
+		conn->waitingOutput = 0;
+		watch(conn, EPOLL_CTL_MOD, watched_events(conn));
+	}
+	unlock_mutex(&conn->lock);
+}
+
+
+/*
+ * Stops watching a connection whose client hung up, giving up on the
+ * replies it had queued. It is closed once every request it still has in
+ * flight has been answered.
+ */
+void connection_close(connection_t *conn) {
+	lock_mutex(&conn->lock);
+	conn->closed = 1;
+	watch(conn, EPOLL_CTL_DEL, 0);
+	if (conn->ring != NULL && epoll_ctl(conn->epollfd, EPOLL_CTL_DEL, conn->ring->serverWake, NULL) != 0) {
+		perror("server: epoll_ctl error");
+		exit(EXIT_FAILURE);
+	}
+	unlock_mutex(&conn->lock);
+
+	/* the replies hold references, so the connection outlives this */
+	connection_flush(conn);
+	connection_release(conn);
+}
@@ -0,0 +1,77 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "../tecnicofs-protocol.h"
+
+/* requests a connection may have in flight before it stops being read */
+#define CONN_MAX_INFLIGHT 64
+/* ... until its replies bring it back down to this */
+#define CONN_RESUME_INFLIGHT 32
+
+
+/*
+ * What an entry of a receiver's event loop refers to: the first field of
+ * every structure registered there.
+ */
+typedef enum watched {
+	WATCHED_CONNECTION,
+	WATCHED_RING
+} watched_t;
+
+/*
+ * Shared-memory rings attached to a session (see tecnicofs-protocol.h).
+ */
+typedef struct connection_ring {
+	watched_t kind; /* WATCHED_RING */
+	struct connection *conn;
+	void *region;
+	tfs_ring_view_t submissions, completions;
+	int serverWake; /* eventfd the client signals when the server is idle */
+	int clientWake; /* eventfd the server signals when the client is idle */
+} connection_ring_t;
+
+/*
+ * A reply that didn't fit in a session's socket, waiting for room. It
+ * still counts as in flight.
+ */
+typedef struct queued_reply {
+	struct queued_reply *next;
+	int fd;       /* descriptor passed along with it, or -1 */
+	size_t size;
+	char message[];
+} queued_reply_t;
+
+/*
+ * A persistent client session over the SOCK_SEQPACKET listener.
+ * Each request received on it holds a reference, so the descriptor stays
+ * open until the last reply has been sent, even if the client went away.
+ */
+typedef struct connection {
+	watched_t kind; /* WATCHED_CONNECTION */
+	int fd;
+	int epollfd;   /* event loop of the receiver watching it */
+	int refs;
+	int inflight;  /* requests received and not yet answered */
+	int throttled; /* removed from the receive set for having too many in flight */
+	int closed;    /* client hung up */
+	int waitingOutput; /* watched for room to push messages it didn't ask for, or queued replies */
+	queued_reply_t *queued, *lastQueued; /* replies waiting for room, in order */
+	connection_ring_t *ring; /* shared-memory transport, if attached */
+	pthread_mutex_t lock;
+} connection_t;
+
+connection_t *connection_accept(int listenfd, int epollfd);
+void connection_request_begin(connection_t *conn);
+int connection_attach(connection_t *conn, int fds[TFS_ATTACH_FDS]);
+void connection_reply(connection_t *conn, void *message, size_t size, int viaRing, int fd);
+void connection_hold(connection_t *conn);
+void connection_put(connection_t *conn);
+void connection_notify(connection_t *conn, void *message, size_t size);
+void connection_wait_output(connection_t *conn);
+void connection_output_ready(connection_t *conn);
+void connection_flush(connection_t *conn);
+void connection_close(connection_t *conn);
+
+#endif /* CONNECTION_H */
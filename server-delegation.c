@@ -0,0 +1,416 @@
+#define _GNU_SOURCE /* pthread_rwlockattr_setkind_np */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "fs/operations.h"
+#include "delegation.h"
+
+/*
+ * Delegations are few and every request is checked against all of them,
+ * so they are kept in a single list. Workers check and apply a request
+ * holding applying for reading, and a delegation is granted holding it
+ * for writing: no request checked before the grant is applied after it.
+ */
+delegation_t *delegations = NULL;
+pthread_mutex_t delegationLock;
+pthread_cond_t recallsChanged; /* wakes the reaper, on CLOCK_MONOTONIC */
+pthread_rwlock_t applying;
+pthread_t reaper;
+int reaperStopping = 0;
+void (*resumeRequest)(request_t *req);
+long delegationCount = 0;
+long delegationsGranted = 0, delegationsRecalled = 0, delegationsExpired = 0, requestsDeferred = 0;
+
+
+static void lock_delegations() {
+	if (pthread_mutex_lock(&delegationLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_delegations() {
+	if (pthread_mutex_unlock(&delegationLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int expired(delegation_t *delegation, struct timespec *now) {
+	return now->tv_sec > delegation->deadline.tv_sec ||
+		(now->tv_sec == delegation->deadline.tv_sec && now->tv_nsec >= delegation->deadline.tv_nsec);
+}
+
+/*
+ * Unlinks a delegation and drops its reference. The list is locked.
+ * Returns: the requests it deferred, in the order they arrived
+ */
+static request_t *remove_delegation(delegation_t **link) {
+	delegation_t *delegation = *link;
+	request_t *deferred = delegation->deferred;
+
+	*link = delegation->next;
+	delegationCount--;
+	connection_put(delegation->conn);
+	free(delegation);
+	return deferred;
+}
+
+/*
+ * Hands deferred requests back to the workers. The list must not be
+ * locked: they are checked against the delegations again.
+ */
+static void resume_requests(request_t *req) {
+	while (req != NULL) {
+		request_t *next = req->next;
+
+		resumeRequest(req);
+		req = next;
+	}
+}
+
+/*
+ * Takes back the delegations whose holders were recalled and didn't give
+ * them back in time.
+ */
+static void *reap_delegations(void *arg) {
+	lock_delegations();
+	while (!reaperStopping) {
+		struct timespec now, next = { 0, 0 };
+		request_t *deferred = NULL;
+		int reaped = 0, waiting = 0, ret;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (delegation_t **link = &delegations; *link != NULL; ) {
+			delegation_t *delegation = *link;
+
+			if (!delegation->recalled) {
+				link = &delegation->next;
+			}
+			else if (expired(delegation, &now)) {
+				deferred = remove_delegation(link);
+				delegationsExpired++;
+				reaped = 1;
+				break;
+			}
+			else {
+				if (!waiting || delegation->deadline.tv_sec < next.tv_sec ||
+					(delegation->deadline.tv_sec == next.tv_sec && delegation->deadline.tv_nsec < next.tv_nsec)) {
+					next = delegation->deadline;
+					waiting = 1;
+				}
+				link = &delegation->next;
+			}
+		}
+
+		if (reaped) {
+			unlock_delegations();
+			resume_requests(deferred);
+			lock_delegations();
+			continue;
+		}
+
+		/* sleep until the next holder runs out of time, or a recall is sent */
+		ret = waiting ? pthread_cond_timedwait(&recallsChanged, &delegationLock, &next) :
+			pthread_cond_wait(&recallsChanged, &delegationLock);
+		if (ret != 0 && ret != ETIMEDOUT) {
+			fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	unlock_delegations();
+	return NULL;
+}
+
+
+/*
+ * Sets up an empty list of delegations and the thread taking them back
+ * from holders that don't answer a recall.
+ * Input:
+ *  - resume: hands a deferred request back to the workers
+ */
+void delegation_init(void (*resume)(request_t *req)) {
+	pthread_condattr_t condAttr;
+	pthread_rwlockattr_t rwlockAttr;
+
+	delegations = NULL;
+	resumeRequest = resume;
+	pthread_mutex_init(&delegationLock, NULL);
+
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	pthread_cond_init(&recallsChanged, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+
+	/* a grant waiting for the requests being applied holds new ones off */
+	pthread_rwlockattr_init(&rwlockAttr);
+	pthread_rwlockattr_setkind_np(&rwlockAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&applying, &rwlockAttr);
+	pthread_rwlockattr_destroy(&rwlockAttr);
+
+	if (pthread_create(&reaper, NULL, reap_delegations, NULL) != 0) {
+		fprintf(stderr, "Error: failed to create thread.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Stops the reaper and releases every delegation left.
+ */
+void delegation_destroy() {
+	lock_delegations();
+	reaperStopping = 1;
+	pthread_cond_signal(&recallsChanged);
+	unlock_delegations();
+	pthread_join(reaper, NULL);
+
+	while (delegations != NULL) {
+		remove_delegation(&delegations);
+	}
+	pthread_rwlock_destroy(&applying);
+	pthread_cond_destroy(&recallsChanged);
+	pthread_mutex_destroy(&delegationLock);
+}
+
+
+/*
+ * Marks the start of a request's check and application, see
+ * delegation_defer().
+ */
+void delegation_enter() {
+	if (pthread_rwlock_rdlock(&applying) != 0) {
+		fprintf(stderr, "Error: pthread_rwlock_rdlock: Failed to lock rwlock.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void delegation_leave() {
+	if (pthread_rwlock_unlock(&applying) != 0) {
+		fprintf(stderr, "Error: pthread_rwlock_unlock: Failed to unlock rwlock.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Tells whether a path of a request from a session falls in a delegation
+ * held by another one.
+ */
+static int conflicts(delegation_t *delegation, connection_t *conn, char *path, int contains) {
+	return delegation->conn != conn &&
+		(tfs_path_under(path, delegation->path) || (contains && tfs_path_under(delegation->path, path)));
+}
+
+/*
+ * Asks the holder of a delegation to give it back, and gives it
+ * TFS_RECALL_MS to. The list is locked.
+ */
+static void recall(delegation_t *delegation) {
+	char frame[sizeof(tfs_header_t) + sizeof(uint16_t) + MAX_FILE_NAME];
+
+	tfs_frame_begin(frame, TFS_OP_RECALL, 0, 0);
+	tfs_frame_put_path(frame, sizeof(frame), delegation->path);
+	connection_notify(delegation->conn, frame, tfs_frame_size(frame));
+
+	clock_gettime(CLOCK_MONOTONIC, &delegation->deadline);
+	delegation->deadline.tv_sec += TFS_RECALL_MS / 1000;
+	delegation->deadline.tv_nsec += (TFS_RECALL_MS % 1000) * 1000000;
+	if (delegation->deadline.tv_nsec >= 1000000000) {
+		delegation->deadline.tv_sec++;
+		delegation->deadline.tv_nsec -= 1000000000;
+	}
+	delegation->recalled = 1;
+	delegationsRecalled++;
+	pthread_cond_signal(&recallsChanged);
+}
+
+/*
+ * Defers a request that touches a subtree delegated to another session
+ * until the subtree is given back, recalling it. Called between
+ * delegation_enter() and delegation_leave(); a request not deferred is
+ * then applied before any new delegation is granted.
+ * Input:
+ *  - req: request to check, handed back through the resume function
+ *  - paths: normalized absolute paths the request operates on
+ *  - contains: for each path, whether the request also touches
+ *    everything under it (a move's source, a print)
+ *  - n: number of paths
+ * Returns: 1 if the request was deferred, 0 if it may be applied
+ */
+int delegation_defer(request_t *req, char **paths, int *contains, int n) {
+	delegation_t *found = NULL;
+
+	lock_delegations();
+	for (delegation_t *delegation = delegations; delegation != NULL && found == NULL; delegation = delegation->next) {
+		for (int i = 0; i < n && found == NULL; i++) {
+			if (conflicts(delegation, req->conn, paths[i], contains[i])) {
+				found = delegation;
+			}
+		}
+	}
+
+	if (found != NULL) {
+		req->next = NULL;
+		if (found->deferred == NULL) {
+			found->deferred = req;
+		}
+		else {
+			found->lastDeferred->next = req;
+		}
+		found->lastDeferred = req;
+		requestsDeferred++;
+
+		if (!found->recalled) {
+			recall(found);
+		}
+	}
+	unlock_delegations();
+
+	return found != NULL;
+}
+
+
+/*
+ * Delegates a directory's subtree to a session, once the requests already
+ * checked were applied.
+ * Input:
+ *  - conn: session asking for the subtree
+ *  - path: directory at its root
+ * Returns:
+ *  the number of entries of the directory, or FAIL if it isn't one, it
+ *  overlaps a subtree already delegated or too many are
+ */
+int delegation_grant(connection_t *conn, char *path) {
+	char normalized[MAX_FILE_NAME];
+	delegation_t *delegation;
+	path_t parsed;
+	int entries = FAIL;
+
+	if (tfs_path_normalize(normalized, sizeof(normalized), path) != 0 || path_parse(&parsed, normalized) != SUCCESS) {
+		return FAIL;
+	}
+
+	if (pthread_rwlock_wrlock(&applying) != 0) {
+		fprintf(stderr, "Error: pthread_rwlock_wrlock: Failed to lock rwlock.\n");
+		exit(EXIT_FAILURE);
+	}
+	lock_delegations();
+
+	for (delegation = delegations; delegation != NULL; delegation = delegation->next) {
+		if (tfs_path_under(normalized, delegation->path) || tfs_path_under(delegation->path, normalized)) {
+			break;
+		}
+	}
+
+	/* nothing is being applied, the directory stays as counted */
+	if (delegation == NULL && delegationCount < DELEGATION_MAX && (entries = count_entries(&parsed)) >= 0) {
+		if ((delegation = malloc(sizeof(delegation_t))) == NULL) {
+			fprintf(stderr, "Error: failed to allocate delegation.\n");
+			exit(EXIT_FAILURE);
+		}
+		strcpy(delegation->path, normalized);
+		delegation->conn = conn;
+		delegation->recalled = 0;
+		delegation->deferred = delegation->lastDeferred = NULL;
+		connection_hold(conn);
+		delegation->next = delegations;
+		delegations = delegation;
+		delegationCount++;
+		delegationsGranted++;
+	}
+	else {
+		entries = FAIL;
+	}
+
+	unlock_delegations();
+	delegation_leave();
+
+	return entries;
+}
+
+
+/*
+ * Takes back a subtree its holder is done with, resuming the requests it
+ * deferred.
+ * Returns: SUCCESS, or FAIL if the session doesn't hold it (anymore)
+ */
+int delegation_return(connection_t *conn, char *path) {
+	char normalized[MAX_FILE_NAME];
+
+	if (tfs_path_normalize(normalized, sizeof(normalized), path) != 0) {
+		return FAIL;
+	}
+
+	lock_delegations();
+	for (delegation_t **link = &delegations; *link != NULL; link = &(*link)->next) {
+		if ((*link)->conn == conn && strcmp((*link)->path, normalized) == 0) {
+			request_t *deferred = remove_delegation(link);
+
+			unlock_delegations();
+			resume_requests(deferred);
+			return SUCCESS;
+		}
+	}
+	unlock_delegations();
+	return FAIL;
+}
+
+
+/*
+ * Takes back the delegations of a session whose client hung up. What it
+ * didn't send is lost.
+ */
+void delegation_forget(connection_t *conn) {
+	request_t *deferred = NULL, *last = NULL;
+
+	lock_delegations();
+	for (delegation_t **link = &delegations; *link != NULL; ) {
+		delegation_t *delegation = *link;
+
+		if (delegation->conn != conn) {
+			link = &delegation->next;
+			continue;
+		}
+		if (delegation->deferred != NULL) {
+			if (last == NULL) {
+				deferred = delegation->deferred;
+			}
+			else {
+				last->next = delegation->deferred;
+			}
+			last = delegation->lastDeferred;
+		}
+		remove_delegation(link);
+	}
+	unlock_delegations();
+
+	resume_requests(deferred);
+}
+
+
+/*
+ * Tells how many subtrees are delegated, so requests can skip working
+ * out their paths while none is.
+ */
+int delegation_count() {
+	return __atomic_load_n(&delegationCount, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Reports how many delegations were granted, recalled and taken back for
+ * not being given back in time, how many are held and how many requests
+ * had to wait for one.
+ */
+void delegation_stats(long *granted, long *recalled, long *expired, long *active, long *deferred) {
+	lock_delegations();
+	*granted = delegationsGranted;
+	*recalled = delegationsRecalled;
+	*expired = delegationsExpired;
+	*active = delegationCount;
+	*deferred = requestsDeferred;
+	unlock_delegations();
+}
@@ -0,0 +1,38 @@
+#ifndef DELEGATION_H
+#define DELEGATION_H
+
+#include <time.h>
+#include "../tecnicofs-api-constants.h"
+#include "connection.h"
+#include "workqueue.h"
+
+/* subtrees delegated at once by all sessions */
+#define DELEGATION_MAX 64
+
+
+/*
+ * A subtree a session changes on its own, with the requests of others on
+ * it deferred until the session gives it back. Each delegation holds a
+ * reference to its connection.
+ */
+typedef struct delegation {
+	char path[MAX_FILE_NAME]; /* normalized */
+	connection_t *conn;
+	int recalled;             /* the holder was asked to give it back */
+	struct timespec deadline; /* when it is taken back, once recalled */
+	request_t *deferred, *lastDeferred; /* linked through their next field */
+	struct delegation *next;
+} delegation_t;
+
+void delegation_init(void (*resume)(request_t *req));
+void delegation_destroy();
+void delegation_enter();
+void delegation_leave();
+int delegation_defer(request_t *req, char **paths, int *contains, int n);
+int delegation_grant(connection_t *conn, char *path);
+int delegation_return(connection_t *conn, char *path);
+void delegation_forget(connection_t *conn);
+int delegation_count();
+void delegation_stats(long *granted, long *recalled, long *expired, long *active, long *deferred);
+
+#endif /* DELEGATION_H */
@@ -0,0 +1,470 @@
+#define _GNU_SOURCE /* memfd_create, F_ADD_SEALS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "fs/operations.h"
+#include "files.h"
+
+/*
+ * Tables are found by connection. Each one is used with the index
+ * read-locked, so one is only dropped once nobody uses it.
+ */
+file_table_t *tables[FILES_BUCKETS];
+pthread_rwlock_t tablesLock;
+long openFiles = 0, bytesRead = 0, bytesMapped = 0, bytesWritten = 0;
+
+
+static void lock_tables(int write) {
+	if ((write ? pthread_rwlock_wrlock(&tablesLock) : pthread_rwlock_rdlock(&tablesLock)) != 0) {
+		fprintf(stderr, "Error: pthread_rwlock_lock: Failed to lock file tables.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_tables() {
+	if (pthread_rwlock_unlock(&tablesLock) != 0) {
+		fprintf(stderr, "Error: pthread_rwlock_unlock: Failed to unlock file tables.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void lock_table(file_table_t *table) {
+	if (pthread_mutex_lock(&table->lock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_table(file_table_t *table) {
+	if (pthread_mutex_unlock(&table->lock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static unsigned long hash_connection(connection_t *conn) {
+	return ((uintptr_t)conn / sizeof(connection_t)) % FILES_BUCKETS;
+}
+
+
+/*
+ * Sets up an empty index of tables.
+ */
+void files_init() {
+	for (int i = 0; i < FILES_BUCKETS; i++) {
+		tables[i] = NULL;
+	}
+	pthread_rwlock_init(&tablesLock, NULL);
+}
+
+
+/*
+ * Releases every table left, without closing its files.
+ */
+void files_destroy() {
+	for (int i = 0; i < FILES_BUCKETS; i++) {
+		while (tables[i] != NULL) {
+			file_table_t *next = tables[i]->next;
+
+			connection_put(tables[i]->conn);
+			pthread_mutex_destroy(&tables[i]->lock);
+			pthread_cond_destroy(&tables[i]->idle);
+			free(tables[i]);
+			tables[i] = next;
+		}
+	}
+	pthread_rwlock_destroy(&tablesLock);
+}
+
+
+/*
+ * Finds a session's table. The index is locked.
+ */
+static file_table_t *find_table(connection_t *conn) {
+	file_table_t *table = tables[hash_connection(conn)];
+
+	while (table != NULL && table->conn != conn) {
+		table = table->next;
+	}
+	return table;
+}
+
+/*
+ * Finds a session's table, leaving the index read-locked for it to be
+ * used; released with unlock_tables().
+ * Input:
+ *  - conn: the session
+ *  - create: whether to add a table if the session has none, unless the
+ *    client went away
+ * Returns: the table, or NULL
+ */
+static file_table_t *get_table(connection_t *conn, int create) {
+	file_table_t *table;
+
+	lock_tables(0);
+	if ((table = find_table(conn)) != NULL || !create) {
+		return table;
+	}
+	unlock_tables();
+
+	lock_tables(1);
+	if (find_table(conn) == NULL && !__atomic_load_n(&conn->closed, __ATOMIC_RELAXED)) {
+		if ((table = malloc(sizeof(file_table_t))) == NULL) {
+			fprintf(stderr, "Error: failed to allocate file table.\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < TFS_MAX_OPEN_FILES; i++) {
+			table->files[i].inumber = FREE_INODE;
+			table->files[i].busy = 0;
+		}
+		pthread_mutex_init(&table->lock, NULL);
+		pthread_cond_init(&table->idle, NULL);
+		connection_hold(conn);
+		table->conn = conn;
+		table->next = tables[hash_connection(conn)];
+		tables[hash_connection(conn)] = table;
+	}
+	unlock_tables();
+
+	/* dropped meanwhile if the client went away */
+	lock_tables(0);
+	return find_table(conn);
+}
+
+/*
+ * Finds an open file of a table, which is locked.
+ * Returns: the file, or NULL if the descriptor isn't open
+ */
+static open_file_t *find_file(file_table_t *table, int fd) {
+	if (table == NULL || fd < 0 || fd >= TFS_MAX_OPEN_FILES || table->files[fd].inumber == FREE_INODE) {
+		return NULL;
+	}
+	return &table->files[fd];
+}
+
+/*
+ * Takes an open file of a table for a read, write or close, waiting for
+ * whatever else is done with the descriptor. The table is left unlocked,
+ * so the session's other descriptors are used meanwhile; the file stays
+ * open, and its offset the caller's, until unpin_file().
+ * Input:
+ *  - table: the session's table, or NULL if it has none
+ *  - fd: descriptor
+ *  - mode: permission the descriptor needs, 0 for none
+ *  - ret: set to TECNICOFS_ERROR_FILE_NOT_OPEN or
+ *    TECNICOFS_ERROR_INVALID_MODE if the file isn't taken
+ * Returns: the file, or NULL
+ */
+static open_file_t *pin_file(file_table_t *table, int fd, permission mode, int *ret) {
+	open_file_t *file;
+
+	if (table == NULL) {
+		*ret = TECNICOFS_ERROR_FILE_NOT_OPEN;
+		return NULL;
+	}
+
+	lock_table(table);
+	while ((file = find_file(table, fd)) != NULL && file->busy) {
+		if (pthread_cond_wait(&table->idle, &table->lock) != 0) {
+			fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (file == NULL) {
+		*ret = TECNICOFS_ERROR_FILE_NOT_OPEN;
+	}
+	else if ((file->mode & mode) != mode) {
+		*ret = TECNICOFS_ERROR_INVALID_MODE;
+		file = NULL;
+	}
+	else {
+		file->busy = 1;
+	}
+	unlock_table(table);
+	return file;
+}
+
+/*
+ * Gives back a file taken with pin_file(), or a descriptor reserved by
+ * files_open().
+ */
+static void unpin_file(file_table_t *table, open_file_t *file) {
+	lock_table(table);
+	file->busy = 0;
+	if (pthread_cond_broadcast(&table->idle) != 0) {
+		fprintf(stderr, "Error: pthread_cond_broadcast: Failed to signal change to mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+	unlock_table(table);
+}
+
+
+/*
+ * Opens a file for a session.
+ * Input:
+ *  - conn: the session
+ *  - dir: handle the path is relative to, or NO_DIR_HANDLE
+ *  - path: parsed path of the file
+ *  - mode: READ, WRITE or RW
+ *  - append: whether writes go to the end of the file, which needs WRITE
+ * Returns:
+ *  the descriptor, TECNICOFS_ERROR_FILE_NOT_FOUND if there is no such
+ *  file, TECNICOFS_ERROR_MAXED_OPEN_FILES, TECNICOFS_ERROR_INVALID_MODE,
+ *  TECNICOFS_ERROR_STALE_HANDLE or TECNICOFS_ERROR_OTHER
+ */
+int files_open(connection_t *conn, int dir, path_t *path, permission mode, int append) {
+	file_table_t *table;
+	int fd = 0, inumber;
+
+	if ((mode != READ && mode != WRITE && mode != RW) || (append && !(mode & WRITE))) {
+		return TECNICOFS_ERROR_INVALID_MODE;
+	}
+	if ((table = get_table(conn, 1)) == NULL) {
+		unlock_tables();
+		return TECNICOFS_ERROR_OTHER;
+	}
+
+	/* the descriptor is reserved while the file is looked for */
+	lock_table(table);
+	while (fd < TFS_MAX_OPEN_FILES && (table->files[fd].inumber != FREE_INODE || table->files[fd].busy)) {
+		fd++;
+	}
+	if (fd < TFS_MAX_OPEN_FILES) {
+		table->files[fd].busy = 1;
+	}
+	unlock_table(table);
+
+	if (fd == TFS_MAX_OPEN_FILES) {
+		unlock_tables();
+		return TECNICOFS_ERROR_MAXED_OPEN_FILES;
+	}
+
+	if ((inumber = open_file(dir, path)) < 0) {
+		unpin_file(table, &table->files[fd]);
+		fd = inumber == FAIL ? TECNICOFS_ERROR_FILE_NOT_FOUND : inumber;
+	}
+	else {
+		lock_table(table);
+		table->files[fd].inumber = inumber;
+		table->files[fd].mode = mode;
+		table->files[fd].append = append;
+		table->files[fd].offset = 0;
+		unlock_table(table);
+		unpin_file(table, &table->files[fd]);
+		__atomic_add_fetch(&openFiles, 1, __ATOMIC_RELAXED);
+	}
+
+	unlock_tables();
+	return fd;
+}
+
+
+/*
+ * Reads from a file a session has open, at the descriptor's offset.
+ * Input:
+ *  - conn: the session
+ *  - fd: descriptor
+ *  - buffer, len: where to store the bytes, and how many are wanted
+ * Returns:
+ *  number of bytes read, 0 at the end of the file,
+ *  TECNICOFS_ERROR_FILE_NOT_OPEN or TECNICOFS_ERROR_INVALID_MODE
+ */
+int files_read(connection_t *conn, int fd, char *buffer, size_t len) {
+	file_table_t *table = get_table(conn, 0);
+	open_file_t *file;
+	int ret;
+
+	if ((file = pin_file(table, fd, READ, &ret)) != NULL) {
+		if ((ret = read_file(file->inumber, buffer, file->offset, len)) > 0) {
+			file->offset += ret;
+			__atomic_add_fetch(&bytesRead, ret, __ATOMIC_RELAXED);
+		}
+		unpin_file(table, file);
+	}
+
+	unlock_tables();
+	return ret;
+}
+
+
+/*
+ * Copies part of a file into a new memfd, sealed so whoever maps it knows
+ * it won't change or shrink. Pages past the end of the file are never
+ * touched, so the memfd takes no more memory than the bytes copied.
+ * Input:
+ *  - inumber, offset, len: what to copy
+ *  - memfd: set to the memfd, if anything was copied
+ * Returns:
+ *  number of bytes copied (the memfd's size), 0 at the end of the file,
+ *  or TECNICOFS_ERROR_OTHER if the memfd couldn't be set up
+ */
+static int copy_to_memfd(int inumber, size_t offset, size_t len, int *memfd) {
+	char *region = MAP_FAILED;
+	int fd, ret;
+
+	if ((fd = memfd_create("tecnicofs-read", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 || ftruncate(fd, len) != 0 ||
+		(region = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("server: memfd error");
+		if (fd >= 0) {
+			close(fd);
+		}
+		return TECNICOFS_ERROR_OTHER;
+	}
+	ret = read_file(inumber, region, offset, len);
+	/* a writable mapping would keep the memfd from being sealed */
+	munmap(region, len);
+
+	if (ret > 0 && (ftruncate(fd, ret) != 0 ||
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)) {
+		perror("server: memfd error");
+		ret = TECNICOFS_ERROR_OTHER;
+	}
+	if (ret <= 0) {
+		close(fd);
+		return ret;
+	}
+	*memfd = fd;
+	return ret;
+}
+
+
+/*
+ * Reads from a file a session has open, at the descriptor's offset, like
+ * files_read(), but into a sealed memfd to be passed to the client, which
+ * maps it rather than receiving the bytes through its socket.
+ * Input:
+ *  - conn: the session
+ *  - fd: descriptor
+ *  - len: bytes wanted
+ *  - memfd: set to the memfd holding the bytes, if any were read
+ * Returns:
+ *  number of bytes read, 0 at the end of the file,
+ *  TECNICOFS_ERROR_FILE_NOT_OPEN, TECNICOFS_ERROR_INVALID_MODE or
+ *  TECNICOFS_ERROR_OTHER
+ */
+int files_map(connection_t *conn, int fd, size_t len, int *memfd) {
+	file_table_t *table = get_table(conn, 0);
+	open_file_t *file;
+	int ret;
+
+	if ((file = pin_file(table, fd, READ, &ret)) != NULL) {
+		if (len == 0) {
+			ret = 0;
+		}
+		else if ((ret = copy_to_memfd(file->inumber, file->offset, len, memfd)) > 0) {
+			file->offset += ret;
+			__atomic_add_fetch(&bytesRead, ret, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&bytesMapped, ret, __ATOMIC_RELAXED);
+		}
+		unpin_file(table, file);
+	}
+
+	unlock_tables();
+	return ret;
+}
+
+
+/*
+ * Writes to a file a session has open, at the descriptor's offset, or at
+ * the end of the file if it was opened to append.
+ * Input:
+ *  - conn: the session
+ *  - fd: descriptor
+ *  - buffer, len: bytes to write
+ * Returns:
+ *  number of bytes written, fewer than len once the file is full,
+ *  TECNICOFS_ERROR_FILE_NOT_OPEN, TECNICOFS_ERROR_INVALID_MODE or
+ *  TECNICOFS_ERROR_OTHER if nothing could be written
+ */
+int files_write(connection_t *conn, int fd, char *buffer, size_t len) {
+	file_table_t *table = get_table(conn, 0);
+	open_file_t *file;
+	int ret;
+
+	if ((file = pin_file(table, fd, WRITE, &ret)) != NULL) {
+		size_t at = file->offset;
+
+		ret = file->append ? append_file(file->inumber, buffer, len, &at) : write_file(file->inumber, buffer, at, len);
+		if (ret == FAIL) {
+			ret = TECNICOFS_ERROR_OTHER;
+		}
+		else {
+			file->offset = at + ret;
+			__atomic_add_fetch(&bytesWritten, ret, __ATOMIC_RELAXED);
+		}
+		unpin_file(table, file);
+	}
+
+	unlock_tables();
+	return ret;
+}
+
+
+/*
+ * Closes a file a session has open.
+ * Returns: SUCCESS, or TECNICOFS_ERROR_FILE_NOT_OPEN
+ */
+int files_close(connection_t *conn, int fd) {
+	file_table_t *table = get_table(conn, 0);
+	open_file_t *file;
+	int ret = SUCCESS;
+
+	if ((file = pin_file(table, fd, 0, &ret)) != NULL) {
+		close_file(file->inumber);
+		__atomic_sub_fetch(&openFiles, 1, __ATOMIC_RELAXED);
+
+		lock_table(table);
+		file->inumber = FREE_INODE;
+		unlock_table(table);
+		unpin_file(table, file);
+	}
+
+	unlock_tables();
+	return ret;
+}
+
+
+/*
+ * Closes the files of a session whose client went away. Must be called
+ * once it is marked closed, so it can't open more.
+ */
+void files_forget(connection_t *conn) {
+	file_table_t **link, *table;
+
+	lock_tables(1);
+	for (link = &tables[hash_connection(conn)]; *link != NULL && (*link)->conn != conn; link = &(*link)->next);
+	table = *link;
+	if (table != NULL) {
+		*link = table->next;
+	}
+	unlock_tables();
+
+	if (table == NULL) {
+		return;
+	}
+	for (int i = 0; i < TFS_MAX_OPEN_FILES; i++) {
+		if (table->files[i].inumber != FREE_INODE) {
+			close_file(table->files[i].inumber);
+			__atomic_sub_fetch(&openFiles, 1, __ATOMIC_RELAXED);
+		}
+	}
+	connection_put(conn);
+	pthread_mutex_destroy(&table->lock);
+	pthread_cond_destroy(&table->idle);
+	free(table);
+}
+
+
+/*
+ * Reports how many files sessions have open and how many bytes they read
+ * (of which through memfds) and wrote.
+ */
+void files_stats(long *open, long *read, long *mapped, long *written) {
+	*open = __atomic_load_n(&openFiles, __ATOMIC_RELAXED);
+	*read = __atomic_load_n(&bytesRead, __ATOMIC_RELAXED);
+	*mapped = __atomic_load_n(&bytesMapped, __ATOMIC_RELAXED);
+	*written = __atomic_load_n(&bytesWritten, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,48 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "../tecnicofs-api-constants.h"
+#include "fs/path.h"
+#include "connection.h"
+
+/* buckets the sessions' tables of open files are spread over */
+#define FILES_BUCKETS 64
+
+
+/*
+ * A file opened by a session. Its descriptor is its place in the
+ * session's table.
+ */
+typedef struct open_file {
+	int inumber;     /* FREE_INODE for an unused descriptor */
+	permission mode;
+	int append;      /* writes go to the end of the file */
+	size_t offset;   /* where the next read or write starts */
+	int busy;        /* being opened, read, written or closed, without the table locked */
+} open_file_t;
+
+/*
+ * The files a session has open. Each table holds a reference to its
+ * connection.
+ */
+typedef struct file_table {
+	connection_t *conn;
+	open_file_t files[TFS_MAX_OPEN_FILES];
+	pthread_mutex_t lock;
+	pthread_cond_t idle;   /* a descriptor is no longer busy */
+	struct file_table *next;
+} file_table_t;
+
+void files_init();
+void files_destroy();
+int files_open(connection_t *conn, int dir, path_t *path, permission mode, int append);
+int files_read(connection_t *conn, int fd, char *buffer, size_t len);
+int files_map(connection_t *conn, int fd, size_t len, int *memfd);
+int files_write(connection_t *conn, int fd, char *buffer, size_t len);
+int files_close(connection_t *conn, int fd);
+void files_forget(connection_t *conn);
+void files_stats(long *open, long *read, long *mapped, long *written);
+
+#endif /* FILES_H */
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "lease.h"
+
+/*
+ * Leases are hashed by the first component of their path, so those under
+ * a subtree being moved are all found in a single bucket.
+ */
+lease_t *leases[LEASE_BUCKETS];
+pthread_mutex_t leaseLocks[LEASE_BUCKETS];
+long leaseCount = 0;
+long leasesGranted = 0, leasesRevoked = 0;
+
+
+/*
+ * Sets up an empty table of leases.
+ */
+void lease_init() {
+	for (int i = 0; i < LEASE_BUCKETS; i++) {
+		leases[i] = NULL;
+		pthread_mutex_init(&leaseLocks[i], NULL);
+	}
+}
+
+
+/*
+ * Releases every lease left in the table.
+ */
+void lease_destroy() {
+	for (int i = 0; i < LEASE_BUCKETS; i++) {
+		while (leases[i] != NULL) {
+			lease_t *next = leases[i]->next;
+			connection_put(leases[i]->conn);
+			free(leases[i]);
+			leases[i] = next;
+		}
+		pthread_mutex_destroy(&leaseLocks[i]);
+	}
+}
+
+
+static unsigned long hash_component(char *path) {
+	unsigned long hash = 5381;
+
+	/* skip the leading '/' of a normalized path */
+	for (char *c = path + 1; *c != '\0' && *c != '/'; c++) {
+		hash = hash * 33 + (unsigned char)*c;
+	}
+	return hash % LEASE_BUCKETS;
+}
+
+static void lock_bucket(unsigned long bucket) {
+	if (pthread_mutex_lock(&leaseLocks[bucket]) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_bucket(unsigned long bucket) {
+	if (pthread_mutex_unlock(&leaseLocks[bucket]) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int expired(lease_t *lease, struct timespec *now) {
+	return now->tv_sec > lease->expires.tv_sec ||
+		(now->tv_sec == lease->expires.tv_sec && now->tv_nsec >= lease->expires.tv_nsec);
+}
+
+/*
+ * Unlinks a lease and drops its reference. The bucket is locked.
+ */
+static void remove_lease(lease_t **link) {
+	lease_t *lease = *link;
+
+	*link = lease->next;
+	connection_put(lease->conn);
+	free(lease);
+	__atomic_sub_fetch(&leaseCount, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Grants a session a lease on a path, or renews the one it has. Must be
+ * called before the lookup it comes with is resolved, so a change racing
+ * with the lookup is either seen by it or reported to the client.
+ * Input:
+ *  - conn: session asking for the lease
+ *  - path: path looked up
+ * Returns:
+ *  1 if the lease was granted, 0 if the table is full or the client left
+ */
+int lease_grant(connection_t *conn, char *path) {
+	char normalized[MAX_FILE_NAME];
+	struct timespec now;
+	unsigned long bucket;
+	lease_t **link, *lease = NULL;
+
+	if (tfs_path_normalize(normalized, sizeof(normalized), path) != 0 ||
+		__atomic_load_n(&conn->closed, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	bucket = hash_component(normalized);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	lock_bucket(bucket);
+	/* look for the session's lease, reclaiming expired ones on the way */
+	for (link = &leases[bucket]; *link != NULL; ) {
+		if (expired(*link, &now) && ((*link)->conn != conn || strcmp((*link)->path, normalized) != 0)) {
+			remove_lease(link);
+			continue;
+		}
+		if ((*link)->conn == conn && strcmp((*link)->path, normalized) == 0) {
+			lease = *link;
+		}
+		link = &(*link)->next;
+	}
+
+	if (lease == NULL) {
+		if (__atomic_add_fetch(&leaseCount, 1, __ATOMIC_RELAXED) > LEASE_MAX ||
+			(lease = malloc(sizeof(lease_t))) == NULL) {
+			__atomic_sub_fetch(&leaseCount, 1, __ATOMIC_RELAXED);
+			unlock_bucket(bucket);
+			return 0;
+		}
+		strcpy(lease->path, normalized);
+		lease->conn = conn;
+		connection_hold(conn);
+		lease->next = leases[bucket];
+		leases[bucket] = lease;
+	}
+
+	/* the server's lease outlives the client's, which starts counting earlier */
+	lease->expires = now;
+	lease->expires.tv_sec += TFS_LEASE_MS / 1000 + 1;
+	unlock_bucket(bucket);
+
+	__atomic_add_fetch(&leasesGranted, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+
+/*
+ * Tells every session holding a lease on a path, or on something under
+ * it, that it changed, and drops those leases. Must be called once the
+ * change is done.
+ * Input:
+ *  - path: path deleted or moved away
+ */
+void lease_revoke(char *path) {
+	char normalized[MAX_FILE_NAME];
+	char frame[sizeof(tfs_header_t) + sizeof(uint16_t) + MAX_FILE_NAME];
+	connection_t *notified[LEASE_MAX];
+	struct timespec now;
+	unsigned long bucket;
+	int n = 0;
+
+	if (tfs_path_normalize(normalized, sizeof(normalized), path) != 0) {
+		return;
+	}
+	bucket = hash_component(normalized);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	tfs_frame_begin(frame, TFS_OP_INVALIDATE, 0, 0);
+	tfs_frame_put_path(frame, sizeof(frame), normalized);
+
+	lock_bucket(bucket);
+	for (lease_t **link = &leases[bucket]; *link != NULL; ) {
+		lease_t *lease = *link;
+		int seen = 0;
+
+		if (!tfs_path_under(lease->path, normalized)) {
+			link = &lease->next;
+			continue;
+		}
+
+		/* one message per session covers all its leases under the path */
+		if (!expired(lease, &now)) {
+			for (int i = 0; i < n && !seen; i++) {
+				seen = notified[i] == lease->conn;
+			}
+			if (!seen) {
+				connection_notify(lease->conn, frame, tfs_frame_size(frame));
+				notified[n++] = lease->conn;
+			}
+			__atomic_add_fetch(&leasesRevoked, 1, __ATOMIC_RELAXED);
+		}
+		remove_lease(link);
+	}
+	unlock_bucket(bucket);
+}
+
+
+/*
+ * Drops the leases of a session whose client hung up.
+ */
+void lease_forget(connection_t *conn) {
+	for (unsigned long bucket = 0; bucket < LEASE_BUCKETS; bucket++) {
+		lock_bucket(bucket);
+		for (lease_t **link = &leases[bucket]; *link != NULL; ) {
+			if ((*link)->conn == conn) {
+				remove_lease(link);
+			}
+			else {
+				link = &(*link)->next;
+			}
+		}
+		unlock_bucket(bucket);
+	}
+}
+
+
+/*
+ * Tells how many leases are held, expired ones included.
+ */
+int lease_count() {
+	return __atomic_load_n(&leaseCount, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Reports how many leases were granted and revoked, and how many are held.
+ */
+void lease_stats(long *granted, long *revoked, long *active) {
+	*granted = __atomic_load_n(&leasesGranted, __ATOMIC_RELAXED);
+	*revoked = __atomic_load_n(&leasesRevoked, __ATOMIC_RELAXED);
+	*active = __atomic_load_n(&leaseCount, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,33 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <time.h>
+#include "../tecnicofs-api-constants.h"
+#include "connection.h"
+
+#define LEASE_BUCKETS 64
+/* leases held at once, further lookups aren't leased */
+#define LEASE_MAX 4096
+
+
+/*
+ * A session's interest in a path it looked up: it is told when the path,
+ * or one of its ancestors, is deleted or moved before the lease expires.
+ * Each lease holds a reference to its connection.
+ */
+typedef struct lease {
+	char path[MAX_FILE_NAME]; /* normalized */
+	connection_t *conn;
+	struct timespec expires;
+	struct lease *next;
+} lease_t;
+
+void lease_init();
+void lease_destroy();
+int lease_grant(connection_t *conn, char *path);
+void lease_revoke(char *path);
+void lease_forget(connection_t *conn);
+int lease_count();
+void lease_stats(long *granted, long *revoked, long *active);
+
+#endif /* LEASE_H */
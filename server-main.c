@@ -1,15 +1,30 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <signal.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include "fs/operations.h"
+#include "workqueue.h"
+#include "stats.h"
+#include "coalesce.h"
+#include "connection.h"
+#include "lease.h"
+#include "watch.h"
+#include "delegation.h"
+#include "files.h"
+#include "tree.h"
+#include "uring.h"
 
 #define MAX_COMMANDS 10
 #define MAX_INPUT_SIZE 100
@@ -17,13 +32,29 @@
 #define SOCK_MAX_PATH_LEN 100
 #define INDIM 30
 
+/* events handled per epoll_wait call */
+#define MAX_EVENTS 64
+
+/* ancillary data accepted with a message: the descriptors of an attach */
+#define CONTROL_SIZE CMSG_SPACE(sizeof(int) * TFS_ATTACH_FDS)
+
+/* largest reply: a read's */
+#define REPLY_MAX_SIZE TFS_MAX_REPLY
+
 /* ex2_r1 */
 /* ex2_r2 */
 /* ex2_r3 */
 /* ex3_final */
 
 int numberThreads = 0;
-int sockfd;
+int numberFastThreads = -1;
+int affinityDepth = DEFAULT_AFFINITY_DEPTH;
+int highWatermark = DEFAULT_HIGH_WATERMARK, lowWatermark = DEFAULT_LOW_WATERMARK;
+long coalesceWindow = DEFAULT_COALESCE_WINDOW_US;
+int ioBatchSize = DEFAULT_IO_BATCH_SIZE;
+int numberSockets = 1;
+int useUring = 0;
+reply_queue_t replies;
 
 int reachedEOF = 0;
 int modifying_fs = 0, printing_fs = 0;
@@ -37,37 +68,126 @@ void errorParse(){
 }
 
 
-int applyCommand(char *command) {
+/*
+ * Prints the file system tree once no modification is in progress, holding
+ * modifications off meanwhile.
+ * Input:
+ *  - name: path of the output file
+ *  - output, outputSize: if not NULL, the tree is rendered into memory
+ *    instead, for the output file to be written by the send stage
+ * Returns:
+ *  SUCCESS or FAIL
+ */
+int printTree(char *name, char **output, size_t *outputSize) {
+    int ret;
+
+    if (pthread_mutex_lock(&m) != 0) {
+        fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+    while (modifying_fs) {
+        if (pthread_cond_wait(&canPrintFS, &m) != 0) {
+            fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
+            exit(EXIT_FAILURE);
+        } 
+    }
 
-    int ret = -1;
-    char commandCopy[MAX_INPUT_SIZE];
-    strcpy(commandCopy, command);
+    printing_fs = 1;
+    ret = output != NULL ? print_to_memory(output, outputSize) : print(name);
+    printing_fs = 0;
 
-    if (command == NULL){
-        return -1;
+    if (pthread_cond_broadcast(&canModifyFS) != 0) {
+        fprintf(stderr, "Error: pthread_cond_signal: Failed to signal change to mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_mutex_unlock(&m) != 0) {
+        fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Gives the absolute path a path of an operation stands for. A path
+ * relative to a directory handle is resolved by searching the tree, so
+ * mutations must be excluded.
+ * Input:
+ *  - command: decoded operation
+ *  - path: one of its paths
+ *  - buffer: MAX_FILE_NAME bytes, used for a relative path
+ * Returns:
+ *  the absolute path, or NULL if the handle went stale
+ */
+char *absolutePath(tfs_request_t *command, char *path, char *buffer) {
+    size_t len;
+
+    if (command->dir == TFS_NO_DIR) {
+        return path;
+    }
+    if (dir_path(command->dir, buffer, MAX_FILE_NAME) != SUCCESS) {
+        return NULL;
+    }
+    len = strlen(buffer);
+    if (snprintf(buffer + len, MAX_FILE_NAME - len, "%s%s", len > 1 ? "/" : "", path) >= (int)(MAX_FILE_NAME - len)) {
+        return NULL;
     }
+    return buffer;
+}
 
-    char token, type;
-    char name[MAX_INPUT_SIZE];
+/*
+ * Gives the absolute path of what a mutation changed, for the watches and
+ * leases kept by path. Mutations are still excluded.
+ * Returns:
+ *  the path, or NULL if nobody is interested
+ */
+char *changedPath(tfs_request_t *command, char *path, char *buffer) {
+    if (watch_count() == 0 && lease_count() == 0) {
+        return NULL;
+    }
+    return absolutePath(command, path, buffer);
+}
 
-    char name2[MAX_INPUT_SIZE];
-    int searchResult, searchResult1, searchResult2;
 
-    int numTokens = sscanf(command, "%c %s %c", &token, name, &type);
+/*
+ * Applies a decoded request to the filesystem.
+ * Input:
+ *  - command: request decoded by decodeRequest()
+ * Returns:
+ *  the operation's return value
+ */
+int applyCommand(tfs_request_t *command) {
 
-    if (numTokens < 2) {
-        fprintf(stderr, "Error: invalid command in Queue\n");
-        exit(EXIT_FAILURE);
+    int ret = -1;
+
+    if (command == NULL){
+        return -1;
     }
 
-    /* variables needed for case 'm' */
-    int k = 0, foundInodeFromPath1 = 0;
-    char *aux, *string_array[3], *saveptr, delim[] = " \n";
+    char token = command->opcode;
+    type nodeType = command->flags & ~TFS_REQUEST_AT;
+    int dir = command->dir == TFS_NO_DIR ? NO_DIR_HANDLE : command->dir;
+    char *name = command->paths[0];
+    char *name2 = command->paths[1];
+    char path1[MAX_FILE_NAME], path2[MAX_FILE_NAME], *changed = NULL;
+    path_t components[TFS_MAX_PATHS];
+    int searchResult;
+
+    /* paths are split into their components once, where they were received */
+    if (token != 'p') {
+        for (int i = 0; i < command->npaths; i++) {
+            if (path_parse(&components[i], command->paths[i]) != SUCCESS) {
+                printf("Invalid path: %s\n", command->paths[i]);
+                return FAIL;
+            }
+        }
+    }
 
     switch (token) {
         case 'c':
-            switch (type) {
-                case 'f':
+            switch (nodeType) {
+                case T_FILE:
                     printf("Create file: %s\n", name);
                     
                     if (pthread_mutex_lock(&m) != 0) {
@@ -83,7 +203,12 @@ int applyCommand(char *command) {
                     }
 
                     modifying_fs = 1;
-                    ret = create(name, T_FILE);
+                    coalesce_mutation_begin();
+                    ret = create_at(dir, &components[0], T_FILE);
+                    coalesce_mutation_end();
+                    if (ret == SUCCESS && (changed = changedPath(command, name, path1)) != NULL) {
+                        watch_notify(TECNICOFS_EVENT_CREATE, changed, NULL);
+                    }
                     modifying_fs = 0;
                     
                     if (pthread_cond_broadcast(&canPrintFS) != 0) {
@@ -98,7 +223,7 @@ int applyCommand(char *command) {
                     return ret;
 
                     break;
-                case 'd':
+                case T_DIRECTORY:
                     printf("Create directory: %s\n", name);
 
                     if (pthread_mutex_lock(&m) != 0) {
@@ -114,7 +239,12 @@ int applyCommand(char *command) {
                     }
 
                     modifying_fs = 1;
-                    ret = create(name, T_DIRECTORY);
+                    coalesce_mutation_begin();
+                    ret = create_at(dir, &components[0], T_DIRECTORY);
+                    coalesce_mutation_end();
+                    if (ret == SUCCESS && (changed = changedPath(command, name, path1)) != NULL) {
+                        watch_notify(TECNICOFS_EVENT_CREATE, changed, NULL);
+                    }
                     modifying_fs = 0;
 
                     if (pthread_cond_broadcast(&canPrintFS) != 0) {
@@ -135,7 +265,8 @@ int applyCommand(char *command) {
             }
             break;
         case 'l':
-            searchResult = lookup(name);
+            /* relative lookups are told apart by handle, not path */
+            searchResult = dir == NO_DIR_HANDLE ? coalesced_lookup(&components[0]) : lookup_at(dir, &components[0]);
 
             if (searchResult >= 0)
                 printf("Search: %s found\n", name);
@@ -160,7 +291,12 @@ int applyCommand(char *command) {
             }
             
             modifying_fs = 1;
-            ret = delete(name);
+            coalesce_mutation_begin();
+            ret = delete_at(dir, &components[0]);
+            coalesce_mutation_end();
+            if (ret == SUCCESS && (changed = changedPath(command, name, path1)) != NULL) {
+                watch_notify(TECNICOFS_EVENT_DELETE, changed, NULL);
+            }
             modifying_fs = 0;
 
             if (pthread_cond_broadcast(&canPrintFS) != 0) {
@@ -172,79 +308,107 @@ int applyCommand(char *command) {
                 exit(EXIT_FAILURE);
             }
 
+            /* clients caching the path learn of it before the reply is sent */
+            if (changed != NULL) {
+                lease_revoke(changed);
+            }
+
             return ret;
 
             break;
 
         case 'm':
-            k = 0;
-            aux = strtok_r(commandCopy, delim, &saveptr);
-
-            while (aux != NULL) {
-                string_array[k++] = aux;
-                aux = strtok_r(NULL, delim, &saveptr);
-            }   
-
-            strcpy(name2, string_array[2]);
-
             /* DEBUG */
             /* printf("~~~~~~~~~~~~~~~~~~~~~~ move ~~~~~~~~~~~~~~~~~~~~~~ %s %s\n", name, name2); */
 
-            searchResult1 = lookup(name);
-            searchResult2 = test_lookup(name2, searchResult1, &foundInodeFromPath1);
-            
-            if (searchResult1 >= 0 && searchResult2 < 0 && !foundInodeFromPath1) {
-                /* DEBUG */
-                /* printf("Move: conditions were met for %s and %s.\n", name, name2); */
-
-                if (pthread_mutex_lock(&m) != 0) {
-                    fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+            if (pthread_mutex_lock(&m) != 0) {
+                fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+                exit(EXIT_FAILURE);
+            }
+            while (printing_fs) {
+                if (pthread_cond_wait(&canModifyFS, &m) != 0) {
+                    fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
                     exit(EXIT_FAILURE);
-                }
-                while (printing_fs) {
-                    if (pthread_cond_wait(&canModifyFS, &m) != 0) {
-                        fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
-                        exit(EXIT_FAILURE);
-                    } 
-                }
-
-                modifying_fs = 1;
-                move(name, name2);
-                modifying_fs = 0;
+                } 
+            }
 
-                if (pthread_cond_broadcast(&canPrintFS) != 0) {
-                    fprintf(stderr, "Error: pthread_cond_signal: Failed to signal change to mutex.\n");
-                    exit(EXIT_FAILURE);
-                }
-                if (pthread_mutex_unlock(&m) != 0) {
-                    fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
-                    exit(EXIT_FAILURE);
+            modifying_fs = 1;
+            /* moves are rare, a relative one is carried out on absolute paths */
+            if (dir != NO_DIR_HANDLE) {
+                name = absolutePath(command, name, path1);
+                name2 = absolutePath(command, name2, path2);
+            }
+            if (name == NULL || name2 == NULL) {
+                ret = TECNICOFS_ERROR_STALE_HANDLE;
+            }
+            else if (dir != NO_DIR_HANDLE &&
+                (path_parse(&components[0], name) != SUCCESS || path_parse(&components[1], name2) != SUCCESS)) {
+                ret = FAIL;
+            }
+            else {
+                /* the paths are checked under the same exclusion the move runs in */
+                coalesce_mutation_begin();
+                ret = move(&components[0], &components[1]);
+                coalesce_mutation_end();
+                if (ret == SUCCESS) {
+                    watch_notify(TECNICOFS_EVENT_MOVE, name, name2);
                 }
+            }
+            modifying_fs = 0;
+
+            if (pthread_cond_broadcast(&canPrintFS) != 0) {
+                fprintf(stderr, "Error: pthread_cond_signal: Failed to signal change to mutex.\n");
+                exit(EXIT_FAILURE);
+            }
+            if (pthread_mutex_unlock(&m) != 0) {
+                fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+                exit(EXIT_FAILURE);
+            }
 
-                return SUCCESS;
+            if (ret == SUCCESS) {
+                lease_revoke(name);
             }
-            return FAIL;
+            return ret;
 
             break;
-        case 'p':
-            printf("Print to file: %s\n", name);
+        case 'y':
+            printf("Copy: %s to %s\n", name, name2);
 
             if (pthread_mutex_lock(&m) != 0) {
                 fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
                 exit(EXIT_FAILURE);
             }
-            while (modifying_fs) {
-                if (pthread_cond_wait(&canPrintFS, &m) != 0) {
+            while (printing_fs) {
+                if (pthread_cond_wait(&canModifyFS, &m) != 0) {
                     fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
                     exit(EXIT_FAILURE);
                 } 
             }
 
-            printing_fs = 1;
-            ret = print(name);
-            printing_fs = 0;
+            modifying_fs = 1;
+            /* as for a move, a relative copy is carried out on absolute paths */
+            if (dir != NO_DIR_HANDLE) {
+                name = absolutePath(command, name, path1);
+                name2 = absolutePath(command, name2, path2);
+            }
+            if (name == NULL || name2 == NULL) {
+                ret = TECNICOFS_ERROR_STALE_HANDLE;
+            }
+            else if (dir != NO_DIR_HANDLE &&
+                (path_parse(&components[0], name) != SUCCESS || path_parse(&components[1], name2) != SUCCESS)) {
+                ret = FAIL;
+            }
+            else {
+                coalesce_mutation_begin();
+                ret = copy_node(&components[0], &components[1]);
+                coalesce_mutation_end();
+                if (ret == SUCCESS) {
+                    watch_notify(TECNICOFS_EVENT_CREATE, name2, NULL);
+                }
+            }
+            modifying_fs = 0;
 
-            if (pthread_cond_broadcast(&canModifyFS) != 0) {
+            if (pthread_cond_broadcast(&canPrintFS) != 0) {
                 fprintf(stderr, "Error: pthread_cond_signal: Failed to signal change to mutex.\n");
                 exit(EXIT_FAILURE);
             }
@@ -255,6 +419,21 @@ int applyCommand(char *command) {
 
             return ret;
 
+            break;
+        case 'p':
+            printf("Print to file: %s\n", name);
+            return printTree(name, NULL, NULL);
+
+            break;
+        case 'o':
+            searchResult = open_dir(dir, &components[0]);
+
+            if (searchResult >= 0)
+                printf("Open directory: %s\n", name);
+            else
+                printf("Open directory: %s failed\n", name);
+            return searchResult;
+
             break;
 
         default: { /* error */
@@ -264,36 +443,294 @@ int applyCommand(char *command) {
     }
 }
 
-void* fnThread(void* arg) {
-    while (1) {
-        struct sockaddr_un client_addr;
-        char in_command[MAX_INPUT_SIZE];
-        int c, operation_staus;
-        socklen_t addrlen;
+/*
+ * Parses a text command (compatibility mode) in place: the tokens are
+ * terminated inside the buffer and pointed to by the decoded request.
+ * Input:
+ *  - buffer: '\0'-terminated command received from client
+ *  - command: decoded request to be filled
+ * Returns: SUCCESS or FAIL
+ */
+int parseTextCommand(char *buffer, tfs_request_t *command) {
+    char *saveptr, delim[] = " \n";
+    char *token = strtok_r(buffer, delim, &saveptr);
+
+    if (token == NULL || strlen(token) != 1) {
+        return FAIL;
+    }
+
+    command->opcode = token[0];
+    command->flags = T_NONE;
+    command->id = 0;
+    command->dir = TFS_NO_DIR;
+    command->npaths = 0;
+
+    while ((token = strtok_r(NULL, delim, &saveptr)) != NULL) {
+        /* node type of a create */
+        if (command->opcode == TFS_OP_CREATE && command->npaths == 1) {
+            if (strcmp(token, "f") == 0)
+                command->flags = T_FILE;
+            else if (strcmp(token, "d") == 0)
+                command->flags = T_DIRECTORY;
+            else
+                return FAIL;
+            continue;
+        }
+        if (command->npaths == TFS_MAX_PATHS) {
+            return FAIL;
+        }
+        command->paths[command->npaths++] = token;
+    }
 
-        addrlen = sizeof(struct sockaddr_un);
+    return SUCCESS;
+}
 
-        /* receive command from client */    
-        c = recvfrom(sockfd, in_command, sizeof(in_command) + 1, 0, (struct sockaddr *)&client_addr, &addrlen);
 
-        if (c <= 0) {
-            continue;
+/*
+ * Checks that a decoded operation is known and has the right arguments.
+ * Input:
+ *  - command: decoded operation
+ * Returns: SUCCESS or FAIL
+ */
+int validateCommand(tfs_request_t *command) {
+    int expectedPaths;
+
+    switch (command->opcode) {
+        case TFS_OP_CREATE:
+            if ((command->flags & ~TFS_REQUEST_AT) != T_FILE && (command->flags & ~TFS_REQUEST_AT) != T_DIRECTORY)
+                return FAIL;
+            expectedPaths = 1;
+            break;
+        case TFS_OP_PRINT:
+            if (command->dir != TFS_NO_DIR)
+                return FAIL;
+            expectedPaths = 1;
+            break;
+        case TFS_OP_DELETE:
+        case TFS_OP_LOOKUP:
+        case TFS_OP_OPENDIR:
+        case TFS_OP_OPEN:
+            expectedPaths = 1;
+            break;
+        case TFS_OP_MOVE:
+        case TFS_OP_COPY:
+            expectedPaths = 2;
+            break;
+        default:
+            return FAIL;
+    }
+
+    /* trees are gone through from absolute paths */
+    if (tfs_tree_op(command) && command->dir != TFS_NO_DIR) {
+        return FAIL;
+    }
+
+    if (command->npaths != expectedPaths) {
+        return FAIL;
+    }
+    /* relative paths name something inside the directory */
+    if (command->dir != TFS_NO_DIR) {
+        if (command->dir < 0)
+            return FAIL;
+        for (int i = 0; i < command->npaths; i++) {
+            if (command->paths[i][strspn(command->paths[i], "/")] == '\0')
+                return FAIL;
         }
-        in_command[c] = '\0';
+    }
+    /* the filesystem still works on bounded path buffers */
+    for (int i = 0; i < command->npaths; i++) {
+        if (strlen(command->paths[i]) >= MAX_FILE_NAME)
+            return FAIL;
+    }
 
-        /* DEBUG */
-        printf("--%ld--%s--\n", (long)pthread_self(), client_addr.sun_path);
+    return SUCCESS;
+}
 
-        operation_staus = applyCommand(in_command);
 
-        /* DEBUG */
-        /* printf("DEBUG-2 %s\n", client_addr.sun_path); */
+/*
+ * Decodes a request without copying it, either from a binary frame or
+ * from a text command, and checks it is well formed. The operations of a
+ * batch are all checked here, and decoded again by the worker running it.
+ * Input:
+ *  - req: request as received from client
+ * Returns: SUCCESS or FAIL
+ */
+int decodeRequest(request_t *req) {
+    tfs_request_t *command = &req->command;
+
+    if (req->length >= sizeof(tfs_header_t) && (unsigned char)req->buffer[0] == TFS_MAGIC) {
+        tfs_header_t header;
+
+        /* keep the id even if the rest is malformed, so the error reaches the client */
+        memcpy(&header, req->buffer, sizeof(header));
+        command->opcode = header.opcode;
+        command->id = header.id;
+        req->binary = 1;
 
-        /* send message to client with operation's return value */
-        if (sendto(sockfd, &operation_staus, sizeof(int), 0, (struct sockaddr *)&client_addr, addrlen) < 0) {
-            perror("server: sendto error");
+        if (tfs_decode_request(req->buffer, req->length, command) != 0) {
+            return FAIL;
+        }
+    }
+    else {
+        req->binary = 0;
+        req->buffer[req->length] = '\0';
+        if (parseTextCommand(req->buffer, command) == FAIL) {
+            return FAIL;
+        }
+    }
+
+    /* carries no paths, only the descriptors passed along */
+    if (command->opcode == TFS_OP_ATTACH) {
+        return req->binary && command->npaths == 0 ? SUCCESS : FAIL;
+    }
+
+    /* delegations are asked for by a session, for a whole subtree */
+    if (command->opcode == TFS_OP_DELEGATE) {
+        return req->binary && command->npaths == 1 && command->dir == TFS_NO_DIR && strlen(command->paths[0]) < MAX_FILE_NAME ?
+            SUCCESS : FAIL;
+    }
+
+    /* files are opened and used by a session, one operation at a time */
+    if (command->opcode == TFS_OP_OPEN) {
+        return req->binary && validateCommand(command) == SUCCESS ? SUCCESS : FAIL;
+    }
+    if (tfs_file_op(command->opcode)) {
+        /* a large read passes its memfd on the socket, never through the rings */
+        if (command->opcode == TFS_OP_MAP) {
+            return req->binary && !req->ring && command->count <= TFS_MAX_MAP ? SUCCESS : FAIL;
+        }
+        return req->binary && command->count <= TFS_MAX_IO ? SUCCESS : FAIL;
+    }
+
+    /* subscriptions of a session, kept by the receive stage */
+    if (command->opcode == TFS_OP_WATCH || command->opcode == TFS_OP_UNWATCH) {
+        return req->binary && command->npaths == 1 && command->dir == TFS_NO_DIR && strlen(command->paths[0]) < MAX_FILE_NAME ?
+            SUCCESS : FAIL;
+    }
+
+    if (command->opcode == TFS_OP_BATCH) {
+        tfs_request_t op;
+        size_t offset = sizeof(tfs_header_t);
+        int ops = 0, next;
+
+        /* a text command named like a batch carries no frames */
+        if (!req->binary || !tfs_frame_valid(req->buffer, req->length)) {
+            return FAIL;
+        }
+
+        while ((next = tfs_batch_next(req->buffer, req->length, &offset, &op)) == 1) {
+            if (++ops > TFS_MAX_BATCH || validateCommand(&op) == FAIL || op.opcode == TFS_OP_OPEN || tfs_tree_op(&op))
+                return FAIL;
+        }
+        return next == 0 && ops > 0 ? SUCCESS : FAIL;
+    }
+
+    return validateCommand(command);
+}
+
+
+/*
+ * Classifies an operation: lookups go to the fast lane, moves, prints,
+ * delegations and trees to the bulk lane and everything else to the
+ * normal lane.
+ * Input:
+ *  - command: decoded operation
+ * Returns:
+ *  lane of the operation
+ */
+lane_t classifyCommand(tfs_request_t *command) {
+    if (tfs_tree_op(command)) {
+        return LANE_BULK;
+    }
+    switch (command->opcode) {
+        case TFS_OP_LOOKUP:
+        case TFS_OP_OPENDIR:
+            return LANE_FAST;
+        case TFS_OP_MOVE:
+        case TFS_OP_PRINT:
+        case TFS_OP_DELEGATE:
+            return LANE_BULK;
+        default:
+            return LANE_NORMAL;
+    }
+}
+
+
+/*
+ * Classifies a request. A batch goes to the lane of its slowest operation.
+ * Input:
+ *  - req: decoded request
+ * Returns:
+ *  lane of the request
+ */
+lane_t classifyRequest(request_t *req) {
+    tfs_request_t op;
+    size_t offset = sizeof(tfs_header_t);
+    lane_t lane = LANE_FAST;
+
+    if (req->command.opcode != TFS_OP_BATCH) {
+        return classifyCommand(&req->command);
+    }
+
+    while (tfs_batch_next(req->buffer, req->length, &offset, &op) == 1) {
+        if (classifyCommand(&op) > lane)
+            lane = classifyCommand(&op);
+    }
+    return lane;
+}
+
+
+/*
+ * Chooses the worker a request should preferably run on, based on the
+ * subtree it touches. Requests without a path (prints and operations on
+ * open files) and the directories of a tree are spread round-robin over
+ * the workers that may take them.
+ * Input:
+ *  - req: request received from client, with its lane already set
+ * Returns:
+ *  index of the preferred worker
+ */
+int routeCommand(request_t *req) {
+    /* shared by the receivers and by the workers handing requests back */
+    static unsigned int nextWorker = 0;
+    int first = req->lane == LANE_FAST ? 0 : numberFastThreads;
+    tfs_request_t *command = &req->command, op;
+
+    /* a batch goes where its first operation would */
+    if (command->opcode == TFS_OP_BATCH) {
+        size_t offset = sizeof(tfs_header_t);
+
+        tfs_batch_next(req->buffer, req->length, &offset, &op);
+        command = &op;
+    }
+
+    if (affinityDepth > 0 && command->opcode != TFS_OP_PRINT && command->npaths > 0 && req->task == NULL) {
+        return workqueue_route(command->paths[0], affinityDepth, req->lane);
+    }
+
+    return first + __atomic_fetch_add(&nextWorker, 1, __ATOMIC_RELAXED) % (unsigned int)(numberThreads - first);
+}
+
+
+/*
+ * Signal handler thread: prints per-class latency on SIGUSR1 and before
+ * terminating on SIGINT or SIGTERM.
+ */
+void* fnSignals(void* arg) {
+    sigset_t *signals = arg;
+    int sig;
+
+    while (1) {
+        if (sigwait(signals, &sig) != 0) {
+            fprintf(stderr, "Error: sigwait: Failed to wait for signal.\n");
             exit(EXIT_FAILURE);
         }
+
+        stats_print(stdout);
+
+        if (sig != SIGUSR1) {
+            exit(EXIT_SUCCESS);
+        }
     }
 
     return NULL;
@@ -312,59 +749,1215 @@ int setSockAddrUn(char *path, struct sockaddr_un *addr) {
 }
 
 
-int main(int argc, char* argv[]) {
-    int i = 0;
+/*
+ * State of one receiver: its sockets, its event loop and the requests it
+ * reads datagrams into.
+ */
+typedef struct receiver {
+    int sockfd;   /* datagram socket */
+    int listenfd; /* listener for client sessions */
+    int epollfd;
+    request_t **reqs;
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+    char *control; /* room for descriptors passed along each message */
+    int shedding;
+#ifdef USE_IO_URING
+    uring_t uring;        /* receives datagrams instead of recvmmsg, with -u */
+    struct msghdr layout; /* of the multishot receive's buffers */
+#endif
+} receiver_t;
+
+
+#ifdef USE_IO_URING
+/*
+ * Posts the multishot receive that keeps delivering the datagram socket's
+ * messages into the ring's buffers.
+ */
+void receiverArmUring(receiver_t *receiver) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&receiver->uring);
+
+    if (sqe == NULL) {
+        fprintf(stderr, "Error: io_uring submission queue full.\n");
+        exit(EXIT_FAILURE);
+    }
+    uring_prep_recvmsg_multishot(sqe, receiver->sockfd, &receiver->layout, 0);
+    if (uring_submit(&receiver->uring, 0) < 0) {
+        perror("server: io_uring_enter error");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    /* server socket variables */
-    struct sockaddr_un server_addr;
-    socklen_t serverlen;
-    char path[SOCK_MAX_PATH_LEN];
 
-    /* test input validity */
-    if (argc != 3) {
-        fprintf(stderr, "Error: Invalid input.\nUsage: ./tecnicofs <numthreads> <server_socket_path>\n");
+/*
+ * Sets up the io_uring a receiver takes its datagrams from, with a buffer
+ * for each datagram of a batch.
+ */
+void receiverInitUring(receiver_t *receiver) {
+    unsigned count = 8;
+
+    /* buffer rings hold a power of two */
+    while (count < (unsigned)ioBatchSize)
+        count <<= 1;
+
+    if (uring_init(&receiver->uring, count) != 0 ||
+        uring_provide_buffers(&receiver->uring, count, sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_un) + TFS_MAX_FRAME, 0) != 0) {
+        fprintf(stderr, "Error: io_uring unavailable.\n");
         exit(EXIT_FAILURE);
     }
 
+    /* each buffer starts with the sender's address, the datagram follows */
+    memset(&receiver->layout, 0, sizeof(receiver->layout));
+    receiver->layout.msg_namelen = sizeof(struct sockaddr_un);
+    receiverArmUring(receiver);
+}
+#endif
+
+
+/*
+ * Sets up a receiver: binds its datagram socket at the given path and its
+ * session listener next to it, and watches both in its own event loop.
+ * Input:
+ *  - path: path of the datagram socket
+ */
+void receiverInit(receiver_t *receiver, char *path) {
+    struct sockaddr_un server_addr;
+    socklen_t serverlen;
+    char sessionPath[SOCK_MAX_PATH_LEN + sizeof(TFS_SESSION_SUFFIX)];
+    struct epoll_event event;
+
     /* declare socket */
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    if ((receiver->sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
         perror("server: can't open socket");
         exit(EXIT_FAILURE);
     }
-    strcpy(path, argv[2]);
     unlink(path);
 
     /* initialize socket address */
     serverlen = setSockAddrUn(path, &server_addr);
 
     /* bind socket to socket address */
-    if (bind(sockfd, (struct sockaddr *)&server_addr, serverlen) < 0) {
+    if (bind(receiver->sockfd, (struct sockaddr *)&server_addr, serverlen) < 0) {
         perror("server: bind error");
         exit(EXIT_FAILURE);
     }
 
-    /* initiate filesystem */
-    init_fs();
+    /* declare the listener for client sessions, next to the datagram socket */
+    if ((receiver->listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("server: can't open socket");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(sessionPath, sizeof(sessionPath), "%s%s", path, TFS_SESSION_SUFFIX);
+    unlink(sessionPath);
+    serverlen = setSockAddrUn(sessionPath, &server_addr);
 
-    /* get number of threads */
-    if (atoi(argv[1]) <= 0) {
-        fprintf(stderr, "Error: Invalid number of threads.\n");
+    if (bind(receiver->listenfd, (struct sockaddr *)&server_addr, serverlen) < 0 || listen(receiver->listenfd, SOMAXCONN) < 0) {
+        perror("server: listen error");
         exit(EXIT_FAILURE);
     }
-    else {
-        numberThreads = atoi(argv[1]);
+
+    receiver->reqs = calloc(ioBatchSize, sizeof(request_t *));
+    receiver->msgs = malloc(sizeof(struct mmsghdr) * ioBatchSize);
+    receiver->iovecs = malloc(sizeof(struct iovec) * ioBatchSize);
+    receiver->control = malloc(CONTROL_SIZE * ioBatchSize);
+    receiver->shedding = 0;
+    if (receiver->reqs == NULL || receiver->msgs == NULL || receiver->iovecs == NULL || receiver->control == NULL) {
+        fprintf(stderr, "Error: failed to allocate receive buffers.\n");
+        exit(EXIT_FAILURE);
     }
 
-    /* create pool of threads */
-    pthread_t tid[numberThreads];
-    for (i = 0; i < numberThreads; i++) {
+    if ((receiver->epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("server: epoll_create1 error");
+        exit(EXIT_FAILURE);
+    }
 
-        if (pthread_create(&tid[i], NULL, fnThread, NULL) != 0) {
-            fprintf(stderr, "Error: failed to create thread.\n");
-            exit(EXIT_FAILURE);
+    /* connections are tagged with their connection_t, the sockets with their fields */
+    event.events = EPOLLIN;
+    event.data.ptr = &receiver->sockfd;
+#ifdef USE_IO_URING
+    /* datagrams then arrive through the ring, which signals its completions */
+    if (useUring) {
+        receiverInitUring(receiver);
+        event.data.ptr = &receiver->uring;
+    }
+    if (epoll_ctl(receiver->epollfd, EPOLL_CTL_ADD, useUring ? receiver->uring.fd : receiver->sockfd, &event) != 0) {
+#else
+    if (epoll_ctl(receiver->epollfd, EPOLL_CTL_ADD, receiver->sockfd, &event) != 0) {
+#endif
+        perror("server: epoll_ctl error");
+        exit(EXIT_FAILURE);
+    }
+    event.data.ptr = &receiver->listenfd;
+    if (epoll_ctl(receiver->epollfd, EPOLL_CTL_ADD, receiver->listenfd, &event) != 0) {
+        perror("server: epoll_ctl error");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Closes descriptors received but not used.
+ */
+void closeFds(int *fds, int nfds) {
+    for (int i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+}
+
+
+/*
+ * Takes the descriptors passed along with a message.
+ * Input:
+ *  - msg: received message
+ *  - fds: room for TFS_ATTACH_FDS descriptors
+ * Returns:
+ *  number of descriptors taken (any beyond TFS_ATTACH_FDS are closed)
+ */
+int receivedFds(struct msghdr *msg, int *fds) {
+    int n = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (n < TFS_ATTACH_FDS)
+                fds[n++] = fd;
+            else
+                close(fd);
         }
-        /* DEBUG */
-        /* printf("(T thread %d criada)\n", i); */
+    }
+    return n;
+}
+
+
+/*
+ * Decodes a received request and hands it to the worker owning its
+ * subtree. Attach requests are handled right here.
+ * Once the queues reach the high watermark, requests are answered right
+ * away with TECNICOFS_ERROR_BUSY until they drain below the low watermark.
+ * Input:
+ *  - req: request received, with its origin filled in
+ *  - fds, nfds: descriptors passed along with it
+ */
+void admitRequest(receiver_t *receiver, request_t *req, int *fds, int nfds) {
+    clock_gettime(CLOCK_MONOTONIC, &req->received);
+    req->output = NULL;
+    req->leased = 0;
+    req->passedFd = -1;
+    req->nresults = 0;
+    req->task = NULL;
+
+    if (decodeRequest(req) == FAIL) {
+        fprintf(stderr, "Error: invalid command from %s\n", req->conn != NULL ? "connection" : req->client_addr.sun_path);
+        req->lane = LANE_NORMAL;
+        req->status = TECNICOFS_ERROR_OTHER;
+        reply_queue_push(&replies, req);
+        closeFds(fds, nfds);
+        return;
+    }
+
+    /* only a session may attach rings, passing their descriptors along */
+    if (req->command.opcode == TFS_OP_ATTACH) {
+        req->lane = LANE_NORMAL;
+        if (req->conn != NULL && !req->ring && nfds == TFS_ATTACH_FDS) {
+            req->status = connection_attach(req->conn, fds) == 0 ? SUCCESS : FAIL;
+        }
+        else {
+            req->status = FAIL;
+            closeFds(fds, nfds);
+        }
+        reply_queue_push(&replies, req);
+        return;
+    }
+    closeFds(fds, nfds);
+
+    /* events are pushed on the session, so only a session may watch */
+    if (req->command.opcode == TFS_OP_WATCH || req->command.opcode == TFS_OP_UNWATCH) {
+        req->lane = LANE_NORMAL;
+        if (req->conn == NULL) {
+            req->status = FAIL;
+        }
+        else if (req->command.opcode == TFS_OP_WATCH) {
+            req->status = watch_add(req->conn, req->command.paths[0], req->command.flags & TFS_WATCH_SUBTREE);
+        }
+        else {
+            req->status = watch_remove(req->conn, req->command.paths[0]);
+        }
+        reply_queue_push(&replies, req);
+        return;
+    }
+
+    req->lane = classifyRequest(req);
+
+    /* admission control */
+    int queued = workqueue_pending();
+    if (queued >= highWatermark) {
+        receiver->shedding = 1;
+    }
+    else if (queued <= lowWatermark) {
+        receiver->shedding = 0;
+    }
+
+    if (receiver->shedding) {
+        req->status = TECNICOFS_ERROR_BUSY;
+        stats_record_shed(req->lane);
+        reply_queue_push(&replies, req);
+    }
+    else {
+        workqueue_dispatch(routeCommand(req), req);
+    }
+}
+
+
+/*
+ * Reads the requests already waiting on a socket (up to ioBatchSize) with
+ * a single recvmmsg call and admits each one.
+ * Input:
+ *  - fd: datagram socket or connection to read from
+ *  - conn: the connection, or NULL for the datagram socket
+ * Returns:
+ *  number of requests read, or -1 if the client closed the connection
+ *  (after handing over the requests it sent before)
+ */
+int receiveBatch(receiver_t *receiver, int fd, connection_t *conn) {
+    request_t **reqs = receiver->reqs;
+    struct mmsghdr *msgs = receiver->msgs;
+    int n, hungUp = 0;
+
+    /* refill the slots handed over in the previous round */
+    for (int i = 0; i < ioBatchSize; i++) {
+        if (reqs[i] == NULL && (reqs[i] = malloc(sizeof(request_t))) == NULL) {
+            fprintf(stderr, "Error: failed to allocate request.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* leave room to terminate a text command */
+        receiver->iovecs[i].iov_base = reqs[i]->buffer;
+        receiver->iovecs[i].iov_len = sizeof(reqs[i]->buffer) - 1;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        memset(&reqs[i]->client_addr, 0, sizeof(struct sockaddr_un));
+        msgs[i].msg_hdr.msg_name = &reqs[i]->client_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        msgs[i].msg_hdr.msg_iov = &receiver->iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        /* only sessions may pass descriptors */
+        if (conn != NULL) {
+            msgs[i].msg_hdr.msg_control = receiver->control + i * CONTROL_SIZE;
+            msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+    }
+
+    /* receive commands from clients */
+    n = recvmmsg(fd, msgs, ioBatchSize, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL);
+    if (n < 0) {
+        return (conn != NULL && errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        request_t *req = reqs[i];
+        int fds[TFS_ATTACH_FDS];
+        int nfds = receivedFds(&msgs[i].msg_hdr, fds);
+
+        /* an empty message on a connection means the client hung up */
+        if (msgs[i].msg_len == 0) {
+            closeFds(fds, nfds);
+            if (conn != NULL) {
+                hungUp = 1;
+                n = i;
+                break;
+            }
+            continue;
+        }
+
+        reqs[i] = NULL;
+        req->length = msgs[i].msg_len;
+        req->addrlen = msgs[i].msg_hdr.msg_namelen;
+        req->conn = conn;
+        req->ring = 0;
+        req->sockfd = receiver->sockfd;
+        if (conn != NULL) {
+            connection_request_begin(conn);
+        }
+        admitRequest(receiver, req, fds, nfds);
+    }
+
+    if (n > 0) {
+        stats_record_io_batch(IO_RECV, n);
+    }
+    return hungUp ? -1 : n;
+}
+
+
+#ifdef USE_IO_URING
+/*
+ * Takes the datagrams the multishot receive completed, without a system
+ * call, and admits each one. The receive is posted again if it stopped,
+ * which the kernel does when it runs out of buffers.
+ */
+void receiveUring(receiver_t *receiver) {
+    uring_t *ring = &receiver->uring;
+    struct io_uring_cqe *cqe;
+    int n = 0, stopped = 0;
+
+    while ((cqe = uring_peek_cqe(ring)) != NULL) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            stopped = 1;
+        }
+
+        if (cqe->res < 0) {
+            if (cqe->res != -ENOBUFS) {
+                fprintf(stderr, "Error: io_uring receive: %s\n", strerror(-cqe->res));
+            }
+        }
+        else if (cqe->flags & IORING_CQE_F_BUFFER) {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)uring_buffer(ring, bid);
+            char *name = (char *)(out + 1);
+            char *payload = name + receiver->layout.msg_namelen + receiver->layout.msg_controllen;
+            request_t *req = malloc(sizeof(request_t));
+
+            if (req == NULL) {
+                fprintf(stderr, "Error: failed to allocate request.\n");
+                exit(EXIT_FAILURE);
+            }
+
+            /* leave room to terminate a text command */
+            req->length = out->payloadlen < sizeof(req->buffer) - 1 ? out->payloadlen : sizeof(req->buffer) - 1;
+            memcpy(req->buffer, payload, req->length);
+            memset(&req->client_addr, 0, sizeof(struct sockaddr_un));
+            req->addrlen = out->namelen < sizeof(struct sockaddr_un) ? out->namelen : sizeof(struct sockaddr_un);
+            memcpy(&req->client_addr, name, req->addrlen);
+            uring_recycle_buffer(ring, bid);
+
+            req->conn = NULL;
+            req->ring = 0;
+            req->sockfd = receiver->sockfd;
+            admitRequest(receiver, req, NULL, 0);
+            n++;
+        }
+        uring_cqe_seen(ring);
+    }
+
+    if (n > 0) {
+        stats_record_io_batch(IO_RECV, n);
+    }
+    if (stopped) {
+        receiverArmUring(receiver);
+    }
+}
+#endif
+
+
+/*
+ * Takes the requests waiting in a session's submission ring (up to
+ * ioBatchSize) and admits each one. If the ring runs empty the server
+ * goes idle on it, to be signalled by the client's next request. A
+ * throttled session isn't drained; its replies wake the receiver up again.
+ */
+void receiveRing(receiver_t *receiver, connection_ring_t *ring) {
+    connection_t *conn = ring->conn;
+    uint64_t wakeups;
+    int n = 0;
+
+    /* consume the wakeup, what it announced is read below */
+    if (read(ring->serverWake, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        perror("server: eventfd read error");
+    }
+
+    /* racy read, a few requests past the limit are harmless */
+    while (!__atomic_load_n(&conn->throttled, __ATOMIC_RELAXED)) {
+        request_t *req;
+        int c;
+
+        if (n == ioBatchSize) {
+            /* leave the rest for after the other events */
+            uint64_t one = 1;
+            if (write(ring->serverWake, &one, sizeof(one)) < 0) {
+                perror("server: eventfd write error");
+            }
+            return;
+        }
+
+        if (!tfs_ring_ready(&ring->submissions)) {
+            if (tfs_ring_prepare_wait(&ring->submissions))
+                return;
+            continue;
+        }
+
+        if ((req = malloc(sizeof(request_t))) == NULL) {
+            fprintf(stderr, "Error: failed to allocate request.\n");
+            exit(EXIT_FAILURE);
+        }
+        c = tfs_ring_pop(&ring->submissions, req->buffer, sizeof(req->buffer) - 1);
+        if (c <= 0) {
+            fprintf(stderr, "Error: invalid frame in submission ring.\n");
+            free(req);
+            continue;
+        }
+
+        memset(&req->client_addr, 0, sizeof(struct sockaddr_un));
+        req->addrlen = 0;
+        req->length = c;
+        req->conn = conn;
+        req->ring = 1;
+        req->sockfd = -1;
+        connection_request_begin(conn);
+        admitRequest(receiver, req, NULL, 0);
+        n++;
+    }
+}
+
+
+/*
+ * Receive stage: each receiver waits for requests on its own datagram
+ * socket and on the client connections it accepted, and accepts new
+ * connections on its listener.
+ */
+void* fnReceiver(void* arg) {
+    receiver_t *receiver = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(receiver->epollfd, events, MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("server: epoll_wait error");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            connection_t *conn = events[i].data.ptr;
+
+            if (events[i].data.ptr == &receiver->sockfd) {
+                receiveBatch(receiver, receiver->sockfd, NULL);
+            }
+#ifdef USE_IO_URING
+            else if (events[i].data.ptr == &receiver->uring) {
+                receiveUring(receiver);
+            }
+#endif
+            else if (events[i].data.ptr == &receiver->listenfd) {
+                while (connection_accept(receiver->listenfd, receiver->epollfd) != NULL);
+            }
+            else if (*(watched_t *)events[i].data.ptr == WATCHED_RING) {
+                receiveRing(receiver, events[i].data.ptr);
+            }
+            else {
+                /* room for the replies and the events its watches have pending */
+                if (events[i].events & EPOLLOUT) {
+                    connection_output_ready(conn);
+                    connection_flush(conn);
+                    watch_flush(conn);
+                }
+                if ((events[i].events & EPOLLIN && receiveBatch(receiver, conn->fd, conn) < 0) ||
+                    events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    /* serve what the client sent before hanging up */
+                    while (receiveBatch(receiver, conn->fd, conn) > 0);
+                    lease_forget(conn);
+                    watch_forget(conn);
+                    delegation_forget(conn);
+                    /* files are closed once no more can be opened */
+                    connection_hold(conn);
+                    connection_close(conn);
+                    files_forget(conn);
+                    connection_put(conn);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Encodes the answer to a request: a reply frame for binary requests (with
+ * every result, for a batch), a bare int for text commands.
+ * Input:
+ *  - req: processed request
+ *  - reply: buffer of REPLY_MAX_SIZE bytes
+ * Returns:
+ *  size of the reply
+ */
+size_t encodeReply(request_t *req, char *reply) {
+    if (req->binary && req->command.opcode == TFS_OP_BATCH && req->status == SUCCESS) {
+        tfs_frame_begin(reply, TFS_OP_BATCH, TFS_RESULT_BATCH, req->command.id);
+        tfs_frame_put(reply, REPLY_MAX_SIZE, req->results, sizeof(int32_t) * req->nresults);
+        return tfs_frame_size(reply);
+    }
+    else if (req->binary && req->command.opcode == TFS_OP_READ) {
+        tfs_frame_begin(reply, TFS_OP_READ, TFS_RESULT_DATA, req->command.id);
+        tfs_frame_put_int(reply, REPLY_MAX_SIZE, req->status);
+        if (req->status > 0) {
+            tfs_frame_put(reply, REPLY_MAX_SIZE, req->data, req->status);
+        }
+        return tfs_frame_size(reply);
+    }
+    else if (req->binary && tfs_tree_op(&req->command)) {
+        tfs_frame_begin(reply, req->command.opcode, TFS_RESULT_TREE, req->command.id);
+        tfs_frame_put_int(reply, REPLY_MAX_SIZE, req->status);
+        tfs_frame_put(reply, REPLY_MAX_SIZE, req->results, sizeof(int32_t) * req->nresults);
+        return tfs_frame_size(reply);
+    }
+    else if (req->binary) {
+        uint8_t resultType = req->command.opcode == TFS_OP_LOOKUP ? TFS_RESULT_INUMBER : TFS_RESULT_STATUS;
+
+        if (req->leased) {
+            resultType |= TFS_RESULT_LEASE;
+        }
+
+        tfs_frame_begin(reply, req->command.opcode, resultType, req->command.id);
+        tfs_frame_put_int(reply, REPLY_MAX_SIZE, req->status);
+        return tfs_frame_size(reply);
+    }
+
+    memcpy(reply, &req->status, sizeof(int));
+    return sizeof(int);
+}
+
+
+#ifdef USE_IO_URING
+/*
+ * Waits for the completions of the entries submitted.
+ * Input:
+ *  - pending: number of entries in flight
+ *  - results: set to each entry's result, indexed by the entry's tag
+ */
+void reapUring(uring_t *ring, int pending, int *results) {
+    while (pending > 0) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+
+        if (cqe == NULL) {
+            if (uring_submit(ring, 1) < 0) {
+                perror("server: io_uring_enter error");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        results[cqe->user_data] = cqe->res;
+        uring_cqe_seen(ring);
+        pending--;
+    }
+}
+
+
+/*
+ * Writes the output of the prints among the requests, all in one
+ * submission, before they are answered. A print whose output can't be
+ * written fails.
+ */
+void writeOutputsUring(uring_t *ring, request_t **reqs, int n) {
+    int fds[n], results[n], pending = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+
+        fds[i] = -1;
+        if (reqs[i]->output == NULL)
+            continue;
+
+        fds[i] = open(reqs[i]->command.paths[0], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fds[i] < 0) {
+            fprintf(stderr, "Error: Invalid output file.\n");
+            reqs[i]->status = FAIL;
+            continue;
+        }
+        if ((sqe = uring_get_sqe(ring)) == NULL) {
+            fprintf(stderr, "Error: io_uring submission queue full, output not written.\n");
+            reqs[i]->status = FAIL;
+            close(fds[i]);
+            fds[i] = -1;
+            continue;
+        }
+        uring_prep_write(sqe, fds[i], reqs[i]->output, reqs[i]->outputSize);
+        sqe->user_data = i;
+        pending++;
+    }
+
+    if (pending > 0 && uring_submit(ring, pending) < 0) {
+        perror("server: io_uring_enter error");
+        exit(EXIT_FAILURE);
+    }
+    reapUring(ring, pending, results);
+
+    for (int i = 0; i < n; i++) {
+        if (fds[i] < 0) {
+            free(reqs[i]->output);
+            reqs[i]->output = NULL;
+            continue;
+        }
+        if (results[i] < 0 || (size_t)results[i] != reqs[i]->outputSize) {
+            fprintf(stderr, "Error: Failed to write output file.\n");
+            reqs[i]->status = FAIL;
+        }
+        if (close(fds[i]) != 0) {
+            fprintf(stderr, "Error: Failed to close file.\n");
+            reqs[i]->status = FAIL;
+        }
+        free(reqs[i]->output);
+        reqs[i]->output = NULL;
+    }
+}
+
+
+/*
+ * Sends the datagram replies prepared in msgs, whatever socket each goes
+ * out of, in one submission.
+ * The sends don't wait: a non-blocking send to a client whose queue is
+ * full has already consumed the message, so the ring must not retry it.
+ * Those replies are sent again here, waiting for room like sendmmsg does.
+ */
+void sendUring(uring_t *ring, request_t **reqs, struct mmsghdr *msgs, int n) {
+    int results[n], pending = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+
+        if (reqs[i]->conn != NULL)
+            continue;
+
+        /* the queue holds a whole batch, this only guards against misuse */
+        if ((sqe = uring_get_sqe(ring)) == NULL) {
+            fprintf(stderr, "Error: io_uring submission queue full.\n");
+            exit(EXIT_FAILURE);
+        }
+        uring_prep_sendmsg(sqe, reqs[i]->sockfd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        sqe->user_data = i;
+        pending++;
+    }
+
+    if (pending == 0)
+        return;
+    if (uring_submit(ring, pending) < 0) {
+        perror("server: io_uring_enter error");
+        exit(EXIT_FAILURE);
+    }
+    stats_record_io_batch(IO_SEND, pending);
+    reapUring(ring, pending, results);
+
+    for (int i = 0; i < n; i++) {
+        if (reqs[i]->conn != NULL)
+            continue;
+
+        if (results[i] == -EAGAIN) {
+            results[i] = sendmsg(reqs[i]->sockfd, &msgs[i].msg_hdr, 0) < 0 ? -errno : 0;
+        }
+        if (results[i] < 0) {
+            fprintf(stderr, "Error: io_uring sendmsg: %s\n", strerror(-results[i]));
+        }
+    }
+}
+#endif
+
+
+/*
+ * Send stage: takes every processed request waiting (up to ioBatchSize)
+ * and answers the datagram ones with a sendmmsg call per server socket,
+ * or with a single io_uring submission (which also writes print output).
+ */
+void* fnSender(void* arg) {
+    request_t *reqs[ioBatchSize];
+    struct mmsghdr msgs[ioBatchSize], batch[ioBatchSize];
+    struct iovec iovecs[ioBatchSize];
+    char (*replyBuffers)[REPLY_MAX_SIZE] = malloc(REPLY_MAX_SIZE * ioBatchSize);
+
+    if (replyBuffers == NULL) {
+        fprintf(stderr, "Error: failed to allocate reply buffers.\n");
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef USE_IO_URING
+    uring_t ring;
+
+    if (useUring && uring_init(&ring, ioBatchSize) != 0) {
+        fprintf(stderr, "Error: io_uring unavailable.\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    while (1) {
+        int n = reply_queue_pop_many(&replies, reqs, ioBatchSize);
+
+        int m = 0;
+
+#ifdef USE_IO_URING
+        /* prints are only answered once their output is written */
+        if (useUring) {
+            writeOutputsUring(&ring, reqs, n);
+        }
+#endif
+
+        for (int i = 0; i < n; i++) {
+            size_t size = encodeReply(reqs[i], replyBuffers[i]);
+
+            /* replies to connections go out right away, datagrams in batches */
+            if (reqs[i]->conn != NULL) {
+                connection_reply(reqs[i]->conn, replyBuffers[i], size, reqs[i]->ring, reqs[i]->passedFd);
+                continue;
+            }
+            iovecs[i].iov_base = replyBuffers[i];
+            iovecs[i].iov_len = size;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = &reqs[i]->client_addr;
+            msgs[i].msg_hdr.msg_namelen = reqs[i]->addrlen;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            m++;
+        }
+
+#ifdef USE_IO_URING
+        if (useUring) {
+            sendUring(&ring, reqs, msgs, n);
+            m = 0;
+        }
+#endif
+
+        /* answer from the socket each request arrived on, one sendmmsg per socket */
+        while (m > 0) {
+            int fd = -1, k = 0;
+
+            for (int i = 0; i < n; i++) {
+                if (reqs[i]->conn != NULL || reqs[i]->sockfd < 0 || (fd >= 0 && reqs[i]->sockfd != fd))
+                    continue;
+                fd = reqs[i]->sockfd;
+                reqs[i]->sockfd = -1;
+                batch[k++] = msgs[i];
+            }
+            m -= k;
+
+            /* send messages to clients with operations' return values */
+            for (int sent = 0; sent < k; ) {
+                int c = sendmmsg(fd, batch + sent, k - sent, 0);
+
+                if (c < 0) {
+                    perror("server: sendmmsg error");
+                    exit(EXIT_FAILURE);
+                }
+                stats_record_io_batch(IO_SEND, c);
+                sent += c;
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (reqs[i]->status != TECNICOFS_ERROR_BUSY) {
+                stats_record_latency(reqs[i]->lane, &reqs[i]->received);
+            }
+            free(reqs[i]);
+        }
+    }
+
+    free(replyBuffers);
+    return NULL;
+}
+
+
+/*
+ * Runs the operations of a batch in order, keeping each one's result.
+ * Input:
+ *  - req: batch request, already checked by decodeRequest()
+ */
+void applyBatch(request_t *req) {
+    tfs_request_t op;
+    size_t offset = sizeof(tfs_header_t);
+
+    req->nresults = 0;
+    while (tfs_batch_next(req->buffer, req->length, &offset, &op) == 1) {
+        req->results[req->nresults++] = applyCommand(&op);
+    }
+    req->status = SUCCESS;
+}
+
+
+/*
+ * Finds the paths an operation works on, as absolute normalized paths to
+ * be checked against the delegations (see delegation_defer()). A print
+ * works on the whole tree. Paths relative to a stale handle are left out,
+ * the operation fails anyway.
+ * Input:
+ *  - command: decoded operation
+ *  - buffers, paths, contains: where to store them, with room for
+ *    TFS_MAX_PATHS
+ * Returns:
+ *  number of paths stored
+ */
+int commandPaths(tfs_request_t *command, char (*buffers)[MAX_FILE_NAME], char **paths, int *contains) {
+    char relative[MAX_FILE_NAME], *path;
+    int n = 0;
+
+    if (command->opcode == TFS_OP_PRINT) {
+        strcpy(buffers[0], "/");
+        paths[0] = buffers[0];
+        contains[0] = 1;
+        return 1;
+    }
+
+    for (int i = 0; i < command->npaths; i++) {
+        path = command->paths[i];
+
+        /* resolving a handle searches the tree */
+        if (command->dir != TFS_NO_DIR) {
+            if (pthread_mutex_lock(&m) != 0) {
+                fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+                exit(EXIT_FAILURE);
+            }
+            path = absolutePath(command, path, relative);
+            if (pthread_mutex_unlock(&m) != 0) {
+                fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (path != NULL && tfs_path_normalize(buffers[n], MAX_FILE_NAME, path) == 0) {
+            paths[n] = buffers[n];
+            /* moving a node moves everything under it, a tree goes through it all */
+            contains[n] = (command->opcode == TFS_OP_MOVE && i == 0) || tfs_tree_op(command);
+            n++;
+        }
+    }
+    return n;
+}
+
+
+/*
+ * Defers a request touching a subtree delegated to another session until
+ * the subtree is given back. A batch waits as a whole.
+ * Must be called between delegation_enter() and delegation_leave().
+ * Returns:
+ *  1 if the request was deferred, 0 if it may be applied
+ */
+int deferRequest(request_t *req) {
+    char buffers[TFS_MAX_BATCH * TFS_MAX_PATHS][MAX_FILE_NAME];
+    char *paths[TFS_MAX_BATCH * TFS_MAX_PATHS];
+    int contains[TFS_MAX_BATCH * TFS_MAX_PATHS];
+    tfs_request_t op;
+    size_t offset = sizeof(tfs_header_t);
+    int n = 0;
+
+    if (delegation_count() == 0) {
+        return 0;
+    }
+
+    if (req->command.opcode != TFS_OP_BATCH) {
+        n = commandPaths(&req->command, buffers, paths, contains);
+    }
+    while (req->command.opcode == TFS_OP_BATCH && tfs_batch_next(req->buffer, req->length, &offset, &op) == 1) {
+        n += commandPaths(&op, buffers + n, paths + n, contains + n);
+    }
+
+    return delegation_defer(req, paths, contains, n);
+}
+
+
+/*
+ * Hands a request back to the workers: one deferred by a delegation, or a
+ * directory of a tree.
+ */
+void resumeDeferred(request_t *req) {
+    workqueue_dispatch(routeCommand(req), req);
+}
+
+
+/*
+ * Grants a session the subtree it asks for, or takes it back.
+ * Input:
+ *  - req: delegate request
+ * Returns:
+ *  see delegation_grant() and delegation_return(); FAIL without a session
+ */
+int applyDelegation(request_t *req) {
+    char *name = req->command.paths[0];
+
+    if (req->conn == NULL) {
+        return FAIL;
+    }
+    if (req->command.flags & TFS_DELEGATE_RETURN) {
+        printf("Return delegation: %s\n", name);
+        return delegation_return(req->conn, name);
+    }
+    printf("Delegate: %s\n", name);
+    return delegation_grant(req->conn, name);
+}
+
+
+/*
+ * Applies an operation on the files of the request's session.
+ * Input:
+ *  - req: open, read, map, write or close request
+ * Returns:
+ *  see files_open(), files_read(), files_map(), files_write() and
+ *  files_close();
+ *  TECNICOFS_ERROR_NO_OPEN_SESSION without a session
+ */
+int applyFileCommand(request_t *req) {
+    tfs_request_t *command = &req->command;
+    path_t path;
+    int ret;
+
+    if (req->conn == NULL) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+
+    switch (command->opcode) {
+        case TFS_OP_OPEN:
+            if (path_parse(&path, command->paths[0]) != SUCCESS) {
+                printf("Invalid path: %s\n", command->paths[0]);
+                return TECNICOFS_ERROR_FILE_NOT_FOUND;
+            }
+            ret = files_open(req->conn, command->dir == TFS_NO_DIR ? NO_DIR_HANDLE : command->dir, &path,
+                command->flags & ~(TFS_REQUEST_AT | TFS_OPEN_APPEND), command->flags & TFS_OPEN_APPEND);
+            printf("Open file: %s %s\n", command->paths[0], ret >= 0 ? "opened" : "failed");
+            return ret;
+        case TFS_OP_READ:
+            /* the bytes are left in the buffer, past the request */
+            req->data = req->buffer + req->length;
+            return files_read(req->conn, command->file, req->data, command->count);
+        case TFS_OP_MAP:
+            return files_map(req->conn, command->file, command->count, &req->passedFd);
+        case TFS_OP_WRITE:
+            return files_write(req->conn, command->file, command->data, command->count);
+        default:
+            printf("Close file: %d\n", command->file);
+            return files_close(req->conn, command->file);
+    }
+}
+
+
+/*
+ * Worker: takes requests from its own deque (or steals them from other
+ * workers) and applies them to the filesystem.
+ */
+void* fnThread(void* arg) {
+    int worker = *(int *)arg;
+
+    while (1) {
+        request_t *req = workqueue_pop(worker);
+
+        /* DEBUG */
+        /* printf("--%ld--%s--\n", (long)pthread_self(), req->conn != NULL ? "connection" : req->client_addr.sun_path); */
+
+        /* granted between requests, see delegation_grant() */
+        if (req->command.opcode == TFS_OP_DELEGATE) {
+            req->status = applyDelegation(req);
+            reply_queue_push(&replies, req);
+            continue;
+        }
+
+        /* requests on a subtree delegated to someone else wait for it to be given back */
+        delegation_enter();
+        if (deferRequest(req)) {
+            delegation_leave();
+            continue;
+        }
+
+        /* a lease is granted before the lookup, see lease_grant() */
+        if (req->command.opcode == TFS_OP_LOOKUP && req->command.flags & TFS_LOOKUP_LEASE && req->conn != NULL &&
+            req->command.dir == TFS_NO_DIR) {
+            req->leased = lease_grant(req->conn, req->command.paths[0]);
+        }
+
+        if (req->command.opcode == TFS_OP_BATCH) {
+            applyBatch(req);
+        }
+        else if (useUring && req->command.opcode == TFS_OP_PRINT) {
+            /* leave the file to the send stage's ring */
+            printf("Print to file: %s\n", req->command.paths[0]);
+            req->status = printTree(req->command.paths[0], &req->output, &req->outputSize);
+            if (req->status != SUCCESS) {
+                req->output = NULL;
+            }
+        }
+        else if (req->command.opcode == TFS_OP_OPEN || tfs_file_op(req->command.opcode)) {
+            req->status = applyFileCommand(req);
+        }
+        else if (tfs_tree_op(&req->command)) {
+            /* answered once the whole tree is done, by whichever worker finishes it */
+            req = tree_apply(req);
+        }
+        else {
+            req->status = applyCommand(&req->command);
+        }
+
+        delegation_leave();
+
+        if (req == NULL) {
+            continue;
+        }
+
+        /* DEBUG */
+        /* printf("DEBUG-2 %s\n", req->client_addr.sun_path); */
+
+        reply_queue_push(&replies, req);
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, char* argv[]) {
+    int i = 0;
+
+    /* server socket variables */
+    char path[SOCK_MAX_PATH_LEN];
+
+    /* parse options */
+    int opt;
+    while ((opt = getopt(argc, argv, "b:d:f:H:L:s:uw:")) != -1) {
+        switch (opt) {
+            case 'b':
+                ioBatchSize = atoi(optarg);
+                break;
+            case 'd':
+                affinityDepth = atoi(optarg);
+                break;
+            case 'f':
+                numberFastThreads = atoi(optarg);
+                break;
+            case 'H':
+                highWatermark = atoi(optarg);
+                break;
+            case 'L':
+                lowWatermark = atoi(optarg);
+                break;
+            case 's':
+                numberSockets = atoi(optarg);
+                break;
+            case 'u':
+#ifdef USE_IO_URING
+                useUring = 1;
+                break;
+#else
+                fprintf(stderr, "Error: built without io_uring support (make IO_URING=1).\n");
+                exit(EXIT_FAILURE);
+#endif
+            case 'w':
+                coalesceWindow = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: ./tecnicofs [-b io_batch_size] [-d affinity_depth] [-f fast_lane_threads] [-H high_watermark] [-L low_watermark] [-s sockets] [-u] [-w coalesce_window_us] <numthreads> <server_socket_path>\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    /* test input validity */
+    if (argc != 3) {
+        fprintf(stderr, "Error: Invalid input.\nUsage: ./tecnicofs [-b io_batch_size] [-d affinity_depth] [-f fast_lane_threads] [-H high_watermark] [-L low_watermark] [-s sockets] [-u] [-w coalesce_window_us] <numthreads> <server_socket_path>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    strcpy(path, argv[2]);
+
+    /* sockets beyond the first are bound at paths derived from it */
+    if (numberSockets < 1 || numberSockets > TFS_MAX_SOCKETS) {
+        fprintf(stderr, "Error: Invalid number of sockets.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* initiate filesystem */
+    init_fs();
+    coalesce_init(coalesceWindow);
+    lease_init();
+    watch_init();
+    files_init();
+
+    /* get number of threads */
+    if (atoi(argv[1]) <= 0) {
+        fprintf(stderr, "Error: Invalid number of threads.\n");
+        exit(EXIT_FAILURE);
+    }
+    else {
+        numberThreads = atoi(argv[1]);
+    }
+
+    /* reserve a share of the workers for the fast lane, keeping at least one for the others */
+    if (numberFastThreads < 0) {
+        numberFastThreads = numberThreads / 4;
+    }
+    if (numberFastThreads >= numberThreads) {
+        numberFastThreads = numberThreads - 1;
+    }
+
+    /* datagrams moved per recvmmsg/sendmmsg call */
+    if (ioBatchSize < 1 || ioBatchSize > MAX_IO_BATCH_SIZE) {
+        fprintf(stderr, "Error: Invalid I/O batch size.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the queues must drain below where shedding started */
+    if (lowWatermark > highWatermark) {
+        lowWatermark = highWatermark;
+    }
+
+    /* handle signals in a dedicated thread, blocking them everywhere else */
+    sigset_t signals;
+    pthread_t signal_tid;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0 ||
+        pthread_create(&signal_tid, NULL, fnSignals, &signals) != 0) {
+        fprintf(stderr, "Error: failed to set up signal handling.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* set up the queues between receive stage, workers and send stage */
+    workqueue_init(numberThreads, numberFastThreads);
+    reply_queue_init(&replies);
+
+    /* recalled delegations are taken back by a thread, which must have the signals blocked */
+    delegation_init(resumeDeferred);
+    tree_init(resumeDeferred, applyCommand);
+
+    /* one receiver per socket */
+    receiver_t receivers[numberSockets];
+    for (i = 0; i < TFS_MAX_SOCKETS; i++) {
+        char socketPath[SOCK_MAX_PATH_LEN + TFS_SOCKET_SUFFIX_LEN];
+        char sessionPath[sizeof(socketPath) + sizeof(TFS_SESSION_SUFFIX)];
+
+        tfs_socket_path(socketPath, sizeof(socketPath), path, i);
+        if (i < numberSockets) {
+            receiverInit(&receivers[i], socketPath);
+            continue;
+        }
+
+        /* clients count the sockets by their paths, drop those of a previous run */
+        snprintf(sessionPath, sizeof(sessionPath), "%s%s", socketPath, TFS_SESSION_SUFFIX);
+        unlink(socketPath);
+        unlink(sessionPath);
+    }
+
+    /* create pool of threads */
+    pthread_t tid[numberThreads], receiver_tid[numberSockets], sender_tid;
+    int worker_ids[numberThreads];
+    for (i = 0; i < numberThreads; i++) {
+        worker_ids[i] = i;
+
+        if (pthread_create(&tid[i], NULL, fnThread, &worker_ids[i]) != 0) {
+            fprintf(stderr, "Error: failed to create thread.\n");
+            exit(EXIT_FAILURE);
+        }
+        /* DEBUG */
+        /* printf("(T thread %d criada)\n", i); */
+    }
+
+    /* create receive and send stages */
+    for (i = 0; i < numberSockets; i++) {
+        if (pthread_create(&receiver_tid[i], NULL, fnReceiver, &receivers[i]) != 0) {
+            fprintf(stderr, "Error: failed to create thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pthread_create(&sender_tid, NULL, fnSender, NULL) != 0) {
+        fprintf(stderr, "Error: failed to create thread.\n");
+        exit(EXIT_FAILURE);
     }
 
     /* start measuring time */
@@ -388,6 +1981,13 @@ int main(int argc, char* argv[]) {
     fprintf(stdout, "TecnicoFS completed in %0.4f seconds.\n", elapsed);
 
     /* release allocated memory */
+    reply_queue_destroy(&replies);
+    workqueue_destroy();
+    coalesce_destroy();
+    lease_destroy();
+    watch_destroy();
+    delegation_destroy();
+    files_destroy();
     destroy_fs();
 
     exit(EXIT_SUCCESS);
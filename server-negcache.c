@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "negcache.h"
+
+/* direct-mapped by path */
+neg_entry_t negcache[NEGCACHE_SIZE];
+pthread_rwlock_t negcacheLock;
+
+/* bumped whenever the whole cache is dropped */
+unsigned long negcacheEpoch = 0;
+long negcacheHits = 0;
+
+
+static void rd_lock_negcache() {
+	if (pthread_rwlock_rdlock(&negcacheLock) != 0) {
+		fprintf(stderr, "Error: negcache: could not rd-lock cache\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void wr_lock_negcache() {
+	if (pthread_rwlock_wrlock(&negcacheLock) != 0) {
+		fprintf(stderr, "Error: negcache: could not wr-lock cache\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_negcache() {
+	if (pthread_rwlock_unlock(&negcacheLock) != 0) {
+		fprintf(stderr, "Error: negcache: could not unlock cache\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static unsigned long hash_path(char *path) {
+	unsigned long hash = 5381;
+
+	for (char *c = path; *c != '\0'; c++) {
+		hash = hash * 33 + (unsigned char)*c;
+	}
+	return hash % NEGCACHE_SIZE;
+}
+
+
+/*
+ * Initializes an empty negative lookup cache.
+ */
+void negcache_init() {
+	for (int i = 0; i < NEGCACHE_SIZE; i++) {
+		negcache[i].valid = 0;
+	}
+	pthread_rwlock_init(&negcacheLock, NULL);
+}
+
+
+/*
+ * Releases the negative lookup cache.
+ */
+void negcache_destroy() {
+	pthread_rwlock_destroy(&negcacheLock);
+}
+
+
+/*
+ * Returns the current epoch, to be passed to negcache_insert() by a walk
+ * that started now.
+ */
+unsigned long negcache_epoch() {
+	return __atomic_load_n(&negcacheEpoch, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Checks whether a path is known not to exist.
+ * Input:
+ *  - path: path of node
+ * Returns:
+ *  1 if the path is cached as missing, 0 otherwise
+ */
+int negcache_lookup(char *path) {
+	neg_entry_t *entry = &negcache[hash_path(path)];
+	int found;
+
+	rd_lock_negcache();
+	found = entry->valid && strcmp(entry->path, path) == 0;
+	unlock_negcache();
+
+	if (found) {
+		__atomic_add_fetch(&negcacheHits, 1, __ATOMIC_RELAXED);
+	}
+	return found;
+}
+
+
+/*
+ * Remembers that a path doesn't exist. Must be called while the walk still
+ * holds the lock of parent_inumber, so no create can slip in between.
+ * Input:
+ *  - path: path that was looked up
+ *  - parent_inumber: last node found on the path
+ *  - name, length: name missing from parent_inumber, not terminated
+ *  - epoch: value of negcache_epoch() when the walk started
+ */
+void negcache_insert(char *path, int parent_inumber, char *name, size_t length, unsigned long epoch) {
+	neg_entry_t *entry = &negcache[hash_path(path)];
+
+	if (strlen(path) >= MAX_FILE_NAME) {
+		return;
+	}
+
+	wr_lock_negcache();
+	/* a flush during the walk may have made what it saw stale */
+	if (epoch == negcacheEpoch) {
+		entry->valid = 1;
+		strcpy(entry->path, path);
+		entry->parent_inumber = parent_inumber;
+		memcpy(entry->name, name, length);
+		entry->name[length] = '\0';
+	}
+	unlock_negcache();
+}
+
+
+/*
+ * Forgets every path whose walk stopped because name was missing from
+ * parent_inumber. Called when that name is added to the directory.
+ * Input:
+ *  - parent_inumber: directory the name was added to
+ *  - name, length: name of the new entry, not terminated
+ */
+void negcache_invalidate(int parent_inumber, char *name, size_t length) {
+	wr_lock_negcache();
+	for (int i = 0; i < NEGCACHE_SIZE; i++) {
+		if (negcache[i].valid && negcache[i].parent_inumber == parent_inumber &&
+			strncmp(negcache[i].name, name, length) == 0 && negcache[i].name[length] == '\0') {
+			negcache[i].valid = 0;
+		}
+	}
+	unlock_negcache();
+}
+
+
+/*
+ * Forgets every path whose walk stopped at the given node. Called when the
+ * node is deleted, as its i-number may be reused elsewhere in the tree.
+ * Input:
+ *  - parent_inumber: node being deleted
+ */
+void negcache_invalidate_parent(int parent_inumber) {
+	wr_lock_negcache();
+	for (int i = 0; i < NEGCACHE_SIZE; i++) {
+		if (negcache[i].valid && negcache[i].parent_inumber == parent_inumber) {
+			negcache[i].valid = 0;
+		}
+	}
+	unlock_negcache();
+}
+
+
+/*
+ * Drops the whole cache. Called when a subtree is moved, since every path
+ * going through it changes at once.
+ */
+void negcache_flush() {
+	wr_lock_negcache();
+	for (int i = 0; i < NEGCACHE_SIZE; i++) {
+		negcache[i].valid = 0;
+	}
+	negcacheEpoch++;
+	unlock_negcache();
+}
+
+
+/*
+ * Reports how many lookups were answered by the cache and how many paths
+ * it holds.
+ */
+void negcache_stats(long *hits, long *entries) {
+	*hits = __atomic_load_n(&negcacheHits, __ATOMIC_RELAXED);
+	*entries = 0;
+
+	rd_lock_negcache();
+	for (int i = 0; i < NEGCACHE_SIZE; i++) {
+		*entries += negcache[i].valid;
+	}
+	unlock_negcache();
+}
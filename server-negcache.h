@@ -0,0 +1,31 @@
+#ifndef NEGCACHE_H
+#define NEGCACHE_H
+
+#include <pthread.h>
+#include "state.h"
+
+#define NEGCACHE_SIZE 256
+
+
+/*
+ * A path known not to exist, along with where its walk stopped: the last
+ * node found and the name that was missing from it.
+ */
+typedef struct neg_entry {
+	int valid;
+	char path[MAX_FILE_NAME];
+	int parent_inumber;
+	char name[MAX_FILE_NAME];
+} neg_entry_t;
+
+void negcache_init();
+void negcache_destroy();
+unsigned long negcache_epoch();
+int negcache_lookup(char *path);
+void negcache_insert(char *path, int parent_inumber, char *name, size_t length, unsigned long epoch);
+void negcache_invalidate(int parent_inumber, char *name, size_t length);
+void negcache_invalidate_parent(int parent_inumber);
+void negcache_flush();
+void negcache_stats(long *hits, long *entries);
+
+#endif /* NEGCACHE_H */
@@ -1,45 +1,8 @@
 #include "operations.h"
+#include "negcache.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <errno.h>
-
-
-/* Given a path, fills pointers with strings for the parent path and child
- * file name
- * Input:
- *  - path: the path to split. ATENTION: the function may alter this parameter
- *  - parent: reference to a char*, to store parent path
- *  - child: reference to a char*, to store child file name
- */
-void split_parent_child_from_path(char * path, char ** parent, char ** child) {
-
-	int n_slashes = 0, last_slash_location = 0;
-	int len = strlen(path);
-
-	// deal with trailing slash ( a/x vs a/x/ )
-	if (path[len-1] == '/') {
-		path[len-1] = '\0';
-	}
-
-	for (int i=0; i < len; ++i) {
-		if (path[i] == '/' && path[i+1] != '\0') {
-			last_slash_location = i;
-			n_slashes++;
-		}
-	}
-
-	if (n_slashes == 0) { // root directory
-		*parent = "";
-		*child = path;
-		return;
-	}
-
-	path[last_slash_location] = '\0';
-	*parent = path;
-	*child = path + last_slash_location + 1;
-
-}
 
 
 /*
@@ -47,6 +10,7 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
  */
 void init_fs() {
 	inode_table_init();
+	negcache_init();
 	
 	/* create root inode */
 	int root = inode_create(T_DIRECTORY);
@@ -64,6 +28,7 @@ void init_fs() {
  */
 void destroy_fs() {
 	inode_table_destroy();
+	negcache_destroy();
 }
 
 
@@ -91,56 +56,193 @@ int is_dir_empty(DirEntry *dirEntries) {
 
 
 /*
- * Looks for node in directory entry from name.
+ * Looks for a path component among the entries of a directory.
  * Input:
- *  - name: path of node
+ *  - path: parsed path
+ *  - i: index of the component
  *  - entries: entries of directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
+int lookup_sub_node(path_t *path, int i, DirEntry *entries) {
+	char *name = PATH_NAME(path, i);
+	size_t length = PATH_LENGTH(path, i);
+
 	if (entries == NULL) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
+	for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
+		if (entries[j].inumber != FREE_INODE && entries[j].hash == path->c[i].hash &&
+			memcmp(entries[j].name, name, length) == 0 && entries[j].name[length] == '\0') {
+			return entries[j].inumber;
+		}
+	}
 	return FAIL;
 }
 
 
+/*
+ * Locks the directory a walk starts at, checking that its handle still
+ * refers to it.
+ * Input:
+ *  - dir: directory handle, or NO_DIR_HANDLE to start at the root
+ *  - write: whether to lock it for writing
+ *  - inumber: where to store the directory's i-number
+ * Returns:
+ *  SUCCESS, or TECNICOFS_ERROR_STALE_HANDLE if the directory is gone;
+ *  the node is locked either way
+ */
+static int lock_start(int dir, int write, int *inumber) {
+	unsigned int generation;
+	type nType;
+
+	*inumber = dir == NO_DIR_HANDLE ? FS_ROOT : dir % INODE_TABLE_SIZE;
+
+	if (write) {
+		wr_lock_node(*inumber);
+	}
+	else {
+		rd_lock_node(*inumber);
+	}
+
+	if (dir == NO_DIR_HANDLE) {
+		return SUCCESS;
+	}
+	generation = inode_get_generation(*inumber, &nType);
+	if (nType != T_DIRECTORY || generation != (unsigned int)(dir / INODE_TABLE_SIZE)) {
+		return TECNICOFS_ERROR_STALE_HANDLE;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Walks the first n components of a path from a directory, locking every
+ * node on the way for reading, and the last one for writing if asked to.
+ * The nodes are left locked.
+ * Input:
+ *  - dir: handle of the directory, or NO_DIR_HANDLE for the root
+ *  - path: parsed path
+ *  - n: number of components to walk
+ *  - write: whether to lock the node reached for writing
+ *  - missing: where to store the index of the component not found, -1 if
+ *    all were
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise, or TECNICOFS_ERROR_STALE_HANDLE
+ */
+static int walk(int dir, path_t *path, int n, int write, int locked_nodes[], int *number_of_locked_nodes, int *missing) {
+
+	int current_inumber, status;
+
+	/* use for copy */
+	type nType;
+	union Data data;
+
+	/* lock the starting directory, for writing if it is the node reached */
+	status = lock_start(dir, write && n == 0, &current_inumber);
+	locked_nodes[*number_of_locked_nodes] = current_inumber;
+	*number_of_locked_nodes += 1;
+
+	*missing = -1;
+	if (status != SUCCESS) {
+		return status;
+	}
+
+	/* get its inode data */
+	inode_get(current_inumber, &nType, &data);
+
+	/* search for all sub nodes */
+	for (int i = 0; i < n; i++) {
+		if (nType != T_DIRECTORY || (current_inumber = lookup_sub_node(path, i, data.dirEntries)) == FAIL) {
+			*missing = i;
+			return FAIL;
+		}
+
+		if (write && i == n - 1) {
+			wr_lock_node(current_inumber);
+		}
+		else {
+			rd_lock_node(current_inumber);
+		}
+		locked_nodes[*number_of_locked_nodes] = current_inumber;
+		*number_of_locked_nodes += 1;
+
+		inode_get(current_inumber, &nType, &data);
+	}
+
+	return current_inumber;
+}
+
+
+/*
+ * Lookup called by operations create() and delete(): walks to the parent
+ * of the path's last component and locks it for writing.
+ * Input:
+ *  - dir: handle of the directory the path is relative to, or
+ *    NO_DIR_HANDLE
+ *  - path: parsed path
+ *  - n: number of components to walk
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise, or TECNICOFS_ERROR_STALE_HANDLE
+ */
+int wr_lookup_at(int dir, path_t *path, int n, int locked_nodes[], int* number_of_locked_nodes) {
+	int missing;
+
+	return walk(dir, path, n, 1, locked_nodes, number_of_locked_nodes, &missing);
+}
+
+
 /*
  * Creates a new node given a path.
  * Input:
- *  - name: path of node
+ *  - path: parsed path of node
  *  - nodeType: type of node
  * Returns: SUCCESS or FAIL
  */
-int create(char *name, type nodeType){
+int create(path_t *path, type nodeType){
+	return create_at(NO_DIR_HANDLE, path, nodeType);
+}
+
+/*
+ * Creates a new node given a path relative to a directory.
+ * Input:
+ *  - dir: handle of the directory, or NO_DIR_HANDLE for an absolute path
+ *  - path: parsed path of node
+ *  - nodeType: type of node
+ * Returns: SUCCESS, FAIL or TECNICOFS_ERROR_STALE_HANDLE
+ */
+int create_at(int dir, path_t *path, type nodeType){
 
 	int locked_nodes[MAX_PATH_LENGTH];
 	int number_of_locked_nodes = 0;
 
 	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	/* the last component names the node, the others its parent */
+	int child = path->n - 1;
+	int parent_length = path_prefix(path, child);
 	/* use for copy */
 	type pType;
 	union Data pdata;
 
-	strcpy(name_copy, name);
-
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
-
 	/* DEBUG */
-	/* printf(" ------------------ create ------------------ name: %s\n", name); */
+	/* printf(" ------------------ create ------------------ name: %s\n", path->base); */
 
-	parent_inumber = wr_lookup(parent_name, locked_nodes, &number_of_locked_nodes);
+	if (child < 0) {
+		printf("failed to create %s, invalid name\n", path->base);
+		return FAIL;
+	}
 
+	parent_inumber = wr_lookup_at(dir, path, child, locked_nodes, &number_of_locked_nodes);
+
+	if (parent_inumber == TECNICOFS_ERROR_STALE_HANDLE) {
+		unlock_nodes(locked_nodes, number_of_locked_nodes);
+		return parent_inumber;
+	}
 	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n", name, parent_name);
+		printf("failed to create %s, invalid parent dir %.*s\n", path->base, parent_length, path->base);
 		
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
@@ -149,14 +251,15 @@ int create(char *name, type nodeType){
 	inode_get(parent_inumber, &pType, &pdata);
 
 	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n", name, parent_name);
+		printf("failed to create %s, parent %.*s is not a dir\n", path->base, parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
 	}
 	
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n", child_name, parent_name);
+	if (lookup_sub_node(path, child, pdata.dirEntries) != FAIL) {
+		printf("failed to create %.*s, already exists in dir %.*s\n", PATH_LENGTH(path, child), PATH_NAME(path, child),
+			parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
@@ -165,7 +268,8 @@ int create(char *name, type nodeType){
 	child_inumber = inode_create(nodeType);
 
 	if (child_inumber == FAIL) {
-		printf("failed to create %s in  %s, couldn't allocate inode\n", child_name, parent_name);
+		printf("failed to create %.*s in  %.*s, couldn't allocate inode\n", PATH_LENGTH(path, child), PATH_NAME(path, child),
+			parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
@@ -179,13 +283,17 @@ int create(char *name, type nodeType){
 	/* DEBUG */
 	/* printf("( <> created child %d)\n", child_inumber); */
 
-	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n", child_name, parent_name);
+	if (dir_add_entry(parent_inumber, child_inumber, PATH_NAME(path, child), PATH_LENGTH(path, child)) == FAIL) {
+		printf("could not add entry %.*s in dir %.*s\n", PATH_LENGTH(path, child), PATH_NAME(path, child),
+			parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
 	}
 
+	/* paths through the new name may exist now */
+	negcache_invalidate(parent_inumber, PATH_NAME(path, child), PATH_LENGTH(path, child));
+
 	unlock_nodes(locked_nodes, number_of_locked_nodes);
 	return SUCCESS;
 }
@@ -194,31 +302,52 @@ int create(char *name, type nodeType){
 /*
  * Deletes a node given a path.
  * Input:
- *  - name: path of node
+ *  - path: parsed path of node
  * Returns: SUCCESS or FAIL
  */
-int delete(char *name){
+int delete(path_t *path){
+	return delete_at(NO_DIR_HANDLE, path);
+}
+
+/*
+ * Deletes a node given a path relative to a directory. An open file
+ * isn't deleted.
+ * Input:
+ *  - dir: handle of the directory, or NO_DIR_HANDLE for an absolute path
+ *  - path: parsed path of node
+ * Returns: SUCCESS, FAIL, TECNICOFS_ERROR_FILE_IS_OPEN or
+ *  TECNICOFS_ERROR_STALE_HANDLE
+ */
+int delete_at(int dir, path_t *path){
 
 	int locked_nodes[MAX_PATH_LENGTH];
 	int number_of_locked_nodes = 0;
 
 	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	/* the last component names the node, the others its parent */
+	int child = path->n - 1;
+	int parent_length = path_prefix(path, child);
 	/* use for copy */
 	type pType, cType;
 	union Data pdata, cdata;
 
-	strcpy(name_copy, name);
-
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
-
 	/* DEBUG */
-	/* printf(" ------------------ delete ------------------ name: %s\n", name); */
+	/* printf(" ------------------ delete ------------------ name: %s\n", path->base); */
+
+	if (child < 0) {
+		printf("failed to delete %s, invalid name\n", path->base);
+		return FAIL;
+	}
 
-	parent_inumber = wr_lookup(parent_name, locked_nodes, &number_of_locked_nodes);
+	parent_inumber = wr_lookup_at(dir, path, child, locked_nodes, &number_of_locked_nodes);
 
+	if (parent_inumber == TECNICOFS_ERROR_STALE_HANDLE) {
+		unlock_nodes(locked_nodes, number_of_locked_nodes);
+		return parent_inumber;
+	}
 	if (parent_inumber == FAIL) {
-		printf("failed to delete %s, invalid parent dir %s\n", child_name, parent_name);
+		printf("failed to delete %.*s, invalid parent dir %.*s\n", PATH_LENGTH(path, child), PATH_NAME(path, child),
+			parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
@@ -227,16 +356,17 @@ int delete(char *name){
 	inode_get(parent_inumber, &pType, &pdata);
 
 	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n", child_name, parent_name);
+		printf("failed to delete %.*s, parent %.*s is not a dir\n", PATH_LENGTH(path, child), PATH_NAME(path, child),
+			parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_node(path, child, pdata.dirEntries);
 
 	if (child_inumber == FAIL) {
-		printf("could not delete %s, does not exist in dir %s\n", name, parent_name);
+		printf("could not delete %s, does not exist in dir %.*s\n", path->base, parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
@@ -250,27 +380,38 @@ int delete(char *name){
 	inode_get(child_inumber, &cType, &cdata);
 
 	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
-		printf("could not delete %s: is a directory and not empty\n", name);
+		printf("could not delete %s: is a directory and not empty\n", path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
 	}
 
+	if (cType == T_FILE && inode_get_open_count(child_inumber) > 0) {
+		printf("could not delete %s: is open\n", path->base);
+
+		unlock_nodes(locked_nodes, number_of_locked_nodes);
+		return TECNICOFS_ERROR_FILE_IS_OPEN;
+	}
+
 	/* remove entry from folder that contained deleted node */
 	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n", child_name, parent_name);
+		printf("failed to delete %.*s from dir %.*s\n", PATH_LENGTH(path, child), PATH_NAME(path, child),
+			parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
 	}
 
 	if (inode_delete(child_inumber) == FAIL) {
-		printf("could not delete inode number %d from dir %s\n", child_inumber, parent_name);
+		printf("could not delete inode number %d from dir %.*s\n", child_inumber, parent_length, path->base);
 
 		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
 	}
 
+	/* its i-number may be reused elsewhere */
+	negcache_invalidate_parent(child_inumber);
+
 	/* DEBUG */
 	/* printf("( <> deleted child %d)\n", child_inumber); */
 
@@ -282,51 +423,34 @@ int delete(char *name){
 /*
  * Lookup for a given path.
  * Input:
- *  - name: path of node
+ *  - path: parsed path of node
  * Returns:
  *  inumber: identifier of the i-node, if found
  *     FAIL: otherwise
  */
-int lookup(char *name) {
+int lookup(path_t *path) {
 
 	int locked_nodes[MAX_PATH_LENGTH];
 	int number_of_locked_nodes = 0;
-	char* saveptr;
 
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
+	int missing;
+	unsigned long epoch;
 
-	strcpy(full_path, name);
+	/* known misses don't need to walk the tree */
+	if (negcache_lookup(path->base)) {
+		return FAIL;
+	}
+	epoch = negcache_epoch();
 
 	/* DEBUG */
-	/* printf(" ------------------ lookup ------------------ name: %s\n", name); */
+	/* printf(" ------------------ lookup ------------------ name: %s\n", path->base); */
 
-	/* start at root node */
-	int current_inumber = FS_ROOT;
-
-	/* use for copy */
-	type nType;
-	union Data data;
-
-	/* lock root node for reading */
-	rd_lock_node(current_inumber);
-	locked_nodes[number_of_locked_nodes] = current_inumber;
-	number_of_locked_nodes += 1;
+	int current_inumber = walk(NO_DIR_HANDLE, path, path->n, 0, locked_nodes, &number_of_locked_nodes, &missing);
 
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
-
-	char *path = strtok_r(full_path, delim, &saveptr);
-
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		path = strtok_r(NULL, delim, &saveptr);
-		
-		rd_lock_node(current_inumber);
-		locked_nodes[number_of_locked_nodes] = current_inumber;
-		number_of_locked_nodes += 1;
-		
-		inode_get(current_inumber, &nType, &data);
+	/* remember the miss while the node it stopped at is still locked */
+	if (current_inumber == FAIL && missing >= 0) {
+		negcache_insert(path->base, locked_nodes[number_of_locked_nodes - 1], PATH_NAME(path, missing),
+			PATH_LENGTH(path, missing), epoch);
 	}
 
 	unlock_nodes(locked_nodes, number_of_locked_nodes);
@@ -344,510 +468,594 @@ int lookup(char *name) {
 
 
 /*
- * Moves existing node in the first path to the location given by the second path
+ * Lookup for a path relative to a directory.
  * Input:
- *  - name1: path of node to move from
- *  - name2: path of node to move to
+ *  - dir: handle of the directory
+ *  - path: parsed path of node
  * Returns:
- *  inumber: identifier of moved inode
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise, or TECNICOFS_ERROR_STALE_HANDLE
  */
-void move(char* name1, char* name2) {
-	int locked_nodes1[MAX_PATH_LENGTH], locked_nodes2[MAX_PATH_LENGTH];
-    int locked_merged_nodes[MAX_PATH_LENGTH];
-	int number_of_locked_nodes1 = 0, number_of_locked_nodes2 = 0, number_of_merged_locked_nodes = 0;
-
-	int i = 0;
-    int test;
-
-	int moved_inumber;
-	int parent_inumber1, child_inumber1;
-	/* use for copy */
-	type pType, type_of_moved_node;
-	union Data data, pdata;
-
-	char *parent_name1, *child_name1, name_copy1[MAX_FILE_NAME];
-	char *parent_name2, *child_name2, name_copy2[MAX_FILE_NAME];
+int lookup_at(int dir, path_t *path) {
 
-	strcpy(name_copy1, name1);
-	strcpy(name_copy2, name2);
+	int locked_nodes[MAX_PATH_LENGTH];
+	int number_of_locked_nodes = 0;
+	int missing;
 
-	split_parent_child_from_path(name_copy1, &parent_name1, &child_name1);
-	split_parent_child_from_path(name_copy2, &parent_name2, &child_name2);
+	int current_inumber = walk(dir, path, path->n, 0, locked_nodes, &number_of_locked_nodes, &missing);
 
-	/* DEBUG */
-	/* printf(" ------------------ move ------------------ name: %s %s\n", name1, name2); */
-
-	parent_inumber1 = mv_wr_lookup(parent_name1, locked_nodes1, &number_of_locked_nodes1);
-	mv_wr_lookup(parent_name2, locked_nodes2, &number_of_locked_nodes2);
-
-    inode_get(parent_inumber1, &pType, &pdata);
-
-    /* get moved_node's inumber */
-	child_inumber1 = lookup_sub_node(child_name1, pdata.dirEntries);
-
-	/* first path's child is the node to be moved */
-	moved_inumber = child_inumber1;
-
-    /* lock inode to be moved */
-	wr_lock_node(moved_inumber);
-	locked_nodes1[number_of_locked_nodes1] = moved_inumber;
-	number_of_locked_nodes1 += 1;
-
-    /* get type and data of inode to be moved */
-	inode_get(moved_inumber, &type_of_moved_node, &data);
-
-    /* lock nodes from shortest path first */
-    /* 1) path1 shorter than path2 */
-    if (number_of_locked_nodes1 < number_of_locked_nodes2) {
-        for (i = 0; i < number_of_locked_nodes1 - 2; i++) {
-            rd_lock_node(locked_nodes1[i]);
-        }
-
-        if (locked_nodes1[i] < locked_nodes1[i+1]) {
-            wr_lock_node(locked_nodes1[i]);
-            wr_lock_node(locked_nodes1[i+1]);
-        }
-        else {
-            wr_lock_node(locked_nodes1[i+1]);
-            wr_lock_node(locked_nodes1[i]);
-        }
-        
-        for (i = 0; i < number_of_locked_nodes2 - 1; i++) {
-            test = rd_trylock_node(locked_nodes2[i]);
-            if (test == EBUSY || test == EDEADLK || test == 0) {
-                continue;
-            }
-            else {
-                fprintf(stderr, "Error: move: could not try-lock lock for reading.\n");
-            }
-        }
-        test = wr_trylock_node(locked_nodes2[i]);
-        if (!(test == EBUSY || test == EDEADLK || test == 0)) {
-            fprintf(stderr, "Error: move: could not try-lock lock for writing.\n");
-        }
-    }
-
-    /* 2) path2 shorter than path1 */
-    else {
-        for (i = 0; i < number_of_locked_nodes2 - 1; i++) {
-            rd_lock_node(locked_nodes2[i]);
-        }
-
-        for (i = 0; i < number_of_locked_nodes1 - 2; i++) {
-            test = rd_trylock_node(locked_nodes1[i]);
-            if (test == EBUSY || test == EDEADLK || test == 0) {
-                continue;
-            }
-            else {
-                fprintf(stderr, "Error: move: could not try-lock lock for reading.\n");
-            }
-        }
-        if (locked_nodes1[i] < locked_nodes1[i+1]) {
-            test = wr_trylock_node(locked_nodes1[i]);
-            if (!(test == EBUSY || test == EDEADLK || test == 0)) {
-                fprintf(stderr, "Error: move: could not try-lock lock for writing.\n");
-            }
-            test = wr_trylock_node(locked_nodes1[i+1]);
-            if (!(test == EBUSY || test == EDEADLK || test == 0)) {
-                fprintf(stderr, "Error: move: could not try-lock lock for writing.\n");
-            }
-        }
-        else {
-            test = wr_trylock_node(locked_nodes1[i+1]);
-            if (!(test == EBUSY || test == EDEADLK || test == 0)) {
-                fprintf(stderr, "Error: move: could not try-lock lock for writing.");
-            }
-            test = wr_trylock_node(locked_nodes1[i]);
-            if (!(test == EBUSY || test == EDEADLK || test == 0)) {
-                fprintf(stderr, "Error: move: could not try-lock lock for writing.");
-            }
-        }
-    }
-
-    /* delete moved inumber */
-	mv_delete(name1);
-    /* create moved inumber in new position */
-	mv_create(name2, type_of_moved_node, moved_inumber);
-
-	/* setter for data */
-	copyData(moved_inumber, data);
-	
-    /* merge both lists to avoid unlocking root twice */
-    for (i = 0; i < number_of_locked_nodes1; i++) {
-        locked_merged_nodes[i] = locked_nodes1[i];
-    }
-    int k = 1;
-    for (int j = i; j < number_of_locked_nodes1 + number_of_locked_nodes2; j++) {
-        locked_merged_nodes[j] = locked_nodes2[k++];
-    }
-
-    number_of_merged_locked_nodes = number_of_locked_nodes1 + number_of_locked_nodes2 - 1;
-    unlock_nodes(locked_merged_nodes, number_of_merged_locked_nodes);
+	unlock_nodes(locked_nodes, number_of_locked_nodes);
+	return current_inumber;
 }
 
 
 /*
- * Lookup called by operations create() and delete().
+ * Opens a handle on a directory, so later operations can take paths
+ * relative to it without walking from the root. The server keeps no
+ * state for it: it is the directory's i-number and generation, and goes
+ * stale once the directory is deleted.
  * Input:
- *  - name: path of node
+ *  - dir: handle the path is relative to, or NO_DIR_HANDLE
+ *  - path: parsed path of the directory
  * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ *  the handle, FAIL if there is no such directory, or
+ *  TECNICOFS_ERROR_STALE_HANDLE
  */
-int wr_lookup(char *name, int locked_nodes[], int* number_of_locked_nodes) {
+int open_dir(int dir, path_t *path) {
 
-	char full_path[MAX_FILE_NAME];
-	char aux_full_path[MAX_FILE_NAME];
-	char* saveptr;
+	int locked_nodes[MAX_PATH_LENGTH];
+	int number_of_locked_nodes = 0;
+	int missing;
+	unsigned int generation;
+	type nType;
 
-	char delim[] = "/";
+	int current_inumber = walk(dir, path, path->n, 0, locked_nodes, &number_of_locked_nodes, &missing);
 
-	strcpy(full_path, name);
-	strcpy(aux_full_path, name);
+	if (current_inumber >= 0) {
+		generation = inode_get_generation(current_inumber, &nType);
+		current_inumber = nType == T_DIRECTORY ? DIR_HANDLE(current_inumber, generation) : FAIL;
+	}
 
-	/* start at root node */
-	int current_inumber = FS_ROOT;
+	unlock_nodes(locked_nodes, number_of_locked_nodes);
+	return current_inumber;
+}
 
-	/* use for copy */
-	type nType;
-	union Data data;
 
-	char *path = strtok_r(full_path, delim, &saveptr);
-	if (path == NULL) {
-		wr_lock_node(current_inumber);
-	}
-	else {
-		rd_lock_node(current_inumber);
-	}
-	locked_nodes[*number_of_locked_nodes] = current_inumber;
-	*number_of_locked_nodes += 1;
+/*
+ * Opens a file: it isn't deleted until closed, and is read and written
+ * through its i-number from then on.
+ * Input:
+ *  - dir: handle the path is relative to, or NO_DIR_HANDLE
+ *  - path: parsed path of the file
+ * Returns:
+ *  inumber: identifier of the file, if found
+ *     FAIL: if there is no such file, or TECNICOFS_ERROR_STALE_HANDLE
+ */
+int open_file(int dir, path_t *path) {
 
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
+	int locked_nodes[MAX_PATH_LENGTH];
+	int number_of_locked_nodes = 0;
+	int missing;
+	type nType;
 
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		path = strtok_r(NULL, delim, &saveptr);
-		
-		if (path == NULL) {
-			wr_lock_node(current_inumber);
+	/* the file is locked for writing, as delete_at() does before checking it is open */
+	int current_inumber = walk(dir, path, path->n, 1, locked_nodes, &number_of_locked_nodes, &missing);
+
+	if (current_inumber >= 0) {
+		inode_get(current_inumber, &nType, NULL);
+		if (nType == T_FILE) {
+			inode_set_open_count(current_inumber, inode_get_open_count(current_inumber) + 1);
 		}
 		else {
-			rd_lock_node(current_inumber);
+			current_inumber = FAIL;
 		}
-		locked_nodes[*number_of_locked_nodes] = current_inumber;
-		*number_of_locked_nodes += 1;
-		
-		inode_get(current_inumber, &nType, &data);
 	}
 
+	unlock_nodes(locked_nodes, number_of_locked_nodes);
 	return current_inumber;
 }
 
+/*
+ * Closes a file opened with open_file(). Once no one has it open, its
+ * contents are shared with identical files.
+ * Input:
+ *  - inumber: identifier of the file
+ */
+void close_file(int inumber) {
+	int count;
 
-/* 
- * Copies data given by argument data into the inode given by inumber.
+	wr_lock_node(inumber);
+	inode_set_open_count(inumber, count = inode_get_open_count(inumber) - 1);
+	if (count == 0) {
+		inode_share(inumber);
+	}
+	unlock_node(inumber);
+}
+
+/*
+ * Reads from an open file, locking only the bytes read, so writes
+ * elsewhere in the file go on meanwhile.
  * Input:
- *  - inumber: identifier of destination inode
- *  - data: pointer to data to be copied
+ *  - inumber: identifier of the file
+ *  - buffer, len: where to store the bytes, and how many are wanted
+ *  - offset: where in the file to start
+ * Returns: number of bytes read, or FAIL
  */
-void copyData(int inumber, union Data data) {
-	type inode_type;
+int read_file(int inumber, char *buffer, size_t offset, size_t len) {
+	range_t range;
+	int ret;
+
+	rd_lock_node(inumber);
+	inode_lock_range(inumber, &range, offset, len, 0);
+	ret = inode_read(inumber, buffer, offset, len);
+	inode_unlock_range(inumber, &range);
+	unlock_node(inumber);
+	return ret;
+}
+
+/*
+ * Writes to an open file. Usually only the bytes written are locked, so
+ * others may read and write elsewhere in the file at once; a file whose
+ * bytes are held inline or shared with others is locked whole, as they
+ * are first moved.
+ * Input:
+ *  - inumber: identifier of the file
+ *  - buffer, len: bytes to write
+ *  - offset: where in the file to start; for an append, set to where
+ *    the bytes went
+ *  - append: whether to write at the end of the file instead
+ * Returns: number of bytes written, or FAIL
+ */
+static int write_at(int inumber, char *buffer, size_t *offset, size_t len, int append) {
+	range_t range;
+	int ret;
+
+	rd_lock_node(inumber);
+	if (!inode_write_in_place(inumber)) {
+		unlock_node(inumber);
+
+		wr_lock_node(inumber);
+		if (append) {
+			*offset = inode_claim_append(inumber, len);
+		}
+		ret = inode_write(inumber, buffer, *offset, len);
+		if (append) {
+			inode_settle_append(inumber, *offset, len, ret);
+		}
+		unlock_node(inumber);
+		return ret;
+	}
 
-	inode_get(inumber, &inode_type, &data);
-	setData(inumber, data);
+	if (append) {
+		*offset = inode_claim_append(inumber, len);
+	}
+	inode_lock_range(inumber, &range, *offset, len, 1);
+	ret = inode_write(inumber, buffer, *offset, len);
+	if (append) {
+		inode_settle_append(inumber, *offset, len, ret);
+	}
+	inode_unlock_range(inumber, &range);
+	unlock_node(inumber);
+	return ret;
 }
 
+/*
+ * Writes to an open file, see write_at().
+ * Returns: number of bytes written, or FAIL
+ */
+int write_file(int inumber, char *buffer, size_t offset, size_t len) {
+	return write_at(inumber, buffer, &offset, len, 0);
+}
 
 /*
- * Prints tecnicofs tree.
+ * Appends to an open file. Appends going on at once each claim their own
+ * bytes at the end of the file, and are written at once.
  * Input:
- *  - fp: pointer to output file
+ *  - inumber: identifier of the file
+ *  - buffer, len: bytes to write
+ *  - offset: set to where they went
+ * Returns: number of bytes written, or FAIL
  */
-void print_tecnicofs_tree(FILE *fp){
-	inode_print_tree(fp, FS_ROOT, "");
+int append_file(int inumber, char *buffer, size_t len, size_t *offset) {
+	return write_at(inumber, buffer, offset, len, 1);
 }
 
+
 /*
- * Creates a new node given a path without locking any inodes.
+ * Counts the entries of a directory.
  * Input:
- *  - name: path of node
- *  - nodeType: type of node
- * Returns: SUCCESS or FAIL
+ *  - path: parsed path of the directory
+ * Returns:
+ *  number of entries, or FAIL if there is no such directory
  */
-int mv_create(char *name, type nodeType, int desired_inumber){
+int count_entries(path_t *path) {
 
-	int parent_inumber , child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
-	/* use for copy */
-	type pType;
-	union Data pdata;
+	int locked_nodes[MAX_PATH_LENGTH];
+	int number_of_locked_nodes = 0;
+	int missing, entries = 0;
+	type nType;
+	union Data data;
+
+	int current_inumber = walk(NO_DIR_HANDLE, path, path->n, 0, locked_nodes, &number_of_locked_nodes, &missing);
 
-	strcpy(name_copy, name);
+	if (current_inumber >= 0) {
+		inode_get(current_inumber, &nType, &data);
+		if (nType != T_DIRECTORY) {
+			entries = FAIL;
+		}
+		for (int i = 0; nType == T_DIRECTORY && i < MAX_DIR_ENTRIES; i++) {
+			if (data.dirEntries[i].inumber != FREE_INODE) {
+				entries++;
+			}
+		}
+	}
+	else {
+		entries = FAIL;
+	}
 
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	unlock_nodes(locked_nodes, number_of_locked_nodes);
+	return entries;
+}
 
-	/* DEBUG */
-	/* printf(" ------------------ mv_create ------------------ name: %s\n", name); */
 
-	parent_inumber = mv_lookup(parent_name);
+/*
+ * Looks for the path of a node below a directory.
+ * Input:
+ *  - current: i-number of the directory
+ *  - target: i-number of the node
+ *  - buffer: holds the directory's path, len bytes long
+ * Returns: SUCCESS, leaving the node's path in buffer, or FAIL
+ */
+static int find_path(int current, int target, char *buffer, size_t size, size_t len) {
+	type nType;
+	union Data data;
 
-	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n", name, parent_name);
+	inode_get(current, &nType, &data);
+	if (nType != T_DIRECTORY) {
 		return FAIL;
 	}
 
-	inode_get(parent_inumber, &pType, &pdata);
+	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+		int n;
 
-	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n", name, parent_name);
-		return FAIL;
-	}
-	
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n", child_name, parent_name);
-		return FAIL;
+		if (data.dirEntries[i].inumber == FREE_INODE) {
+			continue;
+		}
+		n = snprintf(buffer + len, size - len, "/%s", data.dirEntries[i].name);
+		if (n < 0 || (size_t)n >= size - len) {
+			continue;
+		}
+		if (data.dirEntries[i].inumber == target ||
+			find_path(data.dirEntries[i].inumber, target, buffer, size, len + n) == SUCCESS) {
+			return SUCCESS;
+		}
 	}
+	buffer[len] = '\0';
+	return FAIL;
+}
+
+/*
+ * Finds the absolute path of the directory a handle refers to, for what
+ * is kept by path (watches, leases). It searches the whole tree, so the
+ * caller must keep the tree from changing.
+ * Input:
+ *  - dir: directory handle
+ *  - buffer, size: where to store the path
+ * Returns: SUCCESS, or TECNICOFS_ERROR_STALE_HANDLE
+ */
+int dir_path(int dir, char *buffer, size_t size) {
+	unsigned int generation;
+	type nType;
+	int inumber = dir % INODE_TABLE_SIZE;
 
-	child_inumber = mv_inode_create(nodeType, desired_inumber);
+	generation = inode_get_generation(inumber, &nType);
+	if (nType != T_DIRECTORY || generation != (unsigned int)(dir / INODE_TABLE_SIZE)) {
+		return TECNICOFS_ERROR_STALE_HANDLE;
+	}
 
-	if (child_inumber == FAIL) {
-		printf("failed to create %s in  %s, couldn't allocate inode\n", child_name, parent_name);
-		return FAIL;
+	buffer[0] = '\0';
+	if (inumber == FS_ROOT) {
+		snprintf(buffer, size, "/");
+		return SUCCESS;
 	}
+	return find_path(FS_ROOT, inumber, buffer, size, 0) == SUCCESS ? SUCCESS : TECNICOFS_ERROR_STALE_HANDLE;
+}
 
-	/* DEBUG */
-	/* printf("( <> created child %d)\n", child_inumber); */
 
-	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n", child_name, parent_name);
-		return FAIL;
+/*
+ * Follows the first n components of a path from the root without locking
+ * anything, recording the nodes passed. Only used while mutations are
+ * excluded, so the tree can't change under it.
+ * Input:
+ *  - path: parsed path
+ *  - n: number of components to follow
+ *  - chain: where to store the nodes passed, the root first
+ * Returns:
+ *  inumber: identifier of the i-node reached, if found
+ *     FAIL: otherwise
+ */
+static int trace(path_t *path, int n, int chain[]) {
+	int current_inumber = FS_ROOT;
+
+	/* use for copy */
+	type nType;
+	union Data data;
+
+	chain[0] = current_inumber;
+	for (int i = 0; i < n; i++) {
+		inode_get(current_inumber, &nType, &data);
+
+		if (nType != T_DIRECTORY || (current_inumber = lookup_sub_node(path, i, data.dirEntries)) == FAIL) {
+			return FAIL;
+		}
+		chain[i + 1] = current_inumber;
 	}
+	return current_inumber;
+}
 
-	return SUCCESS;
+/*
+ * A node locked by move(), with its depth in the tree.
+ */
+typedef struct move_lock {
+	int inumber;
+	int depth;
+	int write;
+} move_lock_t;
+
+/*
+ * Adds a node to those a move locks, unless it is there already: both
+ * paths usually share their first nodes.
+ */
+static void add_move_lock(move_lock_t locks[], int *n, int inumber, int depth, int write) {
+	for (int i = 0; i < *n; i++) {
+		if (locks[i].inumber == inumber) {
+			locks[i].write |= write;
+			return;
+		}
+	}
+	locks[*n].inumber = inumber;
+	locks[*n].depth = depth;
+	locks[*n].write = write;
+	*n += 1;
 }
 
 /*
- * Deletes a node given a path without locking any inodes.
+ * Moves existing node in the first path to the location given by the second path.
+ * Mutations are excluded by the caller, lookups aren't: the nodes of both
+ * paths are locked from the root down, by depth and then i-number, which
+ * is the order lookups lock them in, so the two can't deadlock.
  * Input:
- *  - name: path of node
+ *  - path1: parsed path of node to move from
+ *  - path2: parsed path of node to move to
  * Returns: SUCCESS or FAIL
  */
-int mv_delete(char *name){
+int move(path_t *path1, path_t *path2) {
 
-	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
-	/* use for copy */
-	type pType, cType;
-	union Data pdata, cdata;
-
-	strcpy(name_copy, name);
+	int chain1[MAX_PATH_LENGTH], chain2[MAX_PATH_LENGTH];
+	move_lock_t locks[2 * MAX_PATH_LENGTH + 1];
+	int locked_nodes[2 * MAX_PATH_LENGTH + 1];
+	int number_of_locked_nodes = 0;
 
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	int parent_inumber1, parent_inumber2, moved_inumber;
+	/* the last components name the node, the others its parents */
+	int child1 = path1->n - 1, child2 = path2->n - 1;
+	/* use for copy */
+	type pType;
+	union Data pdata;
 
 	/* DEBUG */
-	/* printf(" ------------------ mv_delete ------------------ name: %s\n", name); */
+	/* printf(" ------------------ move ------------------ name: %s %s\n", path1->base, path2->base); */
 
-	parent_inumber = mv_lookup(parent_name);
-
-	if (parent_inumber == FAIL) {
-		printf("failed to delete %s, invalid parent dir %s\n", child_name, parent_name);
+	if (child1 < 0 || child2 < 0) {
+		printf("failed to move %s to %s, invalid name\n", path1->base, path2->base);
 		return FAIL;
 	}
 
-	inode_get(parent_inumber, &pType, &pdata);
-
-	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n", child_name, parent_name);
+	parent_inumber1 = trace(path1, child1, chain1);
+	if (parent_inumber1 == FAIL || inode_get(parent_inumber1, &pType, &pdata) == FAIL || pType != T_DIRECTORY ||
+		(moved_inumber = lookup_sub_node(path1, child1, pdata.dirEntries)) == FAIL) {
+		printf("failed to move %s, does not exist\n", path1->base);
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
-
-	if (child_inumber == FAIL) {
-		printf("could not delete %s, does not exist in dir %s\n", name, parent_name);
+	parent_inumber2 = trace(path2, child2, chain2);
+	if (parent_inumber2 == FAIL || inode_get(parent_inumber2, &pType, &pdata) == FAIL || pType != T_DIRECTORY) {
+		printf("failed to move %s, invalid parent dir %.*s\n", path1->base, path_prefix(path2, child2), path2->base);
+		return FAIL;
+	}
+	if (lookup_sub_node(path2, child2, pdata.dirEntries) != FAIL) {
+		printf("failed to move %s, %s already exists\n", path1->base, path2->base);
 		return FAIL;
 	}
+	/* a directory can't be moved inside itself */
+	for (int i = 0; i <= child2; i++) {
+		if (chain2[i] == moved_inumber) {
+			printf("failed to move %s inside itself\n", path1->base);
+			return FAIL;
+		}
+	}
 
-	inode_get(child_inumber, &cType, &cdata);
+	/* both parents and the node moved are changed, the rest only passed */
+	for (int i = 0; i <= child1; i++) {
+		add_move_lock(locks, &number_of_locked_nodes, chain1[i], i, i == child1);
+	}
+	add_move_lock(locks, &number_of_locked_nodes, moved_inumber, child1 + 1, 1);
+	for (int i = 0; i <= child2; i++) {
+		add_move_lock(locks, &number_of_locked_nodes, chain2[i], i, i == child2);
+	}
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
-		printf("could not delete %s: is a directory and not empty\n", name);
-		return FAIL;
+	for (int i = 1; i < number_of_locked_nodes; i++) {
+		move_lock_t lock = locks[i];
+		int j = i;
+
+		while (j > 0 && (locks[j - 1].depth > lock.depth ||
+			(locks[j - 1].depth == lock.depth && locks[j - 1].inumber > lock.inumber))) {
+			locks[j] = locks[j - 1];
+			j--;
+		}
+		locks[j] = lock;
 	}
 
-	/* remove entry from folder that contained deleted node */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n", child_name, parent_name);
+	for (int i = 0; i < number_of_locked_nodes; i++) {
+		if (locks[i].write) {
+			wr_lock_node(locks[i].inumber);
+		}
+		else {
+			rd_lock_node(locks[i].inumber);
+		}
+		locked_nodes[i] = locks[i].inumber;
+	}
+
+	/* the node keeps its i-number and data, only its entry changes places */
+	if (dir_reset_entry(parent_inumber1, moved_inumber) == FAIL) {
+		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
 	}
+	if (dir_add_entry(parent_inumber2, moved_inumber, PATH_NAME(path2, child2), PATH_LENGTH(path2, child2)) == FAIL) {
+		printf("could not add entry %.*s in dir %.*s\n", PATH_LENGTH(path2, child2), PATH_NAME(path2, child2),
+			path_prefix(path2, child2), path2->base);
 
-	if (inode_delete(child_inumber) == FAIL) {
-		printf("could not delete inode number %d from dir %s\n", child_inumber, parent_name);
+		dir_add_entry(parent_inumber1, moved_inumber, PATH_NAME(path1, child1), PATH_LENGTH(path1, child1));
+		unlock_nodes(locked_nodes, number_of_locked_nodes);
 		return FAIL;
 	}
 
-	/* DEBUG */
-	/* printf("( <> deleted child %d)\n", child_inumber); */
+	/* the whole subtree leaves its place, any cached miss through it may be stale */
+	negcache_flush();
 
+	unlock_nodes(locked_nodes, number_of_locked_nodes);
 	return SUCCESS;
 }
 
+
 /*
- * Lookup for a given path without locking any nodes for writing nor for reading. 
- * Used by mv_create() and mv_delete().
+ * Copies the node in the first path to the location given by the second
+ * path: a directory is copied empty, a file with its bytes, which both
+ * share until either is changed. Mutations are excluded by the caller, as
+ * for move(); the file copied is locked last, as everyone else does.
  * Input:
- *  - name: path of node
- * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ *  - path1: parsed path of node to copy
+ *  - path2: parsed path of the copy
+ * Returns: SUCCESS or FAIL
  */
-int mv_lookup(char *name) {
-
-	char* saveptr;
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
+int copy_node(path_t *path1, path_t *path2) {
 
-	strcpy(full_path, name);
-
-	/* DEBUG */
-	/* printf(" ------------------ mv_lookup ------------------ name: %s\n", name); */
-
-	/* start at root node */
-	int current_inumber = FS_ROOT;
+	int chain1[MAX_PATH_LENGTH], chain2[MAX_PATH_LENGTH];
 
+	int parent_inumber1, parent_inumber2, source_inumber, copy_inumber;
+	/* the last components name the nodes, the others their parents */
+	int child1 = path1->n - 1, child2 = path2->n - 1;
 	/* use for copy */
-	type nType;
-	union Data data;
-
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
-
-	char *path = strtok_r(full_path, delim, &saveptr);
+	type pType, sType;
+	union Data pdata;
 
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		path = strtok_r(NULL, delim, &saveptr);
-		
-		inode_get(current_inumber, &nType, &data);
+	if (child1 < 0 || child2 < 0) {
+		printf("failed to copy %s to %s, invalid name\n", path1->base, path2->base);
+		return FAIL;
 	}
 
-	return current_inumber;
-}
-
-/*
- * Lookup for a given path without locking any nodes for writing nor for reading.
- * Input:
- *  - name: path of node
- * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
- */
-int mv_wr_lookup(char *name, int locked_nodes[], int* number_of_locked_nodes) {
-
-	char full_path[MAX_FILE_NAME];
-	char aux_full_path[MAX_FILE_NAME];
-	char* saveptr;
+	parent_inumber1 = trace(path1, child1, chain1);
+	if (parent_inumber1 == FAIL || inode_get(parent_inumber1, &pType, &pdata) == FAIL || pType != T_DIRECTORY ||
+		(source_inumber = lookup_sub_node(path1, child1, pdata.dirEntries)) == FAIL) {
+		printf("failed to copy %s, does not exist\n", path1->base);
+		return FAIL;
+	}
 
-	char delim[] = "/";
+	parent_inumber2 = trace(path2, child2, chain2);
+	if (parent_inumber2 == FAIL || inode_get(parent_inumber2, &pType, &pdata) == FAIL || pType != T_DIRECTORY) {
+		printf("failed to copy %s, invalid parent dir %.*s\n", path1->base, path_prefix(path2, child2), path2->base);
+		return FAIL;
+	}
+	if (lookup_sub_node(path2, child2, pdata.dirEntries) != FAIL) {
+		printf("failed to copy %s, %s already exists\n", path1->base, path2->base);
+		return FAIL;
+	}
 
-	strcpy(full_path, name);
-	strcpy(aux_full_path, name);
+	inode_get(source_inumber, &sType, NULL);
 
-	/* start at root node */
-	int current_inumber = FS_ROOT;
-	locked_nodes[*number_of_locked_nodes] = current_inumber;
-	*number_of_locked_nodes += 1;
+	wr_lock_node(parent_inumber2);
+	if ((copy_inumber = inode_create(sType)) == FAIL) {
+		printf("failed to copy %s to %s, couldn't allocate inode\n", path1->base, path2->base);
 
-	/* use for copy */
-	type nType;
-	union Data data;
+		unlock_node(parent_inumber2);
+		return FAIL;
+	}
 
-	char *path = strtok_r(full_path, delim, &saveptr);
+	/* its readers and writers are done, the bytes stay as they are until shared */
+	if (sType == T_FILE) {
+		wr_lock_node(source_inumber);
+		inode_clone(copy_inumber, source_inumber);
+		unlock_node(source_inumber);
+	}
 
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
+	if (dir_add_entry(parent_inumber2, copy_inumber, PATH_NAME(path2, child2), PATH_LENGTH(path2, child2)) == FAIL) {
+		printf("could not add entry %.*s in dir %.*s\n", PATH_LENGTH(path2, child2), PATH_NAME(path2, child2),
+			path_prefix(path2, child2), path2->base);
 
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		path = strtok_r(NULL, delim, &saveptr);
-		
-		locked_nodes[*number_of_locked_nodes] = current_inumber;
-		*number_of_locked_nodes += 1;
-		
-		inode_get(current_inumber, &nType, &data);
+		inode_delete(copy_inumber);
+		unlock_node(copy_inumber);
+		unlock_node(parent_inumber2);
+		return FAIL;
 	}
 
-	return current_inumber;
+	/* paths through the new name may exist now */
+	negcache_invalidate(parent_inumber2, PATH_NAME(path2, child2), PATH_LENGTH(path2, child2));
+
+	unlock_node(copy_inumber);
+	unlock_node(parent_inumber2);
+	return SUCCESS;
 }
 
+
 /*
- * Lookup for a given path.
+ * Lists the entries of a directory, with their types, so a subtree can be
+ * gone through without keeping it locked.
  * Input:
- *  - name: path of node
- *  - test_inumber: inumber whose existence will be tested
- *  - foundInode: flag to be changed in case inumber is found
+ *  - path: parsed path of the directory
+ *  - entries, types: where to store up to MAX_DIR_ENTRIES entries
  * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: if inumber given was found during search
+ *  number of entries, or FAIL if there is no such directory
  */
-int test_lookup(char *name, int test_inumber, int *foundInode) {
+int list_dir(path_t *path, DirEntry *entries, type *types) {
 
 	int locked_nodes[MAX_PATH_LENGTH];
 	int number_of_locked_nodes = 0;
-	char* saveptr;
-
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
-
-	strcpy(full_path, name);
-
-	/* DEBUG */
-	/* printf(" ------------------ test-lookup ------------------ name: %s\n", name); */
-
-	/* start at root node */
-	int current_inumber = FS_ROOT;
-
-	/* use for copy */
+	int missing, n = 0;
 	type nType;
 	union Data data;
 
-	/* lock root node for reading */
-	rd_lock_node(current_inumber);
-	locked_nodes[number_of_locked_nodes] = current_inumber;
-	number_of_locked_nodes += 1;
-
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
-
-	char *path = strtok_r(full_path, delim, &saveptr);
-
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		path = strtok_r(NULL, delim, &saveptr);
-		
-		rd_lock_node(current_inumber);
-		locked_nodes[number_of_locked_nodes] = current_inumber;
-		number_of_locked_nodes += 1;
-
-        if (current_inumber == test_inumber) {
-            *foundInode = 1;
-            unlock_nodes(locked_nodes, number_of_locked_nodes);
-            return -1;
-        }
+	int current_inumber = walk(NO_DIR_HANDLE, path, path->n, 0, locked_nodes, &number_of_locked_nodes, &missing);
 
+	if (current_inumber >= 0) {
 		inode_get(current_inumber, &nType, &data);
+		if (nType != T_DIRECTORY) {
+			n = FAIL;
+		}
+		/* the entries can't be deleted, nor their nodes reused, while the directory is locked */
+		for (int i = 0; nType == T_DIRECTORY && i < MAX_DIR_ENTRIES; i++) {
+			if (data.dirEntries[i].inumber != FREE_INODE) {
+				entries[n] = data.dirEntries[i];
+				inode_get(entries[n].inumber, &types[n], NULL);
+				n++;
+			}
+		}
+	}
+	else {
+		n = FAIL;
 	}
 
 	unlock_nodes(locked_nodes, number_of_locked_nodes);
+	return n;
+}
 
-	/* DEBUG */
-	/* if (current_inumber != FAIL) {
-		printf("( <> found inode %d)\n", current_inumber);
-	}
-	else {
-		printf("( <> could not find inode %d)\n", current_inumber);
-	} */
 
-	return current_inumber;
+/*
+ * Prints tecnicofs tree.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void print_tecnicofs_tree(FILE *fp){
+	inode_print_tree(fp, FS_ROOT, "");
 }
 
 /*
@@ -873,4 +1081,32 @@ int print(char* fileName) {
 		return -1;
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Renders the file system tree into memory, for the output to be written
+ * elsewhere.
+ * Input:
+ *  - buffer: set to the rendered tree, to be released with free()
+ *  - size: set to its length
+ * Returns:
+ *  SUCCESS: if operation is successful
+ *     FAIL: otherwise
+ */
+int print_to_memory(char **buffer, size_t *size) {
+	FILE* fpOut = open_memstream(buffer, size);
+
+	if (fpOut == NULL) {
+		fprintf(stderr, "Error: Failed to render tree.\n");
+		return -1;
+	}
+
+	print_tecnicofs_tree(fpOut);
+
+	if (fclose(fpOut) != 0) {
+		fprintf(stderr, "Error: Failed to render tree.\n");
+		free(*buffer);
+		return -1;
+	}
+	return 0;
+}
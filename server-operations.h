@@ -1,27 +1,43 @@
 #ifndef FS_H
 #define FS_H
 #include "state.h"
+#include "path.h"
 
-#define MAX_PATH_LENGTH 20
+/* nodes locked by a walk: where it starts, then one per component */
+#define MAX_PATH_LENGTH (MAX_PATH_COMPONENTS + 1)
 
-int wr_lookup(char *name, int locked_nodes[], int* number_of_locked_nodes);
+/* stands for the root when an operation takes an absolute path */
+#define NO_DIR_HANDLE -1
+/* a directory handle: its i-number and the generation it was opened at */
+#define DIR_HANDLE(inumber, generation) ((int)((generation) * INODE_TABLE_SIZE + (inumber)))
+
+int wr_lookup_at(int dir, path_t *path, int n, int locked_nodes[], int* number_of_locked_nodes);
 
 void init_fs();
 void destroy_fs();
 int is_dir_empty(DirEntry *dirEntries);
-int create(char *name, type nodeType);
+int lookup_sub_node(path_t *path, int i, DirEntry *entries);
+int create(path_t *path, type nodeType);
+int create_at(int dir, path_t *path, type nodeType);
 
-void move(char* name1, char* name2);
-int mv_create(char *name, type nodeType, int desired_inumber);
-int mv_delete(char *name);
-int mv_lookup(char *name);
-int mv_wr_lookup(char *name, int locked_nodes[], int* number_of_locked_nodes);
-int test_lookup(char *name, int test_inumber, int *foundInode);
-void copyData(int inumberOrigin, union Data data); 
+int move(path_t *path1, path_t *path2);
+int copy_node(path_t *path1, path_t *path2);
 int print(char* fileName);
+int print_to_memory(char **buffer, size_t *size);
 
-int delete(char *name);
-int lookup(char *name);
+int delete(path_t *path);
+int delete_at(int dir, path_t *path);
+int lookup(path_t *path);
+int lookup_at(int dir, path_t *path);
+int open_dir(int dir, path_t *path);
+int open_file(int dir, path_t *path);
+void close_file(int inumber);
+int read_file(int inumber, char *buffer, size_t offset, size_t len);
+int write_file(int inumber, char *buffer, size_t offset, size_t len);
+int append_file(int inumber, char *buffer, size_t len, size_t *offset);
+int count_entries(path_t *path);
+int list_dir(path_t *path, DirEntry *entries, type *types);
+int dir_path(int dir, char *buffer, size_t size);
 void print_tecnicofs_tree(FILE *fp);
 
 #endif /* FS_H */
@@ -0,0 +1,76 @@
+#include <string.h>
+#include "state.h"
+#include "path.h"
+
+
+/*
+ * Hashes a name, so directory entries can be told apart without comparing
+ * their names.
+ * Input:
+ *  - name: name, not necessarily terminated
+ *  - length: its length
+ */
+uint32_t path_hash(char *name, size_t length) {
+	uint32_t hash = 5381;
+
+	for (size_t i = 0; i < length; i++) {
+		hash = hash * 33 + (unsigned char)name[i];
+	}
+	return hash;
+}
+
+
+/*
+ * Splits a path into its components, ignoring repeated, leading and
+ * trailing slashes. Nothing is copied: the components point into name.
+ * Input:
+ *  - path: where to store the components
+ *  - name: path to split, shorter than MAX_FILE_NAME
+ * Returns:
+ *  SUCCESS, or FAIL if the path is too long or too deep
+ */
+int path_parse(path_t *path, char *name) {
+	char *c = name;
+
+	path->base = name;
+	path->n = 0;
+
+	while (*c != '\0') {
+		char *start;
+
+		while (*c == '/') {
+			c++;
+		}
+		if (*c == '\0') {
+			break;
+		}
+		if (path->n == MAX_PATH_COMPONENTS) {
+			return FAIL;
+		}
+
+		start = c;
+		while (*c != '/' && *c != '\0') {
+			c++;
+		}
+		if (c - name >= MAX_FILE_NAME) {
+			return FAIL;
+		}
+		path->c[path->n].offset = start - name;
+		path->c[path->n].length = c - start;
+		path->c[path->n].hash = path_hash(start, c - start);
+		path->n++;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Tells how much of the path the first n components take, for printing
+ * them with "%.*s".
+ */
+int path_prefix(path_t *path, int n) {
+	if (n == 0) {
+		return 0;
+	}
+	return path->c[n - 1].offset + path->c[n - 1].length;
+}
@@ -0,0 +1,38 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* deepest path an operation takes */
+#define MAX_PATH_COMPONENTS 19
+
+
+/*
+ * A name in a path, kept as where it is in the path rather than a copy.
+ */
+typedef struct path_component {
+	uint16_t offset;
+	uint16_t length;
+	uint32_t hash; /* path_hash() of the name */
+} path_component_t;
+
+/*
+ * A path split into its components once, on top of the path as received,
+ * which must stay in place while the path is used.
+ */
+typedef struct path {
+	char *base;
+	int n;
+	path_component_t c[MAX_PATH_COMPONENTS];
+} path_t;
+
+/* the name of component i, not terminated: use PATH_LENGTH(path, i) */
+#define PATH_NAME(path, i) ((path)->base + (path)->c[i].offset)
+#define PATH_LENGTH(path, i) ((int)(path)->c[i].length)
+
+int path_parse(path_t *path, char *name);
+uint32_t path_hash(char *name, size_t length);
+int path_prefix(path_t *path, int n);
+
+#endif /* PATH_H */
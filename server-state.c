@@ -4,10 +4,18 @@
 #include <unistd.h>
 #include <errno.h>
 #include "state.h"
+#include "path.h"
 #include "../tecnicofs-api-constants.h"
 
 inode_t inode_table[INODE_TABLE_SIZE];
 
+/* contents shared by identical files, by hash; refs are changed under contentsLock */
+FileContents *contentsIndex[CONTENT_BUCKETS];
+pthread_mutex_t contentsLock;
+long sharedContents = 0, sharedSaved = 0, copiesOnWrite = 0;
+long inlineFiles = 0;
+long rangesLocked = 0, rangeWaits = 0;
+
 /* 
  * Lock a node for reading
  * Input:
@@ -104,8 +112,210 @@ void inode_table_init() {
         inode_table[i].nodeType = T_NONE;
         inode_table[i].data.dirEntries = NULL;
         inode_table[i].data.fileContents = NULL;
+        inode_table[i].generation = 0;
+        inode_table[i].openCount = 0;
+        inode_table[i].inlineSize = 0;
+        inode_table[i].ranges = NULL;
+        inode_table[i].appendEnd = 0;
         pthread_rwlock_init(&inode_table[i].lock, NULL);
+        pthread_mutex_init(&inode_table[i].dataLock, NULL);
+        pthread_cond_init(&inode_table[i].rangeUnlocked, NULL);
+    }
+    for (int i = 0; i < CONTENT_BUCKETS; i++) {
+        contentsIndex[i] = NULL;
+    }
+    pthread_mutex_init(&contentsLock, NULL);
+}
+
+
+static void lock_contents() {
+    if (pthread_mutex_lock(&contentsLock) != 0) {
+        fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void unlock_contents() {
+    if (pthread_mutex_unlock(&contentsLock) != 0) {
+        fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void lock_data(inode_t *node) {
+    if (pthread_mutex_lock(&node->dataLock) != 0) {
+        fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void unlock_data(inode_t *node) {
+    if (pthread_mutex_unlock(&node->dataLock) != 0) {
+        fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Memory taken by a file's contents, which sharing them saves.
+ */
+static long contents_footprint(FileContents *file) {
+    long size = sizeof(FileContents);
+
+    for (int i = 0; i < file->n; i++) {
+        size += file->extents[i].size;
+    }
+    return size;
+}
+
+static void contents_free(FileContents *file) {
+    for (int i = 0; i < file->n; i++) {
+        free(file->extents[i].data);
+    }
+    free(file);
+}
+
+/*
+ * Hashes the bytes of a file (FNV-1a).
+ */
+static uint64_t contents_hash(FileContents *file) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t left = file->size;
+
+    for (int i = 0; i < file->n && left > 0; i++) {
+        size_t n = file->extents[i].size < left ? file->extents[i].size : left;
+
+        for (size_t j = 0; j < n; j++) {
+            hash = (hash ^ (unsigned char)file->extents[i].data[j]) * 1099511628211ULL;
+        }
+        left -= n;
+    }
+    return hash;
+}
+
+/*
+ * Tells whether two files hold the same bytes. Extents have the same
+ * sizes in every file, so they are compared one by one.
+ */
+static int contents_equal(FileContents *a, FileContents *b) {
+    size_t left = a->size;
+
+    if (a->size != b->size) {
+        return 0;
+    }
+    for (int i = 0; i < a->n && left > 0; i++) {
+        size_t n = a->extents[i].size < left ? a->extents[i].size : left;
+
+        if (memcmp(a->extents[i].data, b->extents[i].data, n) != 0) {
+            return 0;
+        }
+        left -= n;
+    }
+    return 1;
+}
+
+/*
+ * Takes contents out of the index. contentsLock is held.
+ */
+static void contents_unindex(FileContents *file) {
+    FileContents **link = &contentsIndex[file->hash % CONTENT_BUCKETS];
+
+    while (*link != file) {
+        link = &(*link)->next;
+    }
+    *link = file->next;
+}
+
+/*
+ * Drops a file's reference to its contents, freeing them with the last.
+ */
+static void contents_release(FileContents *file) {
+    if (file->refs > 0) {
+        lock_contents();
+        if (--file->refs > 0) {
+            if (file->refs == 1) {
+                sharedContents--;
+            }
+            sharedSaved -= contents_footprint(file);
+            unlock_contents();
+            return;
+        }
+        contents_unindex(file);
+        unlock_contents();
+    }
+    contents_free(file);
+}
+
+/*
+ * Makes a file's contents its own before they are changed: contents in
+ * the index are taken out of it, or copied if other files share them.
+ * The file is locked for writing.
+ * Returns: SUCCESS, or FAIL if a copy couldn't be allocated
+ */
+static int contents_unshare(inode_t *node) {
+    FileContents *file = node->data.fileContents, *copy;
+
+    lock_contents();
+    if (file->refs == 1) {
+        contents_unindex(file);
+        file->refs = 0;
+        unlock_contents();
+        return SUCCESS;
+    }
+    unlock_contents();
+
+    /*
+     * Shared contents never change, and the file's reference keeps them
+     * around while it is locked, so they are copied without holding up
+     * the other files.
+     */
+    if ((copy = calloc(1, sizeof(FileContents))) == NULL) {
+        return FAIL;
+    }
+    copy->size = file->size;
+    for (int i = 0; i < file->n; i++) {
+        if ((copy->extents[i].data = malloc(file->extents[i].size)) == NULL) {
+            contents_free(copy);
+            return FAIL;
+        }
+        memcpy(copy->extents[i].data, file->extents[i].data, file->extents[i].size);
+        copy->extents[i].size = file->extents[i].size;
+        copy->n++;
+    }
+
+    lock_contents();
+    copiesOnWrite++;
+    unlock_contents();
+
+    /* the others may have let go of them meanwhile */
+    contents_release(file);
+    node->data.fileContents = copy;
+    return SUCCESS;
+}
+
+
+/*
+ * Releases the data of an i-node: a directory's entries, or a file's
+ * extents.
+ * Input:
+ *  - inumber: identifier of the i-node, not yet freed
+ */
+static void inode_free_data(int inumber) {
+    FileContents *file = inode_table[inumber].data.fileContents;
+
+    if (inode_table[inumber].nodeType == T_FILE && file != NULL) {
+        contents_release(file);
+    }
+    else if (inode_table[inumber].nodeType == T_FILE && inode_table[inumber].inlineSize > 0) {
+        __atomic_sub_fetch(&inlineFiles, 1, __ATOMIC_RELAXED);
     }
+    else if (inode_table[inumber].nodeType == T_DIRECTORY && inode_table[inumber].data.dirEntries) {
+        free(inode_table[inumber].data.dirEntries);
+    }
+    inode_table[inumber].data.dirEntries = NULL;
+    inode_table[inumber].inlineSize = 0;
+    inode_table[inumber].appendEnd = 0;
 }
 
 
@@ -115,13 +325,13 @@ void inode_table_init() {
 void inode_table_destroy() {
     for (int i = 0; i < INODE_TABLE_SIZE; i++) {
         if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	        if (inode_table[i].data.dirEntries)
-                free(inode_table[i].data.dirEntries);
+            inode_free_data(i);
         }
         pthread_rwlock_destroy(&inode_table[i].lock);
+        pthread_mutex_destroy(&inode_table[i].dataLock);
+        pthread_cond_destroy(&inode_table[i].rangeUnlocked);
     }
+    pthread_mutex_destroy(&contentsLock);
 }
 
 
@@ -152,6 +362,8 @@ int inode_create(type nType) {
 
             if (inode_table[inumber].nodeType == T_NONE) {
                 inode_table[inumber].nodeType = nType;
+                /* handles to whatever was here before go stale */
+                inode_table[inumber].generation = (inode_table[inumber].generation + 1) % MAX_GENERATION;
 
                 if (nType == T_DIRECTORY) {
                     /* Initializes entry table */
@@ -182,38 +394,6 @@ int inode_create(type nType) {
     return FAIL;
 }
 
-/*
- * Creates a new i-node in the table on the specified position.
- * Input:
- *  - nType: the type of the node (file or directory)
- *  - desired_inumber: the position of the new inode in the inode table
- * Returns:
- *  inumber: identifier of the new i-node, if successfully created
- *     FAIL: if an error occurs
- */
-int mv_inode_create(type nType, int desired_inumber) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-        inode_table[desired_inumber].nodeType = nType;
-
-        if (nType == T_DIRECTORY) {
-            /* Initializes entry table */
-            inode_table[desired_inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-            
-            for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                inode_table[desired_inumber].data.dirEntries[i].inumber = FREE_INODE;
-            }
-        }
-        else {
-            inode_table[desired_inumber].data.fileContents = NULL;
-        }
-        return desired_inumber;
-
-    return FAIL;
-}
-
-
 /*
  * Deletes the i-node.
  * Input:
@@ -229,10 +409,8 @@ int inode_delete(int inumber) {
         return FAIL;
     } 
 
+    inode_free_data(inumber);
     inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
 
     return SUCCESS;
 }
@@ -267,6 +445,462 @@ int inode_get(int inumber, type *nType, union Data *data) {
 }
 
 
+/*
+ * Gets the generation of an i-node, which together with its i-number
+ * tells it apart from nodes that used the same slot before. Unlike
+ * inode_get() it may be asked about a free slot.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - nType: pointer to type, T_NONE for a free slot
+ * Returns: the generation
+ */
+unsigned int inode_get_generation(int inumber, type *nType) {
+    *nType = inode_table[inumber].nodeType;
+    return inode_table[inumber].generation;
+}
+
+
+/*
+ * Gets how many open-file table entries refer to an i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: the count
+ */
+int inode_get_open_count(int inumber) {
+    return inode_table[inumber].openCount;
+}
+
+
+/*
+ * Sets how many open-file table entries refer to an i-node, which is
+ * locked for writing.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - count: the new count
+ */
+void inode_set_open_count(int inumber, int count) {
+    inode_table[inumber].openCount = count;
+}
+
+
+/*
+ * Gives the size of a file's i-th extent.
+ */
+static size_t extent_size(int i) {
+    size_t size = EXTENT_MIN;
+
+    while (i-- > 0 && size < EXTENT_MAX) {
+        size *= 2;
+    }
+    return size;
+}
+
+
+/*
+ * Copies bytes of a file out of its extents.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - buffer: where to copy them
+ *  - offset: where in the file to start
+ *  - len: bytes wanted
+ * Returns: number of bytes copied, fewer than len past the end of the
+ *  file, or FAIL
+ */
+int inode_read(int inumber, char *buffer, size_t offset, size_t len) {
+    FileContents *file;
+    size_t start = 0, copied = 0, fileSize;
+    int n;
+
+    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_FILE)) {
+        printf("inode_read: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    file = inode_table[inumber].data.fileContents;
+    if (file == NULL) {
+        size_t size = inode_table[inumber].inlineSize;
+
+        if (offset >= size) {
+            return 0;
+        }
+        len = len < size - offset ? len : size - offset;
+        memcpy(buffer, inode_table[inumber].inlineData + offset, len);
+        return len;
+    }
+
+    /* extents written to elsewhere may be added meanwhile, those already there stay */
+    lock_data(&inode_table[inumber]);
+    fileSize = file->size;
+    n = file->n;
+    unlock_data(&inode_table[inumber]);
+
+    if (offset >= fileSize) {
+        return 0;
+    }
+    if (len > fileSize - offset) {
+        len = fileSize - offset;
+    }
+
+    for (int i = 0; i < n && copied < len; i++) {
+        size_t size = file->extents[i].size;
+
+        if (offset + copied < start + size) {
+            size_t at = offset + copied - start;
+            size_t n = size - at < len - copied ? size - at : len - copied;
+
+            memcpy(buffer + copied, file->extents[i].data + at, n);
+            copied += n;
+        }
+        start += size;
+    }
+    return copied;
+}
+
+
+/*
+ * Copies bytes into a file's extents, allocating those they land in.
+ * Others may be writing elsewhere in the file, so the extents and the
+ * size are only changed with its dataLock held.
+ * Returns: number of bytes copied, fewer than len if the file is full
+ */
+static size_t extents_write(inode_t *node, FileContents *file, char *buffer, size_t offset, size_t len) {
+    size_t start = 0, copied = 0;
+
+    for (int i = 0; i < MAX_FILE_EXTENTS && copied < len; i++) {
+        size_t size = extent_size(i);
+
+        if (offset + copied < start + size) {
+            size_t at = offset + copied - start;
+            size_t n = size - at < len - copied ? size - at : len - copied;
+            int allocated;
+
+            /* extents are allocated in order, zeroed */
+            lock_data(node);
+            while (file->n <= i) {
+                if ((file->extents[file->n].data = calloc(1, extent_size(file->n))) == NULL) {
+                    break;
+                }
+                file->extents[file->n].size = extent_size(file->n);
+                file->n++;
+            }
+            allocated = file->n > i;
+            unlock_data(node);
+            if (!allocated) {
+                break;
+            }
+
+            memcpy(file->extents[i].data + at, buffer + copied, n);
+            copied += n;
+        }
+        start += size;
+    }
+
+    lock_data(node);
+    if (copied > 0 && offset + copied > file->size) {
+        file->size = offset + copied;
+    }
+    unlock_data(node);
+    return copied;
+}
+
+
+/*
+ * Copies bytes into a file. Up to INLINE_FILE_MAX bytes are kept in the
+ * i-node, then they move to extents, allocated as they are written to.
+ * Bytes skipped over past the end of the file read as zeros.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - buffer: bytes to copy
+ *  - offset: where in the file to start
+ *  - len: number of bytes
+ * Returns: number of bytes copied, fewer than len if the file is full,
+ *  or FAIL if none could be
+ */
+int inode_write(int inumber, char *buffer, size_t offset, size_t len) {
+    inode_t *node = &inode_table[inumber];
+    FileContents *file;
+    size_t copied;
+
+    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_FILE)) {
+        printf("inode_write: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    file = node->data.fileContents;
+    if (file == NULL && offset + len <= INLINE_FILE_MAX) {
+        if (len == 0) {
+            return 0;
+        }
+        if (node->inlineSize == 0) {
+            __atomic_add_fetch(&inlineFiles, 1, __ATOMIC_RELAXED);
+        }
+        if (offset > node->inlineSize) {
+            memset(node->inlineData + node->inlineSize, 0, offset - node->inlineSize);
+        }
+        memcpy(node->inlineData + offset, buffer, len);
+        if (offset + len > node->inlineSize) {
+            node->inlineSize = offset + len;
+        }
+        return len;
+    }
+
+    /* outgrowing the i-node: what it held goes first */
+    if (file == NULL) {
+        if ((file = calloc(1, sizeof(FileContents))) == NULL ||
+            extents_write(node, file, node->inlineData, 0, node->inlineSize) != node->inlineSize) {
+            if (file != NULL) {
+                contents_free(file);
+            }
+            return FAIL;
+        }
+        if (node->inlineSize > 0) {
+            __atomic_sub_fetch(&inlineFiles, 1, __ATOMIC_RELAXED);
+            node->inlineSize = 0;
+        }
+        node->data.fileContents = file;
+    }
+    else if (file->refs > 0) {
+        if (contents_unshare(node) != SUCCESS) {
+            return FAIL;
+        }
+        file = node->data.fileContents;
+    }
+
+    copied = extents_write(node, file, buffer, offset, len);
+    return copied == 0 && len > 0 ? FAIL : (int)copied;
+}
+
+
+/*
+ * Tells whether a file, read-locked, can be written without being
+ * write-locked: its bytes are in extents of its own, so writing only
+ * ever adds extents. Writing one held inline or sharing its contents
+ * replaces them, and needs the file write-locked.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+int inode_write_in_place(int inumber) {
+    FileContents *file = inode_table[inumber].data.fileContents;
+
+    return inode_table[inumber].nodeType == T_FILE && file != NULL && file->refs == 0;
+}
+
+
+/*
+ * Tells whether a range conflicts with one already locked: a write
+ * conflicts with anything it overlaps, reads only with writes.
+ */
+static int range_conflicts(inode_t *node, range_t *range) {
+    for (range_t *held = node->ranges; held != NULL; held = held->next) {
+        if (held->start < range->end && range->start < held->end && (held->write || range->write))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Locks bytes of a file, which is read-locked, for reading or writing,
+ * waiting until no conflicting range is held. Readers and writers of
+ * bytes that don't overlap go on at once.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - range: where to keep the range, until inode_unlock_range()
+ *  - offset, len: bytes to lock
+ *  - write: whether they are to be written
+ */
+void inode_lock_range(int inumber, range_t *range, size_t offset, size_t len, int write) {
+    inode_t *node = &inode_table[inumber];
+    int waited = 0;
+
+    range->start = offset;
+    range->end = offset + len;
+    range->write = write;
+
+    lock_data(node);
+    while (range_conflicts(node, range)) {
+        waited = 1;
+        if (pthread_cond_wait(&node->rangeUnlocked, &node->dataLock) != 0) {
+            fprintf(stderr, "Error: pthread_cond_wait: Failed to wait for range.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    range->next = node->ranges;
+    node->ranges = range;
+    unlock_data(node);
+
+    __atomic_add_fetch(&rangesLocked, 1, __ATOMIC_RELAXED);
+    if (waited) {
+        __atomic_add_fetch(&rangeWaits, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void inode_unlock_range(int inumber, range_t *range) {
+    inode_t *node = &inode_table[inumber];
+    range_t **link = &node->ranges;
+
+    lock_data(node);
+    while (*link != range) {
+        link = &(*link)->next;
+    }
+    *link = range->next;
+    if (pthread_cond_broadcast(&node->rangeUnlocked) != 0) {
+        fprintf(stderr, "Error: pthread_cond_broadcast: Failed to signal range.\n");
+        exit(EXIT_FAILURE);
+    }
+    unlock_data(node);
+}
+
+
+/*
+ * Claims the bytes an append is about to write, at the end of the file,
+ * so appends going on at once each get their own bytes, one after the
+ * other. The file is locked, for reading or writing.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - len: bytes to be appended
+ * Returns: the offset to write them at
+ */
+size_t inode_claim_append(int inumber, size_t len) {
+    inode_t *node = &inode_table[inumber];
+    size_t offset;
+
+    lock_data(node);
+    offset = node->data.fileContents != NULL ? node->data.fileContents->size : node->inlineSize;
+    if (node->appendEnd > offset) {
+        offset = node->appendEnd;
+    }
+    node->appendEnd = offset + len;
+    unlock_data(node);
+    return offset;
+}
+
+/*
+ * Gives back what an append claimed and didn't write, if no append
+ * claimed bytes after it, so the next one doesn't leave a hole.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - offset, len: bytes claimed by inode_claim_append()
+ *  - written: bytes actually written, or FAIL
+ */
+void inode_settle_append(int inumber, size_t offset, size_t len, int written) {
+    inode_t *node = &inode_table[inumber];
+    size_t end = offset + (written > 0 ? (size_t)written : 0);
+
+    lock_data(node);
+    if (node->appendEnd == offset + len && end < node->appendEnd) {
+        node->appendEnd = end;
+    }
+    unlock_data(node);
+}
+
+
+/*
+ * Reports how many byte ranges of files were locked, and how many of
+ * those had to wait for a conflicting one.
+ */
+void inode_range_stats(long *locked, long *waited) {
+    *locked = __atomic_load_n(&rangesLocked, __ATOMIC_RELAXED);
+    *waited = __atomic_load_n(&rangeWaits, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Shares a file's contents with the files holding the same bytes, if any
+ * are found in the index, or else adds them to it. Called once no one has
+ * the file open, or as it is copied, with the file locked for writing;
+ * files held inline are left alone.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_share(int inumber) {
+    inode_t *node = &inode_table[inumber];
+    FileContents *file = node->data.fileContents, *other;
+    uint64_t hash;
+
+    if (node->nodeType != T_FILE || file == NULL || file->refs > 0) {
+        return;
+    }
+    hash = contents_hash(file);
+
+    lock_contents();
+    for (other = contentsIndex[hash % CONTENT_BUCKETS]; other != NULL; other = other->next) {
+        if (other->hash == hash && contents_equal(other, file))
+            break;
+    }
+    if (other == NULL) {
+        file->hash = hash;
+        file->refs = 1;
+        file->next = contentsIndex[hash % CONTENT_BUCKETS];
+        contentsIndex[hash % CONTENT_BUCKETS] = file;
+    }
+    else {
+        if (++other->refs == 2) {
+            sharedContents++;
+        }
+        sharedSaved += contents_footprint(other);
+    }
+    unlock_contents();
+
+    if (other != NULL) {
+        contents_free(file);
+        node->data.fileContents = other;
+    }
+}
+
+
+/*
+ * Gives a new file the bytes of another: bytes held inline are copied,
+ * contents are shared, so either file gets its own copy once changed.
+ * Both files are locked for writing.
+ * Input:
+ *  - inumber: identifier of the new file
+ *  - source: identifier of the file copied
+ */
+void inode_clone(int inumber, int source) {
+    inode_t *node = &inode_table[inumber], *from = &inode_table[source];
+    FileContents *file;
+
+    if (from->data.fileContents == NULL) {
+        memcpy(node->inlineData, from->inlineData, from->inlineSize);
+        node->inlineSize = from->inlineSize;
+        if (node->inlineSize > 0) {
+            __atomic_add_fetch(&inlineFiles, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    /* contents of a file still open aren't in the index yet */
+    inode_share(source);
+    file = from->data.fileContents;
+
+    lock_contents();
+    if (++file->refs == 2) {
+        sharedContents++;
+    }
+    sharedSaved += contents_footprint(file);
+    unlock_contents();
+
+    node->data.fileContents = file;
+}
+
+
+/*
+ * Reports how storage is saved: files held inline (and the contents they
+ * would otherwise take at least), contents shared by more than one file
+ * (and the copies that saves), and copies made to change shared contents.
+ */
+void inode_storage_stats(long *inlined, long *inlineSaved, long *shared, long *saved, long *copies) {
+    *inlined = __atomic_load_n(&inlineFiles, __ATOMIC_RELAXED);
+    *inlineSaved = *inlined * (long)(sizeof(FileContents) + EXTENT_MIN);
+
+    lock_contents();
+    *shared = sharedContents;
+    *saved = sharedSaved;
+    *copies = copiesOnWrite;
+    unlock_contents();
+}
+
+
 /*
  * Resets an entry for a directory.
  * Input:
@@ -309,10 +943,11 @@ int dir_reset_entry(int inumber, int sub_inumber) {
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry 
+ *  - sub_name: name of the sub i-node entry, not necessarily terminated
+ *  - length: length of the name
  * Returns: SUCCESS or FAIL
  */
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name, size_t length) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
@@ -331,7 +966,7 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
         return FAIL;
     }
 
-    if (strlen(sub_name) == 0 ) {
+    if (length == 0 || length >= MAX_FILE_NAME) {
         printf("inode_add_entry: \
                entry name must be non-empty\n");
         return FAIL;
@@ -340,7 +975,9 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
     for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
         if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
             inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
+            memcpy(inode_table[inumber].data.dirEntries[i].name, sub_name, length);
+            inode_table[inumber].data.dirEntries[i].name[length] = '\0';
+            inode_table[inumber].data.dirEntries[i].hash = path_hash(sub_name, length);
             return SUCCESS;
         }
     }
@@ -374,13 +1011,3 @@ void inode_print_tree(FILE *fp, int inumber, char *name) {
         }
     }
 }
-
-/*
- * Sets the data of given inode to data given as input.
- * Input:
- *  - inumber: identifier of the i-node
- *  - data: data contents
- */
-void setData(int inumber, union Data data) {
-	inode_table[inumber].data = data;
-}
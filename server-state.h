@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "../tecnicofs-api-constants.h"
 
@@ -18,20 +19,69 @@
 
 #define DELAY 50000
 
+/* generations wrap here, so a directory handle fits in a positive int */
+#define MAX_GENERATION (0x7fffffff / INODE_TABLE_SIZE)
+
+/* bytes of a file's first extent, each further one doubles up to EXTENT_MAX */
+#define EXTENT_MIN 512
+#define EXTENT_MAX (1 << 20)
+#define MAX_FILE_EXTENTS 32
+
+/* files up to this size keep their bytes in the i-node */
+#define INLINE_FILE_MAX 64
+
+/* buckets of the index of file contents shared by identical files */
+#define CONTENT_BUCKETS 64
+
 
 /*
  * Contains the name of the entry and respective i-number
  */
 typedef struct dirEntry {
 	char name[MAX_FILE_NAME];
+	uint32_t hash; /* path_hash() of the name */
 	int inumber;
 } DirEntry;
 
+/*
+ * A run of a file's bytes, allocated as a whole. Extents follow each other
+ * from the start of the file, so it grows without moving what it holds.
+ */
+typedef struct extent {
+	char *data;
+	size_t size; /* bytes allocated */
+} Extent;
+
+/*
+ * Bytes of a file, allocated once it outgrows INLINE_FILE_MAX. Once no
+ * one has the file open they are put in an index by their hash, and files
+ * closed with the same bytes share them; a file changing shared contents
+ * gets its own copy first.
+ */
+typedef struct fileContents {
+	size_t size; /* bytes written, from the start of the file */
+	int n;       /* extents allocated */
+	Extent extents[MAX_FILE_EXTENTS];
+	int refs;      /* files sharing them, 0 while not in the index */
+	uint64_t hash; /* of the bytes, while in the index */
+	struct fileContents *next;
+} FileContents;
+
+/*
+ * Bytes of a file locked by a reader or a writer, see inode_lock_range().
+ * Kept by whoever locks them, linked to the i-node while held.
+ */
+typedef struct range {
+	size_t start, end; /* [start, end) */
+	int write;
+	struct range *next;
+} range_t;
+
 /*
  * Data is either text (file) or entries (DirEntry)
  */
 union Data {
-	char *fileContents; /* for files */
+	FileContents *fileContents; /* for files */
 	DirEntry *dirEntries; /* for directories */
 };
 
@@ -42,7 +92,16 @@ typedef struct inode_t {
 	type nodeType;
 	union Data data;
 	/* more i-node attributes will be added in future exercises */
+	unsigned int generation; /* bumped each time the slot is reused */
+	int openCount;           /* open-file table entries referring to it */
+	size_t inlineSize;       /* bytes of a file held below, until it gets fileContents */
+	char inlineData[INLINE_FILE_MAX];
 	pthread_rwlock_t lock;
+	/* a file read-locked may be read and written by many at once, see inode_lock_range() */
+	range_t *ranges;          /* locked */
+	size_t appendEnd;         /* where the next append goes, if past the end of the file */
+	pthread_mutex_t dataLock; /* guards the above, and the extents while the i-node is read-locked */
+	pthread_cond_t rangeUnlocked;
 } inode_t;
 
 void rd_lock_node(int i_number);
@@ -56,15 +115,24 @@ void insert_delay(int cycles);
 void inode_table_init();
 void inode_table_destroy();
 int inode_create(type nType);
-
-int mv_inode_create(type nType, int desired_inumber);
 int inode_delete(int inumber);
 int inode_get(int inumber, type *nType, union Data *data);
-int inode_set_file(int inumber, char *fileContents, int len);
+unsigned int inode_get_generation(int inumber, type *nType);
+int inode_get_open_count(int inumber);
+void inode_set_open_count(int inumber, int count);
+int inode_read(int inumber, char *buffer, size_t offset, size_t len);
+int inode_write(int inumber, char *buffer, size_t offset, size_t len);
+void inode_share(int inumber);
+void inode_clone(int inumber, int source);
+int inode_write_in_place(int inumber);
+void inode_lock_range(int inumber, range_t *range, size_t offset, size_t len, int write);
+void inode_unlock_range(int inumber, range_t *range);
+size_t inode_claim_append(int inumber, size_t len);
+void inode_settle_append(int inumber, size_t offset, size_t len, int written);
+void inode_range_stats(long *locked, long *waited);
+void inode_storage_stats(long *inlined, long *inlineSaved, long *shared, long *saved, long *copies);
 int dir_reset_entry(int inumber, int sub_inumber);
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name, size_t length);
 void inode_print_tree(FILE *fp, int inumber, char *name);
 
-void setData(int inumber, union Data data);
-
 #endif /* INODES_H */
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "stats.h"
+#include "fs/state.h"
+#include "fs/negcache.h"
+#include "lease.h"
+#include "watch.h"
+#include "delegation.h"
+#include "files.h"
+#include "tree.h"
+
+/*
+ * Latency histogram of one request class.
+ */
+typedef struct lane_stats {
+	long count;
+	long shed;
+	double total_us;
+	double max_us;
+	long buckets[LATENCY_BUCKETS];
+} lane_stats_t;
+
+lane_stats_t laneStats[NUMBER_OF_LANES];
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+char *laneNames[NUMBER_OF_LANES] = { "fast", "normal", "bulk" };
+
+long lookupSources[NUMBER_OF_LOOKUP_SOURCES];
+
+/* socket system calls made and datagrams they carried */
+long ioCalls[NUMBER_OF_IO_DIRECTIONS];
+long ioMessages[NUMBER_OF_IO_DIRECTIONS];
+
+
+/*
+ * Records the time a request spent in the server, from being received to
+ * being answered.
+ * Input:
+ *  - lane: class of the request
+ *  - received: time at which the request was received
+ */
+void stats_record_latency(lane_t lane, struct timespec *received) {
+	struct timespec now;
+	double us;
+	int bucket = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - received->tv_sec) * 1e6 + (now.tv_nsec - received->tv_nsec) * 1e-3;
+
+	while (bucket < LATENCY_BUCKETS - 1 && (1L << bucket) < us) {
+		bucket++;
+	}
+
+	if (pthread_mutex_lock(&statsLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	laneStats[lane].count++;
+	laneStats[lane].total_us += us;
+	if (us > laneStats[lane].max_us)
+		laneStats[lane].max_us = us;
+	laneStats[lane].buckets[bucket]++;
+
+	if (pthread_mutex_unlock(&statsLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Counts a request refused with a busy reply because the server was overloaded.
+ * Input:
+ *  - lane: class of the request
+ */
+void stats_record_shed(lane_t lane) {
+	if (pthread_mutex_lock(&statsLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	laneStats[lane].shed++;
+
+	if (pthread_mutex_unlock(&statsLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Counts how a lookup request was answered.
+ * Input:
+ *  - source: whether it walked the tree or shared another lookup's result
+ */
+void stats_record_lookup(lookup_source_t source) {
+	__atomic_add_fetch(&lookupSources[source], 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Counts one batch of datagrams moved by a single system call (recvmmsg,
+ * sendmmsg, or one round of io_uring completions).
+ * Input:
+ *  - direction: whether datagrams were received or sent
+ *  - messages: number of datagrams it carried
+ */
+void stats_record_io_batch(io_direction_t direction, int messages) {
+	__atomic_add_fetch(&ioCalls[direction], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ioMessages[direction], messages, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Finds the upper bound of the bucket holding the given percentile.
+ * Input:
+ *  - stats: histogram of a lane
+ *  - percentile: value between 0 and 1
+ * Returns:
+ *  latency in microseconds
+ */
+static long latency_percentile(lane_stats_t *stats, double percentile) {
+	long seen = 0;
+
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += stats->buckets[i];
+		if (seen >= stats->count * percentile)
+			return 1L << i;
+	}
+	return 1L << (LATENCY_BUCKETS - 1);
+}
+
+
+/*
+ * Prints the latency and number of refused requests of every request class,
+ * how lookups were answered and the average socket batch achieved.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void stats_print(FILE *fp) {
+	if (pthread_mutex_lock(&statsLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(fp, "%-8s %10s %10s %10s %10s %10s %10s\n", "lane", "requests", "shed", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+	for (int lane = 0; lane < NUMBER_OF_LANES; lane++) {
+		lane_stats_t *stats = &laneStats[lane];
+
+		fprintf(fp, "%-8s %10ld %10ld %10.1f %10ld %10ld %10.1f\n", laneNames[lane], stats->count, stats->shed,
+			stats->count ? stats->total_us / stats->count : 0.0,
+			stats->count ? latency_percentile(stats, 0.5) : 0,
+			stats->count ? latency_percentile(stats, 0.99) : 0,
+			stats->max_us);
+	}
+	fprintf(fp, "lookups: %ld resolved, %ld joined in flight, %ld reused\n",
+		__atomic_load_n(&lookupSources[LOOKUP_RESOLVED], __ATOMIC_RELAXED),
+		__atomic_load_n(&lookupSources[LOOKUP_JOINED], __ATOMIC_RELAXED),
+		__atomic_load_n(&lookupSources[LOOKUP_REUSED], __ATOMIC_RELAXED));
+
+	for (int dir = 0; dir < NUMBER_OF_IO_DIRECTIONS; dir++) {
+		long calls = __atomic_load_n(&ioCalls[dir], __ATOMIC_RELAXED);
+		long messages = __atomic_load_n(&ioMessages[dir], __ATOMIC_RELAXED);
+
+		fprintf(fp, "%s: %ld datagrams in %ld batches, %.1f per batch\n", dir == IO_RECV ? "received" : "sent",
+			messages, calls, calls ? (double)messages / calls : 0.0);
+	}
+
+	long hits, entries;
+	negcache_stats(&hits, &entries);
+	fprintf(fp, "negative cache: %ld hits, %ld entries\n", hits, entries);
+
+	long granted, revoked, active;
+	lease_stats(&granted, &revoked, &active);
+	fprintf(fp, "leases: %ld granted, %ld revoked, %ld held\n", granted, revoked, active);
+
+	long watches, sent, coalesced, overflows;
+	watch_stats(&watches, &sent, &coalesced, &overflows);
+	fprintf(fp, "watches: %ld held, %ld events sent, %ld coalesced, %ld overflows\n", watches, sent, coalesced, overflows);
+
+	long delegated, recalled, expired, delegations, deferred;
+	delegation_stats(&delegated, &recalled, &expired, &delegations, &deferred);
+	fprintf(fp, "delegations: %ld granted, %ld recalled, %ld taken back, %ld held, %ld requests deferred\n",
+		delegated, recalled, expired, delegations, deferred);
+
+	long open, read, mapped, written;
+	files_stats(&open, &read, &mapped, &written);
+	fprintf(fp, "files: %ld open, %ld bytes read (%ld through memfds), %ld bytes written\n", open, read, mapped, written);
+
+	long inlined, inlineSaved, shared, sharedSaved, copies;
+	inode_storage_stats(&inlined, &inlineSaved, &shared, &sharedSaved, &copies);
+	fprintf(fp, "storage: %ld files inline (%ld bytes saved), %ld contents shared (%ld bytes saved), %ld copied on write\n",
+		inlined, inlineSaved, shared, sharedSaved, copies);
+
+	long ranges, rangeWaits;
+	inode_range_stats(&ranges, &rangeWaits);
+	fprintf(fp, "ranges: %ld locked, %ld waited for a conflicting one\n", ranges, rangeWaits);
+
+	long treesDeleted, treesCopied, treeNodes, treeTasks;
+	tree_stats(&treesDeleted, &treesCopied, &treeNodes, &treeTasks);
+	fprintf(fp, "trees: %ld deleted, %ld copied, %ld nodes, %ld directories handed to the workers\n",
+		treesDeleted, treesCopied, treeNodes, treeTasks);
+	fflush(fp);
+
+	if (pthread_mutex_unlock(&statsLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
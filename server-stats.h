@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+#include "workqueue.h"
+
+/* latencies are kept in power-of-two microsecond buckets */
+#define LATENCY_BUCKETS 32
+
+/*
+ * How a lookup request got its answer.
+ */
+typedef enum lookup_source {
+	LOOKUP_RESOLVED, /* walked the tree */
+	LOOKUP_JOINED,   /* waited for an identical lookup in flight */
+	LOOKUP_REUSED,   /* took a recent result of an identical lookup */
+	NUMBER_OF_LOOKUP_SOURCES
+} lookup_source_t;
+
+/*
+ * Direction of a batched socket system call.
+ */
+typedef enum io_direction {
+	IO_RECV,
+	IO_SEND,
+	NUMBER_OF_IO_DIRECTIONS
+} io_direction_t;
+
+void stats_record_latency(lane_t lane, struct timespec *received);
+void stats_record_shed(lane_t lane);
+void stats_record_lookup(lookup_source_t source);
+void stats_record_io_batch(io_direction_t direction, int messages);
+void stats_print(FILE *fp);
+
+#endif /* STATS_H */
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs/operations.h"
+#include "tree.h"
+
+/*
+ * Trees are gone through one directory at a time: the worker taking a
+ * directory deletes or copies its entries one by one, each with a request
+ * of its own, and hands its subdirectories back to the workers, so no lock
+ * is held for longer than one node and the tree is spread over all of
+ * them. Nothing waits for a subdirectory: the last task done under a
+ * directory finishes it, and the last one of all answers the client.
+ */
+void (*dispatchTask)(request_t *req);
+int (*applyNode)(tfs_request_t *command);
+long treesDeleted = 0, treesCopied = 0, treeNodes = 0, treeTasks = 0;
+
+
+static void lock_job(tree_job_t *job) {
+	if (pthread_mutex_lock(&job->lock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_job(tree_job_t *job) {
+	if (pthread_mutex_unlock(&job->lock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Sets up the operations on trees.
+ * Input:
+ *  - dispatch: hands a request to the workers
+ *  - apply: applies an operation on a single node, as if a client asked
+ */
+void tree_init(void (*dispatch)(request_t *req), int (*apply)(tfs_request_t *command)) {
+	dispatchTask = dispatch;
+	applyNode = apply;
+}
+
+
+/*
+ * Counts a node deleted or copied, or left.
+ */
+static void node_done(tree_job_t *job, int ret) {
+	lock_job(job);
+	if (ret == SUCCESS) {
+		job->done++;
+	}
+	else {
+		job->left++;
+		if (job->status == SUCCESS) {
+			job->status = ret;
+		}
+	}
+	unlock_job(job);
+}
+
+/*
+ * Deletes or copies a single node of a tree.
+ * Input:
+ *  - opcode: TFS_OP_DELETE or TFS_OP_COPY
+ *  - path: absolute path of the node
+ *  - target: absolute path of its copy, NULL for a delete
+ * Returns: the operation's result
+ */
+static int apply_node(tree_job_t *job, uint8_t opcode, char *path, char *target) {
+	tfs_request_t command;
+	int ret;
+
+	command.opcode = opcode;
+	command.flags = 0;
+	command.id = job->req->command.id;
+	command.dir = TFS_NO_DIR;
+	command.npaths = target != NULL ? 2 : 1;
+	command.paths[0] = path;
+	command.paths[1] = target;
+
+	ret = applyNode(&command);
+	node_done(job, ret);
+	return ret;
+}
+
+/*
+ * Builds the path of an entry of a directory.
+ * Returns: SUCCESS, or FAIL if it doesn't fit in MAX_FILE_NAME
+ */
+static int child_path(char *dest, char *dir, char *name) {
+	int len = snprintf(dest, MAX_FILE_NAME, "%s%s%s", dir, strcmp(dir, "/") == 0 ? "" : "/", name);
+
+	return len < MAX_FILE_NAME ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Hands a subdirectory of a task's directory to the workers. It travels
+ * as a request on its own paths, so it is checked against the
+ * delegations when it is taken, like the client's was.
+ */
+static void task_spawn(tree_task_t *parent, char *path, char *target) {
+	tree_job_t *job = parent->job;
+	tree_task_t *task = malloc(sizeof(tree_task_t));
+	request_t *req = malloc(sizeof(request_t));
+
+	if (task == NULL || req == NULL) {
+		fprintf(stderr, "Error: failed to allocate tree task.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	task->job = job;
+	task->parent = parent;
+	task->pending = 1;
+	strcpy(task->path, path);
+	strcpy(task->target, target != NULL ? target : "");
+
+	lock_job(job);
+	parent->pending++;
+	unlock_job(job);
+
+	req->length = 0;
+	req->binary = job->req->binary;
+	req->command = job->req->command;
+	req->command.npaths = target != NULL ? 2 : 1;
+	req->command.paths[0] = task->path;
+	req->command.paths[1] = task->target;
+	req->client_addr = job->req->client_addr;
+	req->addrlen = job->req->addrlen;
+	req->conn = job->req->conn;
+	req->ring = job->req->ring;
+	req->sockfd = job->req->sockfd;
+	req->leased = 0;
+	req->nresults = 0;
+	req->output = NULL;
+	req->passedFd = -1;
+	req->lane = job->req->lane;
+	req->task = task;
+	clock_gettime(CLOCK_MONOTONIC, &req->received);
+
+	__atomic_add_fetch(&treeTasks, 1, __ATOMIC_RELAXED);
+	dispatchTask(req);
+}
+
+/*
+ * Deletes or copies the entries of a task's directory, as they are when it
+ * is listed. Files are done right away, subdirectories handed on.
+ */
+static void task_run(tree_task_t *task) {
+	tree_job_t *job = task->job;
+	int copying = job->req->command.opcode == TFS_OP_COPY;
+	DirEntry entries[MAX_DIR_ENTRIES];
+	type types[MAX_DIR_ENTRIES];
+	char path[MAX_FILE_NAME], target[MAX_FILE_NAME];
+	path_t parsed;
+	int n = FAIL;
+
+	if (path_parse(&parsed, task->path) == SUCCESS) {
+		n = list_dir(&parsed, entries, types);
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (child_path(path, task->path, entries[i].name) != SUCCESS ||
+			(copying && child_path(target, task->target, entries[i].name) != SUCCESS)) {
+			node_done(job, FAIL);
+		}
+		/* a directory is copied empty, its entries by a task of its own */
+		else if (copying) {
+			if (apply_node(job, TFS_OP_COPY, path, target) == SUCCESS && types[i] == T_DIRECTORY) {
+				task_spawn(task, path, target);
+			}
+		}
+		else if (types[i] == T_DIRECTORY) {
+			task_spawn(task, path, NULL);
+		}
+		else {
+			apply_node(job, TFS_OP_DELETE, path, NULL);
+		}
+	}
+}
+
+/*
+ * Ends a job, giving the client's request its results.
+ * Returns: the request, to be answered
+ */
+static request_t *job_finish(tree_job_t *job) {
+	request_t *req = job->req;
+
+	req->status = job->status;
+	req->results[0] = job->done;
+	req->results[1] = job->left;
+	req->nresults = 2;
+
+	__atomic_add_fetch(&treeNodes, job->done, __ATOMIC_RELAXED);
+	pthread_mutex_destroy(&job->lock);
+	free(job);
+	return req;
+}
+
+/*
+ * Marks a task's own part done, or one of the tasks under it. The last
+ * one to be done finishes the directory (deleting it, for a delete), and
+ * so on up the tree.
+ * Returns: the client's request once the whole tree is done, NULL before
+ */
+static request_t *task_finish(tree_task_t *task) {
+	tree_job_t *job = task->job;
+
+	while (task != NULL) {
+		tree_task_t *parent = task->parent;
+		int pending;
+
+		lock_job(job);
+		pending = --task->pending;
+		unlock_job(job);
+
+		if (pending > 0) {
+			return NULL;
+		}
+
+		/* a directory is deleted once everything under it is */
+		if (job->req->command.opcode == TFS_OP_DELETE) {
+			apply_node(job, TFS_OP_DELETE, task->path, NULL);
+		}
+		free(task);
+		task = parent;
+	}
+	return job_finish(job);
+}
+
+/*
+ * Starts deleting or copying a tree for a client. The node at its top is
+ * deleted last, or copied first.
+ * Returns: the client's request if the tree is done, NULL otherwise
+ */
+static request_t *tree_start(request_t *req) {
+	tfs_request_t *command = &req->command;
+	int copying = command->opcode == TFS_OP_COPY;
+	tree_job_t *job = malloc(sizeof(tree_job_t));
+	tree_task_t *task = malloc(sizeof(tree_task_t));
+	path_t parsed;
+
+	if (job == NULL || task == NULL) {
+		fprintf(stderr, "Error: failed to allocate tree job.\n");
+		exit(EXIT_FAILURE);
+	}
+	job->req = req;
+	job->done = job->left = 0;
+	job->status = SUCCESS;
+	pthread_mutex_init(&job->lock, NULL);
+
+	task->job = job;
+	task->parent = NULL;
+	task->pending = 1;
+	__atomic_add_fetch(copying ? &treesCopied : &treesDeleted, 1, __ATOMIC_RELAXED);
+
+	/* a missing tree is an error, not a node left */
+	if (tfs_path_normalize(task->path, MAX_FILE_NAME, command->paths[0]) != 0 ||
+		(copying && tfs_path_normalize(task->target, MAX_FILE_NAME, command->paths[1]) != 0) ||
+		path_parse(&parsed, task->path) != SUCCESS || lookup(&parsed) < 0 ||
+		(copying ? tfs_path_under(task->target, task->path) : strcmp(task->path, "/") == 0)) {
+		printf("%s tree: %s failed\n", copying ? "Copy" : "Delete", command->paths[0]);
+		free(task);
+		job->status = FAIL;
+		return job_finish(job);
+	}
+
+	printf("%s tree: %s\n", copying ? "Copy" : "Delete", task->path);
+	if (!copying || apply_node(job, TFS_OP_COPY, task->path, task->target) == SUCCESS) {
+		task_run(task);
+	}
+	return task_finish(task);
+}
+
+/*
+ * Applies a request on a tree: the client's, or one of the tasks it
+ * handed to the workers.
+ * Input:
+ *  - req: request taken by a worker, see tfs_tree_op()
+ * Returns:
+ *  the client's request once the whole tree is done, to be answered;
+ *  NULL while tasks are left
+ */
+request_t *tree_apply(request_t *req) {
+	tree_task_t *task = req->task;
+
+	if (task == NULL) {
+		return tree_start(req);
+	}
+
+	free(req);
+	task_run(task);
+	return task_finish(task);
+}
+
+
+/*
+ * Reports the trees deleted and copied, the nodes they had and the
+ * directories handed to the workers.
+ */
+void tree_stats(long *deleted, long *copied, long *nodes, long *tasks) {
+	*deleted = __atomic_load_n(&treesDeleted, __ATOMIC_RELAXED);
+	*copied = __atomic_load_n(&treesCopied, __ATOMIC_RELAXED);
+	*nodes = __atomic_load_n(&treeNodes, __ATOMIC_RELAXED);
+	*tasks = __atomic_load_n(&treeTasks, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,38 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <pthread.h>
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-protocol.h"
+#include "workqueue.h"
+
+
+/*
+ * A tree being deleted or copied for a client, answered once every
+ * directory of it is done.
+ */
+typedef struct tree_job {
+	request_t *req;        /* the client's */
+	long done, left;       /* nodes deleted or copied, and not */
+	int status;            /* SUCCESS, or the error of the first node left */
+	pthread_mutex_t lock;  /* guards the above and the tasks' pending counts */
+} tree_job_t;
+
+/*
+ * A directory of a tree, handed to the workers as a request of its own.
+ * A directory being deleted goes once the tasks of the directories under
+ * it are done.
+ */
+typedef struct tree_task {
+	tree_job_t *job;
+	struct tree_task *parent;   /* directory holding it, NULL at the top */
+	int pending;                /* tasks under it not done, plus one for its own entries */
+	char path[MAX_FILE_NAME];   /* normalized */
+	char target[MAX_FILE_NAME]; /* of its copy */
+} tree_task_t;
+
+void tree_init(void (*dispatch)(request_t *req), int (*apply)(tfs_request_t *command));
+request_t *tree_apply(request_t *req);
+void tree_stats(long *deleted, long *copied, long *nodes, long *tasks);
+
+#endif /* TREE_H */
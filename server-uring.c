@@ -0,0 +1,236 @@
+#ifdef USE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+
+/*
+ * Creates an io_uring instance and maps its queues.
+ * Input:
+ *  - entries: size of the submission queue, a power of two
+ * Returns: 0, or -1 if io_uring is unavailable
+ */
+int uring_init(uring_t *ring, unsigned entries) {
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(uring_t));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		return -1;
+	}
+	ring->entries = params.sq_entries;
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sqHead = (unsigned *)((char *)ring->sqRing + params.sq_off.head);
+	ring->sqTail = (unsigned *)((char *)ring->sqRing + params.sq_off.tail);
+	ring->sqMask = (unsigned *)((char *)ring->sqRing + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)((char *)ring->sqRing + params.sq_off.array);
+	ring->cqHead = (unsigned *)((char *)ring->cqRing + params.cq_off.head);
+	ring->cqTail = (unsigned *)((char *)ring->cqRing + params.cq_off.tail);
+	ring->cqMask = (unsigned *)((char *)ring->cqRing + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cqRing + params.cq_off.cqes);
+
+	return 0;
+}
+
+
+/*
+ * Unmaps an io_uring instance and its buffers, and closes it.
+ */
+void uring_destroy(uring_t *ring) {
+	if (ring->bufRing != NULL) {
+		munmap(ring->bufRing, ring->bufRingSize);
+		free(ring->buffers);
+	}
+	munmap(ring->sqes, ring->sqesSize);
+	munmap(ring->cqRing, ring->cqRingSize);
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+}
+
+
+/*
+ * Takes the next free submission queue entry, cleared.
+ * Returns: the entry, or NULL if the queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+	unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sqTail + ring->toSubmit;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= ring->entries) {
+		return NULL;
+	}
+	sqe = &ring->sqes[tail & *ring->sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+	ring->toSubmit++;
+
+	return sqe;
+}
+
+
+/*
+ * Submits the entries prepared so far with a single system call.
+ * Input:
+ *  - waitFor: number of completions to wait for, 0 not to block
+ * Returns: number of entries submitted, or -1 on error
+ */
+int uring_submit(uring_t *ring, unsigned waitFor) {
+	unsigned submitted = ring->toSubmit;
+	int ret;
+
+	__atomic_store_n(ring->sqTail, *ring->sqTail + submitted, __ATOMIC_RELEASE);
+	ring->toSubmit = 0;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, submitted, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+
+/*
+ * Looks at the oldest completion, without a system call.
+ * Returns: the completion, or NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+	unsigned head = *ring->cqHead;
+
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cqMask];
+}
+
+/*
+ * Releases the completion returned by uring_peek_cqe().
+ */
+void uring_cqe_seen(uring_t *ring) {
+	__atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Registers a group of buffers the kernel picks from for receives with
+ * buffer selection.
+ * Input:
+ *  - count: number of buffers, a power of two
+ *  - size: bytes per buffer
+ *  - group: id of the buffer group
+ * Returns: 0, or -1 if the kernel doesn't support buffer rings
+ */
+int uring_provide_buffers(uring_t *ring, unsigned count, unsigned size, int group) {
+	struct io_uring_buf_reg reg;
+
+	ring->bufRingSize = count * sizeof(struct io_uring_buf);
+	ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->buffers = malloc((size_t)count * size);
+	if (ring->bufRing == MAP_FAILED || ring->buffers == NULL) {
+		fprintf(stderr, "Error: failed to allocate receive buffers.\n");
+		exit(EXIT_FAILURE);
+	}
+	ring->bufCount = count;
+	ring->bufSize = size;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring->bufRing;
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		return -1;
+	}
+
+	ring->bufRing->tail = 0;
+	for (unsigned i = 0; i < count; i++) {
+		uring_recycle_buffer(ring, i);
+	}
+	return 0;
+}
+
+/*
+ * Returns the memory of a provided buffer.
+ */
+char *uring_buffer(uring_t *ring, int bid) {
+	return ring->buffers + (size_t)bid * ring->bufSize;
+}
+
+/*
+ * Hands a provided buffer back to the kernel once its contents were used.
+ */
+void uring_recycle_buffer(uring_t *ring, int bid) {
+	unsigned short tail = ring->bufRing->tail;
+	struct io_uring_buf *buf = &ring->bufRing->bufs[tail & (ring->bufCount - 1)];
+
+	buf->addr = (uintptr_t)uring_buffer(ring, bid);
+	buf->len = ring->bufSize;
+	buf->bid = bid;
+	__atomic_store_n(&ring->bufRing->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Prepares a receive that keeps delivering messages, each into a buffer
+ * of the group, until it is stopped (a completion without
+ * IORING_CQE_F_MORE).
+ * Input:
+ *  - msg: layout of the name and control areas; must outlive the receive
+ */
+void uring_prep_recvmsg_multishot(struct io_uring_sqe *sqe, int fd, struct msghdr *msg, int group) {
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = group;
+}
+
+/*
+ * Prepares a sendmsg.
+ * Input:
+ *  - msg: message to send; must outlive the send
+ *  - flags: as for sendmsg(); with MSG_DONTWAIT, a send that would block
+ *    completes with -EAGAIN instead of being retried by the kernel
+ */
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, struct msghdr *msg, int flags) {
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+}
+
+/*
+ * Prepares a write at the current file position.
+ */
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len) {
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (__u64)-1;
+}
+
+#endif /* USE_IO_URING */
@@ -0,0 +1,51 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef USE_IO_URING
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring instance, driven through the raw system calls.
+ * Each instance is used by a single thread.
+ */
+typedef struct uring {
+	int fd;
+	unsigned entries;
+	/* submission queue */
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned toSubmit; /* entries prepared since the last submission */
+	/* completion queue */
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	/* mappings, released by uring_destroy() */
+	void *sqRing, *cqRing;
+	size_t sqRingSize, cqRingSize, sqesSize;
+	/* buffers provided to the kernel for multishot receives */
+	struct io_uring_buf_ring *bufRing;
+	char *buffers;
+	unsigned bufCount, bufSize;
+	size_t bufRingSize;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+void uring_destroy(uring_t *ring);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+int uring_submit(uring_t *ring, unsigned waitFor);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+int uring_provide_buffers(uring_t *ring, unsigned count, unsigned size, int group);
+char *uring_buffer(uring_t *ring, int bid);
+void uring_recycle_buffer(uring_t *ring, int bid);
+
+void uring_prep_recvmsg_multishot(struct io_uring_sqe *sqe, int fd, struct msghdr *msg, int group);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, struct msghdr *msg, int flags);
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len);
+
+#endif /* USE_IO_URING */
+
+#endif /* URING_H */
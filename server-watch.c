@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "fs/state.h"
+#include "watch.h"
+
+/*
+ * Watches are few and every change is checked against all of them, so
+ * they are kept in a single list.
+ */
+watcher_t *watchers = NULL;
+pthread_mutex_t watchLock;
+uint32_t nextWatchId = 1;
+long watchCount = 0;
+long eventsSent = 0, eventsCoalesced = 0, watchOverflows = 0;
+
+
+static void lock_watches() {
+	if (pthread_mutex_lock(&watchLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_watches() {
+	if (pthread_mutex_unlock(&watchLock) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Sets up an empty list of watches.
+ */
+void watch_init() {
+	watchers = NULL;
+	pthread_mutex_init(&watchLock, NULL);
+}
+
+
+/*
+ * Releases every watch left.
+ */
+void watch_destroy() {
+	while (watchers != NULL) {
+		watcher_t *next = watchers->next;
+
+		connection_put(watchers->conn);
+		free(watchers);
+		watchers = next;
+	}
+	pthread_mutex_destroy(&watchLock);
+}
+
+
+/*
+ * Tells whether a change of a normalized path concerns a watch: for a
+ * subtree anything under it, otherwise the directory and its entries.
+ */
+static int watches(watcher_t *watcher, char *path) {
+	size_t n = strlen(watcher->path);
+
+	if (!tfs_path_under(path, watcher->path)) {
+		return 0;
+	}
+	if (watcher->subtree) {
+		return 1;
+	}
+	if (strcmp(watcher->path, "/") == 0) {
+		return strchr(path + 1, '/') == NULL;
+	}
+	return path[n] == '\0' || strchr(path + n + 1, '/') == NULL;
+}
+
+/*
+ * Pushes one event to a watcher's client without blocking.
+ * Returns: 0, or -1 if the socket is full
+ */
+static int send_event(watcher_t *watcher, uint8_t mask, char *path, char *target) {
+	char frame[sizeof(tfs_header_t) + 2 * (sizeof(uint16_t) + MAX_FILE_NAME)];
+
+	tfs_frame_begin(frame, TFS_OP_EVENT, mask, watcher->id);
+	tfs_frame_put_path(frame, sizeof(frame), path);
+	if (target[0] != '\0') {
+		tfs_frame_put_path(frame, sizeof(frame), target);
+	}
+
+	if (send(watcher->conn->fd, frame, tfs_frame_size(frame), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return -1;
+		}
+		/* the client went away, its watches go once the receiver sees it */
+		if (errno != EPIPE && errno != ECONNRESET) {
+			perror("server: event send error");
+		}
+		return 0;
+	}
+	__atomic_add_fetch(&eventsSent, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Sends a watcher's pending events, in order, followed by the overflow
+ * notice if some were dropped. What doesn't fit in the socket waits for
+ * the receiver to report room again. The list is locked.
+ */
+static void flush_watcher(watcher_t *watcher) {
+	if (__atomic_load_n(&watcher->conn->closed, __ATOMIC_RELAXED)) {
+		watcher->count = 0;
+		watcher->overflowed = 0;
+		return;
+	}
+
+	while (watcher->count > 0) {
+		watch_event_t *event = &watcher->queue[watcher->head];
+
+		if (send_event(watcher, event->mask, event->path, event->target) < 0) {
+			connection_wait_output(watcher->conn);
+			return;
+		}
+		watcher->head = (watcher->head + 1) % TFS_WATCH_QUEUE;
+		watcher->count--;
+	}
+
+	if (watcher->overflowed) {
+		if (send_event(watcher, TECNICOFS_EVENT_OVERFLOW, watcher->path, "") < 0) {
+			connection_wait_output(watcher->conn);
+			return;
+		}
+		watcher->overflowed = 0;
+	}
+}
+
+/*
+ * Queues an event for a watcher, merging it with a pending one of the same
+ * path, or dropping it if the queue is full. The list is locked.
+ */
+static void queue_event(watcher_t *watcher, uint8_t mask, char *path, char *target) {
+	watch_event_t *event;
+
+	for (int i = 0; i < watcher->count; i++) {
+		event = &watcher->queue[(watcher->head + i) % TFS_WATCH_QUEUE];
+
+		if (strcmp(event->path, path) == 0 && strcmp(event->target, target) == 0) {
+			event->mask |= mask;
+			__atomic_add_fetch(&eventsCoalesced, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	if (watcher->count == TFS_WATCH_QUEUE) {
+		if (!watcher->overflowed) {
+			__atomic_add_fetch(&watchOverflows, 1, __ATOMIC_RELAXED);
+		}
+		watcher->overflowed = 1;
+		return;
+	}
+
+	event = &watcher->queue[(watcher->head + watcher->count) % TFS_WATCH_QUEUE];
+	event->mask = mask;
+	strcpy(event->path, path);
+	strcpy(event->target, target);
+	watcher->count++;
+}
+
+
+/*
+ * Subscribes a session to the changes of a directory, or of a subtree.
+ * Watching a path the session already watches only changes its scope.
+ * Input:
+ *  - conn: session asking for the watch
+ *  - path: directory watched, which need not exist
+ *  - subtree: whether changes below its entries are reported too
+ * Returns:
+ *  the watch id, or FAIL if the path is too long or too many are held
+ */
+int watch_add(connection_t *conn, char *path, int subtree) {
+	char normalized[MAX_FILE_NAME];
+	watcher_t *watcher;
+	int id;
+
+	if (tfs_path_normalize(normalized, sizeof(normalized), path) != 0) {
+		return FAIL;
+	}
+
+	lock_watches();
+	for (watcher = watchers; watcher != NULL; watcher = watcher->next) {
+		if (watcher->conn == conn && strcmp(watcher->path, normalized) == 0) {
+			watcher->subtree = subtree;
+			id = watcher->id;
+			unlock_watches();
+			return id;
+		}
+	}
+
+	if (watchCount == WATCH_MAX || (watcher = malloc(sizeof(watcher_t))) == NULL) {
+		unlock_watches();
+		return FAIL;
+	}
+	/* ids stay positive, to tell them from errors */
+	watcher->id = nextWatchId;
+	nextWatchId = nextWatchId == INT32_MAX ? 1 : nextWatchId + 1;
+	strcpy(watcher->path, normalized);
+	watcher->subtree = subtree;
+	watcher->conn = conn;
+	watcher->head = watcher->count = 0;
+	watcher->overflowed = 0;
+	connection_hold(conn);
+	watcher->next = watchers;
+	watchers = watcher;
+	watchCount++;
+	id = watcher->id;
+	unlock_watches();
+
+	return id;
+}
+
+
+/*
+ * Unsubscribes a session from a path it watches. Pending events are
+ * dropped.
+ * Returns: SUCCESS, or FAIL if the session doesn't watch the path
+ */
+int watch_remove(connection_t *conn, char *path) {
+	char normalized[MAX_FILE_NAME];
+
+	if (tfs_path_normalize(normalized, sizeof(normalized), path) != 0) {
+		return FAIL;
+	}
+
+	lock_watches();
+	for (watcher_t **link = &watchers; *link != NULL; link = &(*link)->next) {
+		watcher_t *watcher = *link;
+
+		if (watcher->conn == conn && strcmp(watcher->path, normalized) == 0) {
+			*link = watcher->next;
+			watchCount--;
+			unlock_watches();
+			connection_put(watcher->conn);
+			free(watcher);
+			return SUCCESS;
+		}
+	}
+	unlock_watches();
+	return FAIL;
+}
+
+
+/*
+ * Reports a change to the watches it concerns. Called while the change is
+ * still exclusive, so every watcher sees changes in the order they were
+ * made.
+ * Input:
+ *  - mask: TECNICOFS_EVENT_* describing the change
+ *  - path: path created, deleted or moved
+ *  - target: new path of a move, NULL otherwise
+ */
+void watch_notify(uint8_t mask, char *path, char *target) {
+	char normalized[MAX_FILE_NAME], normalizedTarget[MAX_FILE_NAME] = "";
+
+	if (__atomic_load_n(&watchCount, __ATOMIC_RELAXED) == 0 ||
+		tfs_path_normalize(normalized, sizeof(normalized), path) != 0 ||
+		(target != NULL && tfs_path_normalize(normalizedTarget, sizeof(normalizedTarget), target) != 0)) {
+		return;
+	}
+
+	lock_watches();
+	for (watcher_t *watcher = watchers; watcher != NULL; watcher = watcher->next) {
+		if (watches(watcher, normalized) || (target != NULL && watches(watcher, normalizedTarget))) {
+			queue_event(watcher, mask, normalized, normalizedTarget);
+			flush_watcher(watcher);
+		}
+	}
+	unlock_watches();
+}
+
+
+/*
+ * Sends what a session's watches have pending, once its socket has room.
+ */
+void watch_flush(connection_t *conn) {
+	lock_watches();
+	for (watcher_t *watcher = watchers; watcher != NULL; watcher = watcher->next) {
+		if (watcher->conn == conn) {
+			flush_watcher(watcher);
+		}
+	}
+	unlock_watches();
+}
+
+
+/*
+ * Drops the watches of a session whose client hung up.
+ */
+void watch_forget(connection_t *conn) {
+	lock_watches();
+	for (watcher_t **link = &watchers; *link != NULL; ) {
+		watcher_t *watcher = *link;
+
+		if (watcher->conn == conn) {
+			*link = watcher->next;
+			watchCount--;
+			connection_put(watcher->conn);
+			free(watcher);
+		}
+		else {
+			link = &watcher->next;
+		}
+	}
+	unlock_watches();
+}
+
+
+/*
+ * Tells how many watches are held, so changes nobody watches can skip
+ * working out their paths.
+ */
+int watch_count() {
+	return __atomic_load_n(&watchCount, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Reports how many watches are held, how many events were sent and merged
+ * into pending ones, and how many times a watcher's queue overflowed.
+ */
+void watch_stats(long *active, long *sent, long *coalesced, long *overflows) {
+	*active = __atomic_load_n(&watchCount, __ATOMIC_RELAXED);
+	*sent = __atomic_load_n(&eventsSent, __ATOMIC_RELAXED);
+	*coalesced = __atomic_load_n(&eventsCoalesced, __ATOMIC_RELAXED);
+	*overflows = __atomic_load_n(&watchOverflows, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,46 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include "../tecnicofs-api-constants.h"
+#include "connection.h"
+
+/* watches held at once by all sessions */
+#define WATCH_MAX 256
+
+
+/*
+ * A change waiting to be pushed to a watcher.
+ */
+typedef struct watch_event {
+	uint8_t mask;               /* TECNICOFS_EVENT_* */
+	char path[MAX_FILE_NAME];   /* normalized */
+	char target[MAX_FILE_NAME]; /* new path of a move, empty otherwise */
+} watch_event_t;
+
+/*
+ * A session's subscription to a directory or subtree, with the events the
+ * client didn't take yet. Each watch holds a reference to its connection.
+ */
+typedef struct watcher {
+	uint32_t id;
+	char path[MAX_FILE_NAME]; /* normalized */
+	int subtree;
+	connection_t *conn;
+	watch_event_t queue[TFS_WATCH_QUEUE];
+	int head, count;
+	int overflowed; /* events were dropped since the queue was last drained */
+	struct watcher *next;
+} watcher_t;
+
+void watch_init();
+void watch_destroy();
+int watch_add(connection_t *conn, char *path, int subtree);
+int watch_remove(connection_t *conn, char *path);
+void watch_notify(uint8_t mask, char *path, char *target);
+void watch_flush(connection_t *conn);
+void watch_forget(connection_t *conn);
+int watch_count();
+void watch_stats(long *active, long *sent, long *coalesced, long *overflows);
+
+#endif /* WATCH_H */
@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "fs/state.h"
+#include "workqueue.h"
+
+/* one deque per worker in each lane */
+deque_t *deques[NUMBER_OF_LANES];
+int numberWorkers = 0;
+/* workers 0 .. numberFastWorkers-1 only serve the fast lane */
+int numberFastWorkers = 0;
+
+/* number of requests sitting in each lane (may go briefly negative) */
+int pending[NUMBER_OF_LANES];
+int totalPending = 0;
+pthread_mutex_t pendingLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workAvailable = PTHREAD_COND_INITIALIZER;
+pthread_cond_t fastWorkAvailable = PTHREAD_COND_INITIALIZER;
+pthread_cond_t spaceAvailable = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * Locks a mutex, aborting the server on failure.
+ */
+static void lock_mutex(pthread_mutex_t *mutex) {
+	if (pthread_mutex_lock(mutex) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_lock: Failed to lock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Unlocks a mutex, aborting the server on failure.
+ */
+static void unlock_mutex(pthread_mutex_t *mutex) {
+	if (pthread_mutex_unlock(mutex) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_unlock: Failed to unlock mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Initializes one empty deque per worker in every lane.
+ * Input:
+ *  - nWorkers: number of worker threads
+ *  - nFastWorkers: number of those workers reserved for the fast lane
+ */
+void workqueue_init(int nWorkers, int nFastWorkers) {
+	numberWorkers = nWorkers;
+	numberFastWorkers = nFastWorkers;
+
+	for (int lane = 0; lane < NUMBER_OF_LANES; lane++) {
+		deques[lane] = malloc(sizeof(deque_t) * nWorkers);
+
+		if (deques[lane] == NULL) {
+			fprintf(stderr, "Error: workqueue_init: Failed to allocate deques.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < nWorkers; i++) {
+			deques[lane][i].head = 0;
+			deques[lane][i].count = 0;
+			pthread_mutex_init(&deques[lane][i].lock, NULL);
+		}
+		pending[lane] = 0;
+	}
+}
+
+
+/*
+ * Releases the deques and any request still queued in them.
+ */
+void workqueue_destroy() {
+	for (int lane = 0; lane < NUMBER_OF_LANES; lane++) {
+		for (int i = 0; i < numberWorkers; i++) {
+			deque_t *deque = &deques[lane][i];
+
+			for (int j = 0; j < deque->count; j++) {
+				free(deque->items[(deque->head + j) % DEQUE_SIZE]);
+			}
+			pthread_mutex_destroy(&deque->lock);
+		}
+		free(deques[lane]);
+	}
+}
+
+
+/*
+ * Appends a request to the back of a deque.
+ * Returns: SUCCESS or FAIL if the deque is full
+ */
+static int deque_push_back(deque_t *deque, request_t *req) {
+	int ret = FAIL;
+
+	lock_mutex(&deque->lock);
+	if (deque->count < DEQUE_SIZE) {
+		deque->items[(deque->head + deque->count) % DEQUE_SIZE] = req;
+		deque->count++;
+		ret = SUCCESS;
+	}
+	unlock_mutex(&deque->lock);
+
+	return ret;
+}
+
+/*
+ * Takes the oldest request from the front of a deque (owner side).
+ * Returns: the request or NULL if the deque is empty
+ */
+static request_t *deque_pop_front(deque_t *deque) {
+	request_t *req = NULL;
+
+	lock_mutex(&deque->lock);
+	if (deque->count > 0) {
+		req = deque->items[deque->head];
+		deque->head = (deque->head + 1) % DEQUE_SIZE;
+		deque->count--;
+	}
+	unlock_mutex(&deque->lock);
+
+	return req;
+}
+
+/*
+ * Takes the newest request from the back of a deque (thief side).
+ * Returns: the request or NULL if the deque is empty
+ */
+static request_t *deque_pop_back(deque_t *deque) {
+	request_t *req = NULL;
+
+	lock_mutex(&deque->lock);
+	if (deque->count > 0) {
+		deque->count--;
+		req = deque->items[(deque->head + deque->count) % DEQUE_SIZE];
+	}
+	unlock_mutex(&deque->lock);
+
+	return req;
+}
+
+
+/*
+ * Queues a request on the given worker's deque of the request's lane. If
+ * that deque is full the request goes to the next worker with room; if
+ * every deque of the lane is full the caller blocks until a worker takes
+ * something out.
+ * Input:
+ *  - worker: index of the preferred worker
+ *  - req: request to be queued
+ * Returns:
+ *  index of the worker whose deque received the request
+ */
+int workqueue_push(int worker, request_t *req) {
+	int target = worker;
+	lane_t lane = req->lane;
+
+	while (1) {
+		for (int i = 0; i < numberWorkers; i++) {
+			target = (worker + i) % numberWorkers;
+
+			if (deque_push_back(&deques[lane][target], req) == SUCCESS) {
+				lock_mutex(&pendingLock);
+				pending[lane]++;
+				totalPending++;
+				if (pthread_cond_signal(&workAvailable) != 0 ||
+					(lane == LANE_FAST && pthread_cond_signal(&fastWorkAvailable) != 0)) {
+					fprintf(stderr, "Error: pthread_cond_signal: Failed to signal change to mutex.\n");
+					exit(EXIT_FAILURE);
+				}
+				unlock_mutex(&pendingLock);
+				return target;
+			}
+		}
+
+		/* every deque is full, wait for a worker to make room */
+		lock_mutex(&pendingLock);
+		while (pending[lane] >= numberWorkers * DEQUE_SIZE) {
+			if (pthread_cond_wait(&spaceAvailable, &pendingLock) != 0) {
+				fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		unlock_mutex(&pendingLock);
+	}
+}
+
+
+/*
+ * Picks the preferred worker for a path by hashing its first components,
+ * so that requests on the same subtree tend to run on the same worker.
+ * Only fast lane requests are routed to the reserved fast workers.
+ * Input:
+ *  - path: path of the node the request operates on
+ *  - depth: number of leading path components hashed
+ *  - lane: lane of the request
+ * Returns:
+ *  index of the preferred worker
+ */
+int workqueue_route(char *path, int depth, lane_t lane) {
+	unsigned long hash = 5381;
+	int components = 0;
+
+	for (char *c = path; *c != '\0'; c++) {
+		if (*c == '/') {
+			/* skip leading and repeated slashes */
+			if (c == path || *(c - 1) == '/')
+				continue;
+			if (++components == depth)
+				break;
+		}
+		hash = hash * 33 + (unsigned char)*c;
+	}
+
+	if (lane == LANE_FAST)
+		return hash % numberWorkers;
+	return numberFastWorkers + hash % (numberWorkers - numberFastWorkers);
+}
+
+
+/*
+ * Queues a request on its preferred worker unless that worker's shard is
+ * overloaded, in which case it goes to the least loaded worker instead.
+ * Input:
+ *  - worker: index of the preferred worker
+ *  - req: request to be queued
+ * Returns:
+ *  index of the worker whose deque received the request
+ */
+int workqueue_dispatch(int worker, request_t *req) {
+	deque_t *lane = deques[req->lane];
+
+	/* racy read, only used as a hint */
+	if (lane[worker].count >= SHARD_OVERLOAD) {
+		int first = req->lane == LANE_FAST ? 0 : numberFastWorkers;
+		int target = worker;
+
+		for (int i = first; i < numberWorkers; i++) {
+			if (lane[i].count < lane[target].count)
+				target = i;
+		}
+		worker = target;
+	}
+
+	return workqueue_push(worker, req);
+}
+
+
+/*
+ * Takes a request from a lane: first from the worker's own deque, then by
+ * stealing from the other workers.
+ * Returns: the request or NULL if the lane is empty
+ */
+static request_t *lane_pop(lane_t lane, int worker) {
+	request_t *req = deque_pop_front(&deques[lane][worker]);
+
+	for (int i = 1; req == NULL && i < numberWorkers; i++) {
+		req = deque_pop_back(&deques[lane][(worker + i) % numberWorkers]);
+	}
+
+	return req;
+}
+
+
+/*
+ * Takes the next request for a worker, serving lanes in priority order.
+ * Workers reserved for the fast lane never take other requests.
+ * Blocks while there is no work the worker may take.
+ * Input:
+ *  - worker: index of the calling worker
+ * Returns:
+ *  the request to process
+ */
+request_t *workqueue_pop(int worker) {
+	int fastOnly = worker < numberFastWorkers;
+	int lanes = fastOnly ? 1 : NUMBER_OF_LANES;
+	request_t *req = NULL;
+
+	while (1) {
+		for (int lane = 0; req == NULL && lane < lanes; lane++) {
+			req = lane_pop(lane, worker);
+		}
+
+		lock_mutex(&pendingLock);
+		if (req != NULL) {
+			pending[req->lane]--;
+			totalPending--;
+			if (pthread_cond_broadcast(&spaceAvailable) != 0) {
+				fprintf(stderr, "Error: pthread_cond_broadcast: Failed to signal change to mutex.\n");
+				exit(EXIT_FAILURE);
+			}
+			unlock_mutex(&pendingLock);
+			return req;
+		}
+
+		while ((fastOnly ? pending[LANE_FAST] : totalPending) <= 0) {
+			if (pthread_cond_wait(fastOnly ? &fastWorkAvailable : &workAvailable, &pendingLock) != 0) {
+				fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		unlock_mutex(&pendingLock);
+	}
+}
+
+
+/*
+ * Returns the number of requests waiting in the deques.
+ */
+int workqueue_pending() {
+	int n;
+
+	lock_mutex(&pendingLock);
+	n = totalPending;
+	unlock_mutex(&pendingLock);
+
+	return n;
+}
+
+
+/*
+ * Initializes an empty reply queue.
+ */
+void reply_queue_init(reply_queue_t *queue) {
+	queue->first = NULL;
+	queue->last = NULL;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->notEmpty, NULL);
+}
+
+/*
+ * Releases a reply queue and any reply still waiting in it.
+ */
+void reply_queue_destroy(reply_queue_t *queue) {
+	while (queue->first != NULL) {
+		request_t *next = queue->first->next;
+		free(queue->first);
+		queue->first = next;
+	}
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->notEmpty);
+}
+
+/*
+ * Hands a processed request over to the send stage.
+ */
+void reply_queue_push(reply_queue_t *queue, request_t *req) {
+	req->next = NULL;
+
+	lock_mutex(&queue->lock);
+	if (queue->last == NULL) {
+		queue->first = req;
+	}
+	else {
+		queue->last->next = req;
+	}
+	queue->last = req;
+
+	if (pthread_cond_signal(&queue->notEmpty) != 0) {
+		fprintf(stderr, "Error: pthread_cond_signal: Failed to signal change to mutex.\n");
+		exit(EXIT_FAILURE);
+	}
+	unlock_mutex(&queue->lock);
+}
+
+/*
+ * Takes the oldest processed request, blocking while there is none.
+ */
+request_t *reply_queue_pop(reply_queue_t *queue) {
+	request_t *req;
+
+	lock_mutex(&queue->lock);
+	while (queue->first == NULL) {
+		if (pthread_cond_wait(&queue->notEmpty, &queue->lock) != 0) {
+			fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	req = queue->first;
+	queue->first = req->next;
+	if (queue->first == NULL) {
+		queue->last = NULL;
+	}
+	unlock_mutex(&queue->lock);
+
+	return req;
+}
+
+/*
+ * Takes up to max processed requests, oldest first, blocking while there
+ * is none.
+ * Input:
+ *  - reqs: where to store the requests taken
+ *  - max: room in reqs
+ * Returns:
+ *  number of requests taken
+ */
+int reply_queue_pop_many(reply_queue_t *queue, request_t **reqs, int max) {
+	int n = 0;
+
+	lock_mutex(&queue->lock);
+	while (queue->first == NULL) {
+		if (pthread_cond_wait(&queue->notEmpty, &queue->lock) != 0) {
+			fprintf(stderr, "Error: pthread_cond_wait: Failed to block thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	while (n < max && queue->first != NULL) {
+		reqs[n++] = queue->first;
+		queue->first = queue->first->next;
+	}
+	if (queue->first == NULL) {
+		queue->last = NULL;
+	}
+	unlock_mutex(&queue->lock);
+
+	return n;
+}
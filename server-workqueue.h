@@ -0,0 +1,101 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-protocol.h"
+#include "connection.h"
+
+/* capacity of each worker's deque */
+#define DEQUE_SIZE 256
+/* default number of datagrams received or sent in one system call */
+#define DEFAULT_IO_BATCH_SIZE 32
+/* upper bound for the above */
+#define MAX_IO_BATCH_SIZE 1024
+/* queued requests above which a worker's shard is considered overloaded */
+#define SHARD_OVERLOAD 8
+/* default number of path components used to pick a request's worker */
+#define DEFAULT_AFFINITY_DEPTH 1
+/* default queued requests above which new requests are refused ... */
+#define DEFAULT_HIGH_WATERMARK 128
+/* ... until the queues drain below this */
+#define DEFAULT_LOW_WATERMARK 64
+
+
+/*
+ * Request classes, each with its own queues. Lower lanes are served first.
+ */
+typedef enum lane {
+	LANE_FAST,   /* latency-sensitive lookups */
+	LANE_NORMAL, /* creations and deletions */
+	LANE_BULK,   /* moves and prints */
+	NUMBER_OF_LANES
+} lane_t;
+
+/*
+ * A request received from a client, travelling from the receive stage,
+ * through a worker, to the send stage.
+ */
+typedef struct request {
+	char buffer[TFS_MAX_FRAME];
+	int length;
+	int binary;              /* binary frame or text command */
+	tfs_request_t command;   /* decoded in place from buffer */
+	struct sockaddr_un client_addr;
+	socklen_t addrlen;
+	connection_t *conn;      /* session it arrived on, NULL for a datagram */
+	int ring;                /* arrived through the session's shared-memory rings */
+	int sockfd;              /* server socket it arrived on */
+	int leased;              /* lookup whose path the client may cache */
+	int status;
+	int32_t results[TFS_MAX_BATCH]; /* one per operation of a batch */
+	int nresults;
+	char *output;            /* print output left for the send stage to write */
+	char *data;              /* bytes read, for the reply */
+	int passedFd;            /* descriptor passed along with the reply, or -1 */
+	struct tree_task *task;  /* directory of a tree being deleted or copied, NULL for a client's request */
+	size_t outputSize;
+	lane_t lane;
+	struct timespec received;
+	struct request *next; /* used by the reply queue */
+} request_t;
+
+/*
+ * Bounded double-ended queue of requests owned by a single worker.
+ * The owner takes requests from the front, thieves take them from the back.
+ */
+typedef struct deque {
+	request_t *items[DEQUE_SIZE];
+	int head;
+	int count;
+	pthread_mutex_t lock;
+} deque_t;
+
+/*
+ * FIFO of processed requests waiting to be answered by the send stage.
+ */
+typedef struct reply_queue {
+	request_t *first, *last;
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+} reply_queue_t;
+
+void workqueue_init(int nWorkers, int nFastWorkers);
+void workqueue_destroy();
+int workqueue_push(int worker, request_t *req);
+int workqueue_route(char *path, int depth, lane_t lane);
+int workqueue_dispatch(int worker, request_t *req);
+request_t *workqueue_pop(int worker);
+int workqueue_pending();
+
+void reply_queue_init(reply_queue_t *queue);
+void reply_queue_destroy(reply_queue_t *queue);
+void reply_queue_push(reply_queue_t *queue, request_t *req);
+request_t *reply_queue_pop(reply_queue_t *queue);
+int reply_queue_pop_many(reply_queue_t *queue, request_t **reqs, int max);
+
+#endif /* WORKQUEUE_H */
@@ -31,5 +31,16 @@ typedef enum type { T_FILE, T_DIRECTORY, T_NONE } type;
 #define TECNICOFS_ERROR_INVALID_MODE -10
 /* Generic error */
 #define TECNICOFS_ERROR_OTHER -11
+/* Server is overloaded and did not process the request, retry later */
+#define TECNICOFS_ERROR_BUSY -12
+/* Directory handle no longer refers to an existing directory */
+#define TECNICOFS_ERROR_STALE_HANDLE -13
+
+/* Changes reported to a watch, or-ed together when coalesced */
+#define TECNICOFS_EVENT_CREATE 1
+#define TECNICOFS_EVENT_DELETE 2
+#define TECNICOFS_EVENT_MOVE 4
+/* Events were lost, the watched directory should be looked at again */
+#define TECNICOFS_EVENT_OVERFLOW 8
 
 #endif /* TECNICOFS_API_CONSTANTS_H */
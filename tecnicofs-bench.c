@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "tecnicofs-client-api.h"
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-protocol.h"
+
+/* file the benchmarks work on */
+#define BENCH_FILE "/tecnicofs-bench"
+
+/* ways the writers of the write benchmark share the file */
+#define WRITE_OWN_REGION 0
+#define WRITE_SAME_REGION 1
+#define WRITE_APPEND 2
+
+/*
+ * A writer of the write benchmark, with a session of its own.
+ */
+typedef struct writer {
+    int index;
+    int how;
+    pthread_t thread;
+} writer_t;
+
+char* serverName;
+int sharedMemory = 0;
+char *benchmark;
+long size, iterations;
+int writers = 8;
+
+pthread_barrier_t start;
+
+static void displayUsage (const char* appName) {
+    printf("Usage: %s [-m] [-w writers] read|write size iterations server_socket_name\n", appName);
+    printf("  read: reads a file of size bytes, iterations times, through the socket and through memfds\n");
+    printf("  write: each writer writes size bytes, iterations times, to one file: to a region of its own,\n");
+    printf("         all to the same region, and appending\n");
+    exit(EXIT_FAILURE);
+}
+
+static void parseArgs (long argc, char* const argv[]) {
+    int opt;
+
+    /* -m: talk to the server through shared memory, -w: writers of the write benchmark */
+    while ((opt = getopt(argc, argv, "mw:")) != -1) {
+        if (opt == 'm')
+            sharedMemory = 1;
+        else if (opt == 'w' && (writers = atoi(optarg)) > 0)
+            continue;
+        else
+            displayUsage(argv[0]);
+    }
+
+    if (argc - optind != 4) {
+        fprintf(stderr, "Invalid format:\n");
+        displayUsage(argv[0]);
+    }
+
+    benchmark = argv[optind];
+    size = atol(argv[optind + 1]);
+    iterations = atol(argv[optind + 2]);
+    serverName = argv[optind + 3];
+
+    if ((strcmp(benchmark, "read") != 0 && strcmp(benchmark, "write") != 0) || size <= 0 || iterations <= 0) {
+        displayUsage(argv[0]);
+    }
+}
+
+/*
+ * Seconds elapsed since start.
+ */
+static double elapsed(struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void report(char *what, double seconds) {
+    long bytes = size * iterations * (strcmp(benchmark, "write") == 0 ? writers : 1);
+
+    fprintf(stderr, "%-24s %8.3f s %10.1f MB/s\n", what, seconds, bytes / seconds / (1 << 20));
+}
+
+/*
+ * Reads the whole file through an open descriptor.
+ * Input:
+ *  - how: 0 through the socket, TFS_MAX_IO bytes per request; 1 with
+ *    tfsRead(), which reads large files through memfds and copies them
+ *    out; 2 in place, through a memfd
+ * Returns: sum of the bytes, so they are really read
+ */
+static long readFile(int fd, char *buffer, int how) {
+    tfs_mapping_t mapping;
+    long sum = 0, done = 0;
+    int res;
+
+    if (how == 2) {
+        if (tfsReadMapped(fd, size, &mapping) != size) {
+            fprintf(stderr, "Error: short read\n");
+            exit(EXIT_FAILURE);
+        }
+        for (long i = 0; i < size; i++) {
+            sum += mapping.data[i];
+        }
+        tfsReleaseMapping(&mapping);
+        return sum;
+    }
+
+    while (done < size) {
+        int count = how == 1 || size - done < TFS_MAX_IO ? size - done : TFS_MAX_IO;
+
+        if ((res = tfsRead(fd, buffer + done, count)) <= 0) {
+            fprintf(stderr, "Error: short read\n");
+            exit(EXIT_FAILURE);
+        }
+        done += res;
+    }
+    for (long i = 0; i < size; i++) {
+        sum += buffer[i];
+    }
+    return sum;
+}
+
+/*
+ * Reads a file of size bytes over and over, each way it can be read,
+ * reporting the throughput of each.
+ */
+static void benchRead() {
+    char *names[] = { "socket, 4KB requests", "tfsRead (memfd, copied)", "memfd, in place" };
+    char *buffer = malloc(size);
+    struct timespec start;
+    long expected = 0;
+    int fd;
+
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: failed to allocate buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < size; i++) {
+        buffer[i] = 'a' + i % 26;
+        expected += buffer[i];
+    }
+
+    tfsDelete(BENCH_FILE);
+    if (tfsCreate(BENCH_FILE, 'f') != 0 || (fd = tfsOpen(BENCH_FILE, WRITE)) < 0 ||
+        tfsWrite(fd, buffer, size) != size || tfsClose(fd) != 0) {
+        fprintf(stderr, "Error: failed to set up %s\n", BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int how = 0; how < 3; how++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < iterations; i++) {
+            if ((fd = tfsOpen(BENCH_FILE, READ)) < 0 || readFile(fd, buffer, how) != expected) {
+                fprintf(stderr, "Error: failed to read %s\n", BENCH_FILE);
+                exit(EXIT_FAILURE);
+            }
+            tfsClose(fd);
+        }
+        report(names[how], elapsed(&start));
+    }
+
+    tfsDelete(BENCH_FILE);
+    free(buffer);
+}
+
+/*
+ * Writes iterations times size bytes, all set to the writer's letter, in
+ * the way the benchmark asks: after the regions of the writers before it,
+ * at the start of the file or at its end.
+ */
+static void *writeFile(void *arg) {
+    writer_t *writer = arg;
+    tfs_mount_t *mount = sharedMemory ? tfsMountSharedHandle(serverName) : tfsMountHandle(serverName);
+    char *buffer = malloc(size);
+    int fd = -1;
+
+    if (mount == NULL || buffer == NULL) {
+        fprintf(stderr, "Error: writer %d failed to start\n", writer->index);
+        exit(EXIT_FAILURE);
+    }
+
+    if (writer->how == WRITE_APPEND) {
+        fd = tfsmOpenAppend(mount, BENCH_FILE);
+    }
+    else if ((fd = tfsmOpen(mount, BENCH_FILE, RW)) >= 0 && writer->how == WRITE_OWN_REGION) {
+        char *skip = malloc(size * iterations);
+
+        /* there is no seek, reading moves the offset to the writer's region */
+        for (int i = 0; i < writer->index; i++) {
+            if (skip == NULL || tfsmRead(mount, fd, skip, size * iterations) != size * iterations) {
+                fprintf(stderr, "Error: writer %d failed to reach its region\n", writer->index);
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(skip);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error: writer %d failed to open %s\n", writer->index, BENCH_FILE);
+        exit(EXIT_FAILURE);
+    }
+    memset(buffer, 'a' + writer->index % 26, size);
+
+    pthread_barrier_wait(&start);
+    for (long i = 0; i < iterations; i++) {
+        if (tfsmWrite(mount, fd, buffer, size) != size) {
+            fprintf(stderr, "Error: writer %d failed to write\n", writer->index);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait(&start);
+
+    tfsmClose(mount, fd);
+    tfsUnmountHandle(mount);
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Has many writers, each with a session of its own, write to one file at
+ * once, reporting the throughput of each way they share it. Appends are
+ * checked to have lost nothing.
+ */
+static void benchWrite() {
+    char *names[] = { "own regions", "same region", "appends" };
+    writer_t *all = malloc(sizeof(writer_t) * writers);
+    long total = size * iterations * writers;
+    char *contents = malloc(total);
+    struct timespec began;
+    int fd;
+
+    if (all == NULL || contents == NULL) {
+        fprintf(stderr, "Error: failed to allocate writers\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(contents, 0, total);
+    pthread_barrier_init(&start, NULL, writers + 1);
+
+    for (int how = WRITE_OWN_REGION; how <= WRITE_APPEND; how++) {
+        long count[26] = { 0 };
+
+        /* the regions are there to be written over, appends start from nothing */
+        tfsDelete(BENCH_FILE);
+        if (tfsCreate(BENCH_FILE, 'f') != 0 || (fd = tfsOpen(BENCH_FILE, WRITE)) < 0 ||
+            (how != WRITE_APPEND && tfsWrite(fd, contents, total) != total) || tfsClose(fd) != 0) {
+            fprintf(stderr, "Error: failed to set up %s\n", BENCH_FILE);
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < writers; i++) {
+            all[i].index = i;
+            all[i].how = how;
+            if (pthread_create(&all[i].thread, NULL, writeFile, &all[i]) != 0) {
+                fprintf(stderr, "Error: failed to create writer\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        pthread_barrier_wait(&start);
+        clock_gettime(CLOCK_MONOTONIC, &began);
+        pthread_barrier_wait(&start);
+        report(names[how], elapsed(&began));
+        for (int i = 0; i < writers; i++) {
+            pthread_join(all[i].thread, NULL);
+        }
+
+        if (how == WRITE_APPEND) {
+            if ((fd = tfsOpen(BENCH_FILE, READ)) < 0 || tfsRead(fd, contents, total) != total) {
+                fprintf(stderr, "Error: appends lost bytes\n");
+                exit(EXIT_FAILURE);
+            }
+            for (long i = 0; i < total; i++) {
+                count[(contents[i] - 'a') % 26]++;
+            }
+            for (int i = 0; i < writers && i < 26; i++) {
+                if (count[i] != size * iterations * ((writers - i - 1) / 26 + 1)) {
+                    fprintf(stderr, "Error: appends of writer %d lost bytes\n", i);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            tfsClose(fd);
+        }
+    }
+
+    tfsDelete(BENCH_FILE);
+    pthread_barrier_destroy(&start);
+    free(contents);
+    free(all);
+}
+
+int main(int argc, char* argv[]) {
+    parseArgs(argc, argv);
+
+    if ((sharedMemory ? tfsMountShared(serverName) : tfsMount(serverName)) != 0) {
+        fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+        exit(EXIT_FAILURE);
+    }
+
+    /* the API reports every call on stdout, which would be measured too */
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "Error: cannot silence stdout\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(benchmark, "read") == 0) {
+        benchRead();
+    }
+    else {
+        benchWrite();
+    }
+
+    tfsUnmount();
+
+    exit(EXIT_SUCCESS);
+}
@@ -1,221 +1,2923 @@
+#define _GNU_SOURCE /* memfd_create */
 #include "tecnicofs-client-api.h"
+#include "../tecnicofs-protocol.h"
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <sys/un.h>
 #include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
 
 #define CLIENT_SOCKET_BASE_PATH "/tmp/client_socket_so_g55"
 #define SOCK_MAX_PATH_LEN 200
 
-char server_socket_path[SOCK_MAX_PATH_LEN];
-char clientSocketPath[SOCK_MAX_PATH_LEN] = "";
-int sockfd;
+/* retry policy when the server answers TECNICOFS_ERROR_BUSY */
+#define BUSY_MAX_RETRIES 10
+#define BUSY_BACKOFF_MIN_US 1000
+#define BUSY_BACKOFF_MAX_US 100000
+
+/* times the completion ring is checked before going to sleep on it */
+#define RING_SPIN 1000
+
+/* lookups cached by a mount, see tfsmEnableCache() */
+#define CACHE_BUCKETS 64
+#define CACHE_MAX_ENTRIES 1024
+
+/* events received for a mount's watches and not yet taken */
+#define EVENT_QUEUE 256
+
+/* a mount holding a delegation sends what it changed at least this often */
+#define DELEGATION_FLUSH_MS 200
+
+/* reads of at least this many bytes get them through a memfd, see tfsmReadMapped() */
+#define MAP_MIN_READ (64 * 1024)
+
+/* result of an operation the server carried out and failed */
+#define OPERATION_FAILED -1
+
+/* state of a slot of the table of requests in flight */
+#define SLOT_FREE 0
+#define SLOT_SENT 1  /* waiting for the reply */
+#define SLOT_RETRY 2 /* server was busy, to be sent again at retryAt */
+#define SLOT_DONE 3  /* reply received, waiting for tfsPoll/tfsWait */
+
+/*
+ * A request submitted to the server and not yet collected by the caller.
+ * The slot of a request is its id modulo TFS_MAX_INFLIGHT.
+ */
+typedef struct pending_request {
+    uint32_t id;
+    int state;
+    char *request; /* kept to be sent again while the server is busy */
+    int socket; /* server socket it is sent to */
+    int attempts;
+    useconds_t backoff;
+    struct timespec retryAt;
+    char *reply;
+    ssize_t replyLength;
+    char *leasePath;        /* normalized path of a leased lookup, or NULL */
+    int stale;              /* the path changed while the lookup was in flight */
+    struct timespec sentAt; /* the lease counts from here */
+    int passedFd;           /* descriptor that came with the reply, or -1 */
+} pending_request_t;
+
+/*
+ * A lookup answered by the server with a lease, valid until it expires or
+ * the server invalidates it.
+ */
+typedef struct cache_entry {
+    char *path; /* normalized */
+    int inumber;
+    struct timespec expires;
+    struct cache_entry *next;
+} cache_entry_t;
+
+/*
+ * What a mount holding a delegation knows of a path under it. Paths it
+ * neither changed nor looked up since the delegation was granted aren't
+ * known, and are asked to the server.
+ */
+typedef struct local_node {
+    char *path; /* normalized */
+    int present;
+    type nodeType;         /* T_NONE if the server didn't tell */
+    int inumber;           /* -1 until the server is asked */
+    int complete;          /* a directory whose every entry is known */
+    int entries;           /* entries known to be present */
+    unsigned long created; /* sequence number of its pending create, 0 if none */
+    struct local_node *next;
+} local_node_t;
+
+/*
+ * An operation carried out locally and not yet sent to the server.
+ */
+typedef struct pending_op {
+    unsigned long sequence;
+    uint8_t opcode;
+    uint8_t flags;
+    char *path;   /* normalized */
+    char *target; /* new path of a move, NULL otherwise */
+    struct pending_op *next;
+} pending_op_t;
+
+/*
+ * A subtree delegated to a mount, see tfsmDelegate(): what the mount
+ * knows of it and what it changed there. Guarded by the mount's
+ * delegationLock, except for stop, guarded by its lock.
+ */
+typedef struct delegation {
+    char path[MAX_FILE_NAME]; /* normalized */
+    struct tfs_mount *mount;
+    local_node_t *nodes[CACHE_BUCKETS];
+    unsigned long generation; /* bumped whenever the nodes are forgotten */
+    pending_op_t *pending, *lastPending;
+    unsigned long nextSequence;
+    pthread_t flusher;
+    int stop;
+    struct delegation *next; /* given back, its flusher not yet joined */
+} delegation_t;
+
+/*
+ * A mounted filesystem: one channel to the server and the requests in
+ * flight on it. Calls on a mount may come from any number of threads; the
+ * state below is guarded by lock. Threads waiting for replies take turns
+ * receiving them: one at a time sleeps on the channel and stores whatever
+ * arrives in its slot, the others wait on replied.
+ */
+struct tfs_mount {
+    int index; /* tells apart the mounts of a process */
+    char server_socket_path[SOCK_MAX_PATH_LEN];
+    char clientSocketPath[SOCK_MAX_PATH_LEN];
+    int sockfd;
+    int connected; /* session over a connection rather than datagrams */
+    /* the server's sockets, requests are spread over them */
+    struct sockaddr_un serv_addr[TFS_MAX_SOCKETS];
+    socklen_t servlen[TFS_MAX_SOCKETS];
+    int numberSockets;
+
+    /* shared-memory transport, set up by tfsMountShared() */
+    int shared;
+    void *sharedRegion;
+    tfs_ring_view_t submissions, completions;
+    int serverWake, clientWake;
+    int ringOutstanding; /* requests submitted whose reply wasn't taken from the ring */
+
+    pending_request_t inflight[TFS_MAX_INFLIGHT];
+    uint32_t nextSequence;
+    int nextSlot;
+
+    pthread_mutex_t lock;
+    pthread_cond_t replied; /* signalled once replies were stored */
+    int receiving;          /* a thread is waiting on the channel */
+
+    /* leased lookups, if enabled */
+    int caching;
+    cache_entry_t *cache[CACHE_BUCKETS];
+    int cacheEntries;
+    long cacheHits, cacheMisses;
+
+    /* events pushed for the mount's watches */
+    tfs_event_t events[EVENT_QUEUE];
+    int eventHead, eventCount;
+    int eventsOverflowed; /* some were dropped since the queue was last emptied */
+
+    /* subtree delegated to the mount; delegationLock is taken before lock */
+    pthread_mutex_t delegationLock;
+    delegation_t *delegation;
+    delegation_t *retired; /* given back, see reapDelegations() */
+    int recalled;          /* the server wants it back, guarded by lock */
+    long delegatedLocal, delegatedCancelled, delegatedFlushed, delegatedFailed;
+    long delegationCalls;  /* requests sent to answer an operation under it */
+};
+
+/* used by the calls that don't take a mount */
+tfs_mount_t defaultMount;
+int mountSequence = 0;
+
+/* operations added since tfsBatchBegin(), by each thread */
+__thread char batchFrame[TFS_MAX_FRAME];
+__thread int batchOps = 0;
 
 int setSockAddrUn(char *path, struct sockaddr_un *addr) {
     if (addr == NULL)
         return 0;
 
-    bzero((char *)addr, sizeof(struct sockaddr_un));
-    addr->sun_family = AF_UNIX;
-    strcpy(addr->sun_path, path);
+    bzero((char *)addr, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    return SUN_LEN(addr);
+}
+
+static int receiveReply(tfs_mount_t *mount);
+static void waitReply(tfs_mount_t *mount, int timeout);
+static int delegatedCall(tfs_mount_t *mount, uint8_t opcode, uint8_t flags, char *path1, char *path2, int *result);
+static void settleDelegation(tfs_mount_t *mount, char *frame);
+
+/*
+ * Locks a mount's state.
+ */
+static void mountLock(tfs_mount_t *mount) {
+    if (pthread_mutex_lock(&mount->lock) != 0) {
+        fprintf(stderr, "client: failed to lock mount\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void mountUnlock(tfs_mount_t *mount) {
+    if (pthread_mutex_unlock(&mount->lock) != 0) {
+        fprintf(stderr, "client: failed to unlock mount\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Stores every reply already received, waking the threads waiting for
+ * them. The mount must be locked.
+ */
+static void drainReplies(tfs_mount_t *mount) {
+    int n = 0;
+
+    while (receiveReply(mount)) {
+        n++;
+    }
+    if (n > 0 && pthread_cond_broadcast(&mount->replied) != 0) {
+        fprintf(stderr, "client: failed to signal replies\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Hands a request to the server through the submission ring, signalling
+ * the server if it went idle. While the rings are full, replies are taken
+ * off the completion ring so the server can go on. The mount is locked.
+ */
+static void ringSubmit(tfs_mount_t *mount, char *request, size_t size) {
+    int ret = 0;
+
+    while (mount->ringOutstanding >= TFS_RING_COMPLETIONS || (ret = tfs_ring_push(&mount->submissions, request, size)) < 0) {
+        int n = mount->ringOutstanding;
+
+        drainReplies(mount);
+        /* short naps: the thread receiving may take the wakeup meant for this one */
+        if (mount->ringOutstanding == n) {
+            waitReply(mount, 1);
+        }
+    }
+    mount->ringOutstanding++;
+
+    if (ret == 1) {
+        uint64_t one = 1;
+
+        if (write(mount->serverWake, &one, sizeof(one)) < 0) {
+            perror("client: eventfd write error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Sends a request to the server. The mount is locked.
+ */
+static void sendRequest(tfs_mount_t *mount, pending_request_t *slot) {
+    /* a memfd can only come back on the session socket */
+    if (mount->shared && slot->request[offsetof(tfs_header_t, opcode)] != TFS_OP_MAP) {
+        ringSubmit(mount, slot->request, tfs_frame_size(slot->request));
+    }
+    else if (sendto(mount->sockfd, slot->request, tfs_frame_size(slot->request), 0,
+        mount->connected ? NULL : (struct sockaddr *)&mount->serv_addr[slot->socket],
+        mount->connected ? 0 : mount->servlen[slot->socket]) < 0) {
+        perror("client: sendto error");
+        exit(EXIT_FAILURE);
+    }
+    slot->state = SLOT_SENT;
+}
+
+/*
+ * Releases a slot once its reply has been collected.
+ */
+static void releaseSlot(pending_request_t *slot) {
+    free(slot->request);
+    free(slot->reply);
+    free(slot->leasePath);
+    slot->request = NULL;
+    slot->reply = NULL;
+    slot->leasePath = NULL;
+    if (slot->passedFd >= 0) {
+        close(slot->passedFd);
+        slot->passedFd = -1;
+    }
+    slot->state = SLOT_FREE;
+}
+
+static unsigned long hashPath(char *path) {
+    unsigned long hash = 5381;
+
+    for (char *c = path; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    return hash % CACHE_BUCKETS;
+}
+
+/*
+ * Finds the cached lookup of a normalized path, dropping it if it expired.
+ * The mount is locked.
+ * Returns: the entry, or NULL if the path isn't cached
+ */
+static cache_entry_t *cacheFind(tfs_mount_t *mount, char *path) {
+    cache_entry_t **link = &mount->cache[hashPath(path)];
+    struct timespec now;
+
+    for (; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) == 0)
+            break;
+    }
+    if (*link == NULL) {
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > (*link)->expires.tv_sec ||
+        (now.tv_sec == (*link)->expires.tv_sec && now.tv_nsec >= (*link)->expires.tv_nsec)) {
+        cache_entry_t *entry = *link;
+
+        *link = entry->next;
+        free(entry->path);
+        free(entry);
+        mount->cacheEntries--;
+        return NULL;
+    }
+    return *link;
+}
+
+/*
+ * Caches the result of a leased lookup, for TFS_LEASE_MS from when it was
+ * sent. The mount is locked.
+ */
+static void cacheInsert(tfs_mount_t *mount, char *path, int inumber, struct timespec *sentAt) {
+    cache_entry_t *entry = cacheFind(mount, path);
+
+    if (entry == NULL) {
+        if (mount->cacheEntries == CACHE_MAX_ENTRIES || (entry = malloc(sizeof(cache_entry_t))) == NULL) {
+            return;
+        }
+        if ((entry->path = strdup(path)) == NULL) {
+            free(entry);
+            return;
+        }
+        entry->next = mount->cache[hashPath(path)];
+        mount->cache[hashPath(path)] = entry;
+        mount->cacheEntries++;
+    }
+    entry->inumber = inumber;
+    entry->expires.tv_sec = sentAt->tv_sec + TFS_LEASE_MS / 1000;
+    entry->expires.tv_nsec = sentAt->tv_nsec + (TFS_LEASE_MS % 1000) * 1000000;
+    if (entry->expires.tv_nsec >= 1000000000) {
+        entry->expires.tv_sec++;
+        entry->expires.tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * Keeps an event pushed by the server until it is taken with
+ * tfsmNextEvent(), merging it into a waiting one of the same path, or
+ * dropping it if too many are waiting. The mount is locked.
+ */
+static void queueEvent(tfs_mount_t *mount, tfs_request_t *change) {
+    char *target = change->npaths > 1 ? change->paths[1] : "";
+    tfs_event_t *event;
+
+    for (int i = 0; i < mount->eventCount; i++) {
+        event = &mount->events[(mount->eventHead + i) % EVENT_QUEUE];
+        if (event->watch == (int)change->id && strcmp(event->path, change->paths[0]) == 0 &&
+            strcmp(event->target, target) == 0) {
+            event->mask |= change->flags;
+            return;
+        }
+    }
+
+    if (mount->eventCount == EVENT_QUEUE) {
+        mount->eventsOverflowed = 1;
+        return;
+    }
+    event = &mount->events[(mount->eventHead + mount->eventCount++) % EVENT_QUEUE];
+    event->watch = change->id;
+    event->mask = change->flags;
+    snprintf(event->path, sizeof(event->path), "%s", change->paths[0]);
+    snprintf(event->target, sizeof(event->target), "%s", target);
+}
+
+/*
+ * Takes the oldest event waiting, or reports the ones dropped once the
+ * rest were taken. The mount is locked.
+ * Returns: 1 if an event was stored, 0 if there are none
+ */
+static int takeEvent(tfs_mount_t *mount, tfs_event_t *event) {
+    if (mount->eventCount > 0) {
+        *event = mount->events[mount->eventHead];
+        mount->eventHead = (mount->eventHead + 1) % EVENT_QUEUE;
+        mount->eventCount--;
+        return 1;
+    }
+    if (mount->eventsOverflowed) {
+        mount->eventsOverflowed = 0;
+        event->watch = 0;
+        event->mask = TECNICOFS_EVENT_OVERFLOW;
+        event->path[0] = event->target[0] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Forgets the cached lookups of a path and of everything under it, and
+ * keeps leased lookups of them still in flight from being cached. The
+ * mount is locked.
+ * Input:
+ *  - path: normalized path the server reported as changed; NULL for all
+ */
+static void cacheInvalidate(tfs_mount_t *mount, char *path) {
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        for (cache_entry_t **link = &mount->cache[i]; *link != NULL; ) {
+            cache_entry_t *entry = *link;
+
+            if (path != NULL && !tfs_path_under(entry->path, path)) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            free(entry->path);
+            free(entry);
+            mount->cacheEntries--;
+        }
+    }
+
+    for (int i = 0; i < TFS_MAX_INFLIGHT; i++) {
+        pending_request_t *slot = &mount->inflight[i];
+
+        if (slot->state != SLOT_FREE && slot->leasePath != NULL && (path == NULL || tfs_path_under(slot->leasePath, path))) {
+            slot->stale = 1;
+        }
+    }
+}
+
+/*
+ * Receives a message from the session socket, along with the descriptor
+ * passed with it, if any.
+ * Input:
+ *  - passedFd: set to the descriptor, or -1
+ * Returns: as recv()
+ */
+static ssize_t receiveMessage(tfs_mount_t *mount, char *buffer, size_t size, int *passedFd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { buffer, size };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    ssize_t c;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *passedFd = -1;
+
+    c = recvmsg(mount->sockfd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    for (cmsg = c >= 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(passedFd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return c;
+}
+
+/*
+ * Receives one reply, if one arrived, and stores it in its request's slot.
+ * A busy reply schedules the request to be sent again after an
+ * exponential backoff (with some jitter so clients don't retry in
+ * lockstep), up to BUSY_MAX_RETRIES times. The mount is locked.
+ * Returns: 1 if a reply was received, 0 otherwise
+ */
+static int receiveReply(tfs_mount_t *mount) {
+    char reply[TFS_MAX_FRAME];
+    pending_request_t *slot;
+    uint32_t id;
+    int32_t res;
+    ssize_t c = 0;
+    int passedFd = -1;
+
+    /* replies come through the completion ring, the session only brings large reads and tells if the server went away */
+    if (mount->shared && mount->ringOutstanding > 0) {
+        c = tfs_ring_pop(&mount->completions, reply, sizeof(reply));
+    }
+    if (c != 0) {
+        mount->ringOutstanding--;
+    }
+    else {
+        c = receiveMessage(mount, reply, sizeof(reply), &passedFd);
+    }
+
+    /* only the reply to a large read brings a descriptor */
+    if (passedFd >= 0 && (c < (ssize_t)sizeof(tfs_header_t) || reply[offsetof(tfs_header_t, opcode)] != TFS_OP_MAP)) {
+        close(passedFd);
+        passedFd = -1;
+    }
+
+    if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (c < 0) {
+        perror("client: recvmsg error");
+        exit(EXIT_FAILURE);
+    }
+    if (c == 0 && mount->connected) {
+        fprintf(stderr, "client: server closed the connection\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* changes to leased paths are pushed by the server */
+    if (c >= (ssize_t)sizeof(tfs_header_t) && reply[offsetof(tfs_header_t, opcode)] == TFS_OP_INVALIDATE) {
+        tfs_request_t invalidation;
+
+        if (tfs_decode_request(reply, c, &invalidation) != 0 || invalidation.npaths != 1) {
+            fprintf(stderr, "client: invalid notification from server\n");
+            return 1;
+        }
+        cacheInvalidate(mount, invalidation.paths[0]);
+        return 1;
+    }
+
+    /* as are changes to watched paths */
+    if (c >= (ssize_t)sizeof(tfs_header_t) && reply[offsetof(tfs_header_t, opcode)] == TFS_OP_EVENT) {
+        tfs_request_t change;
+
+        if (tfs_decode_request(reply, c, &change) != 0 || change.npaths < 1) {
+            fprintf(stderr, "client: invalid notification from server\n");
+            return 1;
+        }
+        queueEvent(mount, &change);
+        return 1;
+    }
+
+    /* and the server wanting a delegated subtree back */
+    if (c >= (ssize_t)sizeof(tfs_header_t) && reply[offsetof(tfs_header_t, opcode)] == TFS_OP_RECALL) {
+        mount->recalled = 1;
+        return 1;
+    }
+
+    if (tfs_decode_reply(reply, c, &id, &res) != 0) {
+        fprintf(stderr, "client: invalid reply from server\n");
+        return 1;
+    }
+
+    /* skip replies nobody is waiting for anymore */
+    slot = &mount->inflight[id % TFS_MAX_INFLIGHT];
+    if (slot->state != SLOT_SENT || slot->id != id) {
+        if (passedFd >= 0) {
+            close(passedFd);
+        }
+        return 1;
+    }
+
+    if (res == TECNICOFS_ERROR_BUSY && ++slot->attempts < BUSY_MAX_RETRIES) {
+        useconds_t delay = slot->backoff + rand() % slot->backoff;
+
+        clock_gettime(CLOCK_MONOTONIC, &slot->retryAt);
+        slot->retryAt.tv_sec += (slot->retryAt.tv_nsec / 1000 + delay) / 1000000;
+        slot->retryAt.tv_nsec = ((slot->retryAt.tv_nsec / 1000 + delay) % 1000000) * 1000;
+        if (slot->backoff < BUSY_BACKOFF_MAX_US) {
+            slot->backoff *= 2;
+        }
+        slot->state = SLOT_RETRY;
+        return 1;
+    }
+
+    slot->reply = malloc(c);
+    if (slot->reply == NULL) {
+        fprintf(stderr, "client: failed to allocate reply\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(slot->reply, reply, c);
+    slot->replyLength = c;
+    slot->passedFd = passedFd;
+    slot->state = SLOT_DONE;
+    return 1;
+}
+
+/*
+ * Sends again every busy request whose backoff has expired. The mount is
+ * locked.
+ * Returns: milliseconds until the next retry is due, or -1 if none is
+ */
+static int resendDue(tfs_mount_t *mount) {
+    struct timespec now;
+    int next = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < TFS_MAX_INFLIGHT; i++) {
+        pending_request_t *slot = &mount->inflight[i];
+        long ms;
+
+        if (slot->state != SLOT_RETRY)
+            continue;
+
+        ms = (slot->retryAt.tv_sec - now.tv_sec) * 1000 + (slot->retryAt.tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0) {
+            sendRequest(mount, slot);
+        }
+        else if (next < 0 || ms < next) {
+            next = ms;
+        }
+    }
+    return next;
+}
+
+/*
+ * Picks the server socket a request is sent to: requests on the same
+ * subtree go to the same socket, others are spread by the client's pid
+ * (and mount).
+ * Input:
+ *  - path: path the request operates on, or NULL
+ * Returns: index of the socket
+ */
+static int pickSocket(tfs_mount_t *mount, char *path) {
+    unsigned long hash = 5381;
+
+    if (path == NULL) {
+        return (getpid() + mount->index) % mount->numberSockets;
+    }
+
+    /* hash the first component */
+    for (char *c = path; *c != '\0'; c++) {
+        if (*c == '/' && c != path && *(c - 1) != '/')
+            break;
+        if (*c != '/')
+            hash = hash * 33 + (unsigned char)*c;
+    }
+    return hash % mount->numberSockets;
+}
+
+/*
+ * Submits a request frame, keeping what a leased lookup needs to cache
+ * its result.
+ * Input:
+ *  - leasePath: normalized path of a leased lookup, NULL otherwise
+ */
+static int submitFrame(tfs_mount_t *mount, char *frame, char *path, char *leasePath) {
+    pending_request_t *slot = NULL;
+    int i;
+
+    mountLock(mount);
+
+    /* collect what already arrived, so the server is never blocked on us */
+    drainReplies(mount);
+    resendDue(mount);
+
+    for (i = 0; i < TFS_MAX_INFLIGHT; i++) {
+        if (mount->inflight[(mount->nextSlot + i) % TFS_MAX_INFLIGHT].state == SLOT_FREE) {
+            slot = &mount->inflight[(mount->nextSlot + i) % TFS_MAX_INFLIGHT];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        mountUnlock(mount);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    mount->nextSlot = (mount->nextSlot + i + 1) % TFS_MAX_INFLIGHT;
+
+    /* ids stay positive and map back to their slot */
+    slot->id = (mount->nextSequence++ % (INT32_MAX / TFS_MAX_INFLIGHT)) * TFS_MAX_INFLIGHT + (slot - mount->inflight);
+    slot->socket = pickSocket(mount, path);
+    slot->attempts = 0;
+    slot->backoff = BUSY_BACKOFF_MIN_US;
+    slot->reply = NULL;
+    slot->stale = 0;
+    slot->passedFd = -1;
+    slot->leasePath = leasePath != NULL ? strdup(leasePath) : NULL;
+    slot->request = malloc(tfs_frame_size(frame));
+    if (slot->request == NULL || (leasePath != NULL && slot->leasePath == NULL)) {
+        fprintf(stderr, "client: failed to allocate request\n");
+        exit(EXIT_FAILURE);
+    }
+    tfs_frame_set_id(frame, slot->id);
+    memcpy(slot->request, frame, tfs_frame_size(frame));
+
+    clock_gettime(CLOCK_MONOTONIC, &slot->sentAt);
+    sendRequest(mount, slot);
+    mountUnlock(mount);
+    return slot->id;
+}
+
+/*
+ * Submits a request frame without waiting for its reply. With a
+ * delegation held, the changes pending on it are sent first.
+ * Input:
+ *  - frame: request to be sent; its id is set here
+ *  - path: path used to pick the server socket, or NULL
+ * Returns:
+ *  a ticket to collect the reply with, or TECNICOFS_ERROR_OTHER if too
+ *  many requests are in flight
+ */
+int tfsmSubmitFrame(tfs_mount_t *mount, char *frame, char *path) {
+    settleDelegation(mount, frame);
+    return submitFrame(mount, frame, path, NULL);
+}
+
+int tfsSubmitFrame(char *frame, char *path) {
+    return tfsmSubmitFrame(&defaultMount, frame, path);
+}
+
+/*
+ * Finds the slot of a ticket. The mount is locked.
+ * Returns: the slot, or NULL if the ticket is unknown
+ */
+static pending_request_t *ticketSlot(tfs_mount_t *mount, int ticket) {
+    pending_request_t *slot;
+
+    if (ticket <= 0) {
+        return NULL;
+    }
+    slot = &mount->inflight[ticket % TFS_MAX_INFLIGHT];
+    if (slot->state == SLOT_FREE || slot->id != (uint32_t)ticket) {
+        return NULL;
+    }
+    return slot;
+}
+
+/*
+ * Sleeps until a reply may have arrived. With the shared-memory transport
+ * the completion ring is checked for a while first, and the server is
+ * only asked to signal once the client goes to sleep.
+ * Input:
+ *  - timeout: longest time to sleep in milliseconds, -1 for no limit
+ */
+static void waitReply(tfs_mount_t *mount, int timeout) {
+    struct pollfd pfds[2] = { { mount->sockfd, POLLIN, 0 }, { mount->clientWake, POLLIN, 0 } };
+    uint64_t wakeups;
+
+    if (mount->shared) {
+        for (int i = 0; i < RING_SPIN; i++) {
+            if (tfs_ring_ready(&mount->completions))
+                return;
+        }
+        if (!tfs_ring_prepare_wait(&mount->completions))
+            return;
+    }
+
+    if (poll(pfds, mount->shared ? 2 : 1, timeout) < 0 && errno != EINTR) {
+        perror("client: poll error");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mount->shared) {
+        tfs_ring_end_wait(&mount->completions);
+        if (read(mount->clientWake, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+            perror("client: eventfd read error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Blocks until the reply of a ticket has arrived. If no other thread is
+ * receiving, the caller does it for everyone, until its own reply is in.
+ * The mount is locked, and unlocked while sleeping.
+ * Returns: the slot holding the reply, or NULL if the ticket is unknown
+ */
+static pending_request_t *waitSlot(tfs_mount_t *mount, int ticket) {
+    pending_request_t *slot = ticketSlot(mount, ticket);
+
+    while (slot != NULL && slot->state != SLOT_DONE) {
+        int timeout;
+
+        if (mount->receiving) {
+            if (pthread_cond_wait(&mount->replied, &mount->lock) != 0) {
+                fprintf(stderr, "client: failed to wait for replies\n");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+
+        /* sleep until a reply arrives or a busy request is due again */
+        mount->receiving = 1;
+        timeout = resendDue(mount);
+        mountUnlock(mount);
+        waitReply(mount, timeout);
+        mountLock(mount);
+        mount->receiving = 0;
+
+        /* wakes up the others too, one of them takes over receiving */
+        drainReplies(mount);
+        if (pthread_cond_broadcast(&mount->replied) != 0) {
+            fprintf(stderr, "client: failed to signal replies\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return slot;
+}
+
+/*
+ * Checks whether the reply of a ticket has arrived, without blocking.
+ * Input:
+ *  - ticket: returned by one of the tfsSubmit functions
+ *  - result: where to store the operation's result
+ * Returns:
+ *  1 if the operation completed (and the ticket is released), 0 if it is
+ *  still in flight, TECNICOFS_ERROR_OTHER if the ticket is unknown
+ */
+int tfsmPoll(tfs_mount_t *mount, int ticket, int *result) {
+    pending_request_t *slot;
+    uint32_t id;
+    int32_t res;
+
+    mountLock(mount);
+    if ((slot = ticketSlot(mount, ticket)) == NULL) {
+        mountUnlock(mount);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    drainReplies(mount);
+    resendDue(mount);
+
+    if (slot->state != SLOT_DONE) {
+        mountUnlock(mount);
+        return 0;
+    }
+    tfs_decode_reply(slot->reply, slot->replyLength, &id, &res);
+    *result = res;
+    releaseSlot(slot);
+    mountUnlock(mount);
+    return 1;
+}
+
+int tfsPoll(int ticket, int *result) {
+    return tfsmPoll(&defaultMount, ticket, result);
+}
+
+/*
+ * Waits for the reply of a ticket, releasing the ticket.
+ * Input:
+ *  - ticket: returned by one of the tfsSubmit functions
+ * Returns:
+ *  the operation's result, or TECNICOFS_ERROR_OTHER if the ticket is unknown
+ */
+int tfsmWait(tfs_mount_t *mount, int ticket) {
+    pending_request_t *slot;
+    uint32_t id;
+    int32_t res;
+
+    mountLock(mount);
+    if ((slot = waitSlot(mount, ticket)) == NULL) {
+        mountUnlock(mount);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    tfs_decode_reply(slot->reply, slot->replyLength, &id, &res);
+    releaseSlot(slot);
+    mountUnlock(mount);
+    return res;
+}
+
+int tfsWait(int ticket) {
+    return tfsmWait(&defaultMount, ticket);
+}
+
+/*
+ * Builds a request frame for one operation.
+ * Input:
+ *  - frame: buffer of TFS_MAX_FRAME bytes
+ *  - opcode: operation to perform
+ *  - flags: operation flags (node type for create)
+ *  - dir: directory handle the paths are relative to, or TFS_NO_DIR
+ *  - path1, path2: paths the operation takes, path2 may be NULL
+ * Returns: 0, or TECNICOFS_ERROR_OTHER if the paths don't fit
+ */
+static int buildRequest(char *frame, uint8_t opcode, uint8_t flags, int dir, char *path1, char *path2) {
+    tfs_frame_begin(frame, opcode, dir == TFS_NO_DIR ? flags : flags | TFS_REQUEST_AT, 0);
+
+    if ((dir != TFS_NO_DIR && tfs_frame_put_int(frame, TFS_MAX_FRAME, dir) != 0) ||
+        tfs_frame_put_path(frame, TFS_MAX_FRAME, path1) != 0 ||
+        (path2 != NULL && tfs_frame_put_path(frame, TFS_MAX_FRAME, path2) != 0)) {
+        fprintf(stderr, "client: path too long\n");
+        return TECNICOFS_ERROR_OTHER;
+    }
+    return 0;
+}
+
+int tfsBuildRequest(char *frame, uint8_t opcode, uint8_t flags, char *path1, char *path2) {
+    return buildRequest(frame, opcode, flags, TFS_NO_DIR, path1, path2);
+}
+
+/*
+ * Submits one operation, its paths relative to a directory handle.
+ * A relative path says nothing about where it lands, so the socket is
+ * picked as for a request without a path.
+ */
+static int submitAt(tfs_mount_t *mount, uint8_t opcode, uint8_t flags, int dir, char *path1, char *path2) {
+    char request[TFS_MAX_FRAME];
+
+    if (buildRequest(request, opcode, flags, dir, path1, path2) != 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    return tfsmSubmitFrame(mount, request, dir == TFS_NO_DIR ? path1 : NULL);
+}
+
+/*
+ * Submits one operation without waiting for it.
+ * Returns: a ticket, or a negative error
+ */
+int tfsmSubmit(tfs_mount_t *mount, uint8_t opcode, uint8_t flags, char *path1, char *path2) {
+    return submitAt(mount, opcode, flags, TFS_NO_DIR, path1, path2);
+}
+
+int tfsSubmit(uint8_t opcode, uint8_t flags, char *path1, char *path2) {
+    return tfsmSubmit(&defaultMount, opcode, flags, path1, path2);
+}
+
+/*
+ * Performs one operation on the server, its paths relative to a directory
+ * handle.
+ */
+static int callAt(tfs_mount_t *mount, uint8_t opcode, uint8_t flags, int dir, char *path1, char *path2) {
+    int ticket = submitAt(mount, opcode, flags, dir, path1, path2);
+    int res;
+
+    if (ticket < 0) {
+        return ticket;
+    }
+    res = tfsmWait(mount, ticket);
+    printf("Received %d from server.\n", res);
+
+    return res;
+}
+
+/*
+ * Performs one operation on the server.
+ * Input:
+ *  - opcode: operation to perform
+ *  - flags: operation flags (node type for create)
+ *  - path1, path2: paths the operation takes, path2 may be NULL
+ * Returns:
+ *  the operation's result
+ */
+int tfsmCall(tfs_mount_t *mount, uint8_t opcode, uint8_t flags, char *path1, char *path2) {
+    return callAt(mount, opcode, flags, TFS_NO_DIR, path1, path2);
+}
+
+int tfsCall(uint8_t opcode, uint8_t flags, char *path1, char *path2) {
+    return tfsmCall(&defaultMount, opcode, flags, path1, path2);
+}
+
+/*
+ * Translates the node type used by the API to the one sent to the server.
+ * Returns: T_FILE, T_DIRECTORY or T_NONE if invalid
+ */
+type tfsNodeType(char nodeType) {
+    switch (nodeType) {
+        case 'f':
+            return T_FILE;
+        case 'd':
+            return T_DIRECTORY;
+        default:
+            return T_NONE;
+    }
+}
+
+int tfsmCreate(tfs_mount_t *mount, char *filename, char nodeType) {
+    int res;
+
+    if (tfsNodeType(nodeType) == T_NONE) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    if (delegatedCall(mount, TFS_OP_CREATE, tfsNodeType(nodeType), filename, NULL, &res)) {
+        return res;
+    }
+    return tfsmCall(mount, TFS_OP_CREATE, tfsNodeType(nodeType), filename, NULL);
+}
+
+int tfsmDelete(tfs_mount_t *mount, char *path) {
+    int res;
+
+    if (delegatedCall(mount, TFS_OP_DELETE, 0, path, NULL, &res)) {
+        return res;
+    }
+    return tfsmCall(mount, TFS_OP_DELETE, 0, path, NULL);
+}
+
+int tfsmMove(tfs_mount_t *mount, char *from, char *to) {
+    int res;
+
+    if (delegatedCall(mount, TFS_OP_MOVE, 0, from, to, &res)) {
+        return res;
+    }
+    return tfsmCall(mount, TFS_OP_MOVE, 0, from, to);
+}
+
+/*
+ * Opens a handle on a directory. Operations given the handle take paths
+ * relative to it, which the server resolves from the directory instead of
+ * from the root. The handle follows the directory when it is moved and
+ * goes stale once it is deleted; it needs no closing.
+ * Input:
+ *  - dir: handle the path is relative to, or TFS_NO_DIR
+ * Returns:
+ *  the handle (never negative), or a negative error
+ */
+int tfsmOpenDirAt(tfs_mount_t *mount, int dir, char *path) {
+    return callAt(mount, TFS_OP_OPENDIR, 0, dir, path, NULL);
+}
+
+int tfsmOpenDir(tfs_mount_t *mount, char *path) {
+    return tfsmOpenDirAt(mount, TFS_NO_DIR, path);
+}
+
+/*
+ * Operations on paths relative to a directory handle. They fail with
+ * TECNICOFS_ERROR_STALE_HANDLE once the directory is gone. Lookups through
+ * a handle are never answered from the cache.
+ */
+int tfsmCreateAt(tfs_mount_t *mount, int dir, char *name, char nodeType) {
+    if (tfsNodeType(nodeType) == T_NONE) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    return callAt(mount, TFS_OP_CREATE, tfsNodeType(nodeType), dir, name, NULL);
+}
+
+int tfsmDeleteAt(tfs_mount_t *mount, int dir, char *name) {
+    return callAt(mount, TFS_OP_DELETE, 0, dir, name, NULL);
+}
+
+int tfsmLookupAt(tfs_mount_t *mount, int dir, char *name) {
+    return callAt(mount, TFS_OP_LOOKUP, 0, dir, name, NULL);
+}
+
+int tfsmMoveAt(tfs_mount_t *mount, int dir, char *from, char *to) {
+    return callAt(mount, TFS_OP_MOVE, 0, dir, from, to);
+}
+
+/*
+ * Looks up a path. With caching enabled the lookup is answered locally
+ * while the server's lease on it holds, and asks for a lease otherwise.
+ * Under a delegated subtree it is answered from what the mount knows.
+ */
+int tfsmLookup(tfs_mount_t *mount, char *path) {
+    char normalized[TFS_MAX_FRAME], request[TFS_MAX_FRAME];
+    pending_request_t *slot;
+    cache_entry_t *entry;
+    int ticket;
+    uint32_t id;
+    int32_t res;
+
+    if (delegatedCall(mount, TFS_OP_LOOKUP, 0, path, NULL, &ticket)) {
+        return ticket;
+    }
+    if (!mount->caching || tfs_path_normalize(normalized, sizeof(normalized), path) != 0) {
+        return tfsmCall(mount, TFS_OP_LOOKUP, 0, path, NULL);
+    }
+
+    /* invalidations already sent by the server must be seen first */
+    mountLock(mount);
+    drainReplies(mount);
+    if ((entry = cacheFind(mount, normalized)) != NULL) {
+        res = entry->inumber;
+        mount->cacheHits++;
+        mountUnlock(mount);
+        printf("Received %d from cache.\n", res);
+        return res;
+    }
+    mount->cacheMisses++;
+    mountUnlock(mount);
+
+    if (tfsBuildRequest(request, TFS_OP_LOOKUP, TFS_LOOKUP_LEASE, path, NULL) != 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    if ((ticket = submitFrame(mount, request, path, normalized)) < 0) {
+        return ticket;
+    }
+
+    mountLock(mount);
+    if ((slot = waitSlot(mount, ticket)) == NULL) {
+        mountUnlock(mount);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    tfs_decode_reply(slot->reply, slot->replyLength, &id, &res);
+
+    /* a lookup invalidated while in flight may have seen the old tree */
+    if ((slot->reply[offsetof(tfs_header_t, flags)] & TFS_RESULT_LEASE) && res >= 0 && !slot->stale) {
+        cacheInsert(mount, normalized, res, &slot->sentAt);
+    }
+    releaseSlot(slot);
+    mountUnlock(mount);
+    printf("Received %d from server.\n", res);
+
+    return res;
+}
+
+int tfsmPrint(tfs_mount_t *mount, char *outputFile) {
+    return tfsmCall(mount, TFS_OP_PRINT, 0, outputFile, NULL);
+}
+
+int tfsmSubmitCreate(tfs_mount_t *mount, char *filename, char nodeType) {
+    if (tfsNodeType(nodeType) == T_NONE) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    return tfsmSubmit(mount, TFS_OP_CREATE, tfsNodeType(nodeType), filename, NULL);
+}
+
+int tfsmSubmitDelete(tfs_mount_t *mount, char *path) {
+    return tfsmSubmit(mount, TFS_OP_DELETE, 0, path, NULL);
+}
+
+int tfsmSubmitMove(tfs_mount_t *mount, char *from, char *to) {
+    return tfsmSubmit(mount, TFS_OP_MOVE, 0, from, to);
+}
+
+int tfsmSubmitLookup(tfs_mount_t *mount, char *path) {
+    return tfsmSubmit(mount, TFS_OP_LOOKUP, 0, path, NULL);
+}
+
+int tfsmSubmitPrint(tfs_mount_t *mount, char *outputFile) {
+    return tfsmSubmit(mount, TFS_OP_PRINT, 0, outputFile, NULL);
+}
+
+int tfsCreate(char *filename, char nodeType) {
+    return tfsmCreate(&defaultMount, filename, nodeType);
+}
+
+int tfsDelete(char *path) {
+    return tfsmDelete(&defaultMount, path);
+}
+
+int tfsMove(char *from, char *to) {
+    return tfsmMove(&defaultMount, from, to);
+}
+
+int tfsLookup(char *path) {
+    return tfsmLookup(&defaultMount, path);
+}
+
+int tfsPrint(char *outputFile) {
+    return tfsmPrint(&defaultMount, outputFile);
+}
+
+int tfsOpenDir(char *path) {
+    return tfsmOpenDir(&defaultMount, path);
+}
+
+int tfsOpenDirAt(int dir, char *path) {
+    return tfsmOpenDirAt(&defaultMount, dir, path);
+}
+
+int tfsCreateAt(int dir, char *name, char nodeType) {
+    return tfsmCreateAt(&defaultMount, dir, name, nodeType);
+}
+
+int tfsDeleteAt(int dir, char *name) {
+    return tfsmDeleteAt(&defaultMount, dir, name);
+}
+
+int tfsLookupAt(int dir, char *name) {
+    return tfsmLookupAt(&defaultMount, dir, name);
+}
+
+int tfsMoveAt(int dir, char *from, char *to) {
+    return tfsmMoveAt(&defaultMount, dir, from, to);
+}
+
+/*
+ * Opens a file for reading, writing or both, through the mount's session.
+ * Reads and writes through the descriptor don't look the path up again,
+ * each starting where the last one stopped; the file can't be deleted
+ * until it is closed. Closing the session closes its files.
+ * Input:
+ *  - mode: READ, WRITE or RW
+ * Returns:
+ *  the descriptor (never negative), or a negative error
+ */
+int tfsmOpen(tfs_mount_t *mount, char *path, permission mode) {
+    return callAt(mount, TFS_OP_OPEN, mode, TFS_NO_DIR, path, NULL);
+}
+
+/*
+ * Opens a file for appending: each write through the descriptor goes to
+ * the end of the file, as it is then. Appends from many clients at once
+ * each get their own bytes, and are carried out at once.
+ * Returns: see tfsmOpen()
+ */
+int tfsmOpenAppend(tfs_mount_t *mount, char *path) {
+    return callAt(mount, TFS_OP_OPEN, WRITE | TFS_OPEN_APPEND, TFS_NO_DIR, path, NULL);
+}
+
+/*
+ * Performs one operation on an open file.
+ * Input:
+ *  - fd: descriptor
+ *  - data: bytes to write, or where to store the bytes read
+ *  - count: how many, at most TFS_MAX_IO (TFS_MAX_MAP for a large read)
+ *  - memfd: for a large read, set to the memfd holding the bytes, or -1
+ * Returns:
+ *  the operation's result
+ */
+static int fileCall(tfs_mount_t *mount, uint8_t opcode, int fd, char *data, size_t count, int *memfd) {
+    char request[TFS_MAX_FRAME];
+    pending_request_t *slot;
+    int ticket;
+    uint32_t id;
+    int32_t res;
+
+    tfs_frame_begin(request, opcode, 0, 0);
+    tfs_frame_put_int(request, sizeof(request), fd);
+    if (opcode == TFS_OP_READ || opcode == TFS_OP_MAP) {
+        tfs_frame_put_int(request, sizeof(request), count);
+    }
+    else if (opcode == TFS_OP_WRITE) {
+        tfs_frame_put(request, sizeof(request), data, count);
+    }
+
+    if ((ticket = tfsmSubmitFrame(mount, request, NULL)) < 0) {
+        return ticket;
+    }
+
+    mountLock(mount);
+    if ((slot = waitSlot(mount, ticket)) == NULL) {
+        mountUnlock(mount);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    tfs_decode_reply(slot->reply, slot->replyLength, &id, &res);
+
+    /* the bytes read follow the result */
+    if (opcode == TFS_OP_READ && res > 0) {
+        size_t carried = slot->replyLength - sizeof(tfs_header_t) - sizeof(res);
+
+        if ((size_t)res > carried) {
+            res = carried;
+        }
+        memcpy(data, slot->reply + sizeof(tfs_header_t) + sizeof(res), res);
+    }
+    /* or come in the memfd passed along */
+    else if (opcode == TFS_OP_MAP) {
+        *memfd = slot->passedFd;
+        slot->passedFd = -1;
+    }
+    releaseSlot(slot);
+    mountUnlock(mount);
+    return res;
+}
+
+/*
+ * Reads bytes of an open file in the memfd the server passes, mapping it.
+ * Returns: see tfsmReadMapped()
+ */
+static int mapRead(tfs_mount_t *mount, int fd, int len, tfs_mapping_t *mapping) {
+    int memfd = -1, res;
+
+    mapping->data = NULL;
+    mapping->size = 0;
+    if (len < 0 || len > TFS_MAX_MAP) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    if ((res = fileCall(mount, TFS_OP_MAP, fd, NULL, len, &memfd)) > 0) {
+        void *data = memfd < 0 ? MAP_FAILED : mmap(NULL, res, PROT_READ, MAP_SHARED, memfd, 0);
+
+        if (data == MAP_FAILED) {
+            res = TECNICOFS_ERROR_OTHER;
+        }
+        else {
+            mapping->data = data;
+            mapping->size = res;
+        }
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    return res;
+}
+
+/*
+ * Reads or writes len bytes of an open file, TFS_MAX_IO at a time. Large
+ * reads go through memfds instead, see tfsmReadMapped(), and are copied
+ * from there.
+ * Returns:
+ *  bytes read or written, fewer than len once the end of the file (or,
+ *  for a write, its largest size) is reached, or a negative error if
+ *  nothing was
+ */
+static int transfer(tfs_mount_t *mount, uint8_t opcode, int fd, char *buffer, int len) {
+    int done = 0, res = 0;
+
+    if (len < 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    while (done < len) {
+        int count = len - done < TFS_MAX_IO ? len - done : TFS_MAX_IO;
+
+        if (opcode == TFS_OP_READ && mount->connected && len - done >= MAP_MIN_READ) {
+            tfs_mapping_t mapping;
+
+            count = len - done < TFS_MAX_MAP ? len - done : TFS_MAX_MAP;
+            if ((res = mapRead(mount, fd, count, &mapping)) <= 0)
+                break;
+            memcpy(buffer + done, mapping.data, res);
+            tfsReleaseMapping(&mapping);
+        }
+        else if ((res = fileCall(mount, opcode, fd, buffer + done, count, NULL)) <= 0) {
+            break;
+        }
+        done += res;
+        if (res < count)
+            break;
+    }
+    res = done > 0 || res >= 0 ? done : res;
+    printf("Received %d from server.\n", res);
+
+    return res;
+}
+
+int tfsmRead(tfs_mount_t *mount, int fd, char *buffer, int len) {
+    return transfer(mount, TFS_OP_READ, fd, buffer, len);
+}
+
+int tfsmWrite(tfs_mount_t *mount, int fd, char *buffer, int len) {
+    return transfer(mount, TFS_OP_WRITE, fd, buffer, len);
+}
+
+/*
+ * Reads up to len bytes of an open file where the server put them, in
+ * shared memory it hands over, rather than having them copied through
+ * the socket: the bytes can be used in place. tfsmRead() does this for
+ * large reads, and copies them out. Needs a session.
+ * Input:
+ *  - fd: descriptor, open for reading
+ *  - len: bytes wanted, at most TFS_MAX_MAP
+ *  - mapping: set to the bytes read, to be released with
+ *    tfsReleaseMapping(); empty if none were
+ * Returns:
+ *  number of bytes read (mapping->size), 0 at the end of the file, or a
+ *  negative error
+ */
+int tfsmReadMapped(tfs_mount_t *mount, int fd, int len, tfs_mapping_t *mapping) {
+    int res = mapRead(mount, fd, len, mapping);
+
+    printf("Received %d from server.\n", res);
+    return res;
+}
+
+/*
+ * Unmaps the bytes of a read, see tfsmReadMapped().
+ */
+void tfsReleaseMapping(tfs_mapping_t *mapping) {
+    if (mapping->data != NULL) {
+        munmap(mapping->data, mapping->size);
+        mapping->data = NULL;
+        mapping->size = 0;
+    }
+}
+
+/*
+ * Closes a descriptor returned by tfsmOpen().
+ * Returns: 0, or TECNICOFS_ERROR_FILE_NOT_OPEN
+ */
+int tfsmClose(tfs_mount_t *mount, int fd) {
+    int res = fileCall(mount, TFS_OP_CLOSE, fd, NULL, 0, NULL);
+
+    printf("Received %d from server.\n", res);
+    return res;
+}
+
+int tfsOpen(char *path, permission mode) {
+    return tfsmOpen(&defaultMount, path, mode);
+}
+
+int tfsOpenAppend(char *path) {
+    return tfsmOpenAppend(&defaultMount, path);
+}
+
+int tfsRead(int fd, char *buffer, int len) {
+    return tfsmRead(&defaultMount, fd, buffer, len);
+}
+
+int tfsReadMapped(int fd, int len, tfs_mapping_t *mapping) {
+    return tfsmReadMapped(&defaultMount, fd, len, mapping);
+}
+
+int tfsWrite(int fd, char *buffer, int len) {
+    return tfsmWrite(&defaultMount, fd, buffer, len);
+}
+
+int tfsClose(int fd) {
+    return tfsmClose(&defaultMount, fd);
+}
+
+/*
+ * Deletes or copies a whole tree on the server, which answers once every
+ * node of it is done.
+ * Input:
+ *  - opcode: TFS_OP_DELETE or TFS_OP_COPY
+ *  - path1, path2: the tree, and where its copy goes (NULL for a delete)
+ *  - done, left: set to the nodes deleted or copied, and those that could
+ *    not be; may be NULL
+ * Returns: 0, or the error of the first node left
+ */
+static int treeCall(tfs_mount_t *mount, uint8_t opcode, char *path1, char *path2, int *done, int *left) {
+    char request[TFS_MAX_FRAME];
+    pending_request_t *slot;
+    int ticket;
+    uint32_t id;
+    int32_t res, counts[2] = {0, 0};
+
+    if (buildRequest(request, opcode, TFS_TREE, TFS_NO_DIR, path1, path2) != 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    if ((ticket = tfsmSubmitFrame(mount, request, path1)) < 0) {
+        return ticket;
+    }
+
+    mountLock(mount);
+    if ((slot = waitSlot(mount, ticket)) == NULL) {
+        mountUnlock(mount);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    tfs_decode_reply(slot->reply, slot->replyLength, &id, &res);
+
+    /* the counts follow the result */
+    if (slot->replyLength >= sizeof(tfs_header_t) + sizeof(res) + sizeof(counts)) {
+        memcpy(counts, slot->reply + sizeof(tfs_header_t) + sizeof(res), sizeof(counts));
+    }
+    releaseSlot(slot);
+    mountUnlock(mount);
+
+    if (done != NULL) {
+        *done = counts[0];
+    }
+    if (left != NULL) {
+        *left = counts[1];
+    }
+    printf("Received %d from server.\n", res);
+    return res;
+}
+
+/*
+ * Deletes a directory and everything under it, or a file. The server goes
+ * through the tree a directory at a time, so other requests are served
+ * in between; a node in use (a file open, or a directory something was
+ * created in meanwhile) is left, along with the directories holding it.
+ */
+int tfsmDeleteTree(tfs_mount_t *mount, char *path, int *deleted, int *left) {
+    return treeCall(mount, TFS_OP_DELETE, path, NULL, deleted, left);
+}
+
+/*
+ * Copies a single node: a file, with its contents, or a directory, empty.
+ * The copy of a file shares the contents until either is written.
+ */
+int tfsmCopy(tfs_mount_t *mount, char *from, char *to) {
+    return tfsmCall(mount, TFS_OP_COPY, 0, from, to);
+}
+
+/*
+ * Copies a directory and everything under it, or a file. As for
+ * tfsmDeleteTree(), the tree is gone through a directory at a time; a tree
+ * can't be copied inside itself.
+ */
+int tfsmCopyTree(tfs_mount_t *mount, char *from, char *to, int *copied, int *left) {
+    return treeCall(mount, TFS_OP_COPY, from, to, copied, left);
+}
+
+int tfsDeleteTree(char *path, int *deleted, int *left) {
+    return tfsmDeleteTree(&defaultMount, path, deleted, left);
+}
+
+int tfsCopy(char *from, char *to) {
+    return tfsmCopy(&defaultMount, from, to);
+}
+
+int tfsCopyTree(char *from, char *to, int *copied, int *left) {
+    return tfsmCopyTree(&defaultMount, from, to, copied, left);
+}
+
+/*
+ * Lets a mount cache the lookups the server leases to it, and have them
+ * invalidated when the paths change. Leases are only given over a session.
+ * Returns: 0, or TECNICOFS_ERROR_OTHER if the mount has no session
+ */
+int tfsmEnableCache(tfs_mount_t *mount) {
+    if (!mount->connected) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    mountLock(mount);
+    mount->caching = 1;
+    mountUnlock(mount);
+    return 0;
+}
+
+int tfsEnableCache() {
+    return tfsmEnableCache(&defaultMount);
+}
+
+/*
+ * Reports how many lookups of a mount were answered from its cache and how
+ * many went to the server while caching was enabled.
+ */
+void tfsmCacheStats(tfs_mount_t *mount, long *hits, long *misses) {
+    mountLock(mount);
+    *hits = mount->cacheHits;
+    *misses = mount->cacheMisses;
+    mountUnlock(mount);
+}
+
+void tfsCacheStats(long *hits, long *misses) {
+    tfsmCacheStats(&defaultMount, hits, misses);
+}
+
+/*
+ * Subscribes a mount to the changes of a directory, which need not exist
+ * yet. Events are pushed by the server and taken with tfsmNextEvent().
+ * Input:
+ *  - path: directory to watch
+ *  - subtree: whether to also watch everything below its entries
+ * Returns:
+ *  the watch id (positive) events carry, or a negative error; only a
+ *  mount with a session may watch
+ */
+int tfsmWatch(tfs_mount_t *mount, char *path, int subtree) {
+    if (!mount->connected) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    return tfsmCall(mount, TFS_OP_WATCH, subtree ? TFS_WATCH_SUBTREE : 0, path, NULL);
+}
+
+int tfsWatch(char *path, int subtree) {
+    return tfsmWatch(&defaultMount, path, subtree);
+}
+
+/*
+ * Cancels the watch of a directory. Events already received are kept.
+ * Returns: 0, or a negative error if the directory wasn't watched
+ */
+int tfsmUnwatch(tfs_mount_t *mount, char *path) {
+    if (!mount->connected) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    return tfsmCall(mount, TFS_OP_UNWATCH, 0, path, NULL);
+}
+
+int tfsUnwatch(char *path) {
+    return tfsmUnwatch(&defaultMount, path);
+}
+
+/*
+ * Waits for something to arrive on a mount: if no other thread is
+ * receiving, the caller receives for everyone, otherwise it waits for the
+ * one receiving to store what arrived. The mount is locked, and unlocked
+ * while sleeping.
+ * Input:
+ *  - left: longest time to wait in milliseconds, -1 for no limit
+ */
+static void waitTurn(tfs_mount_t *mount, long left) {
+    int wait;
+
+    /* another thread receives for everyone, wait for it to store something */
+    if (mount->receiving) {
+        struct timespec until;
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += left < 0 ? 1 : left / 1000;
+        until.tv_nsec += left < 0 ? 0 : (left % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&mount->replied, &mount->lock, &until);
+        return;
+    }
+
+    mount->receiving = 1;
+    wait = resendDue(mount);
+    if (left >= 0 && (wait < 0 || left < wait)) {
+        wait = left;
+    }
+    mountUnlock(mount);
+    waitReply(mount, wait);
+    mountLock(mount);
+    mount->receiving = 0;
+
+    drainReplies(mount);
+    if (pthread_cond_broadcast(&mount->replied) != 0) {
+        fprintf(stderr, "client: failed to signal replies\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Waits for the next event of a mount's watches. Events of the same path
+ * the client was slow to take may come merged, with several kinds set in
+ * their mask. TECNICOFS_EVENT_OVERFLOW means events were lost: of the
+ * watched path it carries, or of any watch if its watch id is 0.
+ * Input:
+ *  - event: where to store the event
+ *  - timeout: longest time to wait in milliseconds, -1 for no limit
+ * Returns: 1 if an event was stored, 0 on timeout
+ */
+int tfsmNextEvent(tfs_mount_t *mount, tfs_event_t *event, int timeout) {
+    struct timespec deadline, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    mountLock(mount);
+    drainReplies(mount);
+
+    while (!takeEvent(mount, event)) {
+        long left = -1;
+
+        if (timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (left <= 0) {
+                mountUnlock(mount);
+                return 0;
+            }
+        }
+        waitTurn(mount, left);
+    }
+
+    mountUnlock(mount);
+    return 1;
+}
+
+int tfsNextEvent(tfs_event_t *event, int timeout) {
+    return tfsmNextEvent(&defaultMount, event, timeout);
+}
+
+static void lockDelegation(tfs_mount_t *mount) {
+    if (pthread_mutex_lock(&mount->delegationLock) != 0) {
+        fprintf(stderr, "client: failed to lock delegation\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void unlockDelegation(tfs_mount_t *mount) {
+    if (pthread_mutex_unlock(&mount->delegationLock) != 0) {
+        fprintf(stderr, "client: failed to unlock delegation\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Finds what a delegation knows of a normalized path.
+ * Returns: the node, or NULL if the path isn't known
+ */
+static local_node_t *findNode(delegation_t *delegation, char *path) {
+    for (local_node_t *node = delegation->nodes[hashPath(path)]; node != NULL; node = node->next) {
+        if (strcmp(node->path, path) == 0)
+            return node;
+    }
+    return NULL;
+}
+
+/*
+ * Records a normalized path as known, and not existing.
+ */
+static local_node_t *addNode(delegation_t *delegation, char *path) {
+    local_node_t *node = calloc(1, sizeof(local_node_t));
+
+    if (node == NULL || (node->path = strdup(path)) == NULL) {
+        fprintf(stderr, "client: failed to allocate delegation\n");
+        exit(EXIT_FAILURE);
+    }
+    node->nodeType = T_NONE;
+    node->inumber = -1;
+    node->next = delegation->nodes[hashPath(path)];
+    delegation->nodes[hashPath(path)] = node;
+    return node;
+}
+
+/*
+ * Forgets what a delegation knows, but that its root is a directory.
+ */
+static void resetNodes(delegation_t *delegation, int keepRoot) {
+    local_node_t *root;
+
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        while (delegation->nodes[i] != NULL) {
+            local_node_t *next = delegation->nodes[i]->next;
+
+            free(delegation->nodes[i]->path);
+            free(delegation->nodes[i]);
+            delegation->nodes[i] = next;
+        }
+    }
+    delegation->generation++;
+
+    if (keepRoot) {
+        root = addNode(delegation, delegation->path);
+        root->present = 1;
+        root->nodeType = T_DIRECTORY;
+    }
+}
+
+/*
+ * Gives the parent of a normalized path, which isn't "/".
+ */
+static void parentPath(char *path, char *parent) {
+    char *slash = strrchr(path, '/');
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+}
+
+/*
+ * Performs one operation on the server on behalf of the delegation code,
+ * which already sent what it had pending. The delegation is locked.
+ */
+static int delegationCall(tfs_mount_t *mount, uint8_t opcode, uint8_t flags, char *path1, char *path2) {
+    char request[TFS_MAX_FRAME];
+    int ticket;
+
+    if (tfsBuildRequest(request, opcode, flags, path1, path2) != 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    mount->delegationCalls++;
+    if ((ticket = submitFrame(mount, request, path1, NULL)) < 0) {
+        return ticket;
+    }
+    return tfsmWait(mount, ticket);
+}
+
+static void freeOp(pending_op_t *op) {
+    free(op->path);
+    free(op->target);
+    free(op);
+}
+
+/*
+ * Appends an operation carried out locally to those to be sent.
+ * Returns: its sequence number
+ */
+static unsigned long queueOp(delegation_t *delegation, uint8_t opcode, uint8_t flags, char *path, char *target) {
+    pending_op_t *op = malloc(sizeof(pending_op_t));
+
+    if (op == NULL || (op->path = strdup(path)) == NULL ||
+        (op->target = target != NULL ? strdup(target) : NULL, target != NULL && op->target == NULL)) {
+        fprintf(stderr, "client: failed to allocate delegation\n");
+        exit(EXIT_FAILURE);
+    }
+    op->sequence = ++delegation->nextSequence;
+    op->opcode = opcode;
+    op->flags = flags;
+    op->next = NULL;
+    if (delegation->lastPending == NULL) {
+        delegation->pending = op;
+    }
+    else {
+        delegation->lastPending->next = op;
+    }
+    delegation->lastPending = op;
+    return op->sequence;
+}
+
+/*
+ * Drops the pending create of a node being deleted, if nothing pending
+ * after it involves the node: then neither reaches the server.
+ * Returns: 1 if it was dropped
+ */
+static int cancelCreate(delegation_t *delegation, local_node_t *node) {
+    pending_op_t *create = delegation->pending, *previous = NULL;
+
+    while (create != NULL && create->sequence != node->created) {
+        previous = create;
+        create = create->next;
+    }
+    if (node->created == 0 || create == NULL) {
+        return 0;
+    }
+    for (pending_op_t *op = create->next; op != NULL; op = op->next) {
+        if (tfs_path_under(op->path, node->path) || (op->target != NULL && tfs_path_under(op->target, node->path)))
+            return 0;
+    }
+
+    if (previous == NULL) {
+        delegation->pending = create->next;
+    }
+    else {
+        previous->next = create->next;
+    }
+    if (delegation->lastPending == create) {
+        delegation->lastPending = previous;
+    }
+    freeOp(create);
+    return 1;
+}
 
-    return SUN_LEN(addr);
+/*
+ * Sends the operations pending on the mount's delegation to the server,
+ * in batches, waiting for their results. If the server refused some, what
+ * the mount knew of the subtree may be wrong and is forgotten. A batch
+ * that can't be sent (the server busy, or gone) is kept pending, to be
+ * sent again. The delegation is locked.
+ * Returns: number of operations refused, or a negative error if some
+ *  couldn't be sent
+ */
+static int flushPending(tfs_mount_t *mount) {
+    delegation_t *delegation = mount->delegation;
+    int failed = 0, error = 0;
+
+    while (delegation->pending != NULL) {
+        char frame[TFS_MAX_FRAME], request[TFS_MAX_FRAME];
+        int32_t results[TFS_MAX_BATCH];
+        pending_request_t *slot;
+        pending_op_t *op;
+        int ops = 0, ticket, n = -1;
+
+        tfs_frame_begin(frame, TFS_OP_BATCH, 0, 0);
+        for (op = delegation->pending; op != NULL && ops < TFS_MAX_BATCH; op = op->next) {
+            if (tfsBuildRequest(request, op->opcode, op->flags, op->path, op->target) != 0 ||
+                tfs_frame_put(frame, sizeof(frame), request, tfs_frame_size(request)) != 0)
+                break;
+            ops++;
+        }
+
+        if ((ticket = submitFrame(mount, frame, delegation->path, NULL)) < 0) {
+            error = ticket;
+            break;
+        }
+        mountLock(mount);
+        if ((slot = waitSlot(mount, ticket)) == NULL) {
+            mountUnlock(mount);
+            error = TECNICOFS_ERROR_OTHER;
+            break;
+        }
+        n = tfs_decode_batch_reply(slot->reply, slot->replyLength, results, TFS_MAX_BATCH);
+        releaseSlot(slot);
+        mountUnlock(mount);
+
+        /* a batch refused as a whole fails every operation in it */
+        for (int i = 0; i < (ops > 0 ? ops : 1); i++) {
+            if (i >= n || results[i] < 0) {
+                failed++;
+            }
+            op = delegation->pending;
+            delegation->pending = op->next;
+            freeOp(op);
+        }
+        if (delegation->pending == NULL) {
+            delegation->lastPending = NULL;
+        }
+        mount->delegatedFlushed += ops;
+    }
+
+    if (failed > 0) {
+        mount->delegatedFailed += failed;
+        resetNodes(delegation, 1);
+    }
+    return error < 0 ? error : failed;
 }
 
-int tfsCreate(char *filename, char nodeType) {
-    socklen_t servlen;
-    struct sockaddr_un serv_addr;
-    char nodeTypeString[3];
-    int res = 0;
-    char command[MAX_INPUT_SIZE] = "c ";
+/*
+ * Finds out whether a path under the mount's delegation exists: from what
+ * the mount knows, or else from the server, once what is pending was sent.
+ * Asking the server may make the mount forget what it knew, see
+ * flushPending(). The delegation is locked.
+ * Returns: the node, or NULL if the server couldn't be asked
+ */
+static local_node_t *resolveNode(tfs_mount_t *mount, char *path) {
+    delegation_t *delegation = mount->delegation;
+    char parentName[MAX_FILE_NAME];
+    local_node_t *node, *parent;
+    int res, failed;
+
+    if ((node = findNode(delegation, path)) != NULL) {
+        return node;
+    }
+    parentPath(path, parentName);
+    if ((parent = resolveNode(mount, parentName)) == NULL) {
+        return NULL;
+    }
+
+    /* nothing is under a node that doesn't exist, or missing from a directory known in full */
+    if (!parent->present || parent->nodeType == T_FILE || parent->complete) {
+        return addNode(delegation, path);
+    }
+
+    if ((failed = flushPending(mount)) > 0) {
+        return resolveNode(mount, path);
+    }
+    /* nothing may overtake what is pending */
+    if (failed < 0) {
+        return NULL;
+    }
+    res = delegationCall(mount, TFS_OP_LOOKUP, 0, path, NULL);
+    if (res < 0 && res != OPERATION_FAILED) {
+        return NULL;
+    }
 
-    nodeTypeString[0] = ' ';
-    nodeTypeString[1] = nodeType;
-    nodeTypeString[2] = '\0';
+    node = addNode(delegation, path);
+    if (res >= 0) {
+        node->present = 1;
+        node->inumber = res;
+        /* only a directory has entries */
+        parent->nodeType = T_DIRECTORY;
+        parent->entries++;
+    }
+    return node;
+}
 
-    strcat(command, filename);
-    strcat(command, nodeTypeString);
+/*
+ * Records a node as created in a directory.
+ */
+static void markCreated(local_node_t *parent, local_node_t *node, type nodeType) {
+    node->present = 1;
+    node->nodeType = nodeType;
+    node->inumber = -1;
+    node->complete = nodeType == T_DIRECTORY;
+    node->entries = 0;
+    parent->entries++;
+}
 
-    /* initialize server socket address */
-    servlen = setSockAddrUn(server_socket_path, &serv_addr);
+/*
+ * Records a node as deleted from its directory.
+ */
+static void markDeleted(local_node_t *parent, local_node_t *node) {
+    node->present = 0;
+    node->nodeType = T_NONE;
+    node->inumber = -1;
+    node->complete = 0;
+    node->created = 0;
+    parent->entries--;
+}
 
-    /* send message to server */
-    if (sendto(sockfd, command, strlen(command) + 1, 0, (struct sockaddr *)&serv_addr, servlen) < 0) {
-        perror("client: sendto error");
-        exit(EXIT_FAILURE);
+/*
+ * Records a node, and everything known under it, as moved: what was known
+ * under the new path (nothing there exists) is dropped.
+ */
+static void moveNodes(delegation_t *delegation, char *from, char *to) {
+    char fromParent[MAX_FILE_NAME], toParent[MAX_FILE_NAME];
+    local_node_t *moved = NULL;
+    size_t fromLength = strlen(from);
+
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        for (local_node_t **link = &delegation->nodes[i]; *link != NULL; ) {
+            local_node_t *node = *link;
+
+            if (tfs_path_under(node->path, to)) {
+                *link = node->next;
+                free(node->path);
+                free(node);
+            }
+            else if (tfs_path_under(node->path, from)) {
+                *link = node->next;
+                node->next = moved;
+                moved = node;
+            }
+            else {
+                link = &node->next;
+            }
+        }
     }
 
-    /* receive message from server */
-    if (recvfrom(sockfd, &res, sizeof(int), 0, (struct sockaddr *)&serv_addr, &servlen) < 0) {
-        perror("client: recvfrom error");
-        exit(EXIT_FAILURE);
+    while (moved != NULL) {
+        local_node_t *node = moved;
+        char *path = malloc(strlen(to) + strlen(node->path) - fromLength + 1);
+
+        if (path == NULL) {
+            fprintf(stderr, "client: failed to allocate delegation\n");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(path, "%s%s", to, node->path + fromLength);
+        free(node->path);
+        node->path = path;
+        /* its pending create has the old path */
+        node->created = 0;
+        moved = node->next;
+        node->next = delegation->nodes[hashPath(path)];
+        delegation->nodes[hashPath(path)] = node;
     }
-    printf("client: Received %d from server.\n", res);
 
-    return res;
+    parentPath(from, fromParent);
+    parentPath(to, toParent);
+    findNode(delegation, fromParent)->entries--;
+    findNode(delegation, toParent)->entries++;
+    addNode(delegation, from);
 }
 
-int tfsDelete(char *path) {
-    socklen_t servlen;
-    struct sockaddr_un serv_addr;
-    int res = 0;
-    char command[MAX_INPUT_SIZE] = "d ";
+/*
+ * Creates a node under the delegation: locally, unless only the server
+ * knows whether its parent is a directory. The delegation is locked.
+ */
+static int localCreate(tfs_mount_t *mount, char *path, type nodeType, int *result) {
+    delegation_t *delegation = mount->delegation;
+    unsigned long generation = delegation->generation;
+    char parentName[MAX_FILE_NAME];
+    local_node_t *node, *parent;
+    int failed;
+
+    if ((node = resolveNode(mount, path)) == NULL) {
+        *result = TECNICOFS_ERROR_OTHER;
+        return 1;
+    }
+    if (node->present) {
+        *result = OPERATION_FAILED;
+        return 1;
+    }
 
-    strcat(command, path);
+    /* the ancestors of a known node are known */
+    parentPath(path, parentName);
+    if ((parent = resolveNode(mount, parentName)) == NULL || delegation->generation != generation) {
+        return localCreate(mount, path, nodeType, result);
+    }
+    if (!parent->present || parent->nodeType == T_FILE) {
+        *result = OPERATION_FAILED;
+    }
+    else if (parent->nodeType == T_NONE) {
+        if ((failed = flushPending(mount)) > 0) {
+            return localCreate(mount, path, nodeType, result);
+        }
+        if (failed < 0) {
+            *result = failed;
+        }
+        else if ((*result = delegationCall(mount, TFS_OP_CREATE, nodeType, path, NULL)) == 0) {
+            parent->nodeType = T_DIRECTORY;
+            markCreated(parent, node, nodeType);
+        }
+    }
+    else {
+        markCreated(parent, node, nodeType);
+        node->created = queueOp(delegation, TFS_OP_CREATE, nodeType, path, NULL);
+        *result = 0;
+    }
+    return 1;
+}
 
-    /* initialize server socket address */
-    servlen = setSockAddrUn(server_socket_path, &serv_addr);
+/*
+ * Deletes a node under the delegation: locally, unless it may be a
+ * directory whose entries aren't all known. A node created since the last
+ * flush and deleted before the next one never reaches the server.
+ * The delegation is locked.
+ */
+static int localDelete(tfs_mount_t *mount, char *path, int *result) {
+    delegation_t *delegation = mount->delegation;
+    unsigned long generation = delegation->generation;
+    char parentName[MAX_FILE_NAME];
+    local_node_t *node, *parent;
+    int failed;
 
-    /* send message to server */
-    if (sendto(sockfd, command, strlen(command) + 1, 0, (struct sockaddr *)&serv_addr, servlen) < 0) {
-        perror("client: sendto error");
-        exit(EXIT_FAILURE);
+    /* the subtree goes away with its root, the delegation is given back first */
+    if (strcmp(path, delegation->path) == 0) {
+        return 0;
     }
 
-    /* receive message from server */
-    if (recvfrom(sockfd, &res, sizeof(int), 0, (struct sockaddr *)&serv_addr, &servlen) < 0) {
-        perror("client: recvfrom error");
-        exit(EXIT_FAILURE);
+    if ((node = resolveNode(mount, path)) == NULL) {
+        *result = TECNICOFS_ERROR_OTHER;
+        return 1;
+    }
+    parentPath(path, parentName);
+    if ((parent = resolveNode(mount, parentName)) == NULL || delegation->generation != generation) {
+        return localDelete(mount, path, result);
     }
-    printf("Received %d from server.\n", res);
 
-    return res;
+    if (!node->present || (node->nodeType == T_DIRECTORY && node->complete && node->entries > 0)) {
+        *result = OPERATION_FAILED;
+    }
+    else if (node->nodeType == T_NONE || (node->nodeType == T_DIRECTORY && !node->complete)) {
+        if ((failed = flushPending(mount)) > 0) {
+            return localDelete(mount, path, result);
+        }
+        if (failed < 0) {
+            *result = failed;
+        }
+        else if ((*result = delegationCall(mount, TFS_OP_DELETE, 0, path, NULL)) == 0) {
+            markDeleted(parent, node);
+        }
+    }
+    else {
+        if (cancelCreate(delegation, node)) {
+            mount->delegatedCancelled += 2;
+        }
+        else {
+            queueOp(delegation, TFS_OP_DELETE, 0, path, NULL);
+        }
+        markDeleted(parent, node);
+        *result = 0;
+    }
+    return 1;
 }
 
-int tfsMove(char *from, char *to) {
-    socklen_t servlen;
-    struct sockaddr_un serv_addr;
-    int res = 0;
-    char command[MAX_INPUT_SIZE] = "m ";
+/*
+ * Looks up a node under the delegation: locally, unless the server wasn't
+ * asked for its i-number yet. The delegation is locked.
+ */
+static int localLookup(tfs_mount_t *mount, char *path, int *result) {
+    local_node_t *node;
+    int failed;
+
+    if ((node = resolveNode(mount, path)) == NULL) {
+        *result = TECNICOFS_ERROR_OTHER;
+    }
+    else if (!node->present || node->inumber >= 0) {
+        *result = node->present ? node->inumber : OPERATION_FAILED;
+    }
+    else if ((failed = flushPending(mount)) > 0) {
+        return localLookup(mount, path, result);
+    }
+    else if (failed < 0) {
+        *result = failed;
+    }
+    else if ((*result = delegationCall(mount, TFS_OP_LOOKUP, 0, path, NULL)) >= 0) {
+        node->inumber = *result;
+    }
+    return 1;
+}
 
-    strcat(command, from);
-    strcat(command, " ");
-    strcat(command, to);
+/*
+ * Moves a node within the delegation: locally, unless only the server
+ * knows whether the new parent is a directory. Moves across the subtree's
+ * root are left to the server, the delegation being given back first.
+ * The delegation is locked.
+ */
+static int localMove(tfs_mount_t *mount, char *from, char *to, int *result) {
+    delegation_t *delegation = mount->delegation;
+    unsigned long generation = delegation->generation;
+    char parentName[MAX_FILE_NAME];
+    local_node_t *source, *target, *parent;
+    int failed;
 
-    /* intialize server socket address */
-    servlen = setSockAddrUn(server_socket_path, &serv_addr);
+    if (!tfs_path_under(to, delegation->path) || strcmp(from, delegation->path) == 0 ||
+        strcmp(to, delegation->path) == 0) {
+        return 0;
+    }
 
-    /* send message to server */
-    if (sendto(sockfd, command, strlen(command) + 1, 0, (struct sockaddr *)&serv_addr, servlen) < 0) {
-        perror("client: sendto error");
-        exit(EXIT_FAILURE);
+    parentPath(to, parentName);
+    if ((source = resolveNode(mount, from)) == NULL || (target = resolveNode(mount, to)) == NULL ||
+        (parent = resolveNode(mount, parentName)) == NULL) {
+        *result = TECNICOFS_ERROR_OTHER;
+        return 1;
+    }
+    if (delegation->generation != generation) {
+        return localMove(mount, from, to, result);
     }
 
-    /* receive message from server */
-    if (recvfrom(sockfd, &res, sizeof(int), 0, (struct sockaddr *)&serv_addr, &servlen) < 0) {
-        perror("client: recvfrom error");
-        exit(EXIT_FAILURE);
+    if (!source->present || target->present || tfs_path_under(to, from) || !parent->present ||
+        parent->nodeType == T_FILE) {
+        *result = OPERATION_FAILED;
     }
-    printf("Received %d from server.\n", res);
+    else if (parent->nodeType == T_NONE) {
+        if ((failed = flushPending(mount)) > 0) {
+            return localMove(mount, from, to, result);
+        }
+        if (failed < 0) {
+            *result = failed;
+        }
+        else if ((*result = delegationCall(mount, TFS_OP_MOVE, 0, from, to)) == 0) {
+            parent->nodeType = T_DIRECTORY;
+            moveNodes(delegation, from, to);
+        }
+    }
+    else {
+        queueOp(delegation, TFS_OP_MOVE, 0, from, to);
+        moveNodes(delegation, from, to);
+        *result = 0;
+    }
+    return 1;
+}
+
+/*
+ * Carries out an operation on a path under the mount's delegation.
+ * Returns: 1 if it was, its result stored in result; 0 if it is to be
+ *  sent to the server as usual
+ */
+static int delegatedCall(tfs_mount_t *mount, uint8_t opcode, uint8_t flags, char *path1, char *path2, int *result) {
+    char path[MAX_FILE_NAME], target[MAX_FILE_NAME];
+    int handled = 0;
+    long calls;
+
+    if (__atomic_load_n(&mount->delegation, __ATOMIC_ACQUIRE) == NULL ||
+        tfs_path_normalize(path, sizeof(path), path1) != 0 ||
+        (path2 != NULL && tfs_path_normalize(target, sizeof(target), path2) != 0)) {
+        return 0;
+    }
+
+    lockDelegation(mount);
+    calls = mount->delegationCalls;
+    if (mount->delegation != NULL && tfs_path_under(path, mount->delegation->path)) {
+        switch (opcode) {
+            case TFS_OP_CREATE:
+                handled = localCreate(mount, path, flags, result);
+                break;
+            case TFS_OP_DELETE:
+                handled = localDelete(mount, path, result);
+                break;
+            case TFS_OP_LOOKUP:
+                handled = localLookup(mount, path, result);
+                break;
+            case TFS_OP_MOVE:
+                handled = localMove(mount, path, target, result);
+                break;
+        }
+    }
+    if (handled && mount->delegationCalls == calls) {
+        mount->delegatedLocal++;
+        printf("Received %d locally.\n", *result);
+    }
+    else if (handled) {
+        printf("Received %d from server.\n", *result);
+    }
+    unlockDelegation(mount);
+
+    return handled;
+}
+
+/*
+ * Tells whether an operation may change a delegated subtree: a create,
+ * delete or move relative to a handle, under the subtree, or moving what
+ * holds it.
+ */
+static int changesSubtree(delegation_t *delegation, tfs_request_t *op) {
+    char path[MAX_FILE_NAME];
+
+    if (op->opcode != TFS_OP_CREATE && op->opcode != TFS_OP_DELETE && op->opcode != TFS_OP_MOVE && op->opcode != TFS_OP_COPY) {
+        return 0;
+    }
+    if (op->dir != TFS_NO_DIR) {
+        return 1;
+    }
+    for (int i = 0; i < op->npaths; i++) {
+        if (tfs_path_normalize(path, sizeof(path), op->paths[i]) != 0)
+            continue;
+        /* a copy only reads its source, a move or a tree delete takes it away */
+        if (op->opcode == TFS_OP_COPY && i == 0)
+            continue;
+        if (tfs_path_under(path, delegation->path) ||
+            ((op->opcode == TFS_OP_MOVE || tfs_tree_op(op)) && i == 0 && tfs_path_under(delegation->path, path)))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sends what is pending on the mount's delegation and gives it back. Its
+ * flusher, which may be the caller, is joined by reapDelegations().
+ * The delegation is locked.
+ * Returns: 0, or a negative error if the server already took it back or
+ *  what is pending couldn't be sent, in which case it is kept
+ */
+static int giveBack(tfs_mount_t *mount) {
+    delegation_t *delegation = mount->delegation;
+    int res;
+
+    /* kept until what is pending on it is sent */
+    if ((res = flushPending(mount)) < 0) {
+        return res;
+    }
+    res = delegationCall(mount, TFS_OP_DELEGATE, TFS_DELEGATE_RETURN, delegation->path, NULL);
+    resetNodes(delegation, 0);
 
+    mountLock(mount);
+    mount->recalled = 0;
+    mountUnlock(mount);
+
+    __atomic_store_n(&mount->delegation, NULL, __ATOMIC_RELEASE);
+    delegation->next = mount->retired;
+    mount->retired = delegation;
     return res;
 }
 
-int tfsLookup(char *path) {
-    socklen_t servlen;
-    struct sockaddr_un serv_addr;
-    int res = 0;
-    char command[MAX_INPUT_SIZE] = "l ";
+/*
+ * Stops the flushers of the delegations given back and releases them.
+ * The delegation must not be locked.
+ */
+static void reapDelegations(tfs_mount_t *mount) {
+    delegation_t *retired;
 
-    strcat(command, path);
+    lockDelegation(mount);
+    retired = mount->retired;
+    mount->retired = NULL;
+    unlockDelegation(mount);
 
-    /* initialize server socket address */
-    servlen = setSockAddrUn(server_socket_path, &serv_addr);
+    while (retired != NULL) {
+        delegation_t *next = retired->next;
 
-    /* send message to server */
-    if (sendto(sockfd, command, strlen(command) + 1, 0, (struct sockaddr *)&serv_addr, servlen) < 0) {
-        perror("client: sendto error");
+        mountLock(mount);
+        retired->stop = 1;
+        pthread_cond_broadcast(&mount->replied);
+        mountUnlock(mount);
+        if (pthread_join(retired->flusher, NULL) != 0) {
+            fprintf(stderr, "client: failed to join flusher\n");
+            exit(EXIT_FAILURE);
+        }
+        free(retired);
+        retired = next;
+    }
+}
+
+/*
+ * Before a request is sent, sends what the mount's delegation has pending
+ * so the request sees it, and gives the delegation back if the request
+ * may change the subtree behind the mount's back.
+ */
+static void settleDelegation(tfs_mount_t *mount, char *frame) {
+    tfs_request_t request, op;
+    size_t offset = sizeof(tfs_header_t);
+    int changes = 0;
+
+    if (__atomic_load_n(&mount->delegation, __ATOMIC_ACQUIRE) == NULL ||
+        tfs_decode_request(frame, tfs_frame_size(frame), &request) != 0) {
+        return;
+    }
+
+    lockDelegation(mount);
+    if (mount->delegation != NULL) {
+        if (request.opcode != TFS_OP_BATCH) {
+            changes = changesSubtree(mount->delegation, &request);
+        }
+        while (request.opcode == TFS_OP_BATCH && !changes && tfs_batch_next(frame, tfs_frame_size(frame), &offset, &op) == 1) {
+            changes = changesSubtree(mount->delegation, &op);
+        }
+
+        if (changes) {
+            giveBack(mount);
+        }
+        else {
+            flushPending(mount);
+        }
+    }
+    unlockDelegation(mount);
+
+    reapDelegations(mount);
+}
+
+/*
+ * Flusher of a delegation: sends what is pending every
+ * DELEGATION_FLUSH_MS, and gives the delegation back once the server
+ * recalls it. It takes turns receiving with the mount's other threads, so
+ * recalls are seen while the client is idle too.
+ */
+static void *delegationFlusher(void *arg) {
+    delegation_t *delegation = arg;
+    tfs_mount_t *mount = delegation->mount;
+
+    mountLock(mount);
+    while (!delegation->stop) {
+        struct timespec deadline, now;
+        int recalled;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += DELEGATION_FLUSH_MS / 1000;
+        deadline.tv_nsec += (DELEGATION_FLUSH_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (!delegation->stop && !mount->recalled) {
+            long left;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (left <= 0)
+                break;
+            waitTurn(mount, left);
+        }
+        if (delegation->stop) {
+            break;
+        }
+        recalled = mount->recalled;
+        mountUnlock(mount);
+
+        lockDelegation(mount);
+        if (mount->delegation != delegation) {
+            /* given back meanwhile, waits to be stopped */
+            unlockDelegation(mount);
+            mountLock(mount);
+            while (!delegation->stop) {
+                waitTurn(mount, DELEGATION_FLUSH_MS);
+            }
+            break;
+        }
+        if (recalled) {
+            giveBack(mount);
+        }
+        else {
+            flushPending(mount);
+        }
+        unlockDelegation(mount);
+        mountLock(mount);
+    }
+    mountUnlock(mount);
+    return NULL;
+}
+
+/*
+ * Asks the server for a directory's subtree, to change it without a round
+ * trip per operation. Until the mount gives it back, creates, deletes,
+ * lookups and moves under it are carried out locally as far as the mount
+ * knows the subtree, and sent to the server in batches: every
+ * DELEGATION_FLUSH_MS, before any other request of the mount and when the
+ * subtree is given back. It is given back with tfsmUndelegate(), when
+ * unmounting, before a request that may change it behind the mount's
+ * back, and when the server recalls it for another client. Operations
+ * the server refuses when they are sent are only counted, see
+ * tfsmDelegationStats(). A mount with a session holds one at a time.
+ * Returns: 0, or a negative error if the server refused
+ */
+int tfsmDelegate(tfs_mount_t *mount, char *path) {
+    char normalized[MAX_FILE_NAME];
+    delegation_t *delegation;
+    local_node_t *root;
+    int res;
+
+    if (!mount->connected || tfs_path_normalize(normalized, sizeof(normalized), path) != 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    reapDelegations(mount);
+
+    lockDelegation(mount);
+    if (mount->delegation != NULL) {
+        unlockDelegation(mount);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    mountLock(mount);
+    mount->recalled = 0;
+    mountUnlock(mount);
+
+    res = delegationCall(mount, TFS_OP_DELEGATE, 0, normalized, NULL);
+    printf("Received %d from server.\n", res);
+    if (res < 0) {
+        unlockDelegation(mount);
+        return res;
+    }
+
+    if ((delegation = calloc(1, sizeof(delegation_t))) == NULL) {
+        fprintf(stderr, "client: failed to allocate delegation\n");
         exit(EXIT_FAILURE);
     }
+    strcpy(delegation->path, normalized);
+    delegation->mount = mount;
+    root = addNode(delegation, normalized);
+    root->present = 1;
+    root->nodeType = T_DIRECTORY;
+    /* an empty directory is known in full */
+    root->complete = res == 0;
 
-    /* receive message from server */
-    if (recvfrom(sockfd, &res, sizeof(int), 0, (struct sockaddr *)&serv_addr, &servlen) < 0) {
-        perror("client: recvfrom error");
+    if (pthread_create(&delegation->flusher, NULL, delegationFlusher, delegation) != 0) {
+        fprintf(stderr, "client: failed to create flusher\n");
         exit(EXIT_FAILURE);
     }
-    printf("Received %d from server.\n", res);
+    __atomic_store_n(&mount->delegation, delegation, __ATOMIC_RELEASE);
+    unlockDelegation(mount);
+    return 0;
+}
+
+int tfsDelegate(char *path) {
+    return tfsmDelegate(&defaultMount, path);
+}
+
+/*
+ * Sends what the mount's delegation has pending and gives it back.
+ * Returns: 0, or a negative error if the mount holds none, or the server
+ *  took it back already
+ */
+int tfsmUndelegate(tfs_mount_t *mount) {
+    int res = TECNICOFS_ERROR_OTHER;
 
+    lockDelegation(mount);
+    if (mount->delegation != NULL) {
+        res = giveBack(mount);
+    }
+    unlockDelegation(mount);
+
+    reapDelegations(mount);
     return res;
 }
 
-int tfsPrint(char *outputFile) {   
+int tfsUndelegate() {
+    return tfsmUndelegate(&defaultMount);
+}
+
+/*
+ * Sends what the mount's delegation has pending and waits for it.
+ * Returns: number of operations the server refused, or a negative error
+ *  if some couldn't be sent, which stay pending
+ */
+int tfsmFlush(tfs_mount_t *mount) {
+    int failed = 0;
 
-    socklen_t servlen;
-    struct sockaddr_un serv_addr;
-    int res = 0;
-    char command[MAX_INPUT_SIZE] = "p ";
+    lockDelegation(mount);
+    if (mount->delegation != NULL) {
+        failed = flushPending(mount);
+    }
+    unlockDelegation(mount);
+    return failed;
+}
+
+int tfsFlush() {
+    return tfsmFlush(&defaultMount);
+}
 
-    strcat(command, outputFile);
+/*
+ * Reports how many operations of a mount were carried out locally under
+ * its delegations, how many never reached the server (a create and a
+ * delete of the same node), how many were sent later and how many of
+ * those the server refused.
+ */
+void tfsmDelegationStats(tfs_mount_t *mount, long *local, long *cancelled, long *flushed, long *failed) {
+    lockDelegation(mount);
+    *local = mount->delegatedLocal;
+    *cancelled = mount->delegatedCancelled;
+    *flushed = mount->delegatedFlushed;
+    *failed = mount->delegatedFailed;
+    unlockDelegation(mount);
+}
 
-    /* initialize server socket address */
-    servlen = setSockAddrUn(server_socket_path, &serv_addr);
+void tfsDelegationStats(long *local, long *cancelled, long *flushed, long *failed) {
+    tfsmDelegationStats(&defaultMount, local, cancelled, flushed, failed);
+}
 
-    /* send message to server */
-    if (sendto(sockfd, command, strlen(command) + 1, 0, (struct sockaddr *)&serv_addr, servlen) < 0) {
-        perror("client: sendto error");
-        exit(EXIT_FAILURE);
+int tfsSubmitCreate(char *filename, char nodeType) {
+    return tfsmSubmitCreate(&defaultMount, filename, nodeType);
+}
+
+int tfsSubmitDelete(char *path) {
+    return tfsmSubmitDelete(&defaultMount, path);
+}
+
+int tfsSubmitMove(char *from, char *to) {
+    return tfsmSubmitMove(&defaultMount, from, to);
+}
+
+int tfsSubmitLookup(char *path) {
+    return tfsmSubmitLookup(&defaultMount, path);
+}
+
+int tfsSubmitPrint(char *outputFile) {
+    return tfsmSubmitPrint(&defaultMount, outputFile);
+}
+
+/*
+ * Starts a new batch of operations, discarding any batch not submitted.
+ * Each thread builds its own batch.
+ */
+int tfsBatchBegin() {
+    tfs_frame_begin(batchFrame, TFS_OP_BATCH, 0, 0);
+    batchOps = 0;
+    return 0;
+}
+
+/*
+ * Appends one operation to the current batch.
+ * Returns: 0, or TECNICOFS_ERROR_OTHER if the batch is full
+ */
+int tfsBatchAdd(uint8_t opcode, uint8_t flags, char *path1, char *path2) {
+    char op[TFS_MAX_FRAME];
+
+    if (batchOps == TFS_MAX_BATCH || tfsBuildRequest(op, opcode, flags, path1, path2) != 0 ||
+        tfs_frame_put(batchFrame, sizeof(batchFrame), op, tfs_frame_size(op)) != 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    batchOps++;
+    return 0;
+}
+
+int tfsBatchCreate(char *filename, char nodeType) {
+    if (tfsNodeType(nodeType) == T_NONE) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    return tfsBatchAdd(TFS_OP_CREATE, tfsNodeType(nodeType), filename, NULL);
+}
+
+int tfsBatchDelete(char *path) {
+    return tfsBatchAdd(TFS_OP_DELETE, 0, path, NULL);
+}
+
+int tfsBatchMove(char *from, char *to) {
+    return tfsBatchAdd(TFS_OP_MOVE, 0, from, to);
+}
+
+int tfsBatchLookup(char *path) {
+    return tfsBatchAdd(TFS_OP_LOOKUP, 0, path, NULL);
+}
+
+int tfsBatchPrint(char *outputFile) {
+    return tfsBatchAdd(TFS_OP_PRINT, 0, outputFile, NULL);
+}
+
+/*
+ * Sends the calling thread's batch as a single request; the server runs
+ * its operations in order. The batch is empty afterwards.
+ * Input:
+ *  - results: array with room for one result per operation added
+ * Returns:
+ *  number of results stored, or a negative error if the batch wasn't run
+ */
+int tfsmBatchSubmit(tfs_mount_t *mount, int results[]) {
+    pending_request_t *slot;
+    int32_t batchResults[TFS_MAX_BATCH];
+    uint32_t id;
+    int32_t res;
+    int ticket, n;
+
+    if (batchOps == 0) {
+        return 0;
+    }
+
+    ticket = tfsmSubmitFrame(mount, batchFrame, NULL);
+    tfsBatchBegin();
+    if (ticket < 0) {
+        return ticket;
+    }
+    mountLock(mount);
+    if ((slot = waitSlot(mount, ticket)) == NULL) {
+        mountUnlock(mount);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    n = tfs_decode_batch_reply(slot->reply, slot->replyLength, batchResults, TFS_MAX_BATCH);
+    if (n < 0) {
+        /* the whole batch was refused */
+        tfs_decode_reply(slot->reply, slot->replyLength, &id, &res);
+        n = res;
+    }
+
+    for (int i = 0; i < n; i++) {
+        results[i] = batchResults[i];
+    }
+    releaseSlot(slot);
+    mountUnlock(mount);
+    printf("Received %d from server.\n", n);
+    return n;
+}
+
+int tfsBatchSubmit(int results[]) {
+    return tfsmBatchSubmit(&defaultMount, results);
+}
+
+/*
+ * Counts the sockets the server exposes.
+ */
+static int countSockets(char *sockPath) {
+    char path[SOCK_MAX_PATH_LEN + TFS_SOCKET_SUFFIX_LEN];
+    int n = 1;
+
+    for (; n < TFS_MAX_SOCKETS; n++) {
+        tfs_socket_path(path, sizeof(path), sockPath, n);
+        if (access(path, F_OK) != 0)
+            break;
     }
+    return n;
+}
+
+/*
+ * Opens a session with the server over a connection to the session
+ * listener of one of its sockets, picked by the client's pid.
+ * Returns: 0, or -1 if the server doesn't accept connections
+ */
+static int tfsConnect(tfs_mount_t *mount, char *sockPath) {
+    char socketPath[SOCK_MAX_PATH_LEN + TFS_SOCKET_SUFFIX_LEN];
+    char sessionPath[sizeof(socketPath) + sizeof(TFS_SESSION_SUFFIX)];
+    struct sockaddr_un addr;
+    socklen_t len;
 
-    /* receive message from server */
-    if (recvfrom(sockfd, &res, sizeof(int), 0, (struct sockaddr *)&serv_addr, &servlen) < 0) {
-        perror("client: recvfrom error");
+    if ((mount->sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+        perror("client: can't open socket");
         exit(EXIT_FAILURE);
     }
-    printf("Received %d from server.\n", res);
 
-    return res;
+    tfs_socket_path(socketPath, sizeof(socketPath), sockPath, pickSocket(mount, NULL));
+    snprintf(sessionPath, sizeof(sessionPath), "%s%s", socketPath, TFS_SESSION_SUFFIX);
+    len = setSockAddrUn(sessionPath, &addr);
+
+    if (connect(mount->sockfd, (struct sockaddr *)&addr, len) < 0) {
+        close(mount->sockfd);
+        return -1;
+    }
+    mount->connected = 1;
+    return 0;
 }
 
-int tfsMount(char *sockPath) {
+/*
+ * Mounts the filesystem on a mount object: over a session if the server
+ * offers them, over datagrams otherwise.
+ * Returns: 0
+ */
+static int mountInit(tfs_mount_t *mount, char *sockPath) {
     socklen_t clilen;
-    struct sockaddr_un serv_addr, client_addr;
+    struct sockaddr_un client_addr;
+
+    memset(mount, 0, sizeof(tfs_mount_t));
+    mount->index = __atomic_fetch_add(&mountSequence, 1, __ATOMIC_RELAXED);
+    mount->nextSequence = 1;
+    mount->serverWake = mount->clientWake = -1;
+    if (pthread_mutex_init(&mount->lock, NULL) != 0 || pthread_cond_init(&mount->replied, NULL) != 0 ||
+        pthread_mutex_init(&mount->delegationLock, NULL) != 0) {
+        fprintf(stderr, "client: failed to initialize mount\n");
+        exit(EXIT_FAILURE);
+    }
 
-    strcpy(server_socket_path, sockPath);
+    strcpy(mount->server_socket_path, sockPath);
+    mount->numberSockets = countSockets(sockPath);
+
+    /* prefer a persistent session, falling back to datagrams */
+    if (tfsConnect(mount, sockPath) == 0) {
+        return 0;
+    }
 
     /* create/declare socket */
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    if ((mount->sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
         perror("client: can't open socket");
         exit(EXIT_FAILURE);
     }
 
-    /* create unique path */
+    /* create unique path, per mount after the first one of the process */
     pid_t pid = getpid();
-    sprintf(clientSocketPath, "%s%ld", CLIENT_SOCKET_BASE_PATH, (long)pid);
+    if (mount->index == 0) {
+        sprintf(mount->clientSocketPath, "%s%ld", CLIENT_SOCKET_BASE_PATH, (long)pid);
+    }
+    else {
+        sprintf(mount->clientSocketPath, "%s%ld.%d", CLIENT_SOCKET_BASE_PATH, (long)pid, mount->index);
+    }
 
-    if (unlink(clientSocketPath) != 0) {
+    if (unlink(mount->clientSocketPath) != 0 && errno != ENOENT) {
         perror("client: unlink error");
         exit(EXIT_FAILURE);
     }
 
     /* initialize client socket address */
-    clilen = setSockAddrUn(clientSocketPath, &client_addr);
+    clilen = setSockAddrUn(mount->clientSocketPath, &client_addr);
 
     /* bind socket to address */
-    if (bind(sockfd, (struct sockaddr *)&client_addr, clilen) < 0) {
+    if (bind(mount->sockfd, (struct sockaddr *)&client_addr, clilen) < 0) {
         perror("client: bind error");
         exit(EXIT_FAILURE);
     }
 
-    /* initialize server socket address */
-    setSockAddrUn(server_socket_path, &serv_addr);
+    /* initialize server socket addresses */
+    for (int i = 0; i < mount->numberSockets; i++) {
+        char socketPath[SOCK_MAX_PATH_LEN + TFS_SOCKET_SUFFIX_LEN];
+
+        tfs_socket_path(socketPath, sizeof(socketPath), mount->server_socket_path, i);
+        mount->servlen[i] = setSockAddrUn(socketPath, &mount->serv_addr[i]);
+    }
 
     return 0;
 }
 
-int tfsUnmount() {
+/*
+ * Moves a mount's session to rings in memory shared with the server (see
+ * tecnicofs-protocol.h).
+ * Returns: 0, or TECNICOFS_ERROR_CONNECTION_ERROR if the server doesn't
+ *  offer sessions or refuses the rings
+ */
+static int mountAttach(tfs_mount_t *mount) {
+    char frame[sizeof(tfs_header_t) + sizeof(int32_t)];
+    char control[CMSG_SPACE(sizeof(int) * TFS_ATTACH_FDS)];
+    int fds[TFS_ATTACH_FDS];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    uint32_t id;
+    int32_t res;
+    ssize_t c;
+
+    if (!mount->connected) {
+        fprintf(stderr, "client: server doesn't offer sessions\n");
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+
+    /* a sealed region, so its size can be trusted by the server */
+    if ((fds[0] = memfd_create("tecnicofs-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+        ftruncate(fds[0], TFS_SHARED_SIZE) != 0 ||
+        fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+        (mount->sharedRegion = mmap(NULL, TFS_SHARED_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED ||
+        (fds[1] = mount->serverWake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+        (fds[2] = mount->clientWake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        perror("client: can't set up shared memory");
+        exit(EXIT_FAILURE);
+    }
+    tfs_shared_views(mount->sharedRegion, &mount->submissions, &mount->completions);
+    /* the server only looks at the submission ring once signalled */
+    mount->submissions.ring->idle = 1;
+
+    /* pass the descriptors along with an attach request */
+    tfs_frame_begin(frame, TFS_OP_ATTACH, 0, 0);
+    iov.iov_base = frame;
+    iov.iov_len = tfs_frame_size(frame);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(mount->sockfd, &msg, 0) < 0 || (c = recv(mount->sockfd, frame, sizeof(frame), 0)) < 0) {
+        perror("client: attach error");
+        exit(EXIT_FAILURE);
+    }
+    close(fds[0]);
+
+    if (tfs_decode_reply(frame, c, &id, &res) != 0 || res != 0) {
+        fprintf(stderr, "client: server refused shared memory\n");
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+    mount->shared = 1;
+
+    return 0;
+}
+
+/*
+ * Unmounts the filesystem from a mount object, once no other thread
+ * uses it.
+ */
+static void mountRelease(tfs_mount_t *mount) {
+
+    /* send what was changed under the delegation */
+    tfsmUndelegate(mount);
+
+    /* release the shared-memory transport */
+    if (mount->sharedRegion != NULL) {
+        munmap(mount->sharedRegion, TFS_SHARED_SIZE);
+        close(mount->serverWake);
+        close(mount->clientWake);
+        mount->sharedRegion = NULL;
+        mount->shared = 0;
+        mount->ringOutstanding = 0;
+    }
 
     /* destroy client socket */
-    if (close(sockfd) != 0) {
+    if (close(mount->sockfd) != 0) {
         fprintf(stderr, "Error: failed to close descriptor for socket.\n");
         exit(EXIT_FAILURE);
     }
-    if (unlink(clientSocketPath) != 0) {
+    if (!mount->connected && unlink(mount->clientSocketPath) != 0) {
         fprintf(stderr, "Error: failed to deleted socket.\n");
         exit(EXIT_FAILURE);
     }
+    mount->connected = 0;
+
+    cacheInvalidate(mount, NULL);
+    mount->caching = 0;
+    for (int i = 0; i < TFS_MAX_INFLIGHT; i++) {
+        if (mount->inflight[i].state != SLOT_FREE) {
+            releaseSlot(&mount->inflight[i]);
+        }
+    }
+    pthread_cond_destroy(&mount->replied);
+    pthread_mutex_destroy(&mount->lock);
+    pthread_mutex_destroy(&mount->delegationLock);
+}
+
+/*
+ * Mounts the filesystem on a new mount object, whose calls (the tfsm
+ * functions) may be made from any number of threads.
+ * Returns: the mount, or NULL if it couldn't be allocated
+ */
+tfs_mount_t *tfsMountHandle(char *sockPath) {
+    tfs_mount_t *mount = malloc(sizeof(tfs_mount_t));
+
+    if (mount == NULL) {
+        return NULL;
+    }
+    mountInit(mount, sockPath);
+    return mount;
+}
+
+/*
+ * Like tfsMountHandle(), over memory shared with the server.
+ * Returns: the mount, or NULL if the server refused the shared memory
+ */
+tfs_mount_t *tfsMountSharedHandle(char *sockPath) {
+    tfs_mount_t *mount = tfsMountHandle(sockPath);
+
+    if (mount != NULL && mountAttach(mount) != 0) {
+        tfsUnmountHandle(mount);
+        return NULL;
+    }
+    return mount;
+}
+
+int tfsUnmountHandle(tfs_mount_t *mount) {
+    mountRelease(mount);
+    free(mount);
+    return 0;
+}
 
+int tfsMount(char *sockPath) {
+    return mountInit(&defaultMount, sockPath);
+}
+
+/*
+ * Mounts the filesystem over a session and moves the session's requests
+ * to rings in memory shared with the server (see tecnicofs-protocol.h).
+ * Returns: 0, or TECNICOFS_ERROR_CONNECTION_ERROR if the server doesn't
+ *  offer sessions or refuses the rings
+ */
+int tfsMountShared(char *sockPath) {
+    tfsMount(sockPath);
+    if (mountAttach(&defaultMount) != 0) {
+        tfsUnmount();
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+    return 0;
+}
+
+int tfsUnmount() {
+    mountRelease(&defaultMount);
     return 0;
 }
@@ -1,14 +1,120 @@
 #ifndef API_H
 #define API_H
 
+#include <stddef.h>
 #include "../tecnicofs-api-constants.h"
 
+/*
+ * A mounted filesystem, safe to use from many threads at once. The calls
+ * without a mount argument use a default one, set up by tfsMount().
+ */
+typedef struct tfs_mount tfs_mount_t;
+
+/*
+ * A change to a watched directory, see tfsWatch().
+ */
+typedef struct tfs_event {
+    int watch;                  /* id returned by tfsWatch() */
+    int mask;                   /* TECNICOFS_EVENT_* */
+    char path[MAX_FILE_NAME];   /* path created, deleted or moved */
+    char target[MAX_FILE_NAME]; /* new path of a move, empty otherwise */
+} tfs_event_t;
+
+/*
+ * Bytes of a file read in place, see tfsReadMapped().
+ */
+typedef struct tfs_mapping {
+    char *data;
+    size_t size;
+} tfs_mapping_t;
+
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsPrint(char *outputFile);
+int tfsOpenDir(char *path);
+int tfsOpenDirAt(int dir, char *path);
+int tfsCreateAt(int dir, char *name, char nodeType);
+int tfsDeleteAt(int dir, char *name);
+int tfsLookupAt(int dir, char *name);
+int tfsMoveAt(int dir, char *from, char *to);
+int tfsOpen(char *path, permission mode);
+int tfsOpenAppend(char *path);
+int tfsRead(int fd, char *buffer, int len);
+int tfsReadMapped(int fd, int len, tfs_mapping_t *mapping);
+void tfsReleaseMapping(tfs_mapping_t *mapping);
+int tfsWrite(int fd, char *buffer, int len);
+int tfsClose(int fd);
+int tfsDeleteTree(char *path, int *deleted, int *left);
+int tfsCopy(char *from, char *to);
+int tfsCopyTree(char *from, char *to, int *copied, int *left);
+int tfsSubmitCreate(char *path, char nodeType);
+int tfsSubmitDelete(char *path);
+int tfsSubmitLookup(char *path);
+int tfsSubmitMove(char *from, char *to);
+int tfsSubmitPrint(char *outputFile);
+int tfsPoll(int ticket, int *result);
+int tfsWait(int ticket);
+int tfsBatchBegin();
+int tfsBatchCreate(char *path, char nodeType);
+int tfsBatchDelete(char *path);
+int tfsBatchLookup(char *path);
+int tfsBatchMove(char *from, char *to);
+int tfsBatchPrint(char *outputFile);
+int tfsBatchSubmit(int results[]);
 int tfsMount(char* serverName);
+int tfsMountShared(char* serverName);
 int tfsUnmount();
+int tfsEnableCache();
+void tfsCacheStats(long *hits, long *misses);
+int tfsWatch(char *path, int subtree);
+int tfsUnwatch(char *path);
+int tfsNextEvent(tfs_event_t *event, int timeout);
+int tfsDelegate(char *path);
+int tfsUndelegate();
+int tfsFlush();
+void tfsDelegationStats(long *local, long *cancelled, long *flushed, long *failed);
+
+tfs_mount_t *tfsMountHandle(char *serverName);
+tfs_mount_t *tfsMountSharedHandle(char *serverName);
+int tfsUnmountHandle(tfs_mount_t *mount);
+int tfsmCreate(tfs_mount_t *mount, char *path, char nodeType);
+int tfsmDelete(tfs_mount_t *mount, char *path);
+int tfsmLookup(tfs_mount_t *mount, char *path);
+int tfsmMove(tfs_mount_t *mount, char *from, char *to);
+int tfsmPrint(tfs_mount_t *mount, char *outputFile);
+int tfsmOpenDir(tfs_mount_t *mount, char *path);
+int tfsmOpenDirAt(tfs_mount_t *mount, int dir, char *path);
+int tfsmCreateAt(tfs_mount_t *mount, int dir, char *name, char nodeType);
+int tfsmDeleteAt(tfs_mount_t *mount, int dir, char *name);
+int tfsmLookupAt(tfs_mount_t *mount, int dir, char *name);
+int tfsmMoveAt(tfs_mount_t *mount, int dir, char *from, char *to);
+int tfsmOpen(tfs_mount_t *mount, char *path, permission mode);
+int tfsmOpenAppend(tfs_mount_t *mount, char *path);
+int tfsmRead(tfs_mount_t *mount, int fd, char *buffer, int len);
+int tfsmReadMapped(tfs_mount_t *mount, int fd, int len, tfs_mapping_t *mapping);
+int tfsmWrite(tfs_mount_t *mount, int fd, char *buffer, int len);
+int tfsmClose(tfs_mount_t *mount, int fd);
+int tfsmDeleteTree(tfs_mount_t *mount, char *path, int *deleted, int *left);
+int tfsmCopy(tfs_mount_t *mount, char *from, char *to);
+int tfsmCopyTree(tfs_mount_t *mount, char *from, char *to, int *copied, int *left);
+int tfsmSubmitCreate(tfs_mount_t *mount, char *path, char nodeType);
+int tfsmSubmitDelete(tfs_mount_t *mount, char *path);
+int tfsmSubmitLookup(tfs_mount_t *mount, char *path);
+int tfsmSubmitMove(tfs_mount_t *mount, char *from, char *to);
+int tfsmSubmitPrint(tfs_mount_t *mount, char *outputFile);
+int tfsmPoll(tfs_mount_t *mount, int ticket, int *result);
+int tfsmWait(tfs_mount_t *mount, int ticket);
+int tfsmBatchSubmit(tfs_mount_t *mount, int results[]);
+int tfsmEnableCache(tfs_mount_t *mount);
+void tfsmCacheStats(tfs_mount_t *mount, long *hits, long *misses);
+int tfsmWatch(tfs_mount_t *mount, char *path, int subtree);
+int tfsmUnwatch(tfs_mount_t *mount, char *path);
+int tfsmNextEvent(tfs_mount_t *mount, tfs_event_t *event, int timeout);
+int tfsmDelegate(tfs_mount_t *mount, char *path);
+int tfsmUndelegate(tfs_mount_t *mount);
+int tfsmFlush(tfs_mount_t *mount);
+void tfsmDelegationStats(tfs_mount_t *mount, long *local, long *cancelled, long *flushed, long *failed);
 
 #endif /* CLIENT_H */
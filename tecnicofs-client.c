@@ -1,25 +1,50 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <getopt.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
 
+/* operations sent to the server in one batch when replaying a file */
+#define BATCH_SIZE 32
+
+/*
+ * An operation read from the input file, kept until its batch is answered.
+ */
+typedef struct operation {
+    char op;
+    char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+} operation_t;
+
 FILE* inputFile;
 char* serverName;
+int sharedMemory = 0;
+
+operation_t batch[BATCH_SIZE];
+int batchLength = 0;
 
 static void displayUsage (const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s [-m] inputfile server_socket_name\n", appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs (long argc, char* const argv[]) {
-    if (argc != 3) {
+    int opt;
+
+    /* -m: talk to the server through shared memory */
+    while ((opt = getopt(argc, argv, "m")) != -1) {
+        if (opt != 'm')
+            displayUsage(argv[0]);
+        sharedMemory = 1;
+    }
+
+    if (argc - optind != 2) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
-    serverName = argv[2];
+    serverName = argv[optind + 1];
 
-    inputFile = fopen(argv[1], "r");
+    inputFile = fopen(argv[optind], "r");
 
     if (inputFile== NULL) {
         fprintf(stderr, "Error: cannot open input file\n");
@@ -32,21 +57,129 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Prints the outcome of an operation read from the input file.
+ * Input:
+ *  - operation: the operation
+ *  - res: its result
+ */
+static void printResult(operation_t *operation, int res) {
+    char *arg1 = operation->arg1, *arg2 = operation->arg2;
+
+    switch (operation->op) {
+        case 'c':
+            if (arg2[0] == 'f') {
+                if (!res)
+                  printf("Created file: %s\n", arg1);
+                else
+                  printf("Unable to create file: %s\n", arg1);
+            }
+            else {
+                if (!res)
+                  printf("Created directory: %s\n", arg1);
+                else
+                  printf("Unable to create directory: %s\n", arg1);
+            }
+            break;
+        case 'l':
+            if (res >= 0)
+                printf("Search: %s found\n", arg1);
+            else
+                printf("Search: %s not found\n", arg1);
+            break;
+        case 'd':
+            if (!res)
+              printf("Deleted: %s\n", arg1);
+            else
+              printf("Unable to delete: %s\n", arg1);
+            break;
+        case 'm':
+            if (!res)
+              printf("Moved: %s to %s\n", arg1, arg2);
+            else
+              printf("Unable to move: %s to %s\n", arg1, arg2);
+            break;
+        case 'p':
+            if(!res)
+                printf("Printed file system to file: %s\n", arg1);
+            else
+                printf("Unable to print file system to file: %s\n", arg1);
+            break;
+    }
+}
+
+/*
+ * Sends the pending operations to the server as one batch and prints
+ * their results.
+ */
+static void submitBatch() {
+    int results[BATCH_SIZE];
+    int n = tfsBatchSubmit(results);
+
+    for (int i = 0; i < batchLength; i++) {
+        /* a refused batch fails every operation in it, and one cut short those it left out */
+        printResult(&batch[i], n < 0 ? n : i < n ? results[i] : TECNICOFS_ERROR_OTHER);
+    }
+    batchLength = 0;
+}
+
+/*
+ * Adds an operation to the pending batch, submitting the batch first if
+ * it is full.
+ */
+static void addToBatch(operation_t *operation) {
+    int res = 0;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (batchLength == BATCH_SIZE) {
+            submitBatch();
+        }
+
+        switch (operation->op) {
+            case 'c':
+                res = tfsBatchCreate(operation->arg1, operation->arg2[0]);
+                break;
+            case 'l':
+                res = tfsBatchLookup(operation->arg1);
+                break;
+            case 'd':
+                res = tfsBatchDelete(operation->arg1);
+                break;
+            case 'm':
+                res = tfsBatchMove(operation->arg1, operation->arg2);
+                break;
+            case 'p':
+                res = tfsBatchPrint(operation->arg1);
+                break;
+        }
+
+        if (res == 0) {
+            batch[batchLength++] = *operation;
+            return;
+        }
+        /* didn't fit in the batch, send what is there and try again */
+        submitBatch();
+    }
+
+    printResult(operation, res);
+}
+
 void *processInput() {
     char line[MAX_INPUT_SIZE];
 
+    tfsBatchBegin();
+
     while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
-        char op;
-        char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
-        int res;
+        operation_t operation;
+        char *arg1 = operation.arg1, *arg2 = operation.arg2;
 
-        int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
+        int numTokens = sscanf(line, "%c %s %s", &operation.op, arg1, arg2);
 
         /* perform minimal validation */
         if (numTokens < 1) {
             continue;
         }
-        switch (op) {
+        switch (operation.op) {
             case 'c':
                 if(numTokens != 3) {
                     errorParse();
@@ -54,60 +187,25 @@ void *processInput() {
                 }
                 switch (arg2[0]) {
                     case 'f':
-                        res = tfsCreate(arg1, 'f');
-                        if (!res)
-                          printf("Created file: %s\n", arg1);
-                        else
-                          printf("Unable to create file: %s\n", arg1);
-                        break;
                     case 'd':
-                        res = tfsCreate(arg1, 'd');
-                        if (!res)
-                          printf("Created directory: %s\n", arg1);
-                        else
-                          printf("Unable to create directory: %s\n", arg1);
+                        addToBatch(&operation);
                         break;
                     default:
                         fprintf(stderr, "Error: invalid node type\n");
                 }
                 break;
             case 'l':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsLookup(arg1);
-                if (res >= 0)
-                    printf("Search: %s found\n", arg1);
-                else
-                    printf("Search: %s not found\n", arg1);
-                break;
             case 'd':
+            case 'p':
                 if(numTokens != 2)
                     errorParse();
-                res = tfsDelete(arg1);
-                if (!res)
-                  printf("Deleted: %s\n", arg1);
-                else
-                  printf("Unable to delete: %s\n", arg1);
+                addToBatch(&operation);
                 break;
             case 'm':
                 if(numTokens != 3)
                     errorParse();
-                res = tfsMove(arg1, arg2);
-                if (!res)
-                  printf("Moved: %s to %s\n", arg1, arg2);
-                else
-                  printf("Unable to move: %s to %s\n", arg1, arg2);
+                addToBatch(&operation);
                 break;
-            case 'p':
-                if (numTokens != 2)
-                    errorParse();
-                res = tfsPrint(arg1);
-                if(!res)
-                    printf("Printed file system to file: %s\n", arg1);
-                else {
-                    printf("Unable to print file system to file: %s\n", arg1);
-                    break;
-                }
             case '#':
                 break;
             default: { /* error */
@@ -115,6 +213,8 @@ void *processInput() {
             }
         }
     }
+    submitBatch();
+
     fclose(inputFile);
     return NULL;
 }
@@ -122,7 +222,7 @@ void *processInput() {
 int main(int argc, char* argv[]) {
     parseArgs(argc, argv);
 
-    if (tfsMount(serverName) == 0)
+    if ((sharedMemory ? tfsMountShared(serverName) : tfsMount(serverName)) == 0)
       printf("Mounted! (socket = %s)\n", serverName);
     else {
       fprintf(stderr, "Unable to mount socket: %s\n", serverName);
@@ -0,0 +1,677 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "tecnicofs-api-constants.h"
+
+/*
+ * Binary frames exchanged between client and server.
+ *
+ * Every frame starts with a tfs_header_t followed by `length` bytes of
+ * payload. Requests carry their paths in the payload, each as a 16-bit
+ * length, the path bytes and a terminating '\0' (not counted in the
+ * length), so they can be used in place by the receiver. Replies carry a
+ * 32-bit result whose meaning is given by the header's flags.
+ *
+ * Both ends run on the same host, so values are in host byte order.
+ * A frame is told apart from the old text commands by its first byte.
+ */
+
+/*
+ * Besides the datagram socket, the server listens for SOCK_SEQPACKET
+ * connections at the same path with this suffix. Each message on a
+ * connection carries one frame; requests can be pipelined and replies come
+ * back in completion order, matched by id.
+ */
+#define TFS_SESSION_SUFFIX ".seq"
+
+/*
+ * The server may expose several sockets, each served by its own receiver:
+ * the first at the path it was given, socket i at that path followed by
+ * ".i". Clients spread their requests over the ones that exist.
+ */
+#define TFS_MAX_SOCKETS 16
+#define TFS_SOCKET_SUFFIX_LEN 4 /* room for ".15" and the '\0' */
+
+#define TFS_MAGIC 0xF5
+#define TFS_VERSION 1
+#define TFS_MAX_FRAME 8192
+#define TFS_MAX_PATHS 2
+
+/* operations, using the same letters as the text commands */
+#define TFS_OP_CREATE 'c'
+#define TFS_OP_DELETE 'd'
+#define TFS_OP_LOOKUP 'l'
+#define TFS_OP_MOVE 'm'
+#define TFS_OP_PRINT 'p'
+#define TFS_OP_BATCH 'b' /* payload is a sequence of request frames */
+#define TFS_OP_ATTACH 'a' /* sets up the shared-memory transport of a session */
+#define TFS_OP_INVALIDATE 'i' /* sent by the server: a leased path changed */
+#define TFS_OP_WATCH 'w'
+#define TFS_OP_UNWATCH 'u'
+#define TFS_OP_EVENT 'e' /* sent by the server: a watched path changed */
+#define TFS_OP_OPENDIR 'o'
+#define TFS_OP_DELEGATE 'g'
+#define TFS_OP_RECALL 'r' /* sent by the server: a delegated subtree is wanted back */
+#define TFS_OP_OPEN 'O'
+#define TFS_OP_READ 'R'
+#define TFS_OP_WRITE 'W'
+#define TFS_OP_CLOSE 'C'
+#define TFS_OP_MAP 'M'
+#define TFS_OP_COPY 'y'
+
+/* maximum number of operations in a batch */
+#define TFS_MAX_BATCH 64
+/* maximum number of requests a client may have in flight */
+#define TFS_MAX_INFLIGHT 512
+
+/* kind of value carried by a reply (in its flags) */
+#define TFS_RESULT_STATUS 0  /* SUCCESS or a negative error */
+#define TFS_RESULT_INUMBER 1 /* i-number of the node, or a negative error */
+#define TFS_RESULT_BATCH 2   /* one result per operation of a batch */
+#define TFS_RESULT_DATA 3    /* bytes read or a negative error, followed by the bytes */
+#define TFS_RESULT_TREE 4    /* SUCCESS or a negative error, then two counts of nodes */
+
+/*
+ * Leases. A lookup sent over a session with TFS_LOOKUP_LEASE in its flags
+ * asks the server to report changes to the path; if it agrees, the reply
+ * carries TFS_RESULT_LEASE along with its result type. For TFS_LEASE_MS
+ * from sending the lookup, the client may answer lookups of the path
+ * itself, until the server sends a TFS_OP_INVALIDATE frame (id 0, one
+ * path) over the session: the path and everything under it was deleted or
+ * moved. Invalidations are sent on the session socket even when requests
+ * go through shared memory. Leased paths are compared once normalized
+ * with tfs_path_normalize().
+ */
+#define TFS_LOOKUP_LEASE 1
+#define TFS_RESULT_LEASE 0x80
+#define TFS_LEASE_MS 3000
+
+/*
+ * Watches. A TFS_OP_WATCH request sent over a session subscribes it to
+ * changes of a directory's entries, or with TFS_WATCH_SUBTREE of anything
+ * under it; the reply carries a positive watch id. The path need not
+ * exist yet. Each create, delete and move that touches it is pushed as a
+ * TFS_OP_EVENT frame on the session socket: its id is the watch id, its
+ * flags a mask of TECNICOFS_EVENT_* and its paths the normalized path
+ * changed, plus the new path for a move. Events the client is slow to
+ * take are queued by the server, those of the same path merged into one;
+ * once TFS_WATCH_QUEUE are pending further ones are dropped and the
+ * client is sent a TECNICOFS_EVENT_OVERFLOW carrying the watched path.
+ * TFS_OP_UNWATCH takes the watched path.
+ */
+#define TFS_WATCH_SUBTREE 1
+#define TFS_WATCH_QUEUE 64
+
+/*
+ * Directory handles. TFS_OP_OPENDIR resolves a directory once and replies
+ * with a handle (never negative) for it. A create, delete, lookup, move or
+ * opendir with TFS_REQUEST_AT in its flags carries a 32-bit handle at the
+ * start of its payload, before the paths, which are then relative to that
+ * directory (both of them for a move). A handle follows its directory
+ * when it is moved and goes stale (TECNICOFS_ERROR_STALE_HANDLE) once it
+ * is deleted. The server keeps nothing per handle, so none is closed.
+ */
+#define TFS_REQUEST_AT 0x40
+#define TFS_NO_DIR -1
+
+/*
+ * Delegations. A TFS_OP_DELEGATE request sent over a session asks for a
+ * directory's subtree: until the session gives it back, nobody else
+ * changes or looks into it, so the client may apply its own operations
+ * there locally and send them later, in batches. The reply carries how
+ * many entries the directory has, or a negative error if it isn't a
+ * directory or overlaps a subtree already delegated. Requests of others
+ * on the subtree (or moving or printing something holding it) are held by
+ * the server, which sends the holder a TFS_OP_RECALL frame (id 0, the
+ * delegated path) over the session. The holder then sends what it has
+ * pending, waits for the results, and gives the subtree back with a
+ * TFS_OP_DELEGATE carrying TFS_DELEGATE_RETURN; the held requests run
+ * after that. A holder that doesn't give it back within TFS_RECALL_MS of
+ * the recall loses it. Delegated paths are normalized.
+ */
+#define TFS_DELEGATE_RETURN 1
+#define TFS_RECALL_MS 1000
+
+/*
+ * Files. A TFS_OP_OPEN request sent over a session resolves a file once,
+ * its flags the mode (a permission, along with TFS_REQUEST_AT for a
+ * relative path and TFS_OPEN_APPEND for writes to go to the end of the
+ * file), and replies with a descriptor (never negative) into the session's
+ * table of at most TFS_MAX_OPEN_FILES open files. TFS_OP_READ,
+ * TFS_OP_WRITE and TFS_OP_CLOSE carry no paths: their payload is the
+ * 32-bit descriptor, followed for a read by the 32-bit number of bytes
+ * wanted, at most TFS_MAX_IO, and for a write by the bytes to write, as
+ * many. Each descriptor has its own offset, which reads and writes
+ * advance; appends from any number of sessions at once each get their own
+ * bytes at the end of the file, and move the offset past them. A read's
+ * reply carries the bytes after its result, a write's the number of bytes
+ * written. A file can't be deleted while open
+ * (TECNICOFS_ERROR_FILE_IS_OPEN), moving it leaves its descriptors alone.
+ * A session's files are closed when it goes away.
+ *
+ * Large reads. TFS_OP_MAP is a read of up to TFS_MAX_MAP bytes, with the
+ * same payload, sent over the session socket even with the shared-memory
+ * transport attached. Rather than carrying the bytes, its reply passes
+ * (SCM_RIGHTS) a memfd holding them, sealed against any change, and its
+ * result is their number, which is the memfd's size; no memfd comes with
+ * a result of 0 or less. The client maps the memfd and reads the bytes in
+ * place.
+ */
+#define TFS_OPEN_APPEND 0x04
+#define TFS_MAX_OPEN_FILES 16
+#define TFS_MAX_IO 4096
+#define TFS_MAX_MAP (64 << 20)
+
+/*
+ * Copies and trees. TFS_OP_COPY takes two paths and creates the second as
+ * a copy of the first: an empty directory, or a file with the same bytes,
+ * which the two share until either is changed. With TFS_TREE in its flags
+ * it also copies everything under a directory, and a TFS_OP_DELETE with
+ * TFS_TREE deletes a directory along with everything under it. A tree is
+ * gone through by the server alone, its directories spread over the
+ * workers: each node is deleted or copied on its own, so others may see
+ * the tree half done, but never a node. The reply carries
+ * TFS_RESULT_TREE: SUCCESS, or the error of the first node that couldn't
+ * be deleted or copied (a file open, a directory that got new entries
+ * meanwhile), followed by the 32-bit number of nodes deleted or copied and
+ * of those left. Operations on trees take absolute paths and aren't
+ * batched; a directory can't be copied inside itself, nor the root
+ * deleted.
+ */
+#define TFS_TREE 1
+
+/* largest reply: a read's, which is larger than a batch's */
+#define TFS_MAX_REPLY (sizeof(tfs_header_t) + sizeof(int32_t) + TFS_MAX_IO)
+
+
+typedef struct tfs_header {
+	uint8_t magic;
+	uint8_t version;
+	uint8_t opcode;
+	uint8_t flags;   /* node type for create, result type for replies */
+	uint32_t id;     /* chosen by the client, echoed in the reply */
+	uint32_t length; /* bytes of payload after the header */
+} tfs_header_t;
+
+/*
+ * A decoded request. Paths point into the frame they were decoded from.
+ */
+typedef struct tfs_request {
+	uint8_t opcode;
+	uint8_t flags;
+	uint32_t id;
+	int32_t dir; /* handle the paths are relative to, or TFS_NO_DIR */
+	int npaths;
+	char *paths[TFS_MAX_PATHS];
+	int32_t file;   /* descriptor a read, write or close works on */
+	uint32_t count; /* bytes to read or write */
+	char *data;     /* bytes to write, in the frame */
+} tfs_request_t;
+
+
+/*
+ * Builds the path of one of the server's sockets.
+ * Input:
+ *  - dest, size: where to store the path
+ *  - path: path of the server's first socket
+ *  - index: number of the socket
+ */
+static inline void tfs_socket_path(char *dest, size_t size, const char *path, int index) {
+	if (index == 0) {
+		snprintf(dest, size, "%s", path);
+	}
+	else {
+		snprintf(dest, size, "%s.%d", path, index);
+	}
+}
+
+/*
+ * Normalizes a path: a single '/' in front and between components, none at
+ * the end.
+ * Input:
+ *  - dest, size: where to store the normalized path
+ * Returns: 0, or -1 if it doesn't fit
+ */
+static inline int tfs_path_normalize(char *dest, size_t size, const char *path) {
+	size_t n = 0;
+
+	for (const char *c = path; *c != '\0'; c++) {
+		if (*c == '/')
+			continue;
+		if (c == path || *(c - 1) == '/') {
+			if (n + 1 >= size)
+				return -1;
+			dest[n++] = '/';
+		}
+		if (n + 1 >= size)
+			return -1;
+		dest[n++] = *c;
+	}
+	if (n == 0) {
+		if (size < 2)
+			return -1;
+		dest[n++] = '/';
+	}
+	dest[n] = '\0';
+	return 0;
+}
+
+/*
+ * Tells whether a normalized path is another one or lies under it.
+ */
+static inline int tfs_path_under(const char *path, const char *ancestor) {
+	size_t n = strlen(ancestor);
+
+	if (strcmp(ancestor, "/") == 0)
+		return 1;
+	return strncmp(path, ancestor, n) == 0 && (path[n] == '\0' || path[n] == '/');
+}
+
+/*
+ * Starts a frame with an empty payload.
+ */
+static inline void tfs_frame_begin(char *frame, uint8_t opcode, uint8_t flags, uint32_t id) {
+	tfs_header_t header = { TFS_MAGIC, TFS_VERSION, opcode, flags, id, 0 };
+
+	memcpy(frame, &header, sizeof(header));
+}
+
+/*
+ * Sets the id of a frame already built.
+ */
+static inline void tfs_frame_set_id(char *frame, uint32_t id) {
+	memcpy(frame + offsetof(tfs_header_t, id), &id, sizeof(id));
+}
+
+/*
+ * Returns the total size of a frame, header included.
+ */
+static inline size_t tfs_frame_size(char *frame) {
+	tfs_header_t header;
+
+	memcpy(&header, frame, sizeof(header));
+	return sizeof(header) + header.length;
+}
+
+/*
+ * Appends raw bytes to a frame's payload.
+ * Returns: 0, or -1 if they don't fit in size bytes
+ */
+static inline int tfs_frame_put(char *frame, size_t size, const void *bytes, size_t n) {
+	tfs_header_t header;
+
+	memcpy(&header, frame, sizeof(header));
+	if (sizeof(header) + header.length + n > size) {
+		return -1;
+	}
+	memcpy(frame + sizeof(header) + header.length, bytes, n);
+	header.length += n;
+	memcpy(frame, &header, sizeof(header));
+	return 0;
+}
+
+/*
+ * Appends a length-prefixed, '\0'-terminated path to a frame's payload.
+ * Returns: 0, or -1 if it doesn't fit in size bytes
+ */
+static inline int tfs_frame_put_path(char *frame, size_t size, const char *path) {
+	size_t len = strlen(path);
+	uint16_t prefix = len;
+
+	if (len > UINT16_MAX || tfs_frame_size(frame) + sizeof(prefix) + len + 1 > size) {
+		return -1;
+	}
+	tfs_frame_put(frame, size, &prefix, sizeof(prefix));
+	return tfs_frame_put(frame, size, path, len + 1);
+}
+
+/*
+ * Appends a 32-bit integer to a frame's payload.
+ * Returns: 0, or -1 if it doesn't fit in size bytes
+ */
+static inline int tfs_frame_put_int(char *frame, size_t size, int32_t value) {
+	return tfs_frame_put(frame, size, &value, sizeof(value));
+}
+
+/*
+ * Checks that len bytes hold a whole frame of a known version.
+ * Returns: 1 if so, 0 otherwise
+ */
+static inline int tfs_frame_valid(char *frame, size_t len) {
+	tfs_header_t header;
+
+	if (len < sizeof(header)) {
+		return 0;
+	}
+	memcpy(&header, frame, sizeof(header));
+	return header.magic == TFS_MAGIC && header.version == TFS_VERSION &&
+		sizeof(header) + header.length <= len;
+}
+
+/*
+ * Tells whether an operation works on an open file rather than on paths.
+ */
+static inline int tfs_file_op(uint8_t opcode) {
+	return opcode == TFS_OP_READ || opcode == TFS_OP_WRITE || opcode == TFS_OP_CLOSE || opcode == TFS_OP_MAP;
+}
+
+/*
+ * Tells whether an operation works on a whole subtree, see TFS_TREE.
+ */
+static inline int tfs_tree_op(tfs_request_t *req) {
+	return (req->opcode == TFS_OP_DELETE || req->opcode == TFS_OP_COPY) && req->flags & TFS_TREE;
+}
+
+/*
+ * Decodes a request frame. The paths, or the bytes of a write, are left
+ * in the frame and pointed to. The operations of a batch are decoded
+ * separately with tfs_batch_next().
+ * Returns: 0, or -1 if the frame is malformed
+ */
+static inline int tfs_decode_request(char *frame, size_t len, tfs_request_t *req) {
+	tfs_header_t header;
+	size_t offset = sizeof(header);
+
+	if (!tfs_frame_valid(frame, len)) {
+		return -1;
+	}
+	memcpy(&header, frame, sizeof(header));
+	req->opcode = header.opcode;
+	req->flags = header.flags;
+	req->id = header.id;
+	req->dir = TFS_NO_DIR;
+	req->npaths = 0;
+	req->file = -1;
+	req->count = 0;
+	req->data = NULL;
+
+	if (header.opcode == TFS_OP_BATCH) {
+		return 0;
+	}
+
+	if (tfs_file_op(header.opcode)) {
+		if (header.length < sizeof(req->file)) {
+			return -1;
+		}
+		memcpy(&req->file, frame + offset, sizeof(req->file));
+		offset += sizeof(req->file);
+		req->count = sizeof(header) + header.length - offset;
+
+		if (header.opcode == TFS_OP_WRITE) {
+			req->data = frame + offset;
+			return 0;
+		}
+		if ((header.opcode == TFS_OP_READ || header.opcode == TFS_OP_MAP) && req->count == sizeof(req->count)) {
+			memcpy(&req->count, frame + offset, sizeof(req->count));
+			return 0;
+		}
+		return header.opcode == TFS_OP_CLOSE && req->count == 0 ? 0 : -1;
+	}
+
+	if (header.flags & TFS_REQUEST_AT) {
+		if (header.length < sizeof(req->dir)) {
+			return -1;
+		}
+		memcpy(&req->dir, frame + offset, sizeof(req->dir));
+		offset += sizeof(req->dir);
+	}
+
+	while (offset < sizeof(header) + header.length) {
+		uint16_t pathlen;
+
+		if (req->npaths == TFS_MAX_PATHS || offset + sizeof(pathlen) > sizeof(header) + header.length) {
+			return -1;
+		}
+		memcpy(&pathlen, frame + offset, sizeof(pathlen));
+		offset += sizeof(pathlen);
+
+		if (offset + pathlen + 1 > sizeof(header) + header.length || frame[offset + pathlen] != '\0') {
+			return -1;
+		}
+		req->paths[req->npaths++] = frame + offset;
+		offset += pathlen + 1;
+	}
+	return 0;
+}
+
+/*
+ * Decodes the next operation of a batch frame.
+ * Input:
+ *  - frame, len: the batch frame
+ *  - offset: position of the next operation, sizeof(tfs_header_t) for the
+ *    first one; advanced past the decoded operation
+ *  - sub: decoded operation, its paths pointing into the frame
+ * Returns: 1 if an operation was decoded, 0 at the end of the batch, or -1
+ *  if the frame is malformed
+ */
+static inline int tfs_batch_next(char *frame, size_t len, size_t *offset, tfs_request_t *sub) {
+	tfs_header_t header;
+	size_t end;
+
+	if (len < sizeof(header)) {
+		return -1;
+	}
+	memcpy(&header, frame, sizeof(header));
+	end = sizeof(header) + header.length;
+
+	/* the operations can't run past what was received */
+	if (end > len) {
+		return -1;
+	}
+	if (*offset >= end) {
+		return 0;
+	}
+	if (!tfs_frame_valid(frame + *offset, end - *offset) ||
+		tfs_decode_request(frame + *offset, end - *offset, sub) != 0 ||
+		sub->opcode == TFS_OP_BATCH) {
+		return -1;
+	}
+	*offset += tfs_frame_size(frame + *offset);
+	return 1;
+}
+
+/*
+ * Decodes a reply frame. For a batch, result is the first operation's.
+ * Returns: 0, or -1 if the frame is malformed
+ */
+static inline int tfs_decode_reply(char *frame, size_t len, uint32_t *id, int32_t *result) {
+	tfs_header_t header;
+
+	if (!tfs_frame_valid(frame, len)) {
+		return -1;
+	}
+	memcpy(&header, frame, sizeof(header));
+	if (header.length < sizeof(*result)) {
+		return -1;
+	}
+	*id = header.id;
+	memcpy(result, frame + sizeof(header), sizeof(*result));
+	return 0;
+}
+
+/*
+ * Decodes the results of a batch reply.
+ * Input:
+ *  - frame, len: the reply frame
+ *  - results: where to store up to max results
+ * Returns: number of results, or -1 if the frame is not a batch reply
+ */
+static inline int tfs_decode_batch_reply(char *frame, size_t len, int32_t *results, int max) {
+	tfs_header_t header;
+	int n;
+
+	if (!tfs_frame_valid(frame, len)) {
+		return -1;
+	}
+	memcpy(&header, frame, sizeof(header));
+	if (header.flags != TFS_RESULT_BATCH) {
+		return -1;
+	}
+	n = header.length / sizeof(int32_t);
+	if (n > max) {
+		n = max;
+	}
+	memcpy(results, frame + sizeof(header), n * sizeof(int32_t));
+	return n;
+}
+
+
+/*
+ * Shared-memory transport.
+ *
+ * A client with a session may move its requests to a memory region it
+ * shares with the server: it sends an attach frame over the session
+ * carrying (SCM_RIGHTS) a memfd holding a tfs_shared_t, an eventfd that
+ * wakes the server and one that wakes the client. Requests then go through
+ * the submission ring and replies come back through the completion ring,
+ * each a single-producer single-consumer ring of length-prefixed frames.
+ * A consumer about to sleep sets its ring's idle flag and the producer
+ * only signals the eventfd when it finds the flag set, so a busy pair
+ * exchanges requests and replies without system calls.
+ * A client keeps at most TFS_RING_COMPLETIONS requests outstanding on the
+ * rings, so the server never finds the completion ring full.
+ */
+#define TFS_RING_SUBMISSIONS 64
+#define TFS_RING_COMPLETIONS 128
+#define TFS_RING_SUBMISSION_SLOT (sizeof(uint32_t) + TFS_MAX_FRAME)
+#define TFS_RING_COMPLETION_SLOT (sizeof(uint32_t) + TFS_MAX_REPLY)
+/* number of descriptors passed by an attach frame: memfd, server and client eventfds */
+#define TFS_ATTACH_FDS 3
+
+typedef struct tfs_ring {
+	uint32_t head;  /* next slot to consume, advanced by the consumer */
+	uint32_t idle;  /* set by the consumer before it sleeps on its eventfd */
+	char pad[56];   /* keeps the producer's index on its own cache line */
+	uint32_t tail;  /* next slot to fill, advanced by the producer */
+	char pad2[60];
+} tfs_ring_t;
+
+/*
+ * Layout of the shared region: the two ring headers, followed by the
+ * submission slots and then the completion slots.
+ */
+typedef struct tfs_shared {
+	tfs_ring_t submissions; /* client to server */
+	tfs_ring_t completions; /* server to client */
+} tfs_shared_t;
+
+#define TFS_SHARED_SIZE (sizeof(tfs_shared_t) + TFS_RING_SUBMISSIONS * TFS_RING_SUBMISSION_SLOT + \
+	TFS_RING_COMPLETIONS * TFS_RING_COMPLETION_SLOT)
+
+/*
+ * One side's handle on a ring: where its header and slots are mapped.
+ * The geometry is fixed by the protocol, never read from shared memory.
+ */
+typedef struct tfs_ring_view {
+	tfs_ring_t *ring;
+	char *slots;
+	uint32_t count;
+	size_t slotSize;
+} tfs_ring_view_t;
+
+
+/*
+ * Finds the two rings in a mapped shared region.
+ */
+static inline void tfs_shared_views(void *region, tfs_ring_view_t *submissions,
+	tfs_ring_view_t *completions) {
+	tfs_shared_t *shared = region;
+
+	submissions->ring = &shared->submissions;
+	submissions->slots = (char *)region + sizeof(tfs_shared_t);
+	submissions->count = TFS_RING_SUBMISSIONS;
+	submissions->slotSize = TFS_RING_SUBMISSION_SLOT;
+
+	completions->ring = &shared->completions;
+	completions->slots = submissions->slots + TFS_RING_SUBMISSIONS * TFS_RING_SUBMISSION_SLOT;
+	completions->count = TFS_RING_COMPLETIONS;
+	completions->slotSize = TFS_RING_COMPLETION_SLOT;
+}
+
+/*
+ * Appends a frame to a ring (producer side).
+ * Returns: -1 if the ring is full or the frame too large, 1 if the frame
+ *  was added and the consumer is idle and must be signalled, 0 otherwise
+ */
+static inline int tfs_ring_push(tfs_ring_view_t *view, const void *frame, uint32_t len) {
+	uint32_t tail = __atomic_load_n(&view->ring->tail, __ATOMIC_RELAXED);
+	uint32_t head = __atomic_load_n(&view->ring->head, __ATOMIC_ACQUIRE);
+	char *slot = view->slots + (tail % view->count) * view->slotSize;
+
+	if (tail - head >= view->count || len > view->slotSize - sizeof(len)) {
+		return -1;
+	}
+	memcpy(slot, &len, sizeof(len));
+	memcpy(slot + sizeof(len), frame, len);
+
+	/* publish the frame before looking at the idle flag
+	   (pairs with tfs_ring_prepare_wait) */
+	__atomic_store_n(&view->ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&view->ring->idle, __ATOMIC_SEQ_CST) &&
+		__atomic_exchange_n(&view->ring->idle, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Checks whether a ring has frames to consume.
+ */
+static inline int tfs_ring_ready(tfs_ring_view_t *view) {
+	return __atomic_load_n(&view->ring->tail, __ATOMIC_ACQUIRE) !=
+		__atomic_load_n(&view->ring->head, __ATOMIC_RELAXED);
+}
+
+/*
+ * Takes the oldest frame from a ring (consumer side).
+ * Input:
+ *  - frame, size: where to copy the frame
+ * Returns: length of the frame, 0 if the ring is empty, or -1 if the slot
+ *  held a malformed frame (it is skipped)
+ */
+static inline int tfs_ring_pop(tfs_ring_view_t *view, void *frame, size_t size) {
+	uint32_t head = __atomic_load_n(&view->ring->head, __ATOMIC_RELAXED);
+	char *slot = view->slots + (head % view->count) * view->slotSize;
+	uint32_t len;
+	int ret;
+
+	if (__atomic_load_n(&view->ring->tail, __ATOMIC_ACQUIRE) == head) {
+		return 0;
+	}
+	memcpy(&len, slot, sizeof(len));
+	if (len > size || len > view->slotSize - sizeof(len)) {
+		ret = -1;
+	}
+	else {
+		memcpy(frame, slot + sizeof(len), len);
+		ret = len;
+	}
+
+	__atomic_store_n(&view->ring->head, head + 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/*
+ * Marks the consumer as about to sleep on its eventfd.
+ * Returns: 1 if it may sleep, 0 if a frame arrived meanwhile
+ */
+static inline int tfs_ring_prepare_wait(tfs_ring_view_t *view) {
+	__atomic_store_n(&view->ring->idle, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&view->ring->tail, __ATOMIC_SEQ_CST) !=
+		__atomic_load_n(&view->ring->head, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&view->ring->idle, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Marks the consumer as awake again, so the producer stops signalling.
+ */
+static inline void tfs_ring_end_wait(tfs_ring_view_t *view) {
+	__atomic_store_n(&view->ring->idle, 0, __ATOMIC_RELAXED);
+}
+
+#endif /* TECNICOFS_PROTOCOL_H */